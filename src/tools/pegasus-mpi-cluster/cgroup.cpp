@@ -0,0 +1,185 @@
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <sstream>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "cgroup.h"
+#include "log.h"
+
+// How long to wait for the processes in a cgroup to exit after
+// it is killed, in units of 10 ms
+#define CGROUP_KILL_WAIT 100
+
+CGroup::CGroup(const string &path) {
+    this->path = path;
+    this->created = false;
+}
+
+CGroup::~CGroup() {
+    destroy();
+}
+
+/* Create the cgroup directory */
+int CGroup::create() {
+    if (mkdir(path.c_str(), 0755) < 0) {
+        return -1;
+    }
+    created = true;
+    return 0;
+}
+
+/* Remove the cgroup directory. If the task left processes behind, then
+ * they are killed first, because a cgroup cannot be removed while it
+ * has processes in it. */
+int CGroup::destroy() {
+    if (!created) {
+        return 0;
+    }
+
+    for (int i=0; i<=CGROUP_KILL_WAIT; i++) {
+        if (rmdir(path.c_str()) == 0) {
+            created = false;
+            return 0;
+        }
+        if (errno != EBUSY) {
+            return -1;
+        }
+        if (i == 0) {
+            log_warn("Killing processes left behind in cgroup %s", path.c_str());
+            if (write("cgroup.kill", "1") < 0) {
+                log_warn("Unable to kill processes in cgroup %s: %s",
+                        path.c_str(), strerror(errno));
+            }
+        }
+        usleep(10000);
+    }
+
+    errno = EBUSY;
+    return -1;
+}
+
+/* Write value to one of the cgroup's interface files */
+int CGroup::write(const string &file, const string &value) {
+    string filepath = path + "/" + file;
+    int fd = open(filepath.c_str(), O_WRONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t rc = ::write(fd, value.c_str(), value.size());
+    int error = errno;
+    close(fd);
+    if (rc < 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/* Read the contents of one of the cgroup's interface files */
+int CGroup::read(const string &file, string &value) {
+    string filepath = path + "/" + file;
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    value = "";
+    char buf[BUFSIZ];
+    ssize_t rc;
+    while ((rc = ::read(fd, buf, sizeof(buf))) > 0) {
+        value.append(buf, rc);
+    }
+    int error = errno;
+    close(fd);
+    if (rc < 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/* Read a file that contains a single number */
+int CGroup::read_unsigned(const string &file, unsigned long *value) {
+    string contents;
+    if (read(file, contents) < 0) {
+        return -1;
+    }
+    if (sscanf(contents.c_str(), "%lu", value) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Read the value of key from a file that has one "key value" pair per
+ * line, such as cpu.stat and memory.events */
+int CGroup::read_key(const string &file, const string &key, unsigned long *value) {
+    string contents;
+    if (read(file, contents) < 0) {
+        return -1;
+    }
+    std::istringstream lines(contents);
+    string line;
+    while (getline(lines, line)) {
+        std::istringstream fields(line);
+        string name;
+        unsigned long number;
+        if ((fields >> name >> number) && name == key) {
+            *value = number;
+            return 0;
+        }
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+/* The file that processes are written to in order to move them into
+ * the cgroup */
+string CGroup::procs() {
+    return path + "/cgroup.procs";
+}
+
+/* Returns true if path is a cgroup v2 directory */
+bool CGroup::is_cgroup(const string &path) {
+    string controllers = path + "/cgroup.controllers";
+    return access(controllers.c_str(), F_OK) == 0;
+}
+
+/* Enable the controllers that PMC uses for the children of the cgroup at
+ * path, and return the ones that are enabled. A controller can only be
+ * enabled if it is available in the cgroup, and if the cgroup has no
+ * processes in it. */
+int CGroup::enable_controllers(const string &path, set<string> &enabled) {
+    CGroup parent(path);
+
+    string available;
+    if (parent.read("cgroup.controllers", available) < 0) {
+        return -1;
+    }
+
+    const char *wanted[] = { "memory", "cpu", "cpuset", "pids" };
+    std::istringstream names(available);
+    string name;
+    while (names >> name) {
+        for (unsigned i=0; i<sizeof(wanted)/sizeof(wanted[0]); i++) {
+            if (name == wanted[i] && parent.write("cgroup.subtree_control", "+" + name) < 0) {
+                LOG(LOG_DEBUG, "Unable to enable %s controller in cgroup %s: %s",
+                        name.c_str(), path.c_str(), strerror(errno));
+            }
+        }
+    }
+
+    string subtree;
+    if (parent.read("cgroup.subtree_control", subtree) < 0) {
+        return -1;
+    }
+    enabled.clear();
+    std::istringstream controllers(subtree);
+    while (controllers >> name) {
+        enabled.insert(name);
+    }
+
+    return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <string>
+#include <set>
+
+using std::string;
+using std::set;
+
+/* A cgroup v2 directory. Tasks are run in their own cgroup under a
+ * parent cgroup that has been delegated to PMC so that their resource
+ * usage can be limited and measured. */
+class CGroup {
+public:
+    string path;
+    bool created;
+
+    CGroup(const string &path);
+    ~CGroup();
+    int create();
+    int destroy();
+    int write(const string &file, const string &value);
+    int read(const string &file, string &value);
+    int read_unsigned(const string &file, unsigned long *value);
+    int read_key(const string &file, const string &key, unsigned long *value);
+    string procs();
+
+    static bool is_cgroup(const string &path);
+    static int enable_controllers(const string &path, set<string> &enabled);
+};
+
+#endif /* CGROUP_H */
@@ -0,0 +1,223 @@
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "checkpoint.h"
+#include "failure.h"
+#include "log.h"
+#include "tools.h"
+
+/* The FNV-1a hash of the task names, so that a checkpoint is only used
+ * with the DAG that it was written for */
+uint64_t checkpoint_hash(DAG &dag) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (DAG::iterator i = dag.begin(); i != dag.end(); i++) {
+        const string &name = i->first;
+        for (unsigned c=0; c<=name.size(); c++) {
+            hash ^= (unsigned char)name.c_str()[c];
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+/* Serialize the state of the tasks. This is done by the master, so it
+ * only copies the fields that are needed. */
+void build_checkpoint(DAG &dag, uint64_t dag_hash, unsigned long rescue_id, unsigned long rescue_offset, string &data) {
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.ntasks = dag.size();
+    header.dag_hash = dag_hash;
+    header.rescue_id = rescue_id;
+    header.rescue_offset = rescue_offset;
+    header.time = current_time();
+
+    data.resize(sizeof(header) + dag.size() * sizeof(CheckpointTask));
+    memcpy(&data[0], &header, sizeof(header));
+
+    CheckpointTask *records = (CheckpointTask *)&data[sizeof(header)];
+    unsigned n = 0;
+    for (DAG::iterator i = dag.begin(); i != dag.end(); i++, n++) {
+        Task *task = i->second;
+        CheckpointTask &r = records[n];
+        r.maxrss = task->usage.maxrss;
+        r.failures = task->failures;
+        r.submit_seq = task->submit_seq;
+        r.last_exitcode = task->last_exitcode;
+        r.success = task->success;
+        r.memory_exceeded = task->memory_exceeded;
+        r.reserved = 0;
+    }
+}
+
+/* Restore the state of the tasks from the checkpoint at path, which is
+ * mapped into memory rather than parsed. Returns 1 if the checkpoint was
+ * loaded, or 0 if there is no checkpoint or it does not match the DAG.
+ * The rescue file that the checkpoint was written with, and the size it
+ * had, are stored in rescue_id and rescue_offset. */
+int load_checkpoint(const string &path, DAG &dag, unsigned long *rescue_id, unsigned long *rescue_offset) {
+    *rescue_id = 0;
+    *rescue_offset = 0;
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        myfailures("Unable to open checkpoint %s", path.c_str());
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        myfailures("Unable to stat checkpoint %s", path.c_str());
+    }
+
+    size_t expected = sizeof(CheckpointHeader) + dag.size() * sizeof(CheckpointTask);
+    if ((size_t)st.st_size != expected) {
+        log_warn("Ignoring checkpoint %s: it does not match the DAG", path.c_str());
+        close(fd);
+        return 0;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        myfailures("Unable to map checkpoint %s", path.c_str());
+    }
+    close(fd);
+
+    const CheckpointHeader *header = (const CheckpointHeader *)map;
+    if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != CHECKPOINT_VERSION ||
+            header->ntasks != dag.size() ||
+            header->dag_hash != checkpoint_hash(dag)) {
+        log_warn("Ignoring checkpoint %s: it does not match the DAG", path.c_str());
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    const CheckpointTask *records = (const CheckpointTask *)(header + 1);
+    unsigned n = 0;
+    unsigned done = 0;
+    for (DAG::iterator i = dag.begin(); i != dag.end(); i++, n++) {
+        Task *task = i->second;
+        const CheckpointTask &r = records[n];
+        task->success = r.success;
+        task->submit_seq = r.submit_seq;
+        task->last_exitcode = r.last_exitcode;
+        task->usage.maxrss = r.maxrss;
+        task->memory_exceeded = r.memory_exceeded;
+
+        // Tasks that used up all their tries get them all again, like
+        // they would if the workflow was restarted from the rescue file
+        if (r.failures < task->tries) {
+            task->failures = r.failures;
+        }
+
+        if (task->success) {
+            done++;
+        }
+    }
+
+    *rescue_id = header->rescue_id;
+    *rescue_offset = header->rescue_offset;
+
+    log_info("Loaded checkpoint %s: %u of %u tasks done", path.c_str(), done, n);
+
+    munmap(map, st.st_size);
+    return 1;
+}
+
+CheckpointWriter::CheckpointWriter(const string &path) {
+    this->path = path;
+    this->waiting = false;
+    this->stopping = false;
+    this->running = false;
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&submitted, NULL);
+}
+
+CheckpointWriter::~CheckpointWriter() {
+    finish();
+    pthread_cond_destroy(&submitted);
+    pthread_mutex_destroy(&lock);
+}
+
+void CheckpointWriter::start() {
+    if (running) {
+        return;
+    }
+    int rc = pthread_create(&thread, NULL, writer_thread, this);
+    if (rc != 0) {
+        errno = rc;
+        myfailures("Unable to start checkpoint thread");
+    }
+    running = true;
+}
+
+/* Queue a checkpoint to be written. The contents of data are taken, and
+ * data is left with the previous checkpoint so that its memory can be
+ * reused. */
+void CheckpointWriter::submit(string &data) {
+    pthread_mutex_lock(&lock);
+    pending.swap(data);
+    waiting = true;
+    pthread_cond_signal(&submitted);
+    pthread_mutex_unlock(&lock);
+}
+
+void CheckpointWriter::run_writer() {
+    // Signals are handled by the main thread
+    block_signals();
+
+    string data;
+    pthread_mutex_lock(&lock);
+    while (true) {
+        while (!waiting && !stopping) {
+            pthread_cond_wait(&submitted, &lock);
+        }
+        if (!waiting) {
+            break;
+        }
+        data.swap(pending);
+        waiting = false;
+        pthread_mutex_unlock(&lock);
+
+        // Errors are logged, but are not fatal to the workflow
+        if (replace_file(path, data.c_str(), data.size(), true) < 0) {
+            log_error("Unable to write checkpoint %s: %s", path.c_str(),
+                    strerror(errno));
+        } else {
+            LOG(LOG_DEBUG, "Wrote %lu byte checkpoint %s",
+                    (unsigned long)data.size(), path.c_str());
+        }
+
+        pthread_mutex_lock(&lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void *CheckpointWriter::writer_thread(void *arg) {
+    CheckpointWriter *writer = (CheckpointWriter *)arg;
+    writer->run_writer();
+    return NULL;
+}
+
+/* Wait for the last checkpoint that was submitted to be written, and
+ * stop the thread */
+void CheckpointWriter::finish() {
+    if (!running) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_signal(&submitted);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    running = false;
+}
@@ -0,0 +1,70 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <string>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "dag.h"
+
+using std::string;
+
+#define CHECKPOINT_MAGIC "PMCCKPT"
+#define CHECKPOINT_VERSION 1
+
+/* The first thing in a checkpoint. The records of the tasks follow in
+ * the order the DAG stores them, which is sorted by name. Everything is
+ * in the native byte order. */
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t ntasks;
+    uint64_t dag_hash;          // Hash of the task names, in order
+    uint64_t rescue_id;         // Inode of the rescue file
+    uint64_t rescue_offset;     // Size of the rescue file when it was written
+    double time;
+};
+
+struct CheckpointTask {
+    uint64_t maxrss;            // Peak memory of the last run, in KB
+    uint32_t failures;
+    uint32_t submit_seq;
+    int32_t last_exitcode;
+    uint8_t success;
+    uint8_t memory_exceeded;
+    uint16_t reserved;
+};
+
+uint64_t checkpoint_hash(DAG &dag);
+void build_checkpoint(DAG &dag, uint64_t dag_hash, unsigned long rescue_id, unsigned long rescue_offset, string &data);
+int load_checkpoint(const string &path, DAG &dag, unsigned long *rescue_id, unsigned long *rescue_offset);
+
+/* Writes checkpoints in a separate thread. Each checkpoint is written to
+ * a temporary file, synced, and renamed over the old one, so there is
+ * always a complete checkpoint on disk. If a new checkpoint is submitted
+ * while the previous one is being written, only the newest one that is
+ * waiting is kept. */
+class CheckpointWriter {
+private:
+    string path;
+    string pending;
+    bool waiting;
+    bool stopping;
+    bool running;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t submitted;
+
+    void run_writer();
+    static void *writer_thread(void *arg);
+
+public:
+    CheckpointWriter(const string &path);
+    ~CheckpointWriter();
+    void start();
+    void submit(string &data);
+    void finish();
+};
+
+#endif /* CHECKPOINT_H */
@@ -16,6 +16,13 @@ public:
     virtual int size() = 0;
     virtual unsigned long sent() = 0;
     virtual unsigned long recvd() = 0;
+    virtual unsigned long messages_sent() = 0;
+    virtual unsigned long messages_recvd() = 0;
+
+    // Only some communicators allow workers to join and leave while the
+    // workflow is running
+    virtual vector<int> stop_accepting() { return vector<int>(); }
+    virtual void disconnect(int rank) {}
 };
 
 #endif /* COMM_H */
@@ -4,6 +4,7 @@
 class Configuration {
 public:
     bool set_affinity;
+    bool use_vfork;
 };
 
 extern Configuration config;
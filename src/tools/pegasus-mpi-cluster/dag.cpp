@@ -4,12 +4,15 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <math.h>
 #include <cstdlib>
 #include <fstream>
 
 #include "strlib.h"
 #include "dag.h"
+#include "checkpoint.h"
 #include "failure.h"
 #include "log.h"
 
@@ -18,11 +21,12 @@ using std::vector;
 using std::map;
 using std::list;
 
-Task::Task(const string &name, const list<string> &args, unsigned memory, unsigned cpus, unsigned tries, int priority, const map<string,string> &pipe_forwards, const map<string,string> &file_forwards) {
+Task::Task(const string &name, const list<string> &args, unsigned memory, unsigned cpus, unsigned nodes, unsigned tries, int priority, const map<string,string> &pipe_forwards, const map<string,string> &file_forwards) {
     this->name = name;
     this->args = args;
     this->memory = memory;
     this->cpus = cpus;
+    this->nodes = nodes;
     this->tries = tries;
     this->priority = priority;
     this->pipe_forwards = NULL;
@@ -38,6 +42,11 @@ Task::Task(const string &name, const list<string> &args, unsigned memory, unsign
     this->failures = 0;
     this->last_exitcode = 0;
     this->submit_seq = 0;
+    this->queue_time = 0.0;
+    this->queue_cost = 0.0;
+    this->reserved_memory = memory;
+    this->memory_exceeded = false;
+    memset(&this->usage, 0, sizeof(this->usage));
 }
 
 Task::~Task() {
@@ -61,13 +70,13 @@ bool Task::is_ready() {
     return true;
 }
 
-DAG::DAG(const string &dagfile, const string &rescuefile, const bool lock, unsigned tries) {
+DAG::DAG(const string &dagfile, const string &rescuefile, const bool lock, unsigned tries, const string &checkpointfile) {
     this->lock = lock;
     this->dagfd = -1;
     this->tries = tries;
 
     if (this->lock) {
-        log_debug("Locking DAG file...");
+        LOG(LOG_DEBUG, "Locking DAG file...");
 
         dagfd = open(dagfile.c_str(), O_RDWR);
         if (dagfd < 0) {
@@ -93,15 +102,30 @@ DAG::DAG(const string &dagfile, const string &rescuefile, const bool lock, unsig
 
     this->read_dag(dagfile);
 
+    // The checkpoint has the state of the tasks up to some point in the
+    // rescue file, so only the records after that point need to be read,
+    // unless the rescue file was replaced after the checkpoint was written
+    unsigned long id = 0;
+    unsigned long offset = 0;
+    if (!checkpointfile.empty()) {
+        load_checkpoint(checkpointfile, *this, &id, &offset);
+        struct stat st;
+        if (offset > 0 && stat(rescuefile.c_str(), &st) == 0 && st.st_ino != id) {
+            LOG(LOG_DEBUG, "Rescue file %s was replaced after the checkpoint",
+                    rescuefile.c_str());
+            offset = 0;
+        }
+    }
+
     if (!rescuefile.empty()) {
-        this->read_rescue(rescuefile);
+        this->read_rescue(rescuefile, offset);
     }
 }
 
 DAG::~DAG() {
 
     if (this->lock) {
-        log_debug("Unlocking DAG file...");
+        LOG(LOG_DEBUG, "Unlocking DAG file...");
 
         struct flock clear;
         clear.l_start = 0;
@@ -166,6 +190,7 @@ void DAG::read_dag(const string &filename) {
 
     const char *DELIM = " \t\n\r";
     string pegasus_id = "";
+    string pegasus_transformation = "";
     string rec;
     while (getline(infile, rec)) {
         trim(rec);
@@ -194,8 +219,10 @@ void DAG::read_dag(const string &filename) {
             // Default task arguments
             unsigned memory = 0;
             unsigned cpus = 1;
+            unsigned nodes = 1;
             unsigned tries = this->tries;
             int priority = 0;
+            string group;
             map<string, string> pipe_forwards;
             map<string, string> file_forwards;
 
@@ -225,7 +252,7 @@ void DAG::read_dag(const string &filename) {
                         }
                         // We round up to the next integer
                         memory = (unsigned)ceil(fmemory);
-                        log_trace("Requested %u MB memory for task %s", 
+                        LOG(LOG_TRACE, "Requested %u MB memory for task %s", 
                             memory, name.c_str());
                     } else if (arg == "-c" || arg == "--request-cpus") {
                         args.pop_front();
@@ -245,10 +272,28 @@ void DAG::read_dag(const string &filename) {
                                 "Negative CPU requirement not allowed for task %s", 
                                 name.c_str());
                         }
+                        if (fcpus > CPU_T_MAX) {
+                            myfailure(
+                                "CPU requirement for task %s is larger than %u", 
+                                name.c_str(), CPU_T_MAX);
+                        }
                         // We round up to the next integer
                         cpus = (unsigned)ceil(fcpus);
-                        log_trace("Requested %u CPUs for task %s", 
+                        LOG(LOG_TRACE, "Requested %u CPUs for task %s", 
                             cpus, name.c_str());
+                    } else if (arg == "-N" || arg == "--request-nodes") {
+                        args.pop_front();
+                        if (args.size() == 0) {
+                            myfailure("-N/--request-nodes requires N for task %s", 
+                                name.c_str());
+                        }
+                        string snodes = args.front();
+                        if (sscanf(snodes.c_str(), "%u", &nodes) != 1 || nodes == 0) {
+                            myfailure("Invalid node requirement '%s' for task %s", 
+                                snodes.c_str(), name.c_str());
+                        }
+                        LOG(LOG_TRACE, "Requested %u nodes for task %s", 
+                            nodes, name.c_str());
                     } else if (arg == "-t" || arg == "--tries") {
                         args.pop_front();
                         if (args.size() == 0) {
@@ -266,7 +311,7 @@ void DAG::read_dag(const string &filename) {
                                 name.c_str());
                         }
                         tries = itries;
-                        log_trace("Task %s has %u tries", name.c_str(), tries);
+                        LOG(LOG_TRACE, "Task %s has %u tries", name.c_str(), tries);
                     } else if (arg == "-p" || arg == "--priority") {
                         args.pop_front();
                         if (args.size() == 0) {
@@ -278,8 +323,17 @@ void DAG::read_dag(const string &filename) {
                             myfailure("Invalid priority '%s' for task %s", 
                                 spriority.c_str(), name.c_str());
                         }
-                        log_trace("Task %s has priority %d", 
+                        LOG(LOG_TRACE, "Task %s has priority %d", 
                             name.c_str(), priority);
+                    } else if (arg == "-g" || arg == "--group") {
+                        args.pop_front();
+                        if (args.size() == 0) {
+                            myfailure("-g/--group requires NAME for task %s", 
+                                name.c_str());
+                        }
+                        group = args.front();
+                        LOG(LOG_TRACE, "Task %s is in group %s", 
+                            name.c_str(), group.c_str());
                     } else if (arg == "-f" || arg == "--pipe-forward") {
                         args.pop_front();
                         if (args.size() == 0) {
@@ -294,7 +348,7 @@ void DAG::read_dag(const string &filename) {
                         }
                         string varname = forward.substr(0, eq);
                         string filename = forward.substr(eq + 1);
-                        log_trace("Task %s needs data forwarded to %s",
+                        LOG(LOG_TRACE, "Task %s needs data forwarded to %s",
                                 name.c_str(), filename.c_str());
                         pipe_forwards[varname] = filename;
                     } else if (arg == "-F" || arg == "--file-forward") {
@@ -311,7 +365,7 @@ void DAG::read_dag(const string &filename) {
                         }
                         string srcfile = forward.substr(0, eq);
                         string destfile = forward.substr(eq + 1);
-                        log_trace("Task %s needs data forwarded from %s to %s",
+                        LOG(LOG_TRACE, "Task %s needs data forwarded from %s to %s",
                                 name.c_str(), srcfile.c_str(), destfile.c_str());
                         file_forwards[srcfile] = destfile;
                     } else {
@@ -324,14 +378,23 @@ void DAG::read_dag(const string &filename) {
                 }
             }
 
-            Task *t = new Task(name, args, memory, cpus, tries, priority, pipe_forwards, file_forwards);
+            Task *t = new Task(name, args, memory, cpus, nodes, tries, priority, pipe_forwards, file_forwards);
+            t->group = group;
 
             if (pegasus_id.length() > 0) {
-                // We are only interested in the pegasus ID
                 t->pegasus_id = pegasus_id;
+                t->pegasus_transformation = pegasus_transformation;
+
+                // Sub-workflows that were merged into one DAG can be
+                // identified by a prefix on the pegasus id
+                size_t colon = pegasus_id.rfind(':');
+                if (group.empty() && colon != string::npos) {
+                    t->group = pegasus_id.substr(0, colon);
+                }
 
-                // reset the value so that the next task doesn't get it
+                // reset the values so that the next task doesn't get them
                 pegasus_id = "";
+                pegasus_transformation = "";
             }
             this->add_task(t);
         } else if (rec.find("EDGE", 0, 4) == 0) {
@@ -359,7 +422,7 @@ void DAG::read_dag(const string &filename) {
             }
 
             pegasus_id = v[1];
-            //pegasus_transformation = v[2];
+            pegasus_transformation = v[2];
             //pegasus_dax_id = v[3];
         } else if (rec[0] == '#') {
             // Comments
@@ -375,64 +438,109 @@ void DAG::read_dag(const string &filename) {
     infile.close();
 }
 
-void DAG::read_rescue(const string &filename) {
+void DAG::read_rescue(const string &filename, unsigned long offset) {
 
-    // Check if rescue file exists
-    if (access(filename.c_str(), R_OK)) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
         if (errno == ENOENT) {
             // File doesn't exist
             return;
         }
-        myfailures("Unable to read rescue file: %s", filename.c_str());
+        myfailures("Unable to open rescue file: %s", filename.c_str());
     }
 
-    std::ifstream infile;
-    infile.open(filename.c_str());
-    if (!infile.good()) {
-        myfailures("Unable to open rescue file: %s", filename.c_str());
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        myfailures("Unable to stat rescue file: %s", filename.c_str());
+    }
+
+    unsigned long size = st.st_size;
+    if (size < offset) {
+        // The rescue file was replaced after the checkpoint was written
+        log_warn("Rescue file %s is smaller than the checkpoint says, "
+                 "reading all of it", filename.c_str());
+        offset = 0;
+    }
+    if (size == offset) {
+        close(fd);
+        return;
+    }
+
+    char *data = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        myfailures("Unable to map rescue file: %s", filename.c_str());
     }
+    close(fd);
+
+    // The rescue file is compacted when it is opened, which writes the
+    // tasks in the same order as the DAG. As long as the records are in
+    // that order they are matched by walking the DAG instead of searching
+    // it, and only the records appended after that are searched for.
+    iterator next = tasks.begin();
+    bool sorted = true;
 
     const char *DELIM = " \t\n\r";
-    string rec;
-    while (getline(infile, rec)) {
-        trim(rec);
+    const char *end = data + size;
+    const char *line = data + offset;
+    while (line < end) {
+        const char *eol = (const char *)memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            eol = end;
+        }
+        const char *p = line;
+        const char *q = eol;
+        line = eol + 1;
+
+        while (p < q && strchr(DELIM, *p)) {
+            p++;
+        }
+        while (q > p && strchr(DELIM, q[-1])) {
+            q--;
+        }
 
         // Blank lines
-        if (rec.length() == 0) {
+        if (p == q) {
             continue;
         }
 
         // Comments
-        if (rec[0] == '#') {
+        if (*p == '#') {
             continue;
         }
 
-        if (rec.find("DONE", 0, 4) == 0) {
-            vector<string> v;
-
-            split(v, rec, DELIM, 1);
+        string rec(p, q - p);
+        if (rec.compare(0, 4, "DONE") != 0) {
+            myfailure("Invalid rescue record: %s", rec.c_str());
+        }
 
-            if (v.size() < 2) {
-                myfailure("Invalid DONE record: %s\n", rec.c_str());
-            }
+        size_t start = rec.find_first_not_of(DELIM, 4);
+        if (start == 4 || start == string::npos) {
+            myfailure("Invalid DONE record: %s\n", rec.c_str());
+        }
 
-            string name = v[1];
+        string name = rec.substr(start);
 
-            if (!this->has_task(name)) {
-                myfailure("Unknown task %s in rescue file", name.c_str());
+        iterator i;
+        if (sorted && (next == tasks.end() || next->first <= name)) {
+            while (next != tasks.end() && next->first < name) {
+                next++;
+            }
+            i = next;
+            if (i != tasks.end() && i->first != name) {
+                i = tasks.end();
             }
-
-            Task *task = this->get_task(name);
-            task->success = true;
         } else {
-            myfailure("Invalid rescue record: %s", rec.c_str());
+            sorted = false;
+            i = tasks.find(name);
         }
-    }
 
-    if (infile.bad() || !infile.eof()) {
-        myfailures("Error reading rescue file");
+        if (i == tasks.end()) {
+            myfailure("Unknown task %s in rescue file", name.c_str());
+        }
+
+        i->second->success = true;
     }
 
-    infile.close();
+    munmap(data, size);
 }
 
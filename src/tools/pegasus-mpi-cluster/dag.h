@@ -20,8 +20,9 @@ public:
     vector<Task *> children;
     vector<Task *> parents;
 
-    // This comes from the pegasus cluster arguments
+    // These come from the pegasus cluster arguments
     string pegasus_id;
+    string pegasus_transformation;
 
     bool success;
     bool io_failed;
@@ -29,15 +30,39 @@ public:
 
     unsigned memory;
     cpu_t cpus;
+    unsigned nodes;
     unsigned tries;
     unsigned failures;
     int priority;
+
+    // Tasks in different groups share the slots fairly, regardless of
+    // their priorities
+    string group;
+
     map<string, string> *pipe_forwards;
     map<string, string> *file_forwards;
 
     unsigned submit_seq;
 
-    Task(const string &name, const list<string> &args, unsigned memory, unsigned cpus, unsigned tries, int priority, const map<string,string> &pipe_forwards, const map<string,string> &file_forwards);
+    // When the task was put in the ready queue, which is used to age its
+    // priority while it waits
+    double queue_time;
+
+    // What the task's group was charged when it was taken from the ready
+    // queue, which is given back if the task is put back
+    double queue_cost;
+
+    // The memory that is reserved for the task when it is scheduled. This
+    // is normally the memory requested, but with adaptive memory it can 
+    // be less. If a run of the task uses more than was reserved, then the
+    // next run reserves the memory requested.
+    unsigned reserved_memory;
+    bool memory_exceeded;
+
+    // Resource usage of the last run of the task
+    struct taskusage usage;
+
+    Task(const string &name, const list<string> &args, unsigned memory, unsigned cpus, unsigned nodes, unsigned tries, int priority, const map<string,string> &pipe_forwards, const map<string,string> &file_forwards);
     ~Task();
 
     bool is_ready();
@@ -50,13 +75,13 @@ class DAG {
     unsigned tries;
 
     void read_dag(const string &filename);
-    void read_rescue(const string &filename);
+    void read_rescue(const string &filename, unsigned long offset = 0);
     void add_task(Task *task);
     void add_edge(const string &parent, const string &child);
 public:
     typedef map<string, Task *>::iterator iterator;
 
-    DAG(const string &dagfile, const string &rescuefile = "", const bool lock = true, unsigned tries = 1);
+    DAG(const string &dagfile, const string &rescuefile = "", const bool lock = true, unsigned tries = 1, const string &checkpointfile = "");
     ~DAG();
 
     bool has_task(const string &name) const;
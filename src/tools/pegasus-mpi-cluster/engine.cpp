@@ -3,12 +3,14 @@
 #include "string.h"
 #include "stdio.h"
 #include "unistd.h"
+#include <sys/stat.h>
 
 #include "strlib.h"
 #include "dag.h"
 #include "failure.h"
 #include "log.h"
 #include "engine.h"
+#include "tools.h"
 
 Engine::Engine(DAG &dag, const std::string &rescuefile, int max_failures) {
     if (max_failures < 0) {
@@ -17,6 +19,8 @@ Engine::Engine(DAG &dag, const std::string &rescuefile, int max_failures) {
     this->max_failures = max_failures;
     this->dag = &dag;
     this->rescue = NULL;
+    this->rescue_size = 0;
+    this->rescue_inode = 0;
     if (!rescuefile.empty()) {
         this->open_rescue(rescuefile);
     }
@@ -42,19 +46,43 @@ void Engine::queue_ready_task(Task *t) {
     this->queue.insert(t);
 }
 
+/* The new rescue file is a compacted copy of the old one, which has one
+ * record for each task that is done, in the same order as the DAG. It
+ * is written to a temporary file that replaces the old rescue file, so
+ * that the records are not lost if the master fails while it is being
+ * written, and then the new records are appended to it. */
 void Engine::open_rescue(const std::string &filename) {
-    this->rescue = fopen(filename.c_str(), "a");
-    if (this->rescue == NULL) {
-        myfailure("Unable to open rescue file: %s", filename.c_str());
-    }
-    
-    // Mark done tasks as done in the new rescue file
+    std::string data;
+    unsigned done = 0;
     for (DAG::iterator i=this->dag->begin(); i!=this->dag->end(); i++) {
         Task *t = (*i).second;
         if (t->success) {
-            this->write_rescue(t);
+            data += "\nDONE ";
+            data += t->name;
+            done++;
         }
     }
+
+    if (replace_file(filename, data.c_str(), data.size(), true) < 0) {
+        myfailures("Unable to replace rescue file: %s", filename.c_str());
+    }
+
+    this->rescue = fopen(filename.c_str(), "a");
+    if (this->rescue == NULL) {
+        myfailure("Unable to open rescue file: %s", filename.c_str());
+    }
+    if (fseek(this->rescue, 0, SEEK_END) < 0) {
+        myfailures("Unable to seek rescue file: %s", filename.c_str());
+    }
+
+    struct stat st;
+    if (fstat(fileno(this->rescue), &st) == 0) {
+        this->rescue_inode = st.st_ino;
+    }
+    this->rescue_size = ftell(this->rescue);
+
+    LOG(LOG_DEBUG, "Compacted rescue file %s: %u tasks done", 
+            filename.c_str(), done);
 }
 
 bool Engine::has_rescue() {
@@ -77,6 +105,10 @@ void Engine::write_rescue(Task *task) {
         if (fflush(this->rescue)) {
             log_error("Error flushing rescue file: %s", strerror(errno));
         }
+        long size = ftell(this->rescue);
+        if (size >= 0) {
+            this->rescue_size = size;
+        }
 #ifdef SYNC_RESCUE
 #ifdef DARWIN
         // OSX does not have fdatasync
@@ -173,3 +205,14 @@ bool Engine::is_failed() {
     
     return false;
 }
+
+/* The size of the rescue file, which is where a restart that loads a
+ * checkpoint of the current state would start reading it */
+unsigned long Engine::rescue_offset() {
+    return this->rescue_size;
+}
+
+/* Identifies the rescue file, which is replaced on every restart */
+unsigned long Engine::rescue_id() {
+    return this->rescue_inode;
+}
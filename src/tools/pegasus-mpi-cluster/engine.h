@@ -12,6 +12,8 @@ class Engine {
     std::queue<Task *> ready;
     std::set<Task *> queue;
     FILE *rescue;
+    unsigned long rescue_size;
+    unsigned long rescue_inode;
     int failures;
     int max_failures;
     
@@ -31,6 +33,8 @@ public:
     Task *next_ready_task();
     bool is_finished();
     bool is_failed();
+    unsigned long rescue_offset();
+    unsigned long rescue_id();
 };
 
 #endif /* ENGINE_H */
@@ -0,0 +1,381 @@
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "eventlog.h"
+#include "failure.h"
+#include "log.h"
+#include "tools.h"
+
+// The maximum number of logs that can be open at the same time
+#define EVENT_MAX_LOGS 8
+
+// Logs that are open, so that they can be written if the process is
+// killed by a fatal signal
+static AsyncEventLog *active_logs[EVENT_MAX_LOGS];
+static bool handlers_installed = false;
+
+static const int FATAL_SIGNALS[] = {
+    SIGINT, SIGQUIT, SIGILL, SIGABRT, SIGFPE, SIGBUS, SIGSEGV
+};
+
+AsyncEventLog::AsyncEventLog(const string &path, bool append) {
+    this->path = path;
+    this->append = append;
+    this->fd = -1;
+    this->buffer = NULL;
+    this->head = 0;
+    this->tail = 0;
+    this->flush_requests = 0;
+    this->stopping = false;
+    this->running = false;
+    this->failed = false;
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&queued, NULL);
+    pthread_cond_init(&written, NULL);
+}
+
+AsyncEventLog::~AsyncEventLog() {
+    close();
+    delete[] buffer;
+    pthread_cond_destroy(&written);
+    pthread_cond_destroy(&queued);
+    pthread_mutex_destroy(&lock);
+}
+
+/* Open the log file and start the writer thread. This is done when the
+ * first event arrives so that logs that are not used are not created. */
+void AsyncEventLog::open() {
+    int flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+    fd = ::open(path.c_str(), flags, 0666);
+    if (fd < 0) {
+        myfailures("Unable to open %s", path.c_str());
+    }
+
+    buffer = new char[EVENT_BUFFER_SIZE];
+
+    int rc = pthread_create(&writer, NULL, writer_thread, this);
+    if (rc != 0) {
+        errno = rc;
+        myfailures("Unable to start writer thread for %s", path.c_str());
+    }
+    running = true;
+
+    for (int i=0; i<EVENT_MAX_LOGS; i++) {
+        if (active_logs[i] == NULL) {
+            active_logs[i] = this;
+            break;
+        }
+    }
+
+    // Handlers are only installed for signals that would kill the process
+    // anyway, so that we don't change the behavior of the MPI library
+    if (!handlers_installed) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = on_fatal_signal;
+        sigemptyset(&action.sa_mask);
+        for (unsigned i=0; i<sizeof(FATAL_SIGNALS)/sizeof(FATAL_SIGNALS[0]); i++) {
+            struct sigaction current;
+            if (sigaction(FATAL_SIGNALS[i], NULL, &current) == 0 &&
+                    current.sa_handler == SIG_DFL) {
+                sigaction(FATAL_SIGNALS[i], &action, NULL);
+            }
+        }
+        handlers_installed = true;
+    }
+}
+
+/* Stop the writer thread after it has written everything in the queue,
+ * and close the log file */
+void AsyncEventLog::close() {
+    if (running) {
+        pthread_mutex_lock(&lock);
+        stopping = true;
+        pthread_cond_signal(&queued);
+        pthread_mutex_unlock(&lock);
+        pthread_join(writer, NULL);
+        running = false;
+
+        for (int i=0; i<EVENT_MAX_LOGS; i++) {
+            if (active_logs[i] == this) {
+                active_logs[i] = NULL;
+            }
+        }
+    }
+
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+/* Format an event and queue it for the writer thread. This only blocks
+ * if the queue is full. */
+void AsyncEventLog::on_event(WorkflowEvent event, Task *task) {
+    if (!running) {
+        open();
+    }
+
+    EventRecord record;
+    memset(&record, 0, sizeof(record));
+    record.event = event;
+    record.time = current_time();
+    char name[EVENT_MAX_NAME];
+    name[0] = '\0';
+    if (task != NULL) {
+        record.submit_seq = task->submit_seq;
+        record.exitcode = task->last_exitcode;
+        record.usage = task->usage;
+        size_t namelen = task->name.size();
+        if (namelen >= EVENT_MAX_NAME) {
+            namelen = EVENT_MAX_NAME - 1;
+        }
+        memcpy(name, task->name.c_str(), namelen);
+        name[namelen] = '\0';
+    }
+
+    char text[EVENT_MAX_RECORD];
+    pthread_mutex_lock(&lock);
+    int n = format(record, name, text, sizeof(text));
+    if (n <= 0 || (size_t)n >= sizeof(text)) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    while (EVENT_BUFFER_SIZE - (head - tail) < (size_t)n) {
+        pthread_cond_signal(&queued);
+        pthread_cond_wait(&written, &lock);
+    }
+    copy_in(head, text, n);
+
+    // The fatal signal handler can interrupt this thread, so the event
+    // has to be in the buffer before head says that it is
+    __sync_synchronize();
+    head += n;
+    if (head - tail >= EVENT_BATCH_SIZE) {
+        pthread_cond_signal(&queued);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* Wait until all the events that have been queued are written */
+void AsyncEventLog::flush() {
+    if (!running) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    unsigned long target = head;
+    flush_requests++;
+    pthread_cond_signal(&queued);
+    while (tail < target) {
+        pthread_cond_wait(&written, &lock);
+    }
+    flush_requests--;
+    pthread_mutex_unlock(&lock);
+}
+
+void AsyncEventLog::copy_in(unsigned long pos, const void *data, size_t size) {
+    size_t offset = pos % EVENT_BUFFER_SIZE;
+    size_t first = EVENT_BUFFER_SIZE - offset;
+    if (first > size) {
+        first = size;
+    }
+    memcpy(buffer + offset, data, first);
+    memcpy(buffer, (const char *)data + first, size - first);
+}
+
+/* Write the queued events between start and end to the log. This only
+ * calls write(2), so that it can be called from a signal handler. */
+int AsyncEventLog::write_queue(unsigned long start, unsigned long end) {
+    while (start < end) {
+        size_t offset = start % EVENT_BUFFER_SIZE;
+        size_t size = EVENT_BUFFER_SIZE - offset;
+        if (size > end - start) {
+            size = end - start;
+        }
+        ssize_t w = ::write(fd, buffer + offset, size);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        start += w;
+    }
+    return 0;
+}
+
+/* Write the queued events every EVENT_FLUSH_INTERVAL seconds, or sooner
+ * if a batch is ready, a flush was requested, or the log is closing */
+void AsyncEventLog::run_writer() {
+    // Signals are handled by the thread that queues the events
+    block_signals();
+
+    pthread_mutex_lock(&lock);
+    while (!stopping || head != tail) {
+        if (head == tail || (head - tail < EVENT_BATCH_SIZE &&
+                    flush_requests == 0 && !stopping)) {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            double deadline = now.tv_sec + (now.tv_usec / 1.0e6) + EVENT_FLUSH_INTERVAL;
+            struct timespec abstime;
+            abstime.tv_sec = (time_t)deadline;
+            abstime.tv_nsec = (long)((deadline - abstime.tv_sec) * 1.0e9);
+            pthread_cond_timedwait(&queued, &lock, &abstime);
+        }
+
+        unsigned long start = tail;
+        unsigned long end = head;
+        if (start == end) {
+            continue;
+        }
+        if (end - start > EVENT_BATCH_SIZE) {
+            end = start + EVENT_BATCH_SIZE;
+        }
+        pthread_mutex_unlock(&lock);
+        if (write_queue(start, end) < 0 && !failed) {
+            log_error("Error writing %s: %s", path.c_str(), strerror(errno));
+            failed = true;
+        }
+        pthread_mutex_lock(&lock);
+        tail = end;
+        pthread_cond_broadcast(&written);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void *AsyncEventLog::writer_thread(void *arg) {
+    AsyncEventLog *log = (AsyncEventLog *)arg;
+    log->run_writer();
+    return NULL;
+}
+
+/* Write whatever is in the queue of every open log, and then let the
+ * signal kill the process. The lock cannot be taken here, but the events
+ * before head are complete, and the writer thread only moves tail. This
+ * is a best effort: events that the writer thread is in the middle of
+ * writing can appear twice. */
+void AsyncEventLog::on_fatal_signal(int signo) {
+    for (int i=0; i<EVENT_MAX_LOGS; i++) {
+        AsyncEventLog *log = active_logs[i];
+        if (log != NULL && log->fd >= 0) {
+            unsigned long start = log->tail;
+            unsigned long end = log->head;
+            log->write_queue(start, end);
+        }
+    }
+    signal(signo, SIG_DFL);
+    raise(signo);
+}
+
+JobstateLog::JobstateLog(const string &path) : AsyncEventLog(path, true) {
+}
+
+JobstateLog::~JobstateLog() {
+    close();
+}
+
+/* JOB_TERMINATED lines end with the resources the task used. These are
+ * added at the end so that the usual fields stay where they are. */
+int JobstateLog::format(const EventRecord &record, const char *name, char *buf, size_t size) {
+    const struct taskusage *u = &record.usage;
+    switch (record.event) {
+        case TASK_QUEUED:
+            return snprintf(buf, size, "%0.6lf %s SUBMIT %d.0 - - %u\n",
+                    record.time, name, record.submit_seq, record.submit_seq);
+        case TASK_SUBMIT:
+            return snprintf(buf, size, "%0.6lf %s EXECUTE %d.0 - - %u\n",
+                    record.time, name, record.submit_seq, record.submit_seq);
+        case TASK_SUCCESS:
+        case TASK_FAILURE:
+            return snprintf(buf, size, "%0.6lf %s JOB_TERMINATED %d.0 - - %u"
+                    " maxrss=%lu utime=%0.3lf stime=%0.3lf rchar=%llu "
+                    "wchar=%llu read_bytes=%llu write_bytes=%llu\n"
+                    "%0.6lf %s %s %d - - %u\n",
+                    record.time, name, record.submit_seq, record.submit_seq,
+                    u->maxrss, u->utime, u->stime, u->rchar, u->wchar,
+                    u->read_bytes, u->write_bytes, record.time, name,
+                    record.event == TASK_SUCCESS ? "JOB_SUCCESS" : "JOB_FAILURE",
+                    record.exitcode, record.submit_seq);
+        case WORKFLOW_START:
+            return snprintf(buf, size, "%0.6lf INTERNAL *** PMC_STARTED ***\n",
+                    record.time);
+        case WORKFLOW_SUCCESS:
+            return snprintf(buf, size, "%0.6lf INTERNAL *** PMC_FINISHED 0 ***\n",
+                    record.time);
+        case WORKFLOW_FAILURE:
+            return snprintf(buf, size, "%0.6lf INTERNAL *** PMC_FINISHED 1 ***\n",
+                    record.time);
+    }
+    return 0;
+}
+
+DAGManLog::DAGManLog(const string &logpath, const string &dagpath) : AsyncEventLog(logpath, false) {
+    this->dagpath = filename(dagpath);
+    this->last_time = 0;
+    this->last_date[0] = '\0';
+}
+
+DAGManLog::~DAGManLog() {
+    close();
+}
+
+int DAGManLog::format(const EventRecord &record, const char *name, char *buf, size_t size) {
+    /* Format the timestamp for the log file entry */
+    time_t ts = (time_t)record.time;
+    if (ts != last_time || last_date[0] == '\0') {
+        struct tm now;
+        ::localtime_r(&ts, &now);
+        snprintf(last_date, sizeof(last_date), /*mm/dd/yy hh:mm:ss*/ "%02d/%02d/%02d %02d:%02d:%02d",
+                now.tm_mon+1, now.tm_mday, now.tm_year-100,
+                now.tm_hour, now.tm_min, now.tm_sec);
+        last_time = ts;
+    }
+    const char *date = last_date;
+
+    switch (record.event) {
+        case TASK_QUEUED:
+            return snprintf(buf, size,
+                    "%s Submitting Condor Node %s job(s)...\n"
+                    "%s Event: ULOG_SUBMIT for Condor Node %s (%d.0)\n",
+                    date, name, date, name, record.submit_seq);
+        case TASK_SUBMIT:
+            return snprintf(buf, size,
+                    "%s Event: ULOG_EXECUTE for Condor Node %s (%d.0)\n",
+                    date, name, record.submit_seq);
+        case TASK_SUCCESS:
+            return snprintf(buf, size,
+                    "%s Event: ULOG_JOB_TERMINATED for Condor Node %s (%d.0)\n"
+                    "%s Node %s job proc (%d.0) completed successfully.\n",
+                    date, name, record.submit_seq, date, name, record.submit_seq);
+        case TASK_FAILURE:
+            return snprintf(buf, size,
+                    "%s Event: ULOG_JOB_TERMINATED for Condor Node %s (%d.0)\n"
+                    "%s Node %s job proc (%d.0) failed with status %d.\n",
+                    date, name, record.submit_seq, date, name,
+                    record.submit_seq, record.exitcode);
+        case WORKFLOW_START:
+            return snprintf(buf, size,
+                    "%s This is a fake DAGMan log file generated by PMC "
+                    "for the purpose of tricking monitord\n"
+                    "%s ** condor_scheduniv_exec.0.0 (CONDOR_DAGMAN) STARTING UP\n"
+                    "%s ** PID = %d\n"
+                    "%s Parsing %s ...\n",
+                    date, date, date, getpid(), date, dagpath.c_str());
+        case WORKFLOW_SUCCESS:
+            return snprintf(buf, size,
+                    "%s **** condor_scheduniv_exec.0.0 (condor_DAGMAN) "
+                    "pid %d EXITING WITH STATUS 0\n", date, getpid());
+        case WORKFLOW_FAILURE:
+            return snprintf(buf, size,
+                    "%s **** condor_scheduniv_exec.0.0 (condor_DAGMAN) "
+                    "pid %d EXITING WITH STATUS 1\n", date, getpid());
+    }
+    return 0;
+}
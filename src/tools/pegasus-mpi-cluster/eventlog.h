@@ -0,0 +1,130 @@
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+#include <string>
+#include <time.h>
+#include <pthread.h>
+
+#include "dag.h"
+#include "tools.h"
+
+using std::string;
+
+typedef enum {
+    WORKFLOW_START,
+    WORKFLOW_SUCCESS,
+    WORKFLOW_FAILURE,
+    TASK_QUEUED,
+    TASK_SUBMIT,
+    TASK_SUCCESS,
+    TASK_FAILURE
+} WorkflowEvent;
+
+class WorkflowEventListener {
+public:
+    virtual ~WorkflowEventListener() {}
+    virtual void on_event(WorkflowEvent event, Task *task) = 0;
+};
+
+// Size of the ring buffer that events are queued in before they are
+// written, in bytes
+#define EVENT_BUFFER_SIZE (256*1024)
+
+// The writer thread is woken up early when this many bytes are queued
+#define EVENT_BATCH_SIZE (64*1024)
+
+// How long events can wait in the buffer before they are written, in
+// seconds
+#define EVENT_FLUSH_INTERVAL 1.0
+
+// Task names longer than this are truncated in the logs
+#define EVENT_MAX_NAME 4096
+
+// Events that take more than this many bytes to format are dropped. The
+// name of the task can appear twice in an event.
+#define EVENT_MAX_RECORD (2 * EVENT_MAX_NAME + 1024)
+
+/* The parts of an event that the logs need */
+struct EventRecord {
+    WorkflowEvent event;
+    double time;
+    unsigned submit_seq;
+    int exitcode;
+    struct taskusage usage;
+};
+
+/* A listener that writes events to a log file in a background thread, so
+ * that writing events to shared storage is not done on the master's
+ * scheduling path. Events are formatted when they are queued in a ring
+ * buffer, and the writer thread writes them in large batches. The queue
+ * is written when the log is closed, and a best effort is made to write
+ * it when the master dies from a fatal signal. Because the events are
+ * already formatted, the signal handler only has to call write(2).
+ * Subclasses must call close() in their destructor. */
+class AsyncEventLog : public WorkflowEventListener {
+private:
+    string path;
+    bool append;
+    int fd;
+
+    // head and tail count all the bytes ever queued and written, and
+    // are taken modulo EVENT_BUFFER_SIZE to index the buffer
+    char *buffer;
+    volatile unsigned long head;
+    volatile unsigned long tail;
+    unsigned flush_requests;
+    bool stopping;
+    bool running;
+    bool failed;
+
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t written;
+
+    void open();
+    void copy_in(unsigned long pos, const void *data, size_t size);
+    int write_queue(unsigned long start, unsigned long end);
+    void run_writer();
+    static void *writer_thread(void *arg);
+    static void on_fatal_signal(int signo);
+
+protected:
+    /* Format the record into buf, and return the number of characters
+     * that were needed, like snprintf. This is called with the lock of
+     * the log held, when the event is queued. */
+    virtual int format(const EventRecord &record, const char *name, char *buf, size_t size) = 0;
+
+public:
+    AsyncEventLog(const string &path, bool append);
+    virtual ~AsyncEventLog();
+    void on_event(WorkflowEvent event, Task *task);
+    void flush();
+    void close();
+};
+
+class JobstateLog : public AsyncEventLog {
+protected:
+    int format(const EventRecord &record, const char *name, char *buf, size_t size);
+public:
+    JobstateLog(const string &path);
+    ~JobstateLog();
+};
+
+class DAGManLog : public AsyncEventLog {
+private:
+    string dagpath;
+
+    // The timestamp of the last record, which is usually the same as the
+    // timestamp of the next one
+    time_t last_time;
+    char last_date[18];
+
+protected:
+    int format(const EventRecord &record, const char *name, char *buf, size_t size);
+public:
+    DAGManLog(const string &logpath, const string &dagpath);
+    ~DAGManLog();
+};
+
+#endif /* EVENTLOG_H */
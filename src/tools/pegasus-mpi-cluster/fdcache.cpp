@@ -15,6 +15,7 @@ FDEntry::FDEntry(const string &filename, FILE *file) {
     this->file = file;
     this->prev = NULL;
     this->next = NULL;
+    this->buffered = 0.0;
 }
 
 FDEntry::~FDEntry() {
@@ -24,20 +25,68 @@ FDEntry::~FDEntry() {
     }
 }
 
-FDCache::FDCache(unsigned maxsize) {
+/* Write data to the file and flush it */
+int FDEntry::write(const char *data, size_t size) {
+    size_t written = fwrite(data, 1, size, file);
+    if (written != size) {
+        log_error("Error writing %lu bytes to %s: %s", (unsigned long)size,
+                filename.c_str(), strerror(errno));
+        return -1;
+    }
+    if (fflush(file) != 0) {
+        log_error("fflush failed on file %s: %s", filename.c_str(), 
+                strerror(errno));
+        return -1;
+    }
+#ifdef SYNC_IODATA
+#ifdef DARWIN
+    // OSX does not have fdatasync
+    int rc = fsync(fileno(file));
+#else
+    int rc = fdatasync(fileno(file));
+#endif
+    if (rc != 0) {
+        log_error("fsync/fdatasync failed on file %s: %s", filename.c_str(), 
+                strerror(errno));
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/* Write any buffered records to the file. The buffer is emptied even if
+ * the write fails so that the same records are not written again. */
+int FDEntry::flush() {
+    if (buffer.size() == 0) {
+        return 0;
+    }
+    int rc = write(buffer.data(), buffer.size());
+    buffer.clear();
+    buffered = 0.0;
+    return rc;
+}
+
+FDCache::FDCache(unsigned maxsize, unsigned bufsize, double flush_interval) {
     this->maxsize = maxsize;
     this->first = NULL;
     this->last = NULL;
     this->hits = 0;
     this->misses = 0;
+    this->bufsize = bufsize;
+    this->flush_interval = flush_interval;
+    this->dirty = 0;
+    this->pending = 0;
+    this->records = 0;
+    this->flushes = 0;
+    this->flush_errors = 0;
 
     // Determine the system limit
     unsigned limit = get_max_open_files();
-    log_debug("Open files limit = %u", limit);
+    LOG(LOG_DEBUG, "Open files limit = %u", limit);
 
     // Log the number of currently open files
     if (log_debug()) {
-        log_debug("Number of open files = %u", get_nr_open_fds());
+        LOG(LOG_DEBUG, "Number of open files = %u", get_nr_open_fds());
     }
 
     // Determine the maximum number of open files allowed
@@ -59,6 +108,11 @@ FDCache::FDCache(unsigned maxsize) {
     }
 
     log_info("Setting max cached files = %u", this->maxsize);
+
+    if (this->bufsize > 0) {
+        log_info("Buffering up to %u bytes of I/O per file for %lf seconds",
+                this->bufsize, this->flush_interval);
+    }
 }
 
 FDCache::~FDCache() {
@@ -66,9 +120,16 @@ FDCache::~FDCache() {
 }
 
 void FDCache::close() {
+    map<string, FDEntry *>::iterator p = pinned.begin();
+    while (p != pinned.end()) {
+        string filename = (p++)->first;
+        unpin(filename);
+    }
+
     FDEntry *i = first;
     while (i!=NULL) {
         FDEntry *next = i->next;
+        flush(i);
         delete i;
         i = next;
     }
@@ -135,6 +196,7 @@ void FDCache::push(FDEntry *entry) {
         if (remove == NULL) {
             myfailure("Expected an entry");
         }
+        flush(remove);
         delete remove;
     }
 
@@ -149,7 +211,7 @@ void FDCache::push(FDEntry *entry) {
     first = entry;
     byname[entry->filename] = entry;
 
-    log_trace("Adding %s to FDCache", entry->filename.c_str());
+    LOG(LOG_TRACE, "Adding %s to FDCache", entry->filename.c_str());
 }
 
 FDEntry *FDCache::pop() {
@@ -171,12 +233,18 @@ FDEntry *FDCache::pop() {
         last->next = NULL;
     }
 
-    log_trace("Evicting %s from FDCache", remove->filename.c_str());
+    LOG(LOG_TRACE, "Evicting %s from FDCache", remove->filename.c_str());
 
     return remove;
 }
 
-FILE *FDCache::open(string filename) {
+FDEntry *FDCache::get(const string &filename) {
+    map<string, FDEntry *>::iterator p = pinned.find(filename);
+    if (p != pinned.end()) {
+        this->hits += 1;
+        return p->second;
+    }
+
     // If the file is already in the cache, then
     // return it
     map<string, FDEntry *>::iterator i;
@@ -187,7 +255,7 @@ FILE *FDCache::open(string filename) {
         this->hits += 1;
         FDEntry *entry = i->second;
         access(entry);
-        return entry->file;
+        return entry;
     }
     
     // Create directories as needed on file creation
@@ -210,12 +278,45 @@ FILE *FDCache::open(string filename) {
     FDEntry *entry = new FDEntry(filename, file);
     push(entry);
     
-    return file;
+    return entry;
 }
 
-int FDCache::write(string filename, const char *data, int size) {
-    FILE *file = open(filename);
-    if (file == NULL) {
+FILE *FDCache::open(string filename) {
+    FDEntry *entry = get(filename);
+    if (entry == NULL) {
+        return NULL;
+    }
+    return entry->file;
+}
+
+/* Write the records for filename to file, which stays open until the
+ * file is unpinned. This is used for files that are not opened by name,
+ * and for files that must not be closed while they are in use. */
+void FDCache::pin(const string &filename, FILE *file) {
+    if (pinned.count(filename) > 0 || byname.count(filename) > 0) {
+        myfailure("File %s is already in FDCache", filename.c_str());
+    }
+    pinned[filename] = new FDEntry(filename, file);
+}
+
+/* Write the buffered records of a pinned file and remove it from the
+ * cache without closing it */
+int FDCache::unpin(const string &filename) {
+    map<string, FDEntry *>::iterator p = pinned.find(filename);
+    if (p == pinned.end()) {
+        return 0;
+    }
+    FDEntry *entry = p->second;
+    pinned.erase(p);
+    int rc = flush(entry);
+    entry->file = NULL;
+    delete entry;
+    return rc;
+}
+
+int FDCache::write(const string &filename, const char *data, size_t size) {
+    FDEntry *entry = get(filename);
+    if (entry == NULL) {
         log_error("Error opening file %s: errno %d: %s", filename.c_str(),
                   errno, strerror(errno));
 
@@ -226,33 +327,81 @@ int FDCache::write(string filename, const char *data, int size) {
         return -1;
     }
 
-    int rc = fwrite(data, 1, size, file);
-    if (rc != size) {
-        log_error("Error writing %d bytes to %s: %s", size, filename.c_str(), 
-                strerror(errno));
-        return -1;
+    this->records += 1;
+
+    // If buffering is disabled, then every record is written immediately
+    if (this->bufsize == 0) {
+        this->flushes += 1;
+        return entry->write(data, size);
     }
-    if (fflush(file) != 0) {
-        log_error("fflush failed on file %s: %s", filename.c_str(), 
-                strerror(errno));
-        return -1;
+
+    // Records are never split between two writes, so if this one does
+    // not fit in the space remaining, then the buffer is written first
+    if (entry->buffer.size() > 0 && entry->buffer.size() + size > this->bufsize) {
+        if (flush(entry) < 0) {
+            return -1;
+        }
     }
-#ifdef SYNC_IODATA
-#ifdef DARWIN
-    // OSX does not have fdatasync
-    rc = fsync(fileno(file));
-#else
-    rc = fdatasync(fileno(file));
-#endif
-    if (rc != 0) {
-        log_error("fsync/fdatasync failed on file %s: %s", filename.c_str(), 
-                strerror(errno));
+
+    // Records that are larger than the buffer are written directly
+    if (size >= this->bufsize) {
+        this->flushes += 1;
+        return entry->write(data, size);
+    }
+
+    if (entry->buffer.size() == 0) {
+        entry->buffered = current_time();
+        this->dirty += 1;
+    }
+    entry->buffer.append(data, size);
+    this->pending += size;
+
+    return 0;
+}
+
+/* Write the buffered records for entry to its file */
+int FDCache::flush(FDEntry *entry) {
+    if (entry->buffer.size() == 0) {
+        return 0;
+    }
+
+    unsigned size = entry->buffer.size();
+
+    this->dirty -= 1;
+    this->pending -= size;
+    this->flushes += 1;
+
+    if (entry->flush() < 0) {
+        // The records in the buffer may belong to tasks that have already
+        // been marked as successful, so there is no task to fail here
+        log_error("Lost %u bytes of buffered I/O for %s", size, 
+                entry->filename.c_str());
+        this->flush_errors += 1;
         return -1;
     }
-#endif
+
     return 0;
 }
 
+/* Write out all the buffers that have been waiting longer than the flush interval */
+void FDCache::flush_expired(double now) {
+    if (this->dirty == 0) {
+        return;
+    }
+
+    for (FDEntry *i = first; i != NULL; i = i->next) {
+        if (i->buffer.size() > 0 && now - i->buffered >= this->flush_interval) {
+            flush(i);
+        }
+    }
+    for (map<string, FDEntry *>::iterator p = pinned.begin(); p != pinned.end(); p++) {
+        FDEntry *i = p->second;
+        if (i->buffer.size() > 0 && now - i->buffered >= this->flush_interval) {
+            flush(i);
+        }
+    }
+}
+
 /* Determine the system limit on open file descriptors */
 unsigned FDCache::get_max_open_files() {
     unsigned limit = 0;
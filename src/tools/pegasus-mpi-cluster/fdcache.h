@@ -14,8 +14,16 @@ public:
     FILE *file;
     FDEntry *prev;
     FDEntry *next;
+
+    // Records waiting to be written to the file, and the time
+    // at which the oldest of them was added to the buffer
+    string buffer;
+    double buffered;
+
     FDEntry(const string &filename, FILE *file);
     ~FDEntry();
+    int write(const char *data, size_t size);
+    int flush();
 };
 
 class FDCache {
@@ -24,18 +32,35 @@ public:
     unsigned hits;
     unsigned misses;
 
+    unsigned bufsize;
+    double flush_interval;
+    unsigned dirty;
+    unsigned long pending;
+    unsigned long records;
+    unsigned long flushes;
+    unsigned flush_errors;
+
     FDEntry *first;
     FDEntry *last;
     map<string, FDEntry *> byname;
 
-    FDCache(unsigned maxsize=0);
+    // Files that were opened by the caller, such as the task stdout and
+    // stderr. These are never evicted or closed by the cache.
+    map<string, FDEntry *> pinned;
+
+    FDCache(unsigned maxsize=0, unsigned bufsize=0, double flush_interval=0.0);
     ~FDCache();
     double hitrate();
     void access(FDEntry *entry);
     void push(FDEntry *entry);
     FDEntry *pop();
+    FDEntry *get(const string &filename);
     FILE *open(string filename);
-    int write(string filename, const char *data, int size);
+    void pin(const string &filename, FILE *file);
+    int unpin(const string &filename);
+    int write(const string &filename, const char *data, size_t size);
+    int flush(FDEntry *entry);
+    void flush_expired(double now);
     int size();
     void close();
     unsigned get_nr_open_fds();
@@ -1,14 +1,32 @@
 #include "stdio.h"
+#include "string.h"
 #include "time.h"
+#include "sched.h"
+#include "stdint.h"
+#include "stddef.h"
+#include "pthread.h"
 #include "sys/time.h"
 
 #include "log.h"
+#include "tools.h"
 
 #define MAX_LOG_MESSAGE 8192
 
 // This is set to stderr so that it works nicely with Pegasus
 #define DEFAULT_LOG_FILE stderr
 
+// Messages with more arguments than this are formatted by the caller
+// when logging asynchronously
+#define LOG_MAX_ARGS 32
+
+// Records in the ring buffer are padded to a multiple of this so that
+// the size at the start of a record is never split by the end of the
+// buffer
+#define LOG_ALIGN 8
+
+// The writer thread writes messages in batches of up to this many bytes
+#define LOG_BATCH_SIZE (64*1024)
+
 static int loglevel = LOG_INFO;
 static FILE *logfile = DEFAULT_LOG_FILE;
 
@@ -21,6 +39,75 @@ static const char * const loglabels[] = {
     "trace"
 };
 
+/* The types of the arguments of a message that is formatted later */
+typedef enum {
+    ARG_NONE,
+    ARG_INT,
+    ARG_LONG,
+    ARG_LLONG,
+    ARG_SIZE,
+    ARG_INTMAX,
+    ARG_PTRDIFF,
+    ARG_DOUBLE,
+    ARG_LDOUBLE,
+    ARG_PTR,
+    ARG_STRING
+} LogArgType;
+
+/* A conversion specification in a format string */
+struct LogSpec {
+    unsigned length;    // Number of characters, including the %
+    unsigned stars;     // Number of * widths and precisions
+    int precision;      // The precision, -1 if there is none, or -2 for *
+    LogArgType type;
+};
+
+/* A message in the ring buffer. It is followed by nargs LogArgs and
+ * strsize bytes of copied strings. The size is written last, after the
+ * rest of the record, so the writer knows when the record is complete.
+ * If format is NULL, then the message was formatted by the caller and
+ * is the only string argument. */
+struct LogRecord {
+    volatile uint32_t size;
+    int32_t level;
+    uint32_t nargs;
+    uint32_t strsize;
+    struct timeval time;
+    const char *format;
+};
+
+struct LogArg {
+    uint32_t type;
+    uint32_t length;    // Length of the string, for ARG_STRING
+    union {
+        long long i;
+        double d;
+        long double ld;
+        const void *p;
+    } value;
+};
+
+// The arguments follow the LogRecord at an offset that is aligned for
+// the long double in LogArg
+#define LOG_ARGS_OFFSET ((sizeof(LogRecord) + __alignof__(LogArg) - 1) / \
+                         __alignof__(LogArg) * __alignof__(LogArg))
+
+// The copied strings of a message are truncated to MAX_LOG_MESSAGE
+// characters in total, and each one is followed by a NUL
+#define LOG_MAX_RECORD (LOG_ARGS_OFFSET + LOG_MAX_ARGS * sizeof(LogArg) + \
+                        MAX_LOG_MESSAGE + LOG_MAX_ARGS + LOG_ALIGN)
+
+// State of the asynchronous logger. head and tail count all of the bytes
+// ever reserved and written, and are taken modulo LOG_BUFFER_SIZE to
+// index the buffer. Producers reserve space by atomically adding to head.
+static volatile bool async = false;
+static volatile bool stopping = false;
+static char *ring = NULL;
+static volatile unsigned long head = 0;
+static volatile unsigned long tail = 0;
+static pthread_t writer;
+static bool atfork_installed = false;
+
 void log_set_level(int level) {
     loglevel = level;
 }
@@ -37,14 +124,450 @@ FILE *log_get_file() {
     return logfile;
 }
 
-static void timestr(char *dest) {
-    struct timeval tod;
-    gettimeofday(&tod, NULL);
-    struct tm *t = localtime(&(tod.tv_sec));
-    int ms = (int)(tod.tv_usec/1000.0);
-    sprintf(dest, "%04d-%02d-%02d %02d:%02d:%02d.%.3d %s", 
-        t->tm_year+1900, t->tm_mon+1, t->tm_mday,
-        t->tm_hour, t->tm_min, t->tm_sec, ms, t->tm_zone);
+static void timestr(char *dest, const struct timeval *tod) {
+    struct tm t;
+    localtime_r(&(tod->tv_sec), &t);
+    int ms = (int)(tod->tv_usec/1000.0);
+    sprintf(dest, "%04d-%02d-%02d %02d:%02d:%02d.%.3d %s",
+        t.tm_year+1900, t.tm_mon+1, t.tm_mday,
+        t.tm_hour, t.tm_min, t.tm_sec, ms, t.tm_zone);
+}
+
+/* Return the log file, or the default if it is no longer usable */
+static FILE *current_logfile() {
+    // Just in case...
+    if (logfile != DEFAULT_LOG_FILE) {
+        if (logfile == NULL || fileno(logfile) == -1 || ferror(logfile) || ftell(logfile) < 0) {
+            logfile = DEFAULT_LOG_FILE;
+        }
+    }
+    return logfile;
+}
+
+/* Write the label of the message, and the date if logging to a file */
+static int format_prefix(char *dest, size_t size, FILE *file, int level, const struct timeval *tod) {
+    if (file == DEFAULT_LOG_FILE) {
+        return snprintf(dest, size, "[%s] ", loglabels[level]);
+    }
+    char ts[128];
+    timestr(ts, tod);
+    return snprintf(dest, size, "%s [%s] ", ts, loglabels[level]);
+}
+
+/* Parse the conversion specification at the start of format. Returns
+ * false if the specification cannot be formatted later. */
+static bool parse_spec(const char *format, LogSpec &spec) {
+    const char *f = format + 1;
+    spec.stars = 0;
+    spec.precision = -1;
+    spec.type = ARG_NONE;
+
+    if (*f == '%') {
+        spec.length = 2;
+        return true;
+    }
+
+    while (*f != '\0' && strchr("-+ #0'", *f) != NULL) {
+        f++;
+    }
+    if (*f == '*') {
+        spec.stars++;
+        f++;
+    } else {
+        while (*f >= '0' && *f <= '9') f++;
+    }
+    if (*f == '.') {
+        f++;
+        if (*f == '*') {
+            spec.stars++;
+            spec.precision = -2;
+            f++;
+        } else {
+            spec.precision = 0;
+            while (*f >= '0' && *f <= '9') {
+                spec.precision = spec.precision * 10 + (*f - '0');
+                f++;
+            }
+        }
+    }
+
+    char size = ' ';
+    if (f[0] == 'h' && f[1] == 'h') {
+        size = 'H';
+        f += 2;
+    } else if (f[0] == 'l' && f[1] == 'l') {
+        size = 'q';
+        f += 2;
+    } else if (*f != '\0' && strchr("hlLqzjt", *f) != NULL) {
+        size = *f;
+        f++;
+    }
+
+    switch (*f) {
+        case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+            switch (size) {
+                case ' ': case 'h': case 'H': spec.type = ARG_INT; break;
+                case 'l': spec.type = ARG_LONG; break;
+                case 'q': spec.type = ARG_LLONG; break;
+                case 'z': spec.type = ARG_SIZE; break;
+                case 'j': spec.type = ARG_INTMAX; break;
+                case 't': spec.type = ARG_PTRDIFF; break;
+                default: return false;
+            }
+            break;
+        case 'c':
+            spec.type = ARG_INT;
+            break;
+        case 'e': case 'E': case 'f': case 'F':
+        case 'g': case 'G': case 'a': case 'A':
+            spec.type = size == 'L' ? ARG_LDOUBLE : ARG_DOUBLE;
+            break;
+        case 's':
+            // Wide strings are not supported
+            if (size != ' ') {
+                return false;
+            }
+            spec.type = ARG_STRING;
+            break;
+        case 'p':
+            spec.type = ARG_PTR;
+            break;
+        default:
+            return false;
+    }
+
+    spec.length = f - format + 1;
+    return true;
+}
+
+static void copy_in(unsigned long pos, const void *data, size_t size) {
+    size_t offset = pos % LOG_BUFFER_SIZE;
+    size_t first = size;
+    if (offset + size > LOG_BUFFER_SIZE) {
+        first = LOG_BUFFER_SIZE - offset;
+    }
+    memcpy(ring + offset, data, first);
+    memcpy(ring, (const char *)data + first, size - first);
+}
+
+static void copy_out(unsigned long pos, void *data, size_t size) {
+    size_t offset = pos % LOG_BUFFER_SIZE;
+    size_t first = size;
+    if (offset + size > LOG_BUFFER_SIZE) {
+        first = LOG_BUFFER_SIZE - offset;
+    }
+    memcpy(data, ring + offset, first);
+    memcpy((char *)data + first, ring, size - first);
+}
+
+static void clear(unsigned long pos, size_t size) {
+    size_t offset = pos % LOG_BUFFER_SIZE;
+    size_t first = size;
+    if (offset + size > LOG_BUFFER_SIZE) {
+        first = LOG_BUFFER_SIZE - offset;
+    }
+    memset(ring + offset, 0, first);
+    memset(ring, 0, size - first);
+}
+
+/* Queue a message to be formatted and written by the writer thread. The
+ * arguments are copied into the record, but the format string is not,
+ * so it must be a string constant. Messages that cannot be formatted
+ * later are formatted here. This never allocates memory or takes a lock,
+ * but it waits for the writer if the buffer is full. */
+static void log_async(int level, const char *format, va_list args) {
+    LogArg argv[LOG_MAX_ARGS];
+    const char *strings[LOG_MAX_ARGS];
+    int precision[LOG_MAX_ARGS];
+    unsigned nargs = 0;
+    unsigned strsize = 0;
+    unsigned strtext = 0;
+    char message[MAX_LOG_MESSAGE];
+
+    // Check that the message can be formatted later
+    bool deferred = true;
+    for (const char *f = format; *f != '\0'; f++) {
+        if (*f != '%') {
+            continue;
+        }
+        LogSpec spec;
+        if (!parse_spec(f, spec) || nargs + spec.stars + 1 > LOG_MAX_ARGS) {
+            deferred = false;
+            break;
+        }
+        for (unsigned s=0; s<spec.stars; s++) {
+            argv[nargs++].type = ARG_INT;
+        }
+        if (spec.type != ARG_NONE) {
+            precision[nargs] = spec.precision;
+            argv[nargs++].type = spec.type;
+        }
+        f += spec.length - 1;
+    }
+
+    if (deferred) {
+        for (unsigned i=0; i<nargs; i++) {
+            LogArg &arg = argv[i];
+            switch (arg.type) {
+                case ARG_INT: arg.value.i = va_arg(args, int); break;
+                case ARG_LONG: arg.value.i = va_arg(args, long); break;
+                case ARG_LLONG: arg.value.i = va_arg(args, long long); break;
+                case ARG_SIZE: arg.value.i = va_arg(args, size_t); break;
+                case ARG_INTMAX: arg.value.i = va_arg(args, intmax_t); break;
+                case ARG_PTRDIFF: arg.value.i = va_arg(args, ptrdiff_t); break;
+                case ARG_DOUBLE: arg.value.d = va_arg(args, double); break;
+                case ARG_LDOUBLE: arg.value.ld = va_arg(args, long double); break;
+                case ARG_PTR: arg.value.p = va_arg(args, void *); break;
+                case ARG_STRING: {
+                    const char *s = va_arg(args, const char *);
+                    if (s == NULL) {
+                        s = "(null)";
+                    }
+                    // A string with a precision does not have to be
+                    // terminated, so only that much of it is read. A
+                    // * precision is the argument before the string.
+                    size_t length = MAX_LOG_MESSAGE - strtext;
+                    int p = precision[i];
+                    if (p == -2) {
+                        p = (int)argv[i-1].value.i;
+                    }
+                    if (p >= 0 && (size_t)p < length) {
+                        length = p;
+                    }
+                    length = strnlen(s, length);
+                    strings[i] = s;
+                    arg.length = length;
+                    strtext += length;
+                    strsize += length + 1;
+                    break;
+                }
+            }
+        }
+    } else {
+        vsnprintf(message, MAX_LOG_MESSAGE, format, args);
+        format = NULL;
+        nargs = 1;
+        argv[0].type = ARG_STRING;
+        argv[0].length = strlen(message);
+        strings[0] = message;
+        strsize = argv[0].length + 1;
+    }
+
+    LogRecord record;
+    gettimeofday(&record.time, NULL);
+    record.size = 0;
+    record.level = level;
+    record.nargs = nargs;
+    record.strsize = strsize;
+    record.format = format;
+
+    size_t size = LOG_ARGS_OFFSET + nargs * sizeof(LogArg) + strsize;
+    size = (size + LOG_ALIGN - 1) / LOG_ALIGN * LOG_ALIGN;
+
+    // Reserve space in the ring buffer and wait for the writer to make
+    // room if the buffer is full
+    unsigned long pos = __sync_fetch_and_add(&head, size);
+    while (pos + size - tail > LOG_BUFFER_SIZE) {
+        sched_yield();
+    }
+
+    unsigned long p = pos;
+    copy_in(p, &record, sizeof(LogRecord));
+    p += LOG_ARGS_OFFSET;
+    copy_in(p, argv, nargs * sizeof(LogArg));
+    p += nargs * sizeof(LogArg);
+    for (unsigned i=0; i<nargs; i++) {
+        if (argv[i].type == ARG_STRING) {
+            copy_in(p, strings[i], argv[i].length);
+            p += argv[i].length;
+            copy_in(p, "", 1);
+            p += 1;
+        }
+    }
+
+    // Publish the record
+    __sync_synchronize();
+    uint32_t *sizep = (uint32_t *)(ring + (pos % LOG_BUFFER_SIZE));
+    *(volatile uint32_t *)sizep = size;
+}
+
+/* Format a record that was read from the ring buffer */
+static int format_record(char *dest, size_t size, const LogRecord *record) {
+    LogArg *argv = (LogArg *)((const char *)record + LOG_ARGS_OFFSET);
+    const char *strings = (const char *)(argv + record->nargs);
+
+    // Point the string arguments at the copies
+    const char *s = strings;
+    for (unsigned i=0; i<record->nargs; i++) {
+        if (argv[i].type == ARG_STRING) {
+            argv[i].value.p = s;
+            s += argv[i].length + 1;
+        }
+    }
+
+    if (record->format == NULL) {
+        return snprintf(dest, size, "%s", (const char *)argv[0].value.p);
+    }
+
+    size_t len = 0;
+    unsigned next = 0;
+    for (const char *f = record->format; *f != '\0' && len + 1 < size; f++) {
+        if (*f != '%') {
+            dest[len++] = *f;
+            continue;
+        }
+
+        LogSpec spec;
+        parse_spec(f, spec);
+        if (spec.type == ARG_NONE) {
+            dest[len++] = '%';
+            f += spec.length - 1;
+            continue;
+        }
+
+        // Replace any * with the width or precision that was passed
+        char conversion[64];
+        size_t c = 0;
+        for (unsigned i=0; i<spec.length && c + 16 < sizeof(conversion); i++) {
+            if (f[i] == '*') {
+                c += sprintf(conversion + c, "%d", (int)argv[next++].value.i);
+            } else {
+                conversion[c++] = f[i];
+            }
+        }
+        conversion[c] = '\0';
+
+        LogArg &arg = argv[next++];
+        char *out = dest + len;
+        size_t avail = size - len;
+        int n = 0;
+        switch (arg.type) {
+            case ARG_INT: n = snprintf(out, avail, conversion, (int)arg.value.i); break;
+            case ARG_LONG: n = snprintf(out, avail, conversion, (long)arg.value.i); break;
+            case ARG_LLONG: n = snprintf(out, avail, conversion, arg.value.i); break;
+            case ARG_SIZE: n = snprintf(out, avail, conversion, (size_t)arg.value.i); break;
+            case ARG_INTMAX: n = snprintf(out, avail, conversion, (intmax_t)arg.value.i); break;
+            case ARG_PTRDIFF: n = snprintf(out, avail, conversion, (ptrdiff_t)arg.value.i); break;
+            case ARG_DOUBLE: n = snprintf(out, avail, conversion, arg.value.d); break;
+            case ARG_LDOUBLE: n = snprintf(out, avail, conversion, arg.value.ld); break;
+            case ARG_PTR:
+            case ARG_STRING: n = snprintf(out, avail, conversion, arg.value.p); break;
+        }
+        if (n > 0) {
+            len += ((size_t)n < avail) ? n : avail - 1;
+        }
+        f += spec.length - 1;
+    }
+    dest[len] = '\0';
+    return len;
+}
+
+static void write_batch(const char *batch, size_t size) {
+    if (size == 0) {
+        return;
+    }
+    FILE *file = current_logfile();
+    fwrite(batch, 1, size, file);
+    fflush(file);
+}
+
+/* Format and write the queued messages until the logger is stopped */
+static void *writer_thread(void *arg) {
+    // Signals are handled by the main thread
+    block_signals();
+
+    // This is aligned for the long double arguments
+    static long double buffer[LOG_MAX_RECORD / sizeof(long double) + 1];
+    char *record = (char *)buffer;
+    static char batch[LOG_BATCH_SIZE];
+    size_t batched = 0;
+
+    while (true) {
+        if (tail == head) {
+            write_batch(batch, batched);
+            batched = 0;
+            if (stopping) {
+                break;
+            }
+            struct timespec wait = { 0, 10 * 1000 * 1000 };
+            nanosleep(&wait, NULL);
+            continue;
+        }
+
+        // Wait for the producer to finish writing the record
+        uint32_t size = *(volatile uint32_t *)(ring + (tail % LOG_BUFFER_SIZE));
+        if (size == 0) {
+            sched_yield();
+            continue;
+        }
+        __sync_synchronize();
+
+        copy_out(tail, record, size);
+        LogRecord *r = (LogRecord *)record;
+
+        // Make room for more messages
+        clear(tail, size);
+        __sync_synchronize();
+        tail = tail + size;
+
+        char line[MAX_LOG_MESSAGE + 256];
+        int prefix = format_prefix(line, sizeof(line), current_logfile(), r->level, &r->time);
+        int len = prefix + format_record(line + prefix, MAX_LOG_MESSAGE, r);
+        line[len++] = '\n';
+
+        if (batched + len > sizeof(batch)) {
+            write_batch(batch, batched);
+            batched = 0;
+        }
+        memcpy(batch + batched, line, len);
+        batched += len;
+    }
+
+    return NULL;
+}
+
+/* A child process does not have the writer thread, so it logs directly */
+static void log_atfork_child() {
+    async = false;
+}
+
+/* Start logging asynchronously. Messages are copied into a ring buffer
+ * and formatted and written by a separate thread. */
+int log_start_async() {
+    if (async) {
+        return 0;
+    }
+
+    if (ring == NULL) {
+        ring = new char[LOG_BUFFER_SIZE];
+    }
+    memset(ring, 0, LOG_BUFFER_SIZE);
+    head = 0;
+    tail = 0;
+    stopping = false;
+
+    if (!atfork_installed) {
+        pthread_atfork(NULL, NULL, log_atfork_child);
+        atfork_installed = true;
+    }
+
+    if (pthread_create(&writer, NULL, writer_thread, NULL) != 0) {
+        return -1;
+    }
+    async = true;
+
+    return 0;
+}
+
+/* Write the queued messages and go back to logging synchronously. This
+ * should be called after any other threads have stopped logging. */
+void log_stop_async() {
+    if (!async) {
+        return;
+    }
+    async = false;
+    stopping = true;
+    pthread_join(writer, NULL);
 }
 
 void log_message(int level, const char *message, va_list args) {
@@ -52,25 +575,24 @@ void log_message(int level, const char *message, va_list args) {
     if (!log_test(level)) {
         return;
     }
-    
-    // Just in case...
-    if (logfile == NULL || fileno(logfile) == -1 || ferror(logfile) || ftell(logfile) < 0) {
-        logfile = DEFAULT_LOG_FILE;
+
+    if (async) {
+        log_async(level, message, args);
+        return;
     }
-    
+
+    FILE *file = current_logfile();
+
     char logformat[MAX_LOG_MESSAGE];
-    if (logfile == DEFAULT_LOG_FILE) {
-        snprintf(logformat, MAX_LOG_MESSAGE, "[%s] %s\n", 
-                 loglabels[level], message);    
-    } else {
+    struct timeval tod;
+    if (file != DEFAULT_LOG_FILE) {
         // If logging to a file, add the date
-        char ts[128];
-        timestr(ts);
-        snprintf(logformat, MAX_LOG_MESSAGE, "%s [%s] %s\n", 
-                 ts, loglabels[level], message);
+        gettimeofday(&tod, NULL);
     }
-    
-    vfprintf(logfile, logformat, args);
+    int prefix = format_prefix(logformat, MAX_LOG_MESSAGE, file, level, &tod);
+    snprintf(logformat + prefix, MAX_LOG_MESSAGE - prefix, "%s\n", message);
+
+    vfprintf(file, logformat, args);
 }
 
 #define __LOG_MESSAGE(level) \
@@ -79,6 +601,10 @@ void log_message(int level, const char *message, va_list args) {
     log_message(level, format, args); \
     va_end(args);
 
+void log_at(int level, const char *format, ...) {
+    __LOG_MESSAGE(level)
+}
+
 void log_fatal(const char *format, ...) {
     __LOG_MESSAGE(LOG_FATAL)
 }
@@ -11,14 +11,31 @@
 #define LOG_DEBUG 4
 #define LOG_TRACE 5
 
+/* Log a message if level is enabled. Unlike the log_* functions, the
+ * arguments are not evaluated when the level is disabled, so this should
+ * be used for debug and trace messages in frequently executed code. */
+#define LOG(level, ...) \
+    do { \
+        if (log_test(level)) { \
+            log_at(level, __VA_ARGS__); \
+        } \
+    } while (0)
+
+// Size of the ring buffer used by the asynchronous logger, in bytes
+#define LOG_BUFFER_SIZE (1024*1024)
+
 void log_set_level(int level);
 int log_get_level();
 
 void log_set_file(FILE *log);
 FILE *log_get_file();
 
+int log_start_async();
+void log_stop_async();
+
 void log_message(int level, const char *message, va_list args);
 
+void log_at(int level, const char *format, ...);
 void log_fatal(const char *format, ...);
 void log_error(const char *format, ...);
 void log_warn(const char *format, ...);
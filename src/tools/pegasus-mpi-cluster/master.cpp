@@ -1,9 +1,15 @@
 #include <map>
+#include <algorithm>
 #include <stdio.h>
 #include <unistd.h>
 #include <signal.h>
 #include <math.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "master.h"
 #include "failure.h"
@@ -11,6 +17,7 @@
 #include "protocol.h"
 #include "log.h"
 #include "tools.h"
+#include "trace.h"
 
 using std::string;
 using std::vector;
@@ -18,6 +25,9 @@ using std::map;
 
 #define MESSAGE_DUMP_FILE "pmc.message.dmp"
 
+// Maximum number of threads used to merge worker stdio files
+#define MAX_MERGE_THREADS 16
+
 static bool ABORT = false;
 
 static void on_signal(int signo) {
@@ -64,15 +74,81 @@ Host::Host(const string &host_name, unsigned int memory, cpu_t threads, cpu_t co
     for (unsigned i=0; i<threads; i++) {
         cpus[i] = NULL;
     }
+    this->gang = NULL;
+
+    this->tasks_finished = 0;
+    this->tasks_failed = 0;
+    this->failure_score = 0.0;
+    this->score_time = 0.0;
+    this->blacklisted_until = 0.0;
+    this->blacklist_count = 0;
+}
+
+/* Set the NUMA node and physical core of each cpu. The topology is 
+ * ignored if it does not match the number of cpus on the host. */
+void Host::set_topology(const vector<cpu_t> &cpu_nodes, const vector<cpu_t> &cpu_cores) {
+    if (cpu_nodes.size() != threads || cpu_cores.size() != threads) {
+        if (cpu_nodes.size() > 0) {
+            log_warn("Ignoring invalid CPU topology for host %s", host_name.c_str());
+        }
+        return;
+    }
+    this->cpu_nodes = cpu_nodes;
+    this->cpu_cores = cpu_cores;
 }
 
 Host::~Host() {
     delete[] cpus;
 }
 
-/* Check to see if the host has enough resources to run the task */
+/* Check to see if the host has enough resources to run the task. Tasks
+ * that run on more than one node need the whole host. */
 bool Host::can_run(Task *task) {
-    return memory_free >= task->memory && cpus_free >= task->cpus;
+    if (slots == 0 || gang != NULL || (task->nodes > 1 && !is_free())) {
+        return false;
+    }
+    return memory_free >= task->reserved_memory && cpus_free >= task->cpus;
+}
+
+/* Check to see if the host could run the task if it was idle. A host 
+ * with no slots is one where all the workers have left. */
+bool Host::can_fit(Task *task) {
+    return slots > 0 && memory >= task->reserved_memory && threads >= task->cpus;
+}
+
+/* Returns true if no tasks are using the host */
+bool Host::is_free() {
+    return gang == NULL && memory_free == memory && cpus_free == threads;
+}
+
+/* Reserve the whole host for a task that runs on more than one node */
+void Host::reserve_host(Task *task) {
+    if (!is_free()) {
+        myfailure("Host %s cannot be reserved for task %s", 
+                host_name.c_str(), task->name.c_str());
+    }
+
+    gang = task;
+    memory_free = 0;
+    cpus_free = 0;
+    for (unsigned i=0; i<threads; i++) {
+        cpus[i] = task;
+    }
+}
+
+/* Release a host that was reserved for a multi-node task */
+void Host::release_host(Task *task) {
+    if (gang != task) {
+        myfailure("Host %s is not reserved for task %s",
+                host_name.c_str(), task->name.c_str());
+    }
+
+    gang = NULL;
+    memory_free = memory;
+    cpus_free = threads;
+    for (unsigned i=0; i<threads; i++) {
+        cpus[i] = NULL;
+    }
 }
 
 /* Allocate resources to a task */
@@ -81,13 +157,20 @@ vector<cpu_t> Host::allocate_resources(Task *task) {
         myfailure("Host cannot run task %s", task->name.c_str());
     }
 
+    // Multi-node tasks get the whole host, and are not bound to any cpus
+    if (task->nodes > 1) {
+        reserve_host(task);
+        slots_free -= 1;
+        return vector<cpu_t>();
+    }
+
     // Use up the resources
-    memory_free -= task->memory;
+    memory_free -= task->reserved_memory;
     cpus_free -= task->cpus;
     slots_free -= 1;
 
     // This records all of the cpus that we will use for the task
-    vector<cpu_t> bindings;
+    vector<cpu_t> bindings = find_bindings(task);
 
     // We only allocate cores for tasks that request more than 1 thread
     // Single threaded tasks are allowed to float to reduce fragmentation
@@ -95,12 +178,221 @@ vector<cpu_t> Host::allocate_resources(Task *task) {
         return bindings;
     }
 
+    // If we didn't get a solution, then don't bind anything
+    if (bindings.size() != task->cpus) {
+        bindings.clear();
+        log_warn("CPU fragmentation detected when scheduling task %s: not setting affinity", task->name.c_str());
+    }
+
+    // Mark all the cpus that were allocated to the task
+    for (vector<cpu_t>::iterator i=bindings.begin(); i!=bindings.end(); i++) {
+        cpu_t j = *i;
+        cpus[j] = task;
+        LOG(LOG_TRACE, "Assigned CPU %" PRIcpu_t " to task %s", j, task->name.c_str());
+    }
+
+    return bindings;
+}
+
+/* Find the cpus that the task should be bound to without allocating them.
+ * Returns an empty vector if the task should not be bound. */
+vector<cpu_t> Host::find_bindings(Task *task) {
+    vector<cpu_t> bindings;
+
+    if (task->cpus == 1) {
+        return bindings;
+    }
+
+    // If we know the topology, try to keep the task on one NUMA node,
+    // otherwise fall back on assuming the cpus are numbered by socket
+    if (cpu_nodes.size() > 0) {
+        bindings = numa_bindings(task);
+    }
+    if (bindings.size() == 0) {
+        bindings = aligned_bindings(task);
+    }
+
+    return bindings;
+}
+
+/* Returns the physical core of a cpu */
+unsigned Host::core_of(unsigned cpu) {
+    if (cpu_cores.size() > 0) {
+        return cpu_cores[cpu];
+    }
+    return cpu / (threads / cores);
+}
+
+/* Returns the NUMA node of a cpu, or the socket if the topology is unknown */
+unsigned Host::node_of(unsigned cpu) {
+    if (cpu_nodes.size() > 0) {
+        return cpu_nodes[cpu];
+    }
+    return cpu / (threads / sockets);
+}
+
+/* Returns the largest number of cpus that are free on a single socket
+ * or NUMA node. This is the largest task that can be bound without
+ * spanning nodes. */
+unsigned Host::largest_free_block() {
+    vector<unsigned> node_free;
+    for (unsigned i=0; i<threads; i++) {
+        unsigned node = node_of(i);
+        if (node >= node_free.size()) {
+            node_free.resize(node + 1, 0);
+        }
+        if (cpus[i] == NULL) {
+            node_free[node] += 1;
+        }
+    }
+
+    unsigned largest = 0;
+    for (unsigned n=0; n<node_free.size(); n++) {
+        largest = std::max(largest, node_free[n]);
+    }
+
+    // Single threaded tasks use cpus without binding to them
+    return std::min(largest, cpus_free);
+}
+
+/* Returns the number of free cpus on cores that are partly used by
+ * bound tasks. These cpus can only be used by small tasks without
+ * sharing a core. */
+unsigned Host::fragmented_cpus() {
+    vector<unsigned> core_free;
+    vector<unsigned> core_busy;
+    for (unsigned i=0; i<threads; i++) {
+        unsigned core = core_of(i);
+        if (core >= core_free.size()) {
+            core_free.resize(core + 1, 0);
+            core_busy.resize(core + 1, 0);
+        }
+        if (cpus[i] == NULL) {
+            core_free[core] += 1;
+        } else {
+            core_busy[core] += 1;
+        }
+    }
+
+    unsigned fragmented = 0;
+    for (unsigned c=0; c<core_free.size(); c++) {
+        if (core_busy[c] > 0) {
+            fragmented += core_free[c];
+        }
+    }
+    return fragmented;
+}
+
+/* Returns how well the task fits on this host. Lower values are better.
+ * Multicore tasks prefer hosts where they can be bound, and then the 
+ * host that would have the fewest cpus left over. Single threaded tasks
+ * prefer the host with the smallest free block so that they fill holes
+ * that are too small for multicore tasks, instead of breaking up the 
+ * blocks that the multicore tasks need. */
+unsigned Host::fit_cost(Task *task) {
+    if (!can_run(task)) {
+        return UINT_MAX;
+    }
+
+    if (task->cpus == 1) {
+        return largest_free_block();
+    }
+
+    unsigned leftover = cpus_free - task->cpus;
+    if (find_bindings(task).size() == task->cpus) {
+        return leftover;
+    }
+    return threads + leftover;
+}
+
+/* Find cpus for the task on a single NUMA node. This picks the node with
+ * the fewest free cpus that can still hold the task, so that large nodes
+ * are kept free for large tasks. Within the node it takes whole free
+ * cores while the task needs at least a core, and puts the remainder on
+ * the cores with the fewest free cpus. Returns an empty vector if none
+ * of the nodes has enough free cpus. */
+vector<cpu_t> Host::numa_bindings(Task *task) {
+    vector<cpu_t> bindings;
+
+    // Count the free cpus on each node
+    vector<unsigned> node_free;
+    for (unsigned i=0; i<threads; i++) {
+        if (cpu_nodes[i] >= node_free.size()) {
+            node_free.resize(cpu_nodes[i] + 1, 0);
+        }
+        if (cpus[i] == NULL) {
+            node_free[cpu_nodes[i]] += 1;
+        }
+    }
+
+    int node = -1;
+    for (unsigned n=0; n<node_free.size(); n++) {
+        if (node_free[n] >= task->cpus &&
+                (node < 0 || node_free[n] < node_free[node])) {
+            node = n;
+        }
+    }
+    if (node < 0) {
+        LOG(LOG_TRACE, "No NUMA node on host %s has %" PRIcpu_t " free CPUs for task %s",
+                  host_name.c_str(), task->cpus, task->name.c_str());
+        return bindings;
+    }
+    LOG(LOG_TRACE, "Placing task %s on NUMA node %d of host %s", 
+              task->name.c_str(), node, host_name.c_str());
+
+    // Group the free cpus on the node by core
+    map<cpu_t, vector<cpu_t> > core_free;
+    for (unsigned i=0; i<threads; i++) {
+        if (cpu_nodes[i] == (unsigned)node && cpus[i] == NULL) {
+            core_free[cpu_cores[i]].push_back(i);
+        }
+    }
+
+    // Best fit: take the core with the most free cpus that doesn't have 
+    // more than we need, or, if every core has more than we need, the 
+    // core with the fewest free cpus
+    while (bindings.size() < task->cpus && core_free.size() > 0) {
+        unsigned needed = task->cpus - bindings.size();
+        map<cpu_t, vector<cpu_t> >::iterator best = core_free.end();
+        for (map<cpu_t, vector<cpu_t> >::iterator c = core_free.begin(); c != core_free.end(); c++) {
+            unsigned size = c->second.size();
+            if (best == core_free.end()) {
+                best = c;
+                continue;
+            }
+            unsigned best_size = best->second.size();
+            if (size <= needed) {
+                if (best_size > needed || size > best_size) {
+                    best = c;
+                }
+            } else if (best_size > needed && size < best_size) {
+                best = c;
+            }
+        }
+        vector<cpu_t> &core = best->second;
+        for (unsigned i=0; i<core.size() && bindings.size() < task->cpus; i++) {
+            bindings.push_back(core[i]);
+        }
+        core_free.erase(best);
+    }
+
+    sort(bindings.begin(), bindings.end());
+
+    return bindings;
+}
+
+/* Find a contiguous set of cpus for the task assuming that the cpus are
+ * numbered contiguously by socket, core and thread. Returns an empty
+ * vector if there is no solution. */
+vector<cpu_t> Host::aligned_bindings(Task *task) {
+    vector<cpu_t> bindings;
+
     cpu_t threads_per_core = threads / cores;
     cpu_t threads_per_socket = threads / sockets;
     cpu_t threads_needed = task->cpus;
     cpu_t cores_needed = task->cpus / threads_per_core;
     cpu_t sockets_needed = task->cpus / threads_per_socket;
-    log_trace("Task %s requires %" PRIcpu_t " sockets, %" PRIcpu_t " cores, and %" PRIcpu_t " threads\n",
+    LOG(LOG_TRACE, "Task %s requires %" PRIcpu_t " sockets, %" PRIcpu_t " cores, and %" PRIcpu_t " threads\n",
               task->name.c_str(), sockets_needed, cores_needed, threads_needed);
 
     // Determine what the aligned unit step size is
@@ -116,52 +408,91 @@ vector<cpu_t> Host::allocate_resources(Task *task) {
     // This tries to find a contiguous set of cpus that are aligned on a
     // thread, core, or socket boundary. For example, if we need one socket
     // full of cpus, then it will try to find a solution that takes up one full
-    // socket, and not part of two or more sockets.
-    for (cpu_t i=0; i<threads; i+=alignment) {
-        for (cpu_t j=0; j<task->cpus && i+j<threads; j++) {
-            if (cpus[i+j] == NULL) {
-                bindings.push_back(i+j);
-            } else {
+    // socket, and not part of two or more sockets. Of all the free aligned
+    // windows, it picks the one that leaves the fewest free cpus in the 
+    // sockets, and then the cores, that it touches, so that small tasks are 
+    // packed into partly used sockets and cores and whole ones are kept 
+    // for large tasks.
+    bool found = false;
+    unsigned best = 0;
+    unsigned best_cost = 0;
+    for (unsigned i=0; i+task->cpus<=threads; i+=alignment) {
+        bool available = true;
+        for (unsigned j=0; j<task->cpus; j++) {
+            if (cpus[i+j] != NULL) {
                 // One of the cpus is occupied, no solution possible
+                available = false;
                 break;
             }
         }
-
-        if (bindings.size() == task->cpus) {
-            // We found a solution, stop looking
-            break;
-        } else {
-            // No solution, try the next aligned segment
-            bindings.clear();
+        if (!available) {
+            continue;
         }
-    }
 
-    // If we didn't get a contiguous solution above, then don't bind anything
-    if (bindings.size() != task->cpus) {
-        bindings.clear();
-        log_warn("CPU fragmentation detected when scheduling task %s: not setting affinity", task->name.c_str());
+        unsigned last = i + task->cpus - 1;
+        unsigned socket_start = (i / threads_per_socket) * threads_per_socket;
+        unsigned socket_end = (last / threads_per_socket + 1) * threads_per_socket;
+        unsigned core_start = (i / threads_per_core) * threads_per_core;
+        unsigned core_end = (last / threads_per_core + 1) * threads_per_core;
+        unsigned socket_leftover = count_free(socket_start, socket_end) - task->cpus;
+        unsigned core_leftover = count_free(core_start, core_end) - task->cpus;
+        unsigned cost = socket_leftover * threads + core_leftover;
+
+        if (!found || cost < best_cost) {
+            found = true;
+            best = i;
+            best_cost = cost;
+        }
     }
 
-    // Mark all the cpus that were allocated to the task
-    for (vector<cpu_t>::iterator i=bindings.begin(); i!=bindings.end(); i++) {
-        cpu_t j = *i;
-        cpus[j] = task;
-        log_trace("Assigned CPU %" PRIcpu_t " to task %s", j, task->name.c_str());
+    if (found) {
+        for (unsigned j=0; j<task->cpus; j++) {
+            bindings.push_back(best + j);
+        }
     }
 
     return bindings;
 }
 
+/* Returns the number of free cpus in the range [start, end) */
+unsigned Host::count_free(unsigned start, unsigned end) {
+    unsigned count = 0;
+    for (unsigned i=start; i<end && i<threads; i++) {
+        if (cpus[i] == NULL) {
+            count += 1;
+        }
+    }
+    return count;
+}
+
 /* Deallocate all the resources we used for the task */
 void Host::release_resources(Task *task) {
-    cpus_free += task->cpus;
-    memory_free += task->memory;
-    slots_free += 1;
-
-    // Clear any cores occupied by this task
+    vector<cpu_t> bindings;
     for (unsigned i=0; i<threads; i++) {
         if (cpus[i] == task) {
-            cpus[i] = NULL;
+            bindings.push_back(i);
+        }
+    }
+    release_resources(task, task->cpus, task->reserved_memory, bindings);
+}
+
+/* Deallocate the resources that were allocated for one run of the task.
+ * Only the cpus in bindings are cleared, so that another run of the same
+ * task on this host keeps its cpus. */
+void Host::release_resources(Task *task, unsigned cpus, unsigned memory, const vector<cpu_t> &bindings) {
+    if (task->nodes > 1) {
+        release_host(task);
+        slots_free += 1;
+        return;
+    }
+
+    cpus_free += cpus;
+    memory_free += memory;
+    slots_free += 1;
+
+    for (vector<cpu_t>::const_iterator i=bindings.begin(); i!=bindings.end(); i++) {
+        if (this->cpus[*i] == task) {
+            this->cpus[*i] = NULL;
         }
     }
 }
@@ -171,9 +502,63 @@ void Host::add_slot() {
     this->slots_free += 1;
 }
 
-/* Log the number of resources this host currently has */
-void Host::log_resources(FILE *resource_log) {
-    log_trace("Host %s now has %u MB, %u CPUs, and %u slots free", 
+/* Remove a free slot when its worker leaves the workflow */
+void Host::remove_slot() {
+    this->slots -= 1;
+    this->slots_free -= 1;
+}
+
+/* Record the result of a task that ran on the host and return the new
+ * failure score */
+double Host::record_result(bool failed, double now) {
+    failure_score *= pow(0.5, (now - score_time) / HOST_HEALTH_HALF_LIFE);
+    score_time = now;
+
+    tasks_finished += 1;
+    if (failed) {
+        tasks_failed += 1;
+        failure_score += 1.0;
+    }
+
+    return failure_score;
+}
+
+/* The fraction of the tasks that ran on the host that failed */
+double Host::failure_rate() {
+    if (tasks_finished == 0) {
+        return 0.0;
+    }
+    return (double)tasks_failed / tasks_finished;
+}
+
+/* Stop scheduling tasks on the host for a while. Returns the number of
+ * seconds until the host is restored. */
+double Host::blacklist(double now) {
+    double duration = HOST_BLACKLIST_TIME;
+    for (unsigned i=0; i<blacklist_count && duration < HOST_BLACKLIST_MAX; i++) {
+        duration *= 2;
+    }
+    if (duration > HOST_BLACKLIST_MAX) {
+        duration = HOST_BLACKLIST_MAX;
+    }
+
+    blacklist_count += 1;
+    blacklisted_until = now + duration;
+
+    return duration;
+}
+
+/* Put a blacklisted host back into service with a clean record */
+void Host::restore() {
+    blacklisted_until = 0.0;
+    failure_score = 0.0;
+}
+
+/* Log the number of resources this host currently has. If the resources
+ * were released by a task that finished, then the line also has the
+ * resources that the task requested and used. */
+void Host::log_resources(FILE *resource_log, Task *finished) {
+    LOG(LOG_TRACE, "Host %s now has %u MB, %u CPUs, and %u slots free", 
         this->host_name.c_str(), this->memory_free, this->cpus_free, this->slots_free);
 
     if (resource_log == NULL) {
@@ -185,159 +570,244 @@ void Host::log_resources(FILE *resource_log) {
     gettimeofday(&ts, NULL);
     double timestamp = ts.tv_sec + (ts.tv_usec / 1.0e6);
 
-    fprintf(resource_log, "%lf,%u,%u,%u,%s\n", 
-            timestamp, slots_free, cpus_free, memory_free, host_name.c_str());
+    fprintf(resource_log, "%lf,%u,%u,%u,%u,%u,%s", 
+            timestamp, slots_free, cpus_free, memory_free, 
+            largest_free_block(), fragmented_cpus(), host_name.c_str());
+    if (finished != NULL) {
+        struct taskusage *u = &finished->usage;
+        fprintf(resource_log, ",%s,%u,%u,%lu,%lf,%lf,%llu,%llu,%llu,%llu",
+                finished->name.c_str(), finished->cpus, finished->memory,
+                u->maxrss, u->utime, u->stime, u->rchar, u->wchar, 
+                u->read_bytes, u->write_bytes);
+    }
+    fprintf(resource_log, "\n");
 }
 
-JobstateLog::JobstateLog(const string &path) {
-    this->path = path;
-    this->logfile = NULL;
+/* Tasks from Pegasus are grouped by their transformation, other tasks 
+ * are grouped by their executable */
+static string transformation(Task *task) {
+    if (task->pegasus_transformation != "") {
+        return task->pegasus_transformation;
+    }
+    return filename(task->args.front());
 }
 
-JobstateLog::~JobstateLog() {
-    close();
+TaskQueue::TaskQueue() {
+    this->count = 0;
+    this->aging = 0.0;
 }
 
-void JobstateLog::open() {
-    if (this->logfile != NULL) {
-        return;
+TaskQueue::~TaskQueue() {
+    for (map<string, TaskGroup *>::iterator g = groups.begin(); g != groups.end(); g++) {
+        delete g->second;
     }
-    
-    this->logfile = fopen(path.c_str(), "a");
-    if (this->logfile == NULL) {
-        myfailures("Unable to open %s", path.c_str());
+}
+
+/* Set the weight of a group. Groups have a weight of 1 by default. */
+void TaskQueue::set_weight(const string &name, double weight) {
+    weights[name] = weight;
+    map<string, TaskGroup *>::iterator g = groups.find(name);
+    if (g != groups.end()) {
+        g->second->weight = weight;
     }
 }
 
-void JobstateLog::close() {
-    if (logfile != NULL) {
-        fclose(logfile);
-        logfile = NULL;
+/* Set the number of seconds a task has to wait for its priority to go
+ * up by one. This has to be done before any tasks are queued. */
+void TaskQueue::set_aging(double aging) {
+    if (count > 0) {
+        myfailure("Priority aging must be set before tasks are queued");
     }
+    this->aging = aging;
 }
 
-void JobstateLog::on_event(WorkflowEvent event, Task *task) {
-    if (!logfile) {
-        open();
+TaskGroup *TaskQueue::get_group(const string &name) {
+    map<string, TaskGroup *>::iterator g = groups.find(name);
+    if (g != groups.end()) {
+        return g->second;
     }
-    
-    double now = current_time();
-    switch (event) {
-        case TASK_QUEUED:
-            fprintf(logfile, "%0.6lf %s SUBMIT %d.0 - - %u\n", now, 
-                    task->name.c_str(), task->submit_seq, task->submit_seq);
-            break;
-        case TASK_SUBMIT:
-            fprintf(logfile, "%0.6lf %s EXECUTE %d.0 - - %u\n", now, 
-                    task->name.c_str(), task->submit_seq, task->submit_seq);
-            break;
-        case TASK_SUCCESS:
-            fprintf(logfile, "%0.6lf %s JOB_TERMINATED %d.0 - - %u\n", now, 
-                    task->name.c_str(), task->submit_seq, task->submit_seq);
-            fprintf(logfile, "%0.6lf %s JOB_SUCCESS %d - - %u\n", now, 
-                    task->name.c_str(), task->last_exitcode, task->submit_seq);
-            break;
-        case TASK_FAILURE:
-            fprintf(logfile, "%0.6lf %s JOB_TERMINATED %d.0 - - %u\n", now, 
-                    task->name.c_str(), task->submit_seq, task->submit_seq);
-            fprintf(logfile, "%0.6lf %s JOB_FAILURE %d - - %u\n", now,
-                    task->name.c_str(), task->last_exitcode, task->submit_seq);
-            break;
-        case WORKFLOW_START:
-            fprintf(logfile, "%0.6lf INTERNAL *** PMC_STARTED ***\n", now);
-            break;
-        case WORKFLOW_SUCCESS:
-            fprintf(logfile, "%0.6lf INTERNAL *** PMC_FINISHED 0 ***\n", now);
-            break;
-        case WORKFLOW_FAILURE:
-            fprintf(logfile, "%0.6lf INTERNAL *** PMC_FINISHED 1 ***\n", now);
-            break;
+    double weight = 1.0;
+    map<string, double>::iterator w = weights.find(name);
+    if (w != weights.end()) {
+        weight = w->second;
+    }
+    TaskGroup *group = new TaskGroup(name, weight, aging);
+    groups[name] = group;
+    return group;
+}
+
+/* A group that was idle gets in line for its first turn */
+void TaskQueue::activate(TaskGroup *group) {
+    if (!group->active) {
+        group->active = true;
+        group->deficit = group->weight;
+        active.push_back(group);
     }
 }
 
-DAGManLog::DAGManLog(const string &logpath, const string &dagpath) {
-    this->logpath = logpath;
-    this->dagpath = filename(dagpath);
-    this->logfile = NULL;
+/* Queue a task that has become ready */
+void TaskQueue::push(Task *task) {
+    task->queue_time = current_time();
+    TaskGroup *group = get_group(task->group);
+    group->tasks.push(task);
+    activate(group);
+    count++;
+}
+
+/* Put back a task that was popped, but could not be scheduled, or
+ * whose worker left before it finished. The task keeps its place, unless
+ * its submit_seq was changed, and its group gets back what it was
+ * charged for the task. A group that went idle in the meantime has lost what it
+ * saved, so it starts a new turn instead. */
+void TaskQueue::requeue(Task *task) {
+    TaskGroup *group = get_group(task->group);
+    group->tasks.push(task);
+    if (group->active) {
+        group->deficit += task->queue_cost;
+    } else {
+        activate(group);
+    }
+    task->queue_cost = 0.0;
+    group->dispatched--;
+    count++;
+}
+
+/* Return the next task from the group whose turn it is. The group at 
+ * the front of the line keeps dispatching tasks until it can't afford
+ * the next one, and then it goes to the back of the line and earns its
+ * weight for the next turn. Groups that run out of tasks lose what they
+ * have saved, so that they can't use it to take over later. */
+Task *TaskQueue::pop() {
+    if (count == 0) {
+        myfailure("No ready tasks");
+    }
+    while (true) {
+        TaskGroup *group = active.front();
+        if (group->tasks.empty()) {
+            active.pop_front();
+            group->active = false;
+            group->deficit = 0.0;
+            continue;
+        }
+
+        Task *task = group->tasks.top();
+        double cost = task->cpus * task->nodes;
+        if (group->deficit >= cost || active.size() == 1) {
+            // A group that is the only one waiting can dispatch a task
+            // it can't afford, but it only pays what it has
+            group->tasks.pop();
+            task->queue_cost = std::min(cost, group->deficit);
+            group->deficit -= task->queue_cost;
+            group->dispatched++;
+            count--;
+            return task;
+        }
+
+        active.pop_front();
+        active.push_back(group);
+        group->deficit += group->weight;
+    }
 }
 
-DAGManLog::~DAGManLog() {
-    close();
+unsigned TaskQueue::size() const {
+    return count;
 }
 
-void DAGManLog::open() {
-    if (this->logfile != NULL) {
+/* If there is more than one group, log how many tasks each one got */
+void TaskQueue::log_groups() const {
+    if (groups.size() < 2) {
         return;
     }
-    
-    this->logfile = fopen(logpath.c_str(), "w");
-    if (this->logfile == NULL) {
-        myfailures("Unable to open %s", logpath.c_str());
+    for (map<string, TaskGroup *>::const_iterator g = groups.begin(); g != groups.end(); g++) {
+        TaskGroup *group = g->second;
+        log_info("Group %s: weight %g, %lu tasks dispatched", 
+                group->name == "" ? "(none)" : group->name.c_str(),
+                group->weight, group->dispatched);
     }
 }
 
-void DAGManLog::close() {
-    if (logfile != NULL) {
-        fclose(logfile);
-        logfile = NULL;
+MemoryModel::MemoryModel(unsigned margin) {
+    this->margin = margin;
+}
+
+/* Return the amount of memory in MB that should be reserved for the task.
+ * This is the largest peak seen for the task's transformation plus the
+ * margin, and it is never more than the task requested. */
+unsigned MemoryModel::predict(Task *task) {
+    if (task->memory == 0 || task->memory_exceeded) {
+        return task->memory;
+    }
+
+    map<string, pair<unsigned, unsigned long> >::iterator i = 
+        peaks.find(transformation(task));
+    if (i == peaks.end() || i->second.first < ADAPTIVE_MEMORY_SAMPLES) {
+        return task->memory;
+    }
+
+    double peak = i->second.second * (100.0 + margin) / 100.0 / 1024.0;
+    unsigned predicted = (unsigned)ceil(peak);
+    if (predicted < 1) {
+        predicted = 1;
     }
+    return std::min(predicted, task->memory);
 }
 
-void DAGManLog::on_event(WorkflowEvent event, Task *task) {
-    if (!logfile) {
-        open();
+/* Record the peak memory of a task that finished. If the task used more
+ * memory than was reserved for it, or it was killed, which is what the
+ * kernel's OOM killer does, then the task reserves the memory requested 
+ * the next time it runs. */
+void MemoryModel::record(Task *task, int exitcode) {
+    unsigned long peak = task->usage.maxrss;
+
+    if (task->reserved_memory < task->memory) {
+        if (WIFSIGNALED(exitcode) && WTERMSIG(exitcode) == SIGKILL) {
+            log_warn("Task %s was killed with %u MB of memory reserved for "
+                    "it: reserving %u MB next time", task->name.c_str(), 
+                    task->reserved_memory, task->memory);
+            task->memory_exceeded = true;
+        } else if (peak > task->reserved_memory * 1024UL) {
+            log_warn("Task %s used %lu KB of memory, but only %u MB were "
+                    "reserved for it: reserving %u MB next time", 
+                    task->name.c_str(), peak, task->reserved_memory, 
+                    task->memory);
+            task->memory_exceeded = true;
+        }
     }
-    
-    /* Format the timestamp for the log file entry */
-    time_t ts;
-    ::time(&ts);
-    struct tm now;
-    ::localtime_r(&ts, &now);
-    char date[18];
-    sprintf(date, /*mm/dd/yy hh:mm:ss*/ "%02d/%02d/%02d %02d:%02d:%02d", 
-            now.tm_mon+1, now.tm_mday, now.tm_year-100, 
-            now.tm_hour, now.tm_min, now.tm_sec);
-    
-    switch (event) {
-        case TASK_QUEUED:
-            fprintf(logfile, "%s Submitting Condor Node %s job(s)...\n", 
-                    date, task->name.c_str());
-            fprintf(logfile, "%s Event: ULOG_SUBMIT for Condor Node %s (%d.0)\n",
-                    date, task->name.c_str(), task->submit_seq);
-            break;
-        case TASK_SUBMIT:
-            fprintf(logfile, "%s Event: ULOG_EXECUTE for Condor Node %s (%d.0)\n",
-                    date, task->name.c_str(), task->submit_seq);
-            break;
-        case TASK_SUCCESS:
-            fprintf(logfile, "%s Event: ULOG_JOB_TERMINATED for Condor Node %s (%d.0)\n",
-                    date, task->name.c_str(), task->submit_seq);
-            fprintf(logfile, "%s Node %s job proc (%d.0) completed successfully.\n",
-                    date, task->name.c_str(), task->submit_seq);
-            break;
-        case TASK_FAILURE:
-            fprintf(logfile, "%s Event: ULOG_JOB_TERMINATED for Condor Node %s (%d.0)\n",
-                    date, task->name.c_str(), task->submit_seq);
-            fprintf(logfile, "%s Node %s job proc (%d.0) failed with status %d.\n",
-                    date, task->name.c_str(), task->submit_seq, task->last_exitcode);
-            break;
-        case WORKFLOW_START:
-            fprintf(logfile, "%s This is a fake DAGMan log file generated by PMC "
-                    "for the purpose of tricking monitord\n", date);
-            fprintf(logfile, "%s ** condor_scheduniv_exec.0.0 (CONDOR_DAGMAN) "
-                    "STARTING UP\n", date);
-            fprintf(logfile, "%s ** PID = %d\n", date, getpid());
-            fprintf(logfile, "%s Parsing %s ...\n", date, dagpath.c_str()); 
-            break;
-        case WORKFLOW_SUCCESS:
-            fprintf(logfile, "%s **** condor_scheduniv_exec.0.0 (condor_DAGMAN) "
-                    "pid %d EXITING WITH STATUS 0\n", date, getpid());
-            break;
-        case WORKFLOW_FAILURE:
-            fprintf(logfile, "%s **** condor_scheduniv_exec.0.0 (condor_DAGMAN) "
-                    "pid %d EXITING WITH STATUS 1\n", date, getpid());
-            break;
+
+    if (peak == 0) {
+        return;
     }
+
+    pair<unsigned, unsigned long> &p = peaks[transformation(task)];
+    p.first += 1;
+    p.second = std::max(p.second, peak);
+}
+
+RuntimeModel::RuntimeModel(unsigned percentile) {
+    this->percentile = percentile;
+}
+
+/* Record the runtime of a task that finished successfully */
+void RuntimeModel::record(Task *task, double runtime) {
+    vector<double> &r = runtimes[transformation(task)];
+    r.insert(std::upper_bound(r.begin(), r.end(), runtime), runtime);
+}
+
+/* Get the runtime that a task has to exceed before a duplicate of it is
+ * started. Returns false if there are not enough runs of the task's 
+ * transformation to tell. */
+bool RuntimeModel::threshold(Task *task, double *runtime) {
+    map<string, vector<double> >::iterator i = runtimes.find(transformation(task));
+    if (i == runtimes.end() || i->second.size() < SPECULATION_SAMPLES) {
+        return false;
+    }
+    vector<double> &r = i->second;
+    unsigned index = (unsigned)ceil(percentile * r.size() / 100.0);
+    if (index > 0) {
+        index -= 1;
+    }
+    *runtime = r[index];
+    return true;
 }
 
 Master::Master(Communicator *comm, const string &program, Engine &engine,
@@ -353,6 +823,7 @@ Master::Master(Communicator *comm, const string &program, Engine &engine,
     this->dag = &dag;
     this->has_host_script = has_host_script;
     this->max_wall_time = max_wall_time;
+    this->elastic = false;
 
     this->submitted_count = 0;
     this->success_count = 0;
@@ -365,12 +836,10 @@ Master::Master(Communicator *comm, const string &program, Engine &engine,
     this->total_cpus = 0;
     this->total_runtime = 0.0;
 
-    // Determine the number of workers we have
+    // Determine the number of workers we have. If the pool is elastic,
+    // then more workers can join later.
     int numprocs = comm->size();
     this->numworkers = numprocs - 1;
-    if (numworkers == 0) {
-        myfailure("Need at least 1 worker");
-    }
 
     if (resourcefile == "") {
         this->resource_log = NULL;
@@ -379,11 +848,40 @@ Master::Master(Communicator *comm, const string &program, Engine &engine,
     }
 
     this->per_task_stdio = per_task_stdio;
+    this->forward_stdio = false;
+    this->task_stdout = NULL;
+    this->task_stderr = NULL;
 
-    // Task submit sequence starts at 1
+    // Task submit sequence starts at 1, or continues from where a
+    // previous run that was restored from a checkpoint left off
     this->task_submit_seq = 1;
+    for (DAG::iterator i = dag.begin(); i != dag.end(); i++) {
+        Task *task = i->second;
+        this->task_submit_seq = std::max(this->task_submit_seq, task->submit_seq + 1);
+    }
 
-    this->fdcache = new FDCache(maxfds);
+    this->fdcache = new FDCache(maxfds, 0, 1.0);
+
+    this->max_io_inflight = 0;
+    this->io_inflight = 0;
+    this->max_io_inflight_seen = 0;
+
+    this->memory_model = NULL;
+    this->runtime_model = NULL;
+    this->duplicates = 0;
+    this->duplicate_wins = 0;
+
+    this->host_failures = 0;
+
+    this->cycles = 0;
+    this->last_schedule_time = 0.0;
+    this->max_schedule_time = 0.0;
+    this->profiling = false;
+    this->metrics = NULL;
+    this->checkpoint = NULL;
+    this->checkpoint_interval = 0.0;
+    this->last_checkpoint = 0.0;
+    this->dag_hash = 0;
 }
 
 Master::~Master() {
@@ -398,7 +896,7 @@ Master::~Master() {
     }
 
     if (resource_log != NULL && fileno(resource_log) > 2) {
-        log_trace("Closing resource log");
+        LOG(LOG_TRACE, "Closing resource log");
         fclose(resource_log);
     }
 
@@ -407,27 +905,195 @@ Master::~Master() {
         delete fdcache;
         fdcache = NULL;
     }
+
+    delete memory_model;
+    delete runtime_model;
 }
 
 void Master::add_listener(WorkflowEventListener *l) {
     listeners.push_back(l);
 }
 
+void Master::set_metrics(MetricsExporter *metrics) {
+    this->metrics = metrics;
+}
+
+void Master::set_checkpoint(CheckpointWriter *checkpoint, double interval) {
+    this->checkpoint = checkpoint;
+    this->checkpoint_interval = interval;
+    this->dag_hash = checkpoint_hash(*dag);
+}
+
+/* Submit a checkpoint of the state of the tasks to the writer if the
+ * checkpoint interval has passed, or if force is true */
+void Master::save_checkpoint(bool force) {
+    if (checkpoint == NULL) {
+        return;
+    }
+
+    double now = current_time();
+    if (!force && now - last_checkpoint < checkpoint_interval) {
+        return;
+    }
+    last_checkpoint = now;
+
+    build_checkpoint(*dag, dag_hash, engine->rescue_id(), engine->rescue_offset(),
+            checkpoint_data);
+    checkpoint->submit(checkpoint_data);
+}
+
+void Master::set_group_weight(const string &group, double weight) {
+    ready_queue.set_weight(group, weight);
+}
+
+void Master::set_priority_aging(double aging) {
+    ready_queue.set_aging(aging);
+}
+
+/* Buffer the output that tasks send to the master in memory, up to size
+ * bytes per file, and write it at least every flush_interval seconds */
+void Master::set_io_buffer(unsigned size, double flush_interval) {
+    fdcache->bufsize = size;
+    fdcache->flush_interval = flush_interval;
+}
+
+/* Limit the bytes of task output that workers can send to the master
+ * before it is written */
+void Master::set_max_io_inflight(unsigned long max_io_inflight) {
+    this->max_io_inflight = max_io_inflight;
+}
+
+void Master::set_local_stdio(const string &local_stdio) {
+    this->local_stdio = local_stdio;
+}
+
+/* Blacklist hosts where this many recent tasks failed */
+void Master::set_host_failures(unsigned host_failures) {
+    this->host_failures = host_failures;
+}
+
+void Master::enable_stdio_forwarding() {
+    this->forward_stdio = true;
+}
+
+/* Reserve memory for tasks based on the peak memory of earlier tasks of
+ * their transformation, plus margin percent */
+void Master::enable_adaptive_memory(unsigned margin) {
+    delete memory_model;
+    memory_model = new MemoryModel(margin);
+
+    // The peaks of tasks that finished before a restart are known if they
+    // were restored from a checkpoint
+    for (DAG::iterator i = dag->begin(); i != dag->end(); i++) {
+        Task *task = i->second;
+        if (task->success && task->usage.maxrss > 0) {
+            memory_model->record(task, 0);
+        }
+    }
+}
+
+/* Run duplicates of tasks that run longer than this percentile of the
+ * runtimes of their transformation */
+void Master::enable_speculation(unsigned percentile) {
+    delete runtime_model;
+    runtime_model = new RuntimeModel(percentile);
+}
+
+/* Let workers join and leave while the workflow runs */
+void Master::enable_elastic() {
+    this->elastic = true;
+}
+
+void Master::enable_profiling() {
+    this->profiling = true;
+}
+
+/* Give the metrics exporter a new snapshot of the master's state */
+void Master::update_metrics() {
+    if (metrics == NULL) {
+        return;
+    }
+
+    MasterMetrics m;
+    m.time = current_time();
+    m.start_time = start_time;
+
+    for (unsigned i=0; i<slots.size(); i++) {
+        Slot *slot = slots[i];
+        if (slot == NULL) {
+            continue;
+        }
+        m.workers++;
+        if (slot->task != NULL) {
+            m.running_tasks++;
+        }
+    }
+    m.hosts = hosts.size();
+    m.free_slots = free_slots.size();
+
+    m.tasks = dag->size();
+    m.ready_tasks = ready_queue.size();
+    m.submitted_tasks = submitted_count;
+    m.succeeded_tasks = success_count;
+    m.failed_tasks = failed_count;
+
+    m.cycles = cycles;
+    for (int p=0; p<NUM_PHASES; p++) {
+        m.phase_seconds[p] = profile.seconds((MasterPhase)p);
+    }
+    m.last_schedule_seconds = last_schedule_time;
+    m.max_schedule_seconds = max_schedule_time;
+
+    m.messages_sent = comm->messages_sent();
+    m.messages_recvd = comm->messages_recvd();
+    m.bytes_sent = comm->sent();
+    m.bytes_recvd = comm->recvd();
+
+    m.fdcache_hits = fdcache->hits;
+    m.fdcache_misses = fdcache->misses;
+    m.io_pending = fdcache->pending;
+    m.io_inflight = io_inflight;
+    m.io_requests = io_requests.size();
+
+    metrics->update(m);
+}
+
 void Master::publish_event(WorkflowEvent event, Task *task) {
+    if (listeners.empty()) {
+        return;
+    }
+    PhaseTimer timer(profile, PHASE_LISTENERS);
     list<WorkflowEventListener *>::iterator i;
     for (i=listeners.begin(); i!=listeners.end(); i++) {
         (*i)->on_event(event, task);
     }
 }
 
-void Master::submit_task(Task *task, int rank, const vector<cpu_t> &bindings) {
-    log_debug("Submitting task %s to slot %d", task->name.c_str(), rank);
+void Master::submit_task(Task *task, Slot *slot, const vector<cpu_t> &bindings, const vector<string> *hosts) {
+    LOG(LOG_DEBUG, "Submitting task %s to slot %d", task->name.c_str(), slot->rank);
 
     CommandMessage cmd(task->name, task->args, task->pegasus_id, 
-            task->memory, task->cpus, bindings, task->pipe_forwards, task->file_forwards);
-    comm->send_message(&cmd, rank);
+            task->memory, task->cpus, bindings, task->pipe_forwards, task->file_forwards,
+            hosts);
+    comm->send_message(&cmd, slot->rank);
+    trace_event(TRACE_DISPATCH, slot->rank, task->name.c_str(), task->cpus, 
+            task->reserved_memory);
 
-    publish_event(TASK_SUBMIT, task);
+    slot->task = task;
+    slot->start = current_time();
+    slot->cpus = task->cpus;
+    slot->memory = task->reserved_memory;
+    slot->bindings = bindings;
+
+    if (profiling && slot->result_time > 0) {
+        dispatch_latency.record(monotonic_ns() / 1e9 - slot->result_time);
+        slot->result_time = 0.0;
+    }
+
+    // Listeners only see the first copy of a task
+    if (speculated.count(task) == 0) {
+        publish_event(TASK_SUBMIT, task);
+    }
 
     this->submitted_count++;
 }
@@ -438,6 +1104,7 @@ void Master::wait_for_results() {
     // several waiting, then it will process them all and return without 
     // waiting.
     unsigned int tasks = 0;
+    unsigned int workers = 0;
     unsigned int messages = 0;
     do {
         
@@ -458,32 +1125,140 @@ void Master::wait_for_results() {
             double deadline = start_time + (max_wall_time * 60.0);
             timeout = deadline - now;
         }
-        log_trace("Waiting for result");
-        Message *mesg = comm->recv_message(timeout);
-        if (mesg == NULL || ABORT) {
-            ABORT = true;
+
+        /* If there is buffered I/O waiting to be written, then we need
+         * to wake up in time to flush it even if no messages arrive.
+         */
+        if (fdcache->dirty > 0) {
+            if (timeout <= 0 || fdcache->flush_interval < timeout) {
+                timeout = fdcache->flush_interval;
+            }
+        }
+
+        /* If speculation is enabled, then we need to wake up to look for
+         * tasks that are taking too long.
+         */
+        if (runtime_model != NULL) {
+            if (timeout <= 0 || SPECULATION_INTERVAL < timeout) {
+                timeout = SPECULATION_INTERVAL;
+            }
+        }
+
+        /* If a host is blacklisted, then we need to wake up to put it
+         * back into service when its time is up.
+         */
+        double restore = next_restore();
+        if (restore > 0) {
+            if (timeout <= 0 || restore < timeout) {
+                timeout = restore;
+            }
+        }
+
+        LOG(LOG_TRACE, "Waiting for result");
+        Message *mesg;
+        {
+            PhaseTimer timer(profile, PHASE_WAIT);
+            mesg = comm->recv_message(timeout);
+        }
+        if (mesg == NULL) {
+            if (ABORT || wall_time_exceeded()) {
+                ABORT = true;
+                return;
+            }
+            // Timed out waiting for a message so that buffers can be flushed
+            PhaseTimer timer(profile, PHASE_FLUSH);
+            fdcache->flush_expired(current_time());
+            if (runtime_model != NULL || restore > 0) {
+                return;
+            }
+            continue;
+        }
+        if (ABORT) {
+            delete mesg;
             return;
         }
         messages++;
+        uint64_t received = profiling ? monotonic_ns() : 0;
         if (ResultMessage *res = dynamic_cast<ResultMessage *>(mesg)) {
+            PhaseTimer timer(profile, PHASE_RESULT);
             process_result(res);
             tasks++;
         } else if (IODataMessage *iod = dynamic_cast<IODataMessage *>(mesg)) {
+            PhaseTimer timer(profile, PHASE_IODATA);
             process_iodata(iod);
+        } else if (IOCreditMessage *ioc = dynamic_cast<IOCreditMessage *>(mesg)) {
+            PhaseTimer timer(profile, PHASE_CONTROL);
+            process_iocredit(ioc);
+        } else if (RegistrationMessage *reg = dynamic_cast<RegistrationMessage *>(mesg)) {
+            PhaseTimer timer(profile, PHASE_CONTROL);
+            register_worker(reg);
+            workers++;
+        } else if (DepartMessage *dep = dynamic_cast<DepartMessage *>(mesg)) {
+            PhaseTimer timer(profile, PHASE_CONTROL);
+            process_depart(dep);
+            workers++;
         } else {
-            myfailure("Expected result or I/O data message");
+            myfailure("Expected result, I/O data, I/O credit, registration, "
+                      "or depart message");
         }
         delete mesg;
+        if (profiling) {
+            message_latency.record((monotonic_ns() - received) / 1e9);
+        }
+
+        PhaseTimer timer(profile, PHASE_FLUSH);
+        fdcache->flush_expired(current_time());
         
         // We need to do this while tasks == 0 because the caller
         // of this method assumes that it will process at least one
-        // task before returning
-    } while (comm->message_waiting() || tasks == 0);
+        // task before returning. A worker joining or leaving also
+        // changes what can be scheduled.
+    } while (comm->message_waiting() || (tasks == 0 && workers == 0));
     
-    log_trace("Processed %u task(s) and %u message(s) this cycle", 
+    LOG(LOG_TRACE, "Processed %u task(s) and %u message(s) this cycle", 
             tasks, messages);
 }
 
+void Master::process_iocredit(IOCreditMessage *mesg) {
+    LOG(LOG_TRACE, "Worker %d requested credit for %u bytes of I/O", mesg->source, 
+            mesg->bytes);
+    io_requests.push_back(std::make_pair(mesg->source, (unsigned long)mesg->bytes));
+    grant_io_credits();
+}
+
+/* Grant I/O credit to waiting workers in the order they asked for it until
+ * the limit on in-flight I/O is reached. A request that is larger than the
+ * limit is granted when there is nothing else in flight so that it does
+ * not wait forever. */
+void Master::grant_io_credits() {
+    while (io_requests.size() > 0) {
+        int worker = io_requests.front().first;
+        unsigned long bytes = io_requests.front().second;
+        if (io_inflight > 0 && io_inflight + bytes > max_io_inflight) {
+            break;
+        }
+        io_requests.pop_front();
+
+        io_inflight += bytes;
+        io_granted[worker] += bytes;
+        if (io_inflight > max_io_inflight_seen) {
+            max_io_inflight_seen = io_inflight;
+        }
+
+        LOG(LOG_TRACE, "Granting worker %d credit for %lu bytes of I/O (%lu in flight)", 
+                worker, bytes, io_inflight);
+        IOCreditMessage grant(bytes);
+        comm->send_message(&grant, worker);
+    }
+}
+
+bool Master::wall_time_exceeded() {
+    if (max_wall_time <= 0) {
+        return false;
+    }
+    return current_time() >= start_time + (max_wall_time * 60.0);
+}
+
 void Master::process_iodata(IODataMessage *mesg) {
     /* Perform some sanity checks on the message. This
      * was added because of an issue with mangled messages
@@ -502,9 +1277,51 @@ void Master::process_iodata(IODataMessage *mesg) {
         myfailure("Invalid I/O message: bad task name");
     }
     
-    log_trace("Got %u bytes for file %s", mesg->size, mesg->filename.c_str());
+    LOG(LOG_TRACE, "Got %u bytes for file %s", mesg->size, mesg->filename.c_str());
+    trace_event(TRACE_IODATA, mesg->source, mesg->task.c_str(), mesg->size);
+
+    // If this data was sent using credit, then the credit can be
+    // returned to the pool now that the data has been received, even if
+    // the data is not used
+    map<int, unsigned long>::iterator granted = io_granted.find(mesg->source);
+    if (granted != io_granted.end()) {
+        unsigned long returned = mesg->size < granted->second ? mesg->size : granted->second;
+        granted->second -= returned;
+        io_inflight -= returned;
+        if (granted->second == 0) {
+            io_granted.erase(granted);
+        }
+        grant_io_credits();
+    }
+
+    // Only the I/O of the copy of a task that is chosen is written.
+    // Sending I/O is the first thing a worker does when a task finishes,
+    // and the message says whether the copy succeeded; workers do not 
+    // stream task stdio while the task runs if there can be more than 
+    // one copy. A copy that already lost can still be running when the
+    // task is retried, so it must not be chosen over the copies of the
+    // retry.
+    Slot *slot = slots[mesg->source-1];
+    if (!slot->discard && speculated.count(slot->task) > 0) {
+        finish_copy(slot, mesg->exitcode);
+    }
+    if (slot->discard) {
+        LOG(LOG_DEBUG, "Ignoring %u bytes of I/O from duplicate of task %s",
+                mesg->size, mesg->task.c_str());
+        return;
+    }
     
-    if (fdcache->write(mesg->filename, mesg->data, mesg->size) < 0) {
+    // Forwarded task stdio goes to the files that were pinned in the
+    // cache for it
+    string filename = mesg->filename;
+    if (forward_stdio && filename == IODATA_STDOUT) {
+        filename = outfile;
+    } else if (forward_stdio && filename == IODATA_STDERR) {
+        filename = errfile;
+    }
+    int rc = fdcache->write(filename, mesg->data, mesg->size);
+
+    if (rc < 0) {
         log_error("Error writing %d bytes to %s for task %s", mesg->size,
                 mesg->filename.c_str(), mesg->task.c_str());
         
@@ -515,75 +1332,481 @@ void Master::process_iodata(IODataMessage *mesg) {
             myfailure("Unable to find task %s for I/O failure", 
                       mesg->task.c_str());
         }
-        
-        task->io_failed = true;
+        
+        task->io_failed = true;
+    }
+}
+
+void Master::process_result(ResultMessage *mesg) {
+    string name = mesg->name;
+    int exitcode = mesg->exitcode;
+    int rank = mesg->source;
+    double task_runtime = mesg->runtime;
+    
+    total_runtime += task_runtime;
+    
+    Task *task = this->dag->get_task(name);
+    Slot *slot = slots[rank-1];
+    trace_event(TRACE_RESULT, rank, name.c_str(), exitcode);
+
+    if (profiling) {
+        slot->result_time = monotonic_ns() / 1e9;
+    }
+
+    // If there is another copy of the task, then the first one to 
+    // succeed is used, and the result of the other one is ignored. The
+    // resources of the copy that lost are released, and not those of the
+    // task, because the task may have been retried in the meantime.
+    if (!slot->discard && speculated.count(task) > 0) {
+        finish_copy(slot, exitcode);
+    }
+    if (slot->discard) {
+        LOG(LOG_DEBUG, "Ignoring result of duplicate of task %s from worker %d",
+                name.c_str(), rank);
+        slot->discard = false;
+        slot->task = NULL;
+        slot->host->release_resources(task, slot->cpus, slot->memory, slot->bindings);
+        slot->host->log_resources(resource_log);
+        free_slot(slot);
+        return;
+    }
+
+    task->usage = mesg->usage;
+    LOG(LOG_DEBUG, "Task %s used %lu KB of memory and %f seconds of CPU time, "
+            "and read %llu bytes and wrote %llu bytes", name.c_str(), 
+            task->usage.maxrss, task->usage.utime + task->usage.stime,
+            task->usage.rchar, task->usage.wchar);
+
+    if (memory_model != NULL) {
+        memory_model->record(task, exitcode);
+    }
+
+    if (runtime_model != NULL && exitcode == 0) {
+        runtime_model->record(task, task_runtime);
+    }
+
+    if (task->io_failed) {
+        // If there was an error processing I/O data for this task, 
+        // then record it as a failure
+        
+        log_error("Task %s failed due to collective I/O errors", name.c_str());
+        this->failed_count++;
+        
+        // Set the exitcode to something non-zero to force the failure
+        exitcode = 256;
+        
+        // Reset the flag so that, if the task is retried, it won't
+        // automatically fail again
+        task->io_failed = false;
+    } else if (exitcode == 0) {
+        LOG(LOG_DEBUG, "Task %s finished with exitcode %d", name.c_str(), exitcode);
+        this->success_count++;
+    } else {
+        log_error("Task %s failed with exitcode %d", name.c_str(), exitcode);
+        this->failed_count++;
+    }
+    
+    task->last_exitcode = exitcode;
+
+    record_host_result(slot->host, task, exitcode != 0);
+    
+    this->engine->mark_task_finished(task, exitcode);
+    
+    if (exitcode == 0) {
+        publish_event(TASK_SUCCESS, task);
+    } else {
+        publish_event(TASK_FAILURE, task);
+    }
+    
+    // Mark slot idle
+    LOG(LOG_TRACE, "Worker %d is idle", rank);
+    slot->task = NULL;
+    
+    // Return resources to host
+    slot->host->release_resources(task, slot->cpus, slot->memory, slot->bindings);
+    slot->host->log_resources(resource_log, task);
+    release_gang(task);
+
+    // Mark slot as free
+    free_slot(slot);
+}
+
+/* Return a slot to the free list, or park it if its host is blacklisted */
+void Master::free_slot(Slot *slot) {
+    if (slot->host->is_blacklisted()) {
+        parked_slots.push_back(slot);
+    } else {
+        free_slots.push_back(slot);
+    }
+}
+
+/* Update the health of the host where a task finished. If blacklisting
+ * is enabled, then a host where tasks keep failing is blacklisted for a
+ * while, unless it is the last healthy host. */
+void Master::record_host_result(Host *host, Task *task, bool failed) {
+    double now = current_time();
+    double score = host->record_result(failed, now);
+
+    if (failed) {
+        failed_hosts[task].insert(host);
+    } else {
+        failed_hosts.erase(task);
+    }
+
+    if (host_failures == 0 || host->is_blacklisted() || score < host_failures) {
+        return;
+    }
+
+    unsigned healthy = 0;
+    for (unsigned i=0; i<hosts.size(); i++) {
+        if (hosts[i]->num_slots() > 0 && !hosts[i]->is_blacklisted()) {
+            healthy++;
+        }
+    }
+    if (healthy <= 1) {
+        LOG(LOG_DEBUG, "Not blacklisting host %s: it is the last healthy host", 
+                host->name());
+        return;
+    }
+
+    double duration = host->blacklist(now);
+    log_warn("Blacklisting host %s for %.0f seconds: %.0f%% of its tasks failed",
+            host->name(), duration, host->failure_rate() * 100);
+
+    SlotList::iterator s = free_slots.begin();
+    while (s != free_slots.end()) {
+        if ((*s)->host == host) {
+            parked_slots.push_back(*s);
+            s = free_slots.erase(s);
+        } else {
+            s++;
+        }
+    }
+}
+
+/* Returns the number of seconds until the next blacklisted host is 
+ * restored, or 0 if no hosts are blacklisted */
+double Master::next_restore() {
+    double now = current_time();
+    double next = 0.0;
+    for (unsigned i=0; i<hosts.size(); i++) {
+        Host *host = hosts[i];
+        if (!host->is_blacklisted()) {
+            continue;
+        }
+        // Hosts that are due are restored by the next scheduling cycle
+        double remaining = host->blacklist_expires() - now;
+        if (remaining < 0.001) {
+            remaining = 0.001;
+        }
+        if (next == 0.0 || remaining < next) {
+            next = remaining;
+        }
+    }
+    return next;
+}
+
+/* Put blacklisted hosts back into service when their time is up */
+void Master::restore_hosts() {
+    double now = current_time();
+    for (unsigned i=0; i<hosts.size(); i++) {
+        Host *host = hosts[i];
+        if (!host->is_blacklisted() || host->blacklist_expires() > now) {
+            continue;
+        }
+
+        log_info("Restoring blacklisted host %s", host->name());
+        host->restore();
+        SlotList::iterator s = parked_slots.begin();
+        while (s != parked_slots.end()) {
+            if ((*s)->host == host) {
+                free_slots.push_back(*s);
+                s = parked_slots.erase(s);
+            } else {
+                s++;
+            }
+        }
+    }
+}
+
+/* Release the other hosts of a multi-node task */
+void Master::release_gang(Task *task) {
+    map<Task *, vector<Host *> >::iterator g = gangs.find(task);
+    if (g == gangs.end()) {
+        return;
+    }
+    vector<Host *> &gang = g->second;
+    for (unsigned i=1; i<gang.size(); i++) {
+        gang[i]->release_host(task);
+        gang[i]->log_resources(resource_log);
+    }
+    gangs.erase(g);
+}
+
+/* Return the slot of the other copy of the task in slot that is still
+ * running, or NULL if there is none */
+Slot *Master::other_copy(Slot *slot) {
+    for (unsigned i=0; i<slots.size(); i++) {
+        Slot *other = slots[i];
+        if (other != NULL && other != slot && other->task == slot->task && !other->discard) {
+            return other;
+        }
+    }
+    return NULL;
+}
+
+/* One of the copies of a task finished. If it succeeded, then it is 
+ * chosen. If it failed while the other copy is still running, then it is
+ * discarded and the other copy keeps going, so that a copy that fails
+ * fast on a broken host does not kill a healthy one or count as a
+ * failure of the task. The task stays in the speculated set so that it
+ * is not duplicated again. The failure is only used if every copy 
+ * failed. */
+void Master::finish_copy(Slot *slot, int exitcode) {
+    if (exitcode == 0) {
+        choose_copy(slot);
+        return;
+    }
+
+    Slot *other = other_copy(slot);
+    if (other == NULL) {
+        speculated.erase(slot->task);
+        return;
+    }
+    log_info("Copy of task %s failed on worker %d: waiting for the copy "
+            "on worker %d", slot->task->name.c_str(), slot->rank, other->rank);
+    slot->discard = true;
+}
+
+/* The copy of a task in slot succeeded first. The other copy, if it is
+ * still running, is killed. Its slot stays busy until the worker sends
+ * the result, which is ignored. */
+void Master::choose_copy(Slot *slot) {
+    Task *task = slot->task;
+    speculated.erase(task);
+
+    Slot *other = other_copy(slot);
+    if (other != NULL) {
+        log_info("Task %s finished first on worker %d: killing the copy "
+                "on worker %d", task->name.c_str(), slot->rank, other->rank);
+        other->discard = true;
+        KillMessage kill(task->name);
+        comm->send_message(&kill, other->rank);
+
+        // The copy that started later is the duplicate
+        if (other->start < slot->start) {
+            duplicate_wins++;
+        }
+    }
+}
+
+/* Start a duplicate of each task that has been running much longer than
+ * the other tasks of its transformation. This is only done when there 
+ * are free slots and no tasks waiting for them, which usually happens at
+ * the end of the workflow when a few slow tasks, often on a bad host, 
+ * hold up everything else. The duplicate runs on a different host. */
+void Master::speculate_tasks() {
+    if (ready_queue.size() > 0 || free_slots.size() == 0) {
+        return;
+    }
+
+    double now = current_time();
+    for (unsigned i=0; i<slots.size() && free_slots.size() > 0; i++) {
+        Slot *running = slots[i];
+        if (running == NULL || running->task == NULL || running->discard) {
+            continue;
+        }
+        Task *task = running->task;
+        if (task->nodes > 1 || speculated.count(task) > 0) {
+            continue;
+        }
+
+        double threshold;
+        if (!runtime_model->threshold(task, &threshold) || 
+                now - running->start <= threshold) {
+            continue;
+        }
+
+        SlotList::iterator match = free_slots.end();
+        unsigned match_cost = 0;
+        for (SlotList::iterator s = free_slots.begin(); s != free_slots.end(); s++) {
+            Host *host = (*s)->host;
+            if (host == running->host || !host->can_run(task)) {
+                continue;
+            }
+            unsigned cost = host->fit_cost(task);
+            if (match == free_slots.end() || cost < match_cost) {
+                match = s;
+                match_cost = cost;
+            }
+        }
+        if (match == free_slots.end()) {
+            continue;
+        }
+
+        Slot *slot = *match;
+        log_info("Task %s has been running for %.3f seconds on host %s: "
+                "starting a duplicate on host %s", task->name.c_str(), 
+                now - running->start, running->host->name(), slot->host->name());
+
+        vector<cpu_t> bindings = slot->host->allocate_resources(task);
+        slot->host->log_resources(resource_log);
+        speculated.insert(task);
+        submit_task(task, slot, bindings);
+        free_slots.erase(match);
+        duplicates++;
+    }
+}
+
+/* A worker that joined the workflow after it started is leaving. If it 
+ * was running a task, then the task is put back in the queue. */
+void Master::process_depart(DepartMessage *mesg) {
+    int rank = mesg->source;
+    if (rank < 1 || (unsigned)rank > slots.size() || slots[rank-1] == NULL) {
+        myfailure("Got depart message from unknown worker %d", rank);
+    }
+    Slot *slot = slots[rank-1];
+    Host *host = slot->host;
+
+    Task *task = slot->task;
+    if (task == NULL) {
+        free_slots.remove(slot);
+        parked_slots.remove(slot);
+    } else if (slot->discard || other_copy(slot) != NULL) {
+        // Another copy of the task is still running, or already finished
+        log_info("Worker %d left while running a copy of task %s",
+                rank, task->name.c_str());
+        if (!slot->discard) {
+            speculated.erase(task);
+        }
+        host->release_resources(task, slot->cpus, slot->memory, slot->bindings);
+        host->log_resources(resource_log);
+    } else {
+        log_warn("Worker %d left while running task %s: requeueing it",
+                rank, task->name.c_str());
+        speculated.erase(task);
+        host->release_resources(task, slot->cpus, slot->memory, slot->bindings);
+        host->log_resources(resource_log);
+        release_gang(task);
+
+        // The task was already dispatched once, so the queue gets back
+        // what it charged for it
+        task->submit_seq = this->task_submit_seq++;
+        ready_queue.requeue(task);
+        trace_event(TRACE_QUEUED, -1, task->name.c_str());
+        publish_event(TASK_QUEUED, task);
+    }
+
+    // The worker will not send any more I/O, so its credit is returned
+    map<int, unsigned long>::iterator granted = io_granted.find(rank);
+    if (granted != io_granted.end()) {
+        io_inflight -= granted->second;
+        io_granted.erase(granted);
+    }
+    list<pair<int, unsigned long> >::iterator r = io_requests.begin();
+    while (r != io_requests.end()) {
+        if (r->first == rank) {
+            r = io_requests.erase(r);
+        } else {
+            r++;
+        }
     }
+    grant_io_credits();
+
+    host->remove_slot();
+    host->log_resources(resource_log);
+    slots[rank-1] = NULL;
+    delete slot;
+    numworkers--;
+
+    // The shutdown message tells the worker that it can go
+    ShutdownMessage shmsg;
+    comm->send_message(&shmsg, rank);
+    comm->disconnect(rank);
+
+    log_info("Worker %d on host %s left the workflow", rank, host->name());
 }
 
-void Master::process_result(ResultMessage *mesg) {
-    string name = mesg->name;
-    int exitcode = mesg->exitcode;
-    int rank = mesg->source;
-    double task_runtime = mesg->runtime;
-    
-    total_runtime += task_runtime;
-    
-    Task *task = this->dag->get_task(name);
+/* A worker stdio file that needs to be appended to one of the task 
+ * stdio files at the end of the workflow */
+struct MergeJob {
+    string srcfile;
+    string stream;
+    int destfd;
+    off_t offset;
+    size_t size;
+    bool exists;
+    bool parallel;
+    int error;
+};
+
+/* Jobs are handed out to the merge threads in order */
+struct MergeQueue {
+    vector<MergeJob> *jobs;
+    unsigned next;
+    pthread_mutex_t lock;
+};
+
+static void run_merge_job(MergeJob &job) {
+    if (!job.exists || job.size == 0) {
+        return;
+    }
 
-    if (task->io_failed) {
-        // If there was an error processing I/O data for this task, 
-        // then record it as a failure
-        
-        log_error("Task %s failed due to collective I/O errors", name.c_str());
-        this->failed_count++;
-        
-        // Set the exitcode to something non-zero to force the failure
-        exitcode = 256;
-        
-        // Reset the flag so that, if the task is retried, it won't
-        // automatically fail again
-        task->io_failed = false;
-    } else if (exitcode == 0) {
-        log_debug("Task %s finished with exitcode %d", name.c_str(), exitcode);
-        this->success_count++;
-    } else {
-        log_error("Task %s failed with exitcode %d", name.c_str(), exitcode);
-        this->failed_count++;
+    int src = open(job.srcfile.c_str(), O_RDONLY);
+    if (src < 0) {
+        job.error = errno;
+        return;
     }
-    
-    task->last_exitcode = exitcode;
-    
-    this->engine->mark_task_finished(task, exitcode);
-    
-    if (exitcode == 0) {
-        publish_event(TASK_SUCCESS, task);
-    } else {
-        publish_event(TASK_FAILURE, task);
+
+    // Parallel jobs write at their precomputed offset, the others
+    // append at the current offset of the destination
+    off_t offset = job.offset;
+    ssize_t copied = copy_file_data(job.destfd, job.parallel ? &offset : NULL,
+            src, job.size);
+    if (copied < 0) {
+        job.error = errno;
+    } else if ((size_t)copied != job.size) {
+        // The file was truncated while we were copying it
+        job.error = EIO;
     }
-    
-    // Mark slot idle
-    log_trace("Worker %d is idle", rank);
-    Slot *slot = slots[rank-1];
-    
-    // Return resources to host
-    slot->host->release_resources(task);
-    slot->host->log_resources(resource_log);
 
-    // Mark slot as free
-    free_slots.push_back(slot);
+    close(src);
 }
 
-void Master::merge_all_task_stdio() {
-    // If we have per task stdio we don't need to merge the outputs
-    if (per_task_stdio) {
-        return;
+static void *merge_thread(void *arg) {
+    MergeQueue *queue = (MergeQueue *)arg;
+    while (1) {
+        pthread_mutex_lock(&queue->lock);
+        unsigned next = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (next >= queue->jobs->size()) {
+            break;
+        }
+
+        MergeJob &job = (*queue->jobs)[next];
+        if (job.parallel) {
+            run_merge_job(job);
+        }
     }
-    
-    log_info("Merging task stdio from workers...");
-    
-    FILE *task_stdout = stdout;
-    FILE *task_stderr = stderr;
-    
+    return NULL;
+}
+
+/* The merge can only write to the destination at precomputed offsets if 
+ * it is a regular file that is not opened in append mode */
+static bool is_seekable(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || (flags & O_APPEND)) {
+        return false;
+    }
+    return lseek(fd, 0, SEEK_CUR) >= 0;
+}
+
+void Master::open_task_stdio() {
     // Open task stdout
     if (outfile == "stdout") {
         task_stdout = stdout;
@@ -605,62 +1828,222 @@ void Master::merge_all_task_stdio() {
             myfailures("Unable to open stderr file: %s\n", this->outfile.c_str());
         }
     }
-    
-    char rankstr[10];
-    for (int i=1; i<=numworkers; i++) {
-        log_debug("Merging stdio from worker %d...", i);
 
-        sprintf(rankstr, "%d", i);
-        
-        string task_outfile = this->dagfile + ".out." + rankstr;
-        this->merge_task_stdio(task_stdout, task_outfile, "stdout");
-        
-        string task_errfile = this->dagfile + ".err." + rankstr;
-        this->merge_task_stdio(task_stderr, task_errfile, "stderr");
+    // If the workers forward task stdio, then it is written through the
+    // cache like the other forwarded I/O
+    if (forward_stdio) {
+        fdcache->pin(outfile, task_stdout);
+        if (errfile != outfile) {
+            fdcache->pin(errfile, task_stderr);
+        }
     }
-    
-    if (fileno(task_stdout) > 2) {
-        fclose(task_stdout);
+}
+
+void Master::close_task_stdio() {
+    if (forward_stdio) {
+        fdcache->unpin(outfile);
+        fdcache->unpin(errfile);
+    }
+
+    if (task_stdout != NULL) {
+        if (fileno(task_stdout) > 2) {
+            fclose(task_stdout);
+        } else {
+            fflush(task_stdout);
+        }
     }
     
-    if (fileno(task_stderr) > 2) {
-        fclose(task_stderr);
+    if (task_stderr != NULL && task_stderr != task_stdout) {
+        if (fileno(task_stderr) > 2) {
+            fclose(task_stderr);
+        } else {
+            fflush(task_stderr);
+        }
     }
+
+    task_stdout = NULL;
+    task_stderr = NULL;
 }
 
-void Master::merge_task_stdio(FILE *dest, const string &srcfile, const string &stream) {
-    log_trace("Merging %s file: %s", stream.c_str(), srcfile.c_str());
+void Master::merge_all_task_stdio() {
+    // If we have per task stdio, or if the workers forwarded task stdio, 
+    // then we don't need to merge the outputs
+    if (per_task_stdio || forward_stdio) {
+        return;
+    }
     
-    FILE *src = fopen(srcfile.c_str(), "r");
-    if (src == NULL) {
-        // The file may not exist if the worker didn't run any tasks, just print a warning
-        if (errno == ENOENT) {
-            log_warn("No %s file: %s", stream.c_str(), srcfile.c_str());
-            return;
-        } else {
-            myfailures("Unable to open task %s file: %s", stream.c_str(), srcfile.c_str());
+    log_info("Merging task stdio from workers...");
+
+    open_task_stdio();
+
+    // The data is written to the file descriptors directly, so anything
+    // in the stdio buffers has to go first
+    fflush(task_stdout);
+    fflush(task_stderr);
+
+    // The order of the data in the destination files is the same as if
+    // the worker files were appended one at a time
+    vector<MergeJob> jobs;
+    char rankstr[10];
+    for (unsigned r=0; r<stdio_ranks.size(); r++) {
+        sprintf(rankstr, "%d", stdio_ranks[r]);
+
+        MergeJob out;
+        out.srcfile = this->dagfile + ".out." + rankstr;
+        out.stream = "stdout";
+        out.destfd = fileno(task_stdout);
+        jobs.push_back(out);
+
+        MergeJob err;
+        err.srcfile = this->dagfile + ".err." + rankstr;
+        err.stream = "stderr";
+        err.destfd = fileno(task_stderr);
+        jobs.push_back(err);
+    }
+
+    for (vector<MergeJob>::iterator i = jobs.begin(); i != jobs.end(); i++) {
+        MergeJob &job = *i;
+        job.offset = 0;
+        job.size = 0;
+        job.exists = true;
+        job.parallel = false;
+        job.error = 0;
+
+        struct stat st;
+        if (stat(job.srcfile.c_str(), &st) < 0) {
+            // The file may not exist if the worker didn't run any tasks, just print a warning
+            if (errno == ENOENT) {
+                log_warn("No %s file: %s", job.stream.c_str(), job.srcfile.c_str());
+                job.exists = false;
+                continue;
+            } else {
+                myfailures("Unable to open task %s file: %s", job.stream.c_str(), 
+                        job.srcfile.c_str());
+            }
+        }
+        job.size = st.st_size;
+    }
+
+    // Compute the offset of each worker file in its destination. Nothing
+    // can be logged from here until the copy is finished because the log
+    // may be one of the destinations.
+    map<int, off_t> offsets;
+    map<int, bool> seekable;
+    unsigned parallel = 0;
+    for (vector<MergeJob>::iterator i = jobs.begin(); i != jobs.end(); i++) {
+        MergeJob &job = *i;
+        if (!job.exists) {
+            continue;
+        }
+
+        if (seekable.find(job.destfd) == seekable.end()) {
+            seekable[job.destfd] = is_seekable(job.destfd);
+            if (seekable[job.destfd]) {
+                offsets[job.destfd] = lseek(job.destfd, 0, SEEK_CUR);
+            }
+        }
+
+        if (seekable[job.destfd]) {
+            job.parallel = true;
+            job.offset = offsets[job.destfd];
+            offsets[job.destfd] += job.size;
+            parallel++;
         }
     }
-    
-    char buf[BUFSIZ];
-    while (1) {
-        int r = fread(buf, 1, BUFSIZ, src);
-        if (r < 0) {
-            myfailures("Error reading source file: %s", srcfile.c_str());
+
+    // Copy the worker files that go to regular files in parallel
+    if (parallel > 0) {
+        MergeQueue queue;
+        queue.jobs = &jobs;
+        queue.next = 0;
+        pthread_mutex_init(&queue.lock, NULL);
+
+        unsigned nthreads = parallel < MAX_MERGE_THREADS ? parallel : MAX_MERGE_THREADS;
+
+        // The master thread is one of the merge threads. If a thread
+        // cannot be created, then the remaining threads do its share.
+        vector<pthread_t> threads;
+        int rc = 0;
+        for (unsigned i=1; i<nthreads; i++) {
+            pthread_t thread;
+            rc = pthread_create(&thread, NULL, merge_thread, &queue);
+            if (rc != 0) {
+                break;
+            }
+            threads.push_back(thread);
         }
-        if (r == 0) {
-            break;
+        merge_thread(&queue);
+        for (unsigned i=0; i<threads.size(); i++) {
+            pthread_join(threads[i], NULL);
+        }
+
+        pthread_mutex_destroy(&queue.lock);
+
+        // Move the destinations to the end of the merged data so that
+        // anything written later is not written over the top of it
+        for (map<int, off_t>::iterator i = offsets.begin(); i != offsets.end(); i++) {
+            lseek(i->first, i->second, SEEK_SET);
         }
-        int w = fwrite(buf, 1, r, dest);
-        if (w < r) {
-            myfailures("Error writing to dest file");
+
+        if (rc != 0) {
+            log_warn("Unable to create merge thread: %s", strerror(rc));
         }
+        LOG(LOG_DEBUG, "Merged %u stdio files using %u threads", parallel, 
+                (unsigned)threads.size() + 1);
     }
-    
-    fclose(src);
-    
-    if (unlink(srcfile.c_str())) {
-        myfailures("Unable to delete task %s file: %s", stream.c_str(), srcfile.c_str());
+
+    // Pipes, terminals and files opened for append are done in order
+    for (vector<MergeJob>::iterator i = jobs.begin(); i != jobs.end(); i++) {
+        MergeJob &job = *i;
+        if (!job.parallel) {
+            LOG(LOG_TRACE, "Merging %s file: %s", job.stream.c_str(), job.srcfile.c_str());
+            run_merge_job(job);
+        }
+    }
+
+    for (vector<MergeJob>::iterator i = jobs.begin(); i != jobs.end(); i++) {
+        MergeJob &job = *i;
+        if (!job.exists) {
+            continue;
+        }
+        if (job.error != 0) {
+            myfailures("Error merging task %s file %s: %s", job.stream.c_str(),
+                    job.srcfile.c_str(), strerror(job.error));
+        }
+        if (unlink(job.srcfile.c_str())) {
+            myfailures("Unable to delete task %s file: %s", job.stream.c_str(), 
+                    job.srcfile.c_str());
+        }
+    }
+
+    close_task_stdio();
+}
+
+void Master::shutdown_workers() {
+    log_info("Sending workers shutdown messages...");
+    for (unsigned i=0; i<slots.size(); i++) {
+        if (slots[i] == NULL) {
+            continue;
+        }
+        int rank = slots[i]->rank;
+        LOG(LOG_DEBUG, "Sending shutdown message to worker %d", rank);
+        ShutdownMessage shmsg;
+        comm->send_message(&shmsg, rank);
+    }
+
+    // Workers that joined, but were not registered yet, also need to be
+    // told to shut down
+    if (elastic) {
+        vector<int> joined = comm->stop_accepting();
+        for (unsigned i=0; i<joined.size(); i++) {
+            int rank = joined[i];
+            if ((unsigned)rank <= slots.size() && slots[rank-1] != NULL) {
+                continue;
+            }
+            LOG(LOG_DEBUG, "Sending shutdown message to unregistered worker %d", rank);
+            ShutdownMessage shmsg;
+            comm->send_message(&shmsg, rank);
+        }
     }
 }
 
@@ -671,7 +2054,7 @@ void Master::write_cluster_summary(bool failed) {
     
     char summary[BUFSIZ];
     sprintf(summary, "[cluster-summary stat=\"%s\", tasks=%u, submitted=%u, succeeded=%u, failed=%u, extra=0,"
-                 " start=\"%s\", duration=%.3f, pid=%d, app=\"%s\", runtime=%.3f, slots=%d, cpus=%u]\n",
+                 " start=\"%s\", duration=%.3f, pid=%d, app=\"%s\", runtime=%.3f, slots=%d, cpus=%u",
                  failed ? "failed" : "ok", 
                  this->dag->size(),
                  this->submitted_count,
@@ -684,12 +2067,29 @@ void Master::write_cluster_summary(bool failed) {
                  total_runtime,
                  this->numworkers,
                  this->total_cpus);
+
+    string record = summary;
+
+    // List the hosts that were blacklisted at any time during the run
+    if (host_failures > 0) {
+        string blacklisted;
+        for (unsigned i=0; i<hosts.size(); i++) {
+            if (hosts[i]->times_blacklisted() > 0) {
+                if (blacklisted != "") {
+                    blacklisted += ",";
+                }
+                blacklisted += hosts[i]->name();
+            }
+        }
+        record += ", blacklisted=\"" + blacklisted + "\"";
+    }
+    record += "]\n";
     
-    int len = strlen(summary);
+    int len = record.size();
 
     // XXX This should probably be written to the task_stdout, but for most
     // pegasus workflows task_stdout = stdout
-    int w = fwrite(summary, 1, len, stdout);
+    int w = fwrite(record.c_str(), 1, len, stdout);
     if (w < len) {
         myfailures("Error writing cluster-summary");
     }
@@ -702,11 +2102,11 @@ void Master::write_cluster_summary(bool failed) {
  * and so on. The master is not given a host rank.
  */
 void Master::register_workers() {
-    typedef map<string, Host *> HostMap;
-    HostMap hostmap;
-    
     typedef map<int, string> HostnameMap;
     HostnameMap hostnames;
+
+    // Workers that joined while we were waiting are registered last
+    list<RegistrationMessage *> joined;
     
     // Collect host names from all workers, create host objects
     for (int i=0; i<numworkers; i++) {
@@ -716,32 +2116,25 @@ void Master::register_workers() {
             myfailure("Expected registration message");
         }
         int rank = msg->source;
+        if (rank > numworkers) {
+            joined.push_back(msg);
+            i--;
+            continue;
+        }
+        if (msg->version != PROTOCOL_VERSION) {
+            myfailure("Worker %d is using protocol version %u, but the master "
+                      "is using version %u", rank, msg->version, PROTOCOL_VERSION);
+        }
         string hostname = msg->hostname;
-        unsigned int memory = msg->memory;
-        unsigned int threads = msg->threads;
-        unsigned int cores = msg->cores;
-        unsigned int sockets = msg->sockets;
+        add_host(msg);
         delete msg;
 
         hostnames[rank] = hostname;
-
-        if (hostmap.find(hostname) == hostmap.end()) {
-            // If the host is not found, create a new one
-            log_debug("Got new host: name=%s, mem=%u, threads/cpus=%u, cores=%u, sockets=%u",
-                    hostname.c_str(), memory, threads, cores, sockets);
-            Host *newhost = new Host(hostname, memory, threads, cores, sockets);
-            hosts.push_back(newhost);
-            hostmap[hostname] = newhost;
-        } else {
-            // Otherwise, increment the number of slots available
-            Host *host = hostmap[hostname];
-            host->add_slot();
-        }
         
-        log_debug("Slot %d on host %s", rank, hostname.c_str());
+        LOG(LOG_DEBUG, "Slot %d on host %s", rank, hostname.c_str());
     }
     
-    typedef map<string, int> RankMap;
+    typedef map<string, vector<int> > RankMap;
     RankMap ranks;
     
     // Create slots, assign a host rank to each worker
@@ -755,19 +2148,30 @@ void Master::register_workers() {
         Slot *slot = new Slot(rank, host);
         slots.push_back(slot);
         free_slots.push_back(slot);
+        trace_event(TRACE_SLOT, rank, host->name());
         
-        // Compute hostrank for this slot
-        RankMap::iterator nextrank = ranks.find(hostname);
+        // The host rank of this slot is the number of slots on 
+        // the host that came before it
+        ranks[hostname].push_back(rank);
+    }
+
+    for (int rank=1; rank<=numworkers; rank++) {
+        vector<int> &hostranks = ranks[hostnames[rank]];
         int hostrank = 0;
-        if (nextrank != ranks.end()) {
-            hostrank = nextrank->second;
+        while (hostranks[hostrank] != rank) {
+            hostrank++;
         }
-        ranks[hostname] = hostrank + 1;
         
-        HostrankMessage hrmsg(hostrank);
+        HostrankMessage hrmsg(hostrank, hostranks);
         comm->send_message(&hrmsg, rank);
         
-        log_debug("Host rank of worker %d is %d", rank, hostrank);
+        LOG(LOG_DEBUG, "Host rank of worker %d is %d", rank, hostrank);
+
+        // With node-local stdio only the first worker on each host
+        // has stdio files on shared storage
+        if (local_stdio == "" || hostrank == 0) {
+            stdio_ranks.push_back(rank);
+        }
     }
     
     // Log the initial resource freeability
@@ -775,66 +2179,257 @@ void Master::register_workers() {
         Host *host = *i;
         host->log_resources(resource_log);
     }
+
+    for (list<RegistrationMessage *>::iterator j = joined.begin(); j != joined.end(); j++) {
+        register_worker(*j);
+        delete *j;
+    }
+}
+
+/* Add a slot for a worker to its host, creating the host if this is the
+ * first worker on it */
+Host *Master::add_host(RegistrationMessage *msg) {
+    string hostname = msg->hostname;
+
+    map<string, Host *>::iterator h = hostmap.find(hostname);
+    if (h != hostmap.end()) {
+        // Increment the number of slots available
+        Host *host = h->second;
+        host->add_slot();
+        return host;
+    }
+
+    LOG(LOG_DEBUG, "Got new host: name=%s, mem=%u, threads/cpus=%u, cores=%u, sockets=%u",
+            hostname.c_str(), msg->memory, msg->threads, msg->cores, msg->sockets);
+    Host *host = new Host(hostname, msg->memory, msg->threads, msg->cores, msg->sockets);
+    host->set_topology(msg->cpu_nodes, msg->cpu_cores);
+    hosts.push_back(host);
+    hostmap[hostname] = host;
+    return host;
+}
+
+/* Register a worker that joined the workflow after it started. The host
+ * rank of the worker is the number of workers on the host before it. */
+void Master::register_worker(RegistrationMessage *msg) {
+    int rank = msg->source;
+    if (msg->version != PROTOCOL_VERSION) {
+        log_error("Worker %d is using protocol version %u, but the master "
+                  "is using version %u", rank, msg->version, PROTOCOL_VERSION);
+        ShutdownMessage shmsg;
+        comm->send_message(&shmsg, rank);
+        comm->disconnect(rank);
+        return;
+    }
+
+    Host *host = add_host(msg);
+    Slot *slot = new Slot(rank, host);
+    if (slots.size() < (unsigned)rank) {
+        slots.resize(rank, NULL);
+    }
+    slots[rank-1] = slot;
+    free_slot(slot);
+    numworkers++;
+    trace_event(TRACE_SLOT, rank, host->name());
+
+    vector<int> hostranks;
+    for (unsigned i=0; i<slots.size(); i++) {
+        if (slots[i] != NULL && slots[i]->host == host) {
+            hostranks.push_back(slots[i]->rank);
+        }
+    }
+    int hostrank = 0;
+    while (hostranks[hostrank] != rank) {
+        hostrank++;
+    }
+    HostrankMessage hrmsg(hostrank, hostranks);
+    comm->send_message(&hrmsg, rank);
+
+    stdio_ranks.push_back(rank);
+
+    host->log_resources(resource_log);
+
+    log_info("Worker %d on host %s joined the workflow", rank, host->name());
 }
 
 void Master::schedule_tasks() {
-    log_debug("Scheduling %d tasks on %d slots...", 
+    LOG(LOG_DEBUG, "Scheduling %d tasks on %d slots...", 
         ready_queue.size(), free_slots.size());
 
     int scheduled = 0;
     TaskList deferred_tasks;
 
+    // Hosts that are kept free for multi-node tasks that are waiting
+    set<Host *> draining;
+
     while (ready_queue.size() > 0 && free_slots.size() > 0) {
-        Task *task = ready_queue.top();
-        ready_queue.pop();
+        Task *task = ready_queue.pop();
 
-        log_trace("Scheduling task %s", task->name.c_str());
+        LOG(LOG_TRACE, "Scheduling task %s", task->name.c_str());
 
-        bool match = false;
+        // The prediction can change while the task is waiting, so it is
+        // updated every time we try to schedule the task
+        if (memory_model != NULL) {
+            task->reserved_memory = memory_model->predict(task);
+            LOG(LOG_TRACE, "Reserving %u MB of the %u MB requested by task %s",
+                    task->reserved_memory, task->memory, task->name.c_str());
+        }
 
-        for (SlotList::iterator s = free_slots.begin(); s != free_slots.end(); s++) {
-            Slot *slot = *s;
-            Host *host = slot->host;
+        if (task->nodes > 1) {
+            if (schedule_gang(task, draining)) {
+                scheduled += 1;
+            } else {
+                LOG(LOG_TRACE, "Not enough free hosts for task %s", task->name.c_str());
+                deferred_tasks.push_back(task);
+            }
+            continue;
+        }
 
-            // If the task fits, schedule it
-            if (host->can_run(task)) {
+        // Find the slot on the host where the task fits best. The cost 
+        // only depends on the host, so it is computed once per host. 
+        // Retries prefer hosts where the task has not failed before.
+        map<Task *, set<Host *> >::iterator failed = failed_hosts.find(task);
+        SlotList::iterator match = free_slots.end();
+        unsigned match_cost = 0;
+        bool match_failed = false;
+        map<Host *, unsigned> costs;
+        for (SlotList::iterator s = free_slots.begin(); s != free_slots.end(); s++) {
+            Host *host = (*s)->host;
 
-                log_trace("Matched task %s to slot %d on host %s", 
-                    task->name.c_str(), slot->rank, host->name());
+            if (draining.count(host) > 0 || !host->can_run(task)) {
+                continue;
+            }
 
-                // Reserve the resources
-                vector<cpu_t> bindings = host->allocate_resources(task);
-                host->log_resources(resource_log);
+            if (costs.find(host) == costs.end()) {
+                costs[host] = host->fit_cost(task);
+            }
+            unsigned cost = costs[host];
+            bool failed_here = failed != failed_hosts.end() && 
+                failed->second.count(host) > 0;
+
+            if (match == free_slots.end() || failed_here < match_failed ||
+                    (failed_here == match_failed && cost < match_cost)) {
+                match = s;
+                match_cost = cost;
+                match_failed = failed_here;
+            }
+        }
 
-                submit_task(task, slot->rank, bindings);
+        // If the task fits, schedule it
+        if (match != free_slots.end()) {
+            Slot *slot = *match;
+            Host *host = slot->host;
 
-                s = free_slots.erase(s);
+            LOG(LOG_TRACE, "Matched task %s to slot %d on host %s", 
+                task->name.c_str(), slot->rank, host->name());
 
-                // so that the s++ in the loop doesn't skip one
-                s--;
+            // Reserve the resources
+            vector<cpu_t> bindings = host->allocate_resources(task);
+            host->log_resources(resource_log);
 
-                match = true;
-                scheduled += 1;
+            submit_task(task, slot, bindings);
 
-                // This is to break out of the slot loop so that we can 
-                // consider the next task
-                break;
-            }
-        }
+            free_slots.erase(match);
 
-        if (!match) {
+            scheduled += 1;
+        } else {
             // If the task could not be scheduled, then we save it 
             // and move on to the next one. It will be requeued later.
-            log_trace("No slot found for task %s", task->name.c_str());
+            LOG(LOG_TRACE, "No slot found for task %s", task->name.c_str());
             deferred_tasks.push_back(task);
         }
     }
 
-    log_debug("Scheduled %d tasks and deferred %d tasks", scheduled, deferred_tasks.size());
+    LOG(LOG_DEBUG, "Scheduled %d tasks and deferred %d tasks", scheduled, deferred_tasks.size());
 
     // Requeue all the deferred tasks
     for (TaskList::iterator t = deferred_tasks.begin(); t != deferred_tasks.end(); t++) {
-        ready_queue.push(*t);
+        ready_queue.requeue(*t);
+    }
+}
+
+/* Schedule a task that runs on more than one node. The task runs in a 
+ * free slot on an idle host, and the other hosts it needs are reserved
+ * for it. If there are not enough idle hosts, then hosts are drained so
+ * that the task does not wait forever behind smaller tasks. */
+bool Master::schedule_gang(Task *task, set<Host *> &draining) {
+    SlotList::iterator leader = free_slots.end();
+    for (SlotList::iterator s = free_slots.begin(); s != free_slots.end(); s++) {
+        Host *host = (*s)->host;
+        if (draining.count(host) == 0 && host->can_run(task)) {
+            leader = s;
+            break;
+        }
+    }
+    if (leader == free_slots.end()) {
+        drain_hosts(task, draining);
+        return false;
+    }
+
+    Slot *slot = *leader;
+    vector<Host *> gang;
+    gang.push_back(slot->host);
+    for (unsigned i=0; i<hosts.size() && gang.size() < task->nodes; i++) {
+        Host *host = hosts[i];
+        if (host != slot->host && draining.count(host) == 0 && 
+                !host->is_blacklisted() && host->can_run(task)) {
+            gang.push_back(host);
+        }
+    }
+    if (gang.size() < task->nodes) {
+        drain_hosts(task, draining);
+        return false;
+    }
+
+    vector<cpu_t> bindings = gang[0]->allocate_resources(task);
+    vector<string> hostnames;
+    for (unsigned i=0; i<gang.size(); i++) {
+        if (i > 0) {
+            gang[i]->reserve_host(task);
+        }
+        gang[i]->log_resources(resource_log);
+        hostnames.push_back(gang[i]->name());
+    }
+
+    LOG(LOG_TRACE, "Matched task %s to slot %d and %u hosts", task->name.c_str(),
+            slot->rank, gang.size());
+
+    submit_task(task, slot, bindings, &hostnames);
+
+    free_slots.erase(leader);
+    gangs[task] = gang;
+
+    return true;
+}
+
+/* Keep enough hosts free for a multi-node task that cannot be scheduled
+ * yet, preferring hosts that are already idle. The same hosts are chosen
+ * every time, so they will eventually become idle. */
+void Master::drain_hosts(Task *task, set<Host *> &draining) {
+    vector<Host *> chosen;
+    for (unsigned pass=0; pass<2; pass++) {
+        for (unsigned i=0; i<hosts.size() && chosen.size() < task->nodes; i++) {
+            Host *host = hosts[i];
+            if (draining.count(host) > 0 || host->is_blacklisted() || 
+                    !host->can_fit(task)) {
+                continue;
+            }
+            if ((pass == 0) != host->is_free()) {
+                continue;
+            }
+            chosen.push_back(host);
+        }
+    }
+
+    // If another task is draining the hosts we would need, then let it go
+    // first
+    if (chosen.size() < task->nodes) {
+        return;
+    }
+
+    for (unsigned i=0; i<chosen.size(); i++) {
+        LOG(LOG_TRACE, "Draining host %s for task %s", chosen[i]->name(), 
+                task->name.c_str());
+        draining.insert(chosen[i]);
     }
 }
 
@@ -842,18 +2437,24 @@ void Master::queue_ready_tasks() {
     while (this->engine->has_ready_task()) {
         Task *task = this->engine->next_ready_task();
 
-        log_debug("Queueing task %s", task->name.c_str());
+        LOG(LOG_DEBUG, "Queueing task %s", task->name.c_str());
         
         // Assign a submit sequence number to this task
         task->submit_seq = this->task_submit_seq++;
         
         ready_queue.push(task);
+        trace_event(TRACE_QUEUED, -1, task->name.c_str());
         
         publish_event(TASK_QUEUED, task);
     }
 }
 
 int Master::run() {
+    // If the pool is elastic, then all of the workers can join later
+    if (numworkers == 0 && !elastic) {
+        myfailure("Need at least 1 worker");
+    }
+
     log_info("Master starting with %d workers", numworkers);
     
     start_time = current_time();
@@ -878,29 +2479,44 @@ int Master::run() {
         alarm((unsigned)ceil(max_wall_time * 60.0));
     }
     
+    if (metrics != NULL) {
+        metrics->start();
+    }
+
+    if (checkpoint != NULL) {
+        checkpoint->start();
+        last_checkpoint = current_time();
+    }
+
     register_workers();
+    update_metrics();
     
     // Check to make sure that there is at least one host capable
-    // of executing every task
-    for (DAG::iterator t = dag->begin(); t != dag->end(); t++){
+    // of executing every task. If the pool is elastic, then the hosts
+    // that can run a task might join later.
+    for (DAG::iterator t = dag->begin(); t != dag->end() && !elastic; t++){
         Task *task = (*t).second;
         
-        // Check all the hosts for one that can run the task
-        bool match = false;
+        // Check all the hosts for enough hosts that can run the task
+        unsigned matches = 0;
         for (unsigned h=0; h<hosts.size(); h++) {
             Host *host = hosts[h];
             if (host->can_run(task)) {
-                match = true;
-                break;
+                matches += 1;
             }
         }
         
-        if (!match) {
+        if (matches == 0) {
             // There was no host found that was capable of executing the
             // task, so we must abort
             myfailure("FATAL ERROR: No host is capable of running task %s", 
                 task->name.c_str());
         }
+        if (matches < task->nodes) {
+            myfailure("FATAL ERROR: Task %s requires %u hosts, but only %u "
+                "hosts are capable of running it", task->name.c_str(), 
+                task->nodes, matches);
+        }
     }
     
     // If there is a host script, wait here for it to run
@@ -908,15 +2524,50 @@ int Master::run() {
         comm->barrier();
     }
     
+    // If the workers are forwarding task stdio, then it is written
+    // as the tasks finish instead of being merged at the end
+    if (forward_stdio) {
+        open_task_stdio();
+    }
+
     log_info("Starting workflow");
     double makespan_start = current_time();
     // Keep executing tasks until the workflow is finished or the master
     // needs to abort the workflow due to a signal being caught
+    profile.start();
     while (!this->engine->is_finished() && !ABORT) {
-        queue_ready_tasks();
-        schedule_tasks();
+        uint64_t cycle_start = monotonic_ns();
+        trace_event(TRACE_BEGIN, -1, "schedule");
+        {
+            PhaseTimer timer(profile, PHASE_QUEUE);
+            queue_ready_tasks();
+        }
+        {
+            PhaseTimer timer(profile, PHASE_SCHEDULE);
+            restore_hosts();
+            trace_event(TRACE_COUNTERS, -1, "", ready_queue.size(), free_slots.size());
+            schedule_tasks();
+            if (runtime_model != NULL) {
+                speculate_tasks();
+            }
+        }
+        trace_event(TRACE_END, -1, "schedule");
+        uint64_t wait_start = monotonic_ns();
+        update_metrics();
+        trace_event(TRACE_BEGIN, -1, "wait");
         wait_for_results();
+        trace_event(TRACE_END, -1, "wait");
+        save_checkpoint(false);
+
+        last_schedule_time = (wait_start - cycle_start) / 1e9;
+        max_schedule_time = std::max(max_schedule_time, last_schedule_time);
+        cycles++;
+        if (profiling) {
+            schedule_latency.record(last_schedule_time);
+            cycle_latency.record((monotonic_ns() - cycle_start) / 1e9);
+        }
     }
+    profile.stop();
 	double makespan_finish = current_time();
     
     if (ABORT) {
@@ -938,11 +2589,23 @@ int Master::run() {
     // Close FDCache here before merging output so that
     // we can be sure the data files are flushed
     fdcache->close();
+
+    if (metrics != NULL) {
+        update_metrics();
+        metrics->stop();
+    }
+
+    // The last checkpoint has to be on disk before the master exits,
+    // including when the workflow is aborted
+    if (checkpoint != NULL) {
+        save_checkpoint(true);
+        checkpoint->finish();
+    }
     
     // Compute resource utilization
     double master_util = total_runtime / (wall_time * (numworkers+1));
     double worker_util = total_runtime / (wall_time * numworkers);
-    if (total_runtime <= 0) {
+    if (total_runtime <= 0 || numworkers == 0) {
         master_util = 0.0;
         worker_util = 0.0;
     }
@@ -956,17 +2619,69 @@ int Master::run() {
     log_info("Bytes sent to workers: %lu", comm->sent());
     log_info("Bytes received from workers: %lu", comm->recvd());
     log_info("File descriptor cache hit rate: %lf", fdcache->hitrate());
+    log_info("Master loop: %lu cycles in %lf seconds", cycles, profile.total());
+    for (int p=0; p<NUM_PHASES; p++) {
+        double seconds = profile.seconds((MasterPhase)p);
+        log_info("Time in %s: %lf seconds (%.1lf%%)", phase_name((MasterPhase)p),
+                seconds, profile.total() > 0 ? 100.0 * seconds / profile.total() : 0.0);
+    }
+    if (profiling) {
+        dispatch_latency.log("Result to next dispatch latency");
+        message_latency.log("Message processing latency");
+        schedule_latency.log("Scheduling latency");
+        cycle_latency.log("Master loop cycle latency");
+    }
+    if (fdcache->bufsize > 0) {
+        log_info("Collective I/O records: %lu in %lu writes", 
+                fdcache->records, fdcache->flushes);
+    }
+    if (max_io_inflight > 0) {
+        log_info("Max I/O credit in flight: %lu bytes", max_io_inflight_seen);
+    }
+    if (runtime_model != NULL) {
+        log_info("Duplicate tasks: %u started, %u finished first", 
+                duplicates, duplicate_wins);
+    }
+    ready_queue.log_groups();
+    for (unsigned i=0; i<hosts.size(); i++) {
+        Host *host = hosts[i];
+        if (host->times_blacklisted() > 0) {
+            log_info("Host %s was blacklisted %u times: %.0f%% of its tasks failed",
+                    host->name(), host->times_blacklisted(), 
+                    host->failure_rate() * 100);
+        }
+    }
+
+    // If some buffered I/O could not be written, then some of the tasks 
+    // that were marked successful have lost their output
+    if (fdcache->flush_errors > 0) {
+        log_error("Unable to write %u buffers of collective I/O", 
+                fdcache->flush_errors);
+    }
 
-    bool failed = ABORT || this->engine->is_failed();
+    bool failed = ABORT || this->engine->is_failed() || fdcache->flush_errors > 0;
     write_cluster_summary(failed);
     
-    if (!per_task_stdio) merge_all_task_stdio();
-    
-    log_info("Sending workers shutdown messages...");
-    for (int i=1; i<=numworkers; i++) {
-        log_debug("Sending shutdown message to worker %d", i);
-        ShutdownMessage shmsg;
-        comm->send_message(&shmsg, i);
+    // With node-local stdio the workers copy their stdio files to shared
+    // storage after they get the shutdown message, so the merge has to 
+    // wait until they are done
+    if (local_stdio != "") {
+        shutdown_workers();
+        log_info("Waiting for workers to copy node-local stdio...");
+        // The first barrier is for the workers to finish writing their
+        // local files, and the second is for the copies to finish
+        comm->barrier();
+        comm->barrier();
+    }
+
+    if (forward_stdio) {
+        close_task_stdio();
+    } else if (!per_task_stdio) {
+        merge_all_task_stdio();
+    }
+
+    if (local_stdio == "") {
+        shutdown_workers();
     }
     
     if (failed) {
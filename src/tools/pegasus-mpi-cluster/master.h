@@ -4,23 +4,48 @@
 #include <list>
 #include <vector>
 #include <map>
+#include <set>
+#include <utility>
 
 #include "engine.h"
 #include "dag.h"
 #include "protocol.h"
 #include "comm.h"
 #include "fdcache.h"
+#include "eventlog.h"
+#include "metrics.h"
+#include "checkpoint.h"
+#include "profile.h"
 
 using std::string;
 using std::vector;
 using std::priority_queue;
 using std::list;
 using std::map;
+using std::pair;
+using std::set;
+
+// The failure score of a host is halved every HOST_HEALTH_HALF_LIFE 
+// seconds, so that old failures are forgotten
+#define HOST_HEALTH_HALF_LIFE 60.0
+
+// How long a host is blacklisted the first time, in seconds. The time 
+// doubles every time the same host is blacklisted, up to 
+// HOST_BLACKLIST_MAX seconds.
+#define HOST_BLACKLIST_TIME 60.0
+#define HOST_BLACKLIST_MAX 3600.0
 
 class Host {
 private:
     Task **cpus;
 
+    // The multi-node task that has reserved the whole host, if any
+    Task *gang;
+
+    // NUMA node and physical core of each cpu, if known
+    vector<cpu_t> cpu_nodes;
+    vector<cpu_t> cpu_cores;
+
     string host_name;
     unsigned int memory;
     cpu_t threads;
@@ -32,79 +57,192 @@ private:
     unsigned int cpus_free;
     unsigned int slots_free;
 
+    // Health of the host. The failure score is the number of recent 
+    // task failures, which decays exponentially with time.
+    unsigned tasks_finished;
+    unsigned tasks_failed;
+    double failure_score;
+    double score_time;
+    double blacklisted_until;
+    unsigned blacklist_count;
+
+    vector<cpu_t> find_bindings(Task *task);
+    vector<cpu_t> numa_bindings(Task *task);
+    vector<cpu_t> aligned_bindings(Task *task);
+    unsigned count_free(unsigned start, unsigned end);
+    unsigned core_of(unsigned cpu);
+    unsigned node_of(unsigned cpu);
+
 public:
     Host(const string &host_name, unsigned int memory, cpu_t threads, cpu_t cores, cpu_t sockets);
     ~Host();
     const char *name() { return host_name.c_str(); }
+    void set_topology(const vector<cpu_t> &cpu_nodes, const vector<cpu_t> &cpu_cores);
     void add_slot();
+    void remove_slot();
     bool can_run(Task *task);
+    bool can_fit(Task *task);
+    bool is_free();
+    unsigned fit_cost(Task *task);
+    unsigned largest_free_block();
+    unsigned fragmented_cpus();
     vector<cpu_t> allocate_resources(Task *task);
     void release_resources(Task *task);
-    void log_resources(FILE *resource_log);
+    void release_resources(Task *task, unsigned cpus, unsigned memory, const vector<cpu_t> &bindings);
+    void reserve_host(Task *task);
+    void release_host(Task *task);
+    void log_resources(FILE *resource_log, Task *finished = NULL);
+    unsigned num_slots() { return slots; }
+    double record_result(bool failed, double now);
+    double failure_rate();
+    double blacklist(double now);
+    void restore();
+    bool is_blacklisted() { return blacklisted_until > 0; }
+    double blacklist_expires() { return blacklisted_until; }
+    unsigned times_blacklisted() { return blacklist_count; }
+};
+
+// The number of runs of a transformation that adaptive memory needs to 
+// see before it reserves less than the memory requested for its tasks
+#define ADAPTIVE_MEMORY_SAMPLES 3
+
+/* Learns the peak memory usage of each transformation so that tasks can
+ * be scheduled using the memory they are likely to use instead of the
+ * memory they requested. */
+class MemoryModel {
+private:
+    // Number of runs and largest peak memory in KB of each transformation
+    map<string, pair<unsigned, unsigned long> > peaks;
+    unsigned margin;
+public:
+    MemoryModel(unsigned margin);
+    unsigned predict(Task *task);
+    void record(Task *task, int exitcode);
+};
+
+// The number of successful runs of a transformation that speculation 
+// needs to see before it runs duplicates of its tasks
+#define SPECULATION_SAMPLES 3
+
+// How often the master looks for tasks to run duplicates of, in seconds
+#define SPECULATION_INTERVAL 1.0
+
+/* Learns the runtime of each transformation so that tasks that run much
+ * longer than the other tasks of their transformation can be found. */
+class RuntimeModel {
+private:
+    // Sorted runtimes of the successful runs of each transformation
+    map<string, vector<double> > runtimes;
+    unsigned percentile;
+public:
+    RuntimeModel(unsigned percentile);
+    void record(Task *task, double runtime);
+    bool threshold(Task *task, double *runtime);
 };
 
 class Slot {
 public:
     unsigned int rank;
     Host *host;
+
+    // The task that is running in the slot, if any, and when it started
+    Task *task;
+    double start;
+
+    // The resources that were allocated for the task in the slot. Two 
+    // copies of a task, or a copy and a retry, can be allocated different
+    // resources, so these are what is released when the slot is done.
+    unsigned cpus;
+    unsigned memory;
+    vector<cpu_t> bindings;
+
+    // Set if the task is a copy that lost to another copy of the same
+    // task, and its result should be ignored
+    bool discard;
+
+    // When the last result from the slot arrived, if profiling is enabled
+    double result_time;
     
     Slot(unsigned int rank, Host *host) {
         this->rank = rank;
         this->host = host;
+        this->task = NULL;
+        this->start = 0.0;
+        this->cpus = 0;
+        this->memory = 0;
+        this->discard = false;
+        this->result_time = 0.0;
     }
 };
 
+/* Orders the tasks in a group by priority, and then by the order they
+ * were queued. If aging is enabled, then a task's priority goes up by
+ * one for every aging seconds it waits. All the tasks age at the same 
+ * rate, so the order only depends on when they were queued. */
 class TaskPriority {
 public:
-    bool operator ()(const Task *x, const Task *y){
-        return x->priority < y->priority;
+    double aging;
+
+    TaskPriority(double aging = 0.0) {
+        this->aging = aging;
     }
-};
 
-typedef enum {
-    WORKFLOW_START,
-    WORKFLOW_SUCCESS,
-    WORKFLOW_FAILURE,
-    TASK_QUEUED,
-    TASK_SUBMIT,
-    TASK_SUCCESS,
-    TASK_FAILURE
-} WorkflowEvent;
-
-class WorkflowEventListener {
-public:
-    virtual void on_event(WorkflowEvent event, Task *task) = 0;
+    bool operator ()(const Task *x, const Task *y) const {
+        double diff = x->priority - y->priority;
+        if (aging > 0.0) {
+            diff -= (x->queue_time - y->queue_time) / aging;
+        }
+        if (diff != 0.0) {
+            return diff < 0.0;
+        }
+        return x->submit_seq > y->submit_seq;
+    }
 };
 
-class JobstateLog : public WorkflowEventListener {
-private:
-    string path;
-    FILE *logfile;
-    
-    void open();
-    void close();
+class TaskGroup {
 public:
-    JobstateLog(const string &path);
-    ~JobstateLog();
-    void on_event(WorkflowEvent event, Task *task);
+    string name;
+    double weight;
+    double deficit;
+    bool active;
+    unsigned long dispatched;
+    priority_queue<Task *, vector<Task *>, TaskPriority> tasks;
+
+    TaskGroup(const string &name, double weight, double aging) : 
+        tasks(TaskPriority(aging)) {
+        this->name = name;
+        this->weight = weight;
+        this->deficit = 0.0;
+        this->active = false;
+        this->dispatched = 0;
+    }
 };
 
-class DAGManLog : public WorkflowEventListener {
-private:
-    string logpath;
-    string dagpath;
-    FILE *logfile;
-    
-    void open();
-    void close();
+/* The ready queue. Groups of tasks take turns using weighted deficit 
+ * round-robin, where each turn a group earns its weight in CPUs and 
+ * spends the CPUs of the tasks it dispatches, so that each group gets a
+ * share of the CPUs proportional to its weight. */
+class TaskQueue {
+    map<string, TaskGroup *> groups;
+    list<TaskGroup *> active;
+    map<string, double> weights;
+    unsigned count;
+    double aging;
+
+    TaskGroup *get_group(const string &name);
+    void activate(TaskGroup *group);
 public:
-    DAGManLog(const string &logpath, const string &dagpath);
-    ~DAGManLog();
-    void on_event(WorkflowEvent event, Task *task);
+    TaskQueue();
+    ~TaskQueue();
+    void set_weight(const string &name, double weight);
+    void set_aging(double aging);
+    void push(Task *task);
+    void requeue(Task *task);
+    Task *pop();
+    unsigned size() const;
+    void log_groups() const;
 };
 
-typedef priority_queue<Task *, vector<Task *>, TaskPriority> TaskQueue;
-
 typedef list<Slot *> SlotList;
 typedef list<Task *> TaskList;
 
@@ -120,8 +258,11 @@ class Master {
     
     FILE *resource_log;
     
+    // Slots are indexed by rank-1. The slots of workers that left the 
+    // workflow are NULL.
     vector<Slot *> slots;
     vector<Host *> hosts;
+    map<string, Host *> hostmap;
     SlotList free_slots;
     TaskQueue ready_queue;
     
@@ -142,24 +283,116 @@ class Master {
     double wall_time;
     
     FDCache *fdcache;
+
+    // Flow control for I/O forwarding. Workers ask for credit before 
+    // sending large amounts of I/O data, and the master limits the 
+    // total amount of credit that is outstanding.
+    unsigned long max_io_inflight;
+    unsigned long io_inflight;
+    unsigned long max_io_inflight_seen;
+    map<int, unsigned long> io_granted;
+    list<pair<int, unsigned long> > io_requests;
     
     bool per_task_stdio;
+    bool forward_stdio;
+    string local_stdio;
+
+    // Ranks of the workers that have stdio files to merge
+    vector<int> stdio_ranks;
+
+    FILE *task_stdout;
+    FILE *task_stderr;
     
     list<WorkflowEventListener *> listeners;
     unsigned task_submit_seq;
+
+    // Used to reserve less memory for tasks than they request, if 
+    // adaptive memory is enabled
+    MemoryModel *memory_model;
+
+    // The hosts reserved for each multi-node task that is running. The
+    // first host is the one where the task runs.
+    map<Task *, vector<Host *> > gangs;
+
+    // Workers can join and leave while the workflow is running
+    bool elastic;
+
+    // Used to run a duplicate of tasks that take much longer than the
+    // other tasks of their transformation, if speculation is enabled.
+    // Tasks are in the speculated set until one of the copies succeeds,
+    // or until all of them fail.
+    RuntimeModel *runtime_model;
+    set<Task *> speculated;
+    unsigned duplicates;
+    unsigned duplicate_wins;
+
+    // Hosts are blacklisted for a while when their failure score reaches
+    // host_failures, if blacklisting is enabled. The free slots of 
+    // blacklisted hosts are parked until the host is restored. 
+    unsigned host_failures;
+    SlotList parked_slots;
+
+    // The hosts where each task has failed, so that retries can be run
+    // somewhere else
+    map<Task *, set<Host *> > failed_hosts;
+
+    // Time spent in each part of the master loop
+    Profile profile;
+    unsigned long cycles;
+    double last_schedule_time;
+    double max_schedule_time;
+
+    // Latency histograms, if profiling is enabled
+    bool profiling;
+    Histogram dispatch_latency;
+    Histogram message_latency;
+    Histogram schedule_latency;
+    Histogram cycle_latency;
+
+    // Publishes snapshots of the master's state while it runs, if
+    // metrics are enabled
+    MetricsExporter *metrics;
+
+    // Saves the state of the tasks every checkpoint_interval seconds, if
+    // checkpoints are enabled
+    CheckpointWriter *checkpoint;
+    double checkpoint_interval;
+    double last_checkpoint;
+    uint64_t dag_hash;
+    string checkpoint_data;
     
     void register_workers();
+    Host *add_host(RegistrationMessage *msg);
+    void register_worker(RegistrationMessage *msg);
+    void process_depart(DepartMessage *mesg);
+    void release_gang(Task *task);
+    void speculate_tasks();
+    Slot *other_copy(Slot *slot);
+    void finish_copy(Slot *slot, int exitcode);
+    void choose_copy(Slot *slot);
+    void free_slot(Slot *slot);
+    void record_host_result(Host *host, Task *task, bool failed);
+    void restore_hosts();
+    double next_restore();
     void schedule_tasks();
     void wait_for_results();
     void process_result(ResultMessage *mesg);
     void process_iodata(IODataMessage *mesg);
+    void process_iocredit(IOCreditMessage *mesg);
+    void grant_io_credits();
     void queue_ready_tasks();
-    void submit_task(Task *t, int worker, const vector<cpu_t> &bindings);
+    bool schedule_gang(Task *task, set<Host *> &draining);
+    void drain_hosts(Task *task, set<Host *> &draining);
+    void submit_task(Task *t, Slot *slot, const vector<cpu_t> &bindings, const vector<string> *hosts = NULL);
+    void open_task_stdio();
+    void close_task_stdio();
     void merge_all_task_stdio();
-    void merge_task_stdio(FILE *dest, const string &src, const string &stream);
+    void shutdown_workers();
     void write_cluster_summary(bool failed);
 
     void publish_event(WorkflowEvent event, Task *task);
+    void update_metrics();
+    void save_checkpoint(bool force);
     bool wall_time_exceeded();
 public:
     Master(Communicator *comm, const string &program, Engine &engine, DAG &dag, const string &dagfile, 
@@ -169,6 +402,19 @@ public:
     ~Master();
     int run();
     void add_listener(WorkflowEventListener *l);
+    void set_metrics(MetricsExporter *metrics);
+    void set_checkpoint(CheckpointWriter *checkpoint, double interval);
+    void set_group_weight(const string &group, double weight);
+    void set_priority_aging(double aging);
+    void set_io_buffer(unsigned size, double flush_interval);
+    void set_max_io_inflight(unsigned long max_io_inflight);
+    void set_local_stdio(const string &local_stdio);
+    void set_host_failures(unsigned host_failures);
+    void enable_stdio_forwarding();
+    void enable_adaptive_memory(unsigned margin);
+    void enable_speculation(unsigned percentile);
+    void enable_elastic();
+    void enable_profiling();
 };
 
 #endif /* MASTER_H */
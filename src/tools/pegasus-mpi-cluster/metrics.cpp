@@ -0,0 +1,321 @@
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "metrics.h"
+#include "failure.h"
+#include "log.h"
+#include "tools.h"
+
+MasterMetrics::MasterMetrics() {
+    memset(this, 0, sizeof(MasterMetrics));
+}
+
+static void metric(string &out, const char *name, const char *type,
+        const char *help, double value) {
+    char buf[512];
+    snprintf(buf, sizeof(buf), "# HELP %s %s\n# TYPE %s %s\n%s %.15g\n",
+            name, help, name, type, name, value);
+    out += buf;
+}
+
+/* Format the metrics in the Prometheus text exposition format */
+string format_metrics(const MasterMetrics &m, double throughput) {
+    string out;
+
+    metric(out, "pmc_start_time_seconds", "gauge",
+            "Time when the master started, in seconds since the epoch",
+            m.start_time);
+    metric(out, "pmc_last_update_time_seconds", "gauge",
+            "Time when the master last updated the metrics",
+            m.time);
+
+    metric(out, "pmc_hosts", "gauge",
+            "Number of hosts in the workflow", m.hosts);
+    metric(out, "pmc_workers", "gauge",
+            "Number of workers in the workflow", m.workers);
+    metric(out, "pmc_free_slots", "gauge",
+            "Number of workers that can be given a task", m.free_slots);
+
+    metric(out, "pmc_tasks", "gauge",
+            "Number of tasks in the workflow", m.tasks);
+    metric(out, "pmc_ready_tasks", "gauge",
+            "Number of tasks waiting for a slot", m.ready_tasks);
+    metric(out, "pmc_running_tasks", "gauge",
+            "Number of tasks running on workers", m.running_tasks);
+    metric(out, "pmc_submitted_tasks_total", "counter",
+            "Number of times tasks were sent to workers", m.submitted_tasks);
+    metric(out, "pmc_succeeded_tasks_total", "counter",
+            "Number of task runs that succeeded", m.succeeded_tasks);
+    metric(out, "pmc_failed_tasks_total", "counter",
+            "Number of task runs that failed", m.failed_tasks);
+    metric(out, "pmc_task_throughput", "gauge",
+            "Task runs finished per second over the last interval", throughput);
+
+    metric(out, "pmc_scheduler_cycles_total", "counter",
+            "Number of passes through the master loop", m.cycles);
+    out += "# HELP pmc_master_phase_seconds_total Time the master loop spent in each phase\n"
+           "# TYPE pmc_master_phase_seconds_total counter\n";
+    for (int p=0; p<NUM_PHASES; p++) {
+        char buf[128];
+        snprintf(buf, sizeof(buf), "pmc_master_phase_seconds_total{phase=\"%s\"} %.15g\n",
+                phase_name((MasterPhase)p), m.phase_seconds[p]);
+        out += buf;
+    }
+    metric(out, "pmc_scheduler_last_schedule_seconds", "gauge",
+            "Time the last pass spent scheduling tasks", m.last_schedule_seconds);
+    metric(out, "pmc_scheduler_max_schedule_seconds", "gauge",
+            "Longest time a pass spent scheduling tasks", m.max_schedule_seconds);
+
+    metric(out, "pmc_messages_sent_total", "counter",
+            "Number of messages the master sent", m.messages_sent);
+    metric(out, "pmc_messages_received_total", "counter",
+            "Number of messages the master received", m.messages_recvd);
+    metric(out, "pmc_bytes_sent_total", "counter",
+            "Number of bytes the master sent", m.bytes_sent);
+    metric(out, "pmc_bytes_received_total", "counter",
+            "Number of bytes the master received", m.bytes_recvd);
+
+    double lookups = m.fdcache_hits + m.fdcache_misses;
+    metric(out, "pmc_fdcache_hits_total", "counter",
+            "Number of I/O writes that found the file open", m.fdcache_hits);
+    metric(out, "pmc_fdcache_misses_total", "counter",
+            "Number of I/O writes that had to open the file", m.fdcache_misses);
+    metric(out, "pmc_fdcache_hit_rate", "gauge",
+            "Fraction of I/O writes that found the file open",
+            lookups > 0 ? m.fdcache_hits / lookups : 0.0);
+    metric(out, "pmc_io_pending_bytes", "gauge",
+            "Bytes of I/O data buffered by the master", m.io_pending);
+    metric(out, "pmc_io_inflight_bytes", "gauge",
+            "Bytes of I/O credit granted to workers", m.io_inflight);
+    metric(out, "pmc_io_credit_requests", "gauge",
+            "Number of workers waiting for I/O credit", m.io_requests);
+
+    return out;
+}
+
+MetricsExporter::MetricsExporter(const string &path, const string &socket_path, double interval) {
+    this->path = path;
+    this->socket_path = socket_path;
+    this->interval = interval;
+    this->listenfd = -1;
+    this->wakefds[0] = -1;
+    this->wakefds[1] = -1;
+    this->running = false;
+    this->throughput = 0.0;
+    this->last_tick = 0.0;
+    this->last_finished = 0;
+
+    pthread_mutex_init(&lock, NULL);
+}
+
+MetricsExporter::~MetricsExporter() {
+    stop();
+    pthread_mutex_destroy(&lock);
+}
+
+void MetricsExporter::open_socket() {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        myfailure("Metrics socket path is too long: %s", socket_path.c_str());
+    }
+    strcpy(addr.sun_path, socket_path.c_str());
+
+    listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenfd < 0) {
+        myfailures("Unable to create metrics socket");
+    }
+
+    // Remove the socket left behind by a previous run
+    unlink(socket_path.c_str());
+
+    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        myfailures("Unable to bind metrics socket %s", socket_path.c_str());
+    }
+    if (listen(listenfd, 16) < 0) {
+        myfailures("Unable to listen on metrics socket %s", socket_path.c_str());
+    }
+
+    log_info("Serving metrics on %s", socket_path.c_str());
+}
+
+/* Start the thread that exports the metrics */
+void MetricsExporter::start() {
+    if (running) {
+        return;
+    }
+
+    if (socket_path != "") {
+        open_socket();
+    }
+
+    if (pipe(wakefds) < 0) {
+        myfailures("Unable to create pipe for metrics thread");
+    }
+
+    last_tick = current_time();
+
+    int rc = pthread_create(&thread, NULL, exporter_thread, this);
+    if (rc != 0) {
+        errno = rc;
+        myfailures("Unable to start metrics thread");
+    }
+    running = true;
+}
+
+/* Called by the master to replace the current snapshot */
+void MetricsExporter::update(const MasterMetrics &metrics) {
+    pthread_mutex_lock(&lock);
+    current = metrics;
+    pthread_mutex_unlock(&lock);
+}
+
+string MetricsExporter::format() {
+    pthread_mutex_lock(&lock);
+    MasterMetrics metrics = current;
+    double throughput = this->throughput;
+    pthread_mutex_unlock(&lock);
+
+    return format_metrics(metrics, throughput);
+}
+
+/* Update the throughput at the end of an interval */
+void MetricsExporter::tick(double now) {
+    pthread_mutex_lock(&lock);
+    unsigned finished = current.succeeded_tasks + current.failed_tasks;
+    if (now > last_tick) {
+        throughput = (finished - last_finished) / (now - last_tick);
+    }
+    last_finished = finished;
+    last_tick = now;
+    pthread_mutex_unlock(&lock);
+}
+
+/* Write the metrics to a temporary file and rename it over the metrics
+ * file. Errors are logged, but are not fatal to the workflow. */
+void MetricsExporter::write_file() {
+    if (path == "") {
+        return;
+    }
+
+    string data = format();
+    if (replace_file(path, data.c_str(), data.size(), false) < 0) {
+        log_error("Unable to write metrics file %s: %s", path.c_str(),
+                strerror(errno));
+    }
+}
+
+/* Send the metrics to a client of the socket and hang up */
+void MetricsExporter::serve_client() {
+    int fd = accept(listenfd, NULL, NULL);
+    if (fd < 0) {
+        log_warn("Unable to accept metrics client: %s", strerror(errno));
+        return;
+    }
+
+    // Don't let a client that stops reading hold up the thread
+    struct timeval timeout;
+    timeout.tv_sec = 1;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    string data = format();
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t rc = send(fd, data.c_str() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG(LOG_DEBUG, "Unable to send metrics to client: %s", strerror(errno));
+            break;
+        }
+        sent += rc;
+    }
+
+    ::close(fd);
+}
+
+void MetricsExporter::run_exporter() {
+    // Signals are handled by the main thread
+    block_signals();
+
+    double next = current_time() + interval;
+    while (true) {
+        struct pollfd fds[2];
+        fds[0].fd = wakefds[0];
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = listenfd;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+
+        double now = current_time();
+        int timeout = 0;
+        if (next > now) {
+            timeout = (int)ceil((next - now) * 1000);
+        }
+
+        int rc = poll(fds, 2, timeout);
+        if (rc < 0 && errno != EINTR) {
+            log_error("Metrics thread failed to poll: %s", strerror(errno));
+            return;
+        }
+
+        // The master is stopping the thread
+        if (fds[0].revents != 0) {
+            return;
+        }
+
+        now = current_time();
+        if (now >= next) {
+            tick(now);
+            write_file();
+            next = now + interval;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            serve_client();
+        }
+    }
+}
+
+void *MetricsExporter::exporter_thread(void *arg) {
+    MetricsExporter *exporter = (MetricsExporter *)arg;
+    exporter->run_exporter();
+    return NULL;
+}
+
+/* Stop the thread and write the final metrics */
+void MetricsExporter::stop() {
+    if (!running) {
+        return;
+    }
+
+    char c = 0;
+    if (write(wakefds[1], &c, 1) < 0) {
+        log_error("Unable to wake metrics thread: %s", strerror(errno));
+    }
+    pthread_join(thread, NULL);
+    running = false;
+
+    tick(current_time());
+    write_file();
+
+    ::close(wakefds[0]);
+    ::close(wakefds[1]);
+    if (listenfd >= 0) {
+        ::close(listenfd);
+        listenfd = -1;
+        unlink(socket_path.c_str());
+    }
+}
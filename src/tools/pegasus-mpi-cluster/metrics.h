@@ -0,0 +1,93 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <pthread.h>
+
+#include "profile.h"
+
+using std::string;
+
+// How often the metrics file is rewritten by default, in seconds
+#define METRICS_INTERVAL 10.0
+
+/* A snapshot of the state of the master. The master fills one of these
+ * in on every pass through its scheduling loop. Counters only go up
+ * over the life of the workflow, the rest are the current values. */
+struct MasterMetrics {
+    double time;                    // When the snapshot was taken
+    double start_time;              // When the master started
+
+    unsigned hosts;
+    unsigned workers;
+    unsigned free_slots;
+
+    unsigned tasks;
+    unsigned ready_tasks;
+    unsigned running_tasks;
+    unsigned submitted_tasks;       // Counter
+    unsigned succeeded_tasks;       // Counter
+    unsigned failed_tasks;          // Counter
+
+    unsigned long cycles;           // Counter
+    double phase_seconds[NUM_PHASES];   // Counter
+    double last_schedule_seconds;
+    double max_schedule_seconds;
+
+    unsigned long messages_sent;    // Counter
+    unsigned long messages_recvd;   // Counter
+    unsigned long bytes_sent;       // Counter
+    unsigned long bytes_recvd;      // Counter
+
+    unsigned fdcache_hits;          // Counter
+    unsigned fdcache_misses;        // Counter
+    unsigned long io_pending;       // Bytes buffered in the FDCache
+    unsigned long io_inflight;      // Bytes of I/O credit granted
+    unsigned io_requests;           // Workers waiting for I/O credit
+
+    MasterMetrics();
+};
+
+/* Publishes the master's metrics in the Prometheus text format. A
+ * thread rewrites the metrics file every interval, and answers
+ * connections to the metrics socket, so that neither one blocks the
+ * master. The file is written to a temporary file and renamed so that
+ * readers never see a partial file. */
+class MetricsExporter {
+private:
+    string path;
+    string socket_path;
+    double interval;
+    int listenfd;
+    int wakefds[2];
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    bool running;
+
+    MasterMetrics current;
+
+    // Tasks finished per second over the last interval
+    double throughput;
+    double last_tick;
+    unsigned last_finished;
+
+    void open_socket();
+    void tick(double now);
+    void write_file();
+    void serve_client();
+    void run_exporter();
+    static void *exporter_thread(void *arg);
+
+public:
+    MetricsExporter(const string &path, const string &socket_path, double interval = METRICS_INTERVAL);
+    ~MetricsExporter();
+    void start();
+    void update(const MasterMetrics &metrics);
+    string format();
+    void stop();
+};
+
+string format_metrics(const MasterMetrics &metrics, double throughput);
+
+#endif /* METRICS_H */
@@ -1,5 +1,9 @@
 /* mpi.h must come before stdio.h for Intel MPI */
 #include <mpi.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include "mpicomm.h"
 #include "protocol.h"
@@ -7,18 +11,59 @@
 #include "tools.h"
 #include "log.h"
 
-MPICommunicator::MPICommunicator(int *argc, char ***argv) {
-    MPI_Init(argc, argv);
+/* If threads is true, then MPI is initialized so that the master can 
+ * accept new workers in a separate thread */
+MPICommunicator::MPICommunicator(int *argc, char ***argv, bool threads) {
+    if (threads) {
+        int provided = MPI_THREAD_SINGLE;
+        MPI_Init_thread(argc, argv, MPI_THREAD_MULTIPLE, &provided);
+        thread_multiple = provided >= MPI_THREAD_MULTIPLE;
+    } else {
+        MPI_Init(argc, argv);
+        thread_multiple = false;
+    }
     MPI_Comm_set_errhandler(MPI_COMM_WORLD, MPI_ERRORS_ARE_FATAL);
     MPI_Comm_rank(MPI_COMM_WORLD, &myrank);
     MPI_Comm_size(MPI_COMM_WORLD, &mysize);
     bytes_sent = 0;
     bytes_recvd = 0;
+    mesgs_sent = 0;
+    mesgs_recvd = 0;
     sleep_on_recv = true;
+    master_comm = MPI_COMM_WORLD;
+    accepting = false;
+    next_rank = mysize;
+    pthread_mutex_init(&accept_lock, NULL);
 }
 
 MPICommunicator::~MPICommunicator() {
+    // Both sides of a connection have to disconnect before MPI_Finalize
+    if (master_comm != MPI_COMM_WORLD) {
+        MPI_Comm_disconnect(&master_comm);
+    }
+    add_joined();
+    for (map<int, MPI_Comm>::iterator j = joined.begin(); j != joined.end(); j++) {
+        MPI_Comm_disconnect(&j->second);
+    }
+    joined.clear();
     MPI_Finalize();
+    pthread_mutex_destroy(&accept_lock);
+}
+
+/* Get the communicator and the rank within it that are used to
+ * talk to rank */
+MPI_Comm MPICommunicator::comm_for(int rank, int &dest) {
+    if (rank == 0 && master_comm != MPI_COMM_WORLD) {
+        dest = 0;
+        return master_comm;
+    }
+    map<int, MPI_Comm>::iterator j = joined.find(rank);
+    if (j != joined.end()) {
+        dest = 0;
+        return j->second;
+    }
+    dest = rank;
+    return MPI_COMM_WORLD;
 }
 
 void MPICommunicator::send_message(Message *message, int dest) {
@@ -26,11 +71,14 @@ void MPICommunicator::send_message(Message *message, int dest) {
     unsigned msgsize = message->msgsize;
     int tag = message->tag();
 
-    log_trace("Rank %d: Sending %d byte message of type %d to %d",
+    LOG(LOG_TRACE, "Rank %d: Sending %d byte message of type %d to %d",
               myrank, msgsize, tag, dest);
 
-    MPI_Send(msg, msgsize, MPI_CHAR, dest, tag, MPI_COMM_WORLD);
+    int peer;
+    MPI_Comm comm = comm_for(dest, peer);
+    MPI_Send(msg, msgsize, MPI_CHAR, peer, tag, comm);
     bytes_sent += msgsize;
+    mesgs_sent += 1;
 }
 
 Message *MPICommunicator::recv_message(double timeout) {
@@ -39,15 +87,16 @@ Message *MPICommunicator::recv_message(double timeout) {
     // need to get the source and tag so that we can match the
     // recv below.
     MPI_Status status;
-    int got_message = wait_for_message(status, timeout);
+    MPI_Comm comm;
+    int source;
+    int got_message = wait_for_message(status, comm, source, timeout);
     if (!got_message) {
-        log_trace("Rank %d: No message waiting", myrank);
+        LOG(LOG_TRACE, "Rank %d: No message waiting", myrank);
         return NULL;
     }
 
-    // This is the message sender, and the type of message
-    // We need to match these in the recv below
-    int source = status.MPI_SOURCE;
+    // This is the type of message. We need to match it and the sender
+    // in the recv below.
     int tag = status.MPI_TAG;
 
     // Get the size of the message and allocate a buffer for it
@@ -55,12 +104,13 @@ Message *MPICommunicator::recv_message(double timeout) {
     MPI_Get_count(&status, MPI_CHAR, &msgsize);
     char *msg = new char[msgsize];
 
-    log_trace("Rank %d: Receiving %d byte message of type %d from %d",
+    LOG(LOG_TRACE, "Rank %d: Receiving %d byte message of type %d from %d",
               myrank, msgsize, tag, source);
 
     // Recieve the message
-    MPI_Recv(msg, msgsize, MPI_CHAR, source, tag, MPI_COMM_WORLD, &status);
+    MPI_Recv(msg, msgsize, MPI_CHAR, status.MPI_SOURCE, tag, comm, &status);
     bytes_recvd += msgsize;
+    mesgs_recvd += 1;
 
     // Create the right type of message
     Message *message = NULL;
@@ -85,6 +135,15 @@ Message *MPICommunicator::recv_message(double timeout) {
         case IODATA:
             message = new IODataMessage(msg, msgsize, source);
             break;
+        case IOCREDIT:
+            message = new IOCreditMessage(msg, msgsize, source);
+            break;
+        case DEPART:
+            message = new DepartMessage(msg, msgsize, source);
+            break;
+        case KILL:
+            message = new KillMessage(msg, msgsize, source);
+            break;
         default:
             myfailure("Unknown message type: %d", type);
     }
@@ -93,12 +152,37 @@ Message *MPICommunicator::recv_message(double timeout) {
 }
 
 bool MPICommunicator::message_waiting() {
-    int flag;
-    MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, MPI_STATUS_IGNORE);
-    return flag != 0;
+    MPI_Status status;
+    MPI_Comm comm;
+    int source;
+    return probe(status, comm, source);
 }
 
-int MPICommunicator::wait_for_message(MPI_Status &status, double timeout) {
+/* Check for a message from any rank. If there is one, then comm is set
+ * to the communicator it was sent on and source to the rank of the sender. */
+bool MPICommunicator::probe(MPI_Status &status, MPI_Comm &comm, int &source) {
+    int flag = 0;
+    MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, master_comm, &flag, &status);
+    if (flag) {
+        comm = master_comm;
+        source = status.MPI_SOURCE;
+        return true;
+    }
+
+    add_joined();
+    for (map<int, MPI_Comm>::iterator j = joined.begin(); j != joined.end(); j++) {
+        MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, j->second, &flag, &status);
+        if (flag) {
+            comm = j->second;
+            source = j->first;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int MPICommunicator::wait_for_message(MPI_Status &status, MPI_Comm &comm, int &source, double timeout) {
     /* On many MPI implementations MPI_Probe uses a busy wait loop. This
      * really wreaks havoc on the load and CPU utilization of the workers 
      * when there are no tasks to process or some slots are idle due to 
@@ -111,17 +195,17 @@ int MPICommunicator::wait_for_message(MPI_Status &status, double timeout) {
      * decreases responsiveness a bit, but it is a fair tradeoff.
      */
 
-    log_trace("Rank %d: waiting for message", myrank);
+    LOG(LOG_TRACE, "Rank %d: waiting for message", myrank);
 
-    if (sleep_on_recv || timeout > 0) {
+    // Messages from workers that joined later arrive on other 
+    // communicators, and MPI cannot block on more than one of them
+    if (sleep_on_recv || timeout > 0 || accepting || joined.size() > 0) {
         double start = current_time();
         unsigned i = 0;
         while (1) {
             i++;
 
-            int message = 0;
-            MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &message, &status);
-            if (message) {
+            if (probe(status, comm, source)) {
                 // We got the message
                 return 1;
             }
@@ -150,7 +234,9 @@ int MPICommunicator::wait_for_message(MPI_Status &status, double timeout) {
     } else {
         // This call blocks, potentially in a busy loop depending on the
         // MPI implementation used
-        MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+        MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, master_comm, &status);
+        comm = master_comm;
+        source = status.MPI_SOURCE;
         return 1;
     }
 
@@ -181,3 +267,154 @@ unsigned long MPICommunicator::recvd() {
     return bytes_recvd;
 }
 
+unsigned long MPICommunicator::messages_sent() {
+    return mesgs_sent;
+}
+
+unsigned long MPICommunicator::messages_recvd() {
+    return mesgs_recvd;
+}
+
+/* Move the workers accepted by the accept thread to the joined map */
+void MPICommunicator::add_joined() {
+    if (!accepting && accepted.size() == 0) {
+        return;
+    }
+    pthread_mutex_lock(&accept_lock);
+    while (accepted.size() > 0) {
+        pair<int, MPI_Comm> worker = accepted.front();
+        accepted.pop_front();
+        LOG(LOG_DEBUG, "Worker %d joined", worker.first);
+        joined[worker.first] = worker.second;
+    }
+    pthread_mutex_unlock(&accept_lock);
+}
+
+void *MPICommunicator::accept_thread(void *arg) {
+    MPICommunicator *comm = (MPICommunicator *)arg;
+    comm->accept_loop();
+    return NULL;
+}
+
+/* Accept connections from new workers and give each one a rank. Workers
+ * that connect after the master stops accepting are given rank -1, which
+ * tells them that the workflow is over. */
+void MPICommunicator::accept_loop() {
+    while (true) {
+        MPI_Comm worker;
+        MPI_Comm_accept(port, MPI_INFO_NULL, 0, MPI_COMM_SELF, &worker);
+
+        pthread_mutex_lock(&accept_lock);
+        int rank = -1;
+        if (accepting) {
+            rank = next_rank++;
+            accepted.push_back(std::make_pair(rank, worker));
+        }
+        MPI_Send(&rank, 1, MPI_INT, 0, 0, worker);
+        pthread_mutex_unlock(&accept_lock);
+
+        if (rank < 0) {
+            MPI_Comm_disconnect(&worker);
+        }
+    }
+}
+
+/* Open a port that new workers can connect to and write its name to
+ * portfile. This requires MPI_THREAD_MULTIPLE because the workers are
+ * accepted in a separate thread. */
+void MPICommunicator::accept_workers(const string &portfile) {
+    if (!thread_multiple) {
+        myfailure("Accepting workers requires an MPI library that "
+                  "supports MPI_THREAD_MULTIPLE");
+    }
+
+    MPI_Open_port(MPI_INFO_NULL, port);
+
+    // The port file is replaced atomically so that workers never see a
+    // partial name
+    string contents = string(port) + "\n";
+    if (replace_file(portfile, contents.c_str(), contents.size(), false) < 0) {
+        myfailures("Unable to write port file %s", portfile.c_str());
+    }
+    this->portfile = portfile;
+
+    accepting = true;
+    if (pthread_create(&acceptor, NULL, accept_thread, this) != 0) {
+        myfailure("Unable to create thread to accept workers");
+    }
+
+    log_info("Accepting workers on port %s", port);
+}
+
+/* Stop accepting new workers, and return the ranks of the workers that
+ * joined and are still connected. */
+vector<int> MPICommunicator::stop_accepting() {
+    if (accepting) {
+        pthread_mutex_lock(&accept_lock);
+        accepting = false;
+        pthread_mutex_unlock(&accept_lock);
+
+        // MPI_Comm_accept cannot be interrupted, so the thread is left 
+        // waiting for a connection that will never come
+        pthread_detach(acceptor);
+        unlink(portfile.c_str());
+        MPI_Close_port(port);
+    }
+
+    add_joined();
+
+    vector<int> ranks;
+    for (map<int, MPI_Comm>::iterator j = joined.begin(); j != joined.end(); j++) {
+        ranks.push_back(j->first);
+    }
+    return ranks;
+}
+
+/* Disconnect from a worker that joined later. This waits for the worker 
+ * to disconnect too. */
+void MPICommunicator::disconnect(int rank) {
+    map<int, MPI_Comm>::iterator j = joined.find(rank);
+    if (j == joined.end()) {
+        return;
+    }
+    MPI_Comm_disconnect(&j->second);
+    joined.erase(j);
+    LOG(LOG_DEBUG, "Worker %d disconnected", rank);
+}
+
+/* Connect to the master of a workflow that is already running, using the 
+ * port it wrote to portfile, and get a rank from it. Returns false if the
+ * master is no longer accepting workers. */
+bool MPICommunicator::join(const string &portfile) {
+    char name[MPI_MAX_PORT_NAME];
+    FILE *f = NULL;
+    for (int i=0; i<JOIN_TIMEOUT; i++) {
+        f = fopen(portfile.c_str(), "r");
+        if (f != NULL || errno != ENOENT) {
+            break;
+        }
+        sleep(1);
+    }
+    if (f == NULL) {
+        myfailures("Unable to read port file %s", portfile.c_str());
+    }
+    if (fgets(name, sizeof(name), f) == NULL) {
+        myfailure("Port file %s is empty", portfile.c_str());
+    }
+    fclose(f);
+    name[strcspn(name, "\n")] = '\0';
+
+    LOG(LOG_DEBUG, "Rank %d: Connecting to port %s", myrank, name);
+    MPI_Comm_connect(name, MPI_INFO_NULL, 0, MPI_COMM_SELF, &master_comm);
+
+    int rank;
+    MPI_Recv(&rank, 1, MPI_INT, 0, 0, master_comm, MPI_STATUS_IGNORE);
+    if (rank < 0) {
+        MPI_Comm_disconnect(&master_comm);
+        master_comm = MPI_COMM_WORLD;
+        return false;
+    }
+
+    myrank = rank;
+    return true;
+}
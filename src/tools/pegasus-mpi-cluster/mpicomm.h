@@ -1,20 +1,64 @@
 #ifndef MPICOMM_H
 #define MPICOMM_H
 
+#include <mpi.h>
+#include <pthread.h>
+#include <string>
+#include <map>
+#include <list>
+#include <vector>
+#include <utility>
+
 #include "comm.h"
 
+using std::string;
+using std::map;
+using std::list;
+using std::vector;
+using std::pair;
+
+// How long a worker waits for the master to create the port file 
+// before giving up on joining the workflow, in seconds
+#define JOIN_TIMEOUT 60
+
 class MPICommunicator : public Communicator {
 private:
     int myrank;
     int mysize;
     unsigned long bytes_sent;
     unsigned long bytes_recvd;
-    virtual int wait_for_message(MPI_Status &status, double timeout);
+    unsigned long mesgs_sent;
+    unsigned long mesgs_recvd;
+    bool thread_multiple;
+
+    // The communicator used to talk to the master. This is MPI_COMM_WORLD
+    // unless the worker joined the workflow after it started.
+    MPI_Comm master_comm;
+
+    // Workers that joined after the workflow started. Each one is 
+    // connected to the master by its own intercommunicator and is given
+    // a rank after the ranks in MPI_COMM_WORLD. New workers are accepted
+    // by a thread and handed to the main thread through the accepted list.
+    map<int, MPI_Comm> joined;
+    list<pair<int, MPI_Comm> > accepted;
+    pthread_mutex_t accept_lock;
+    pthread_t acceptor;
+    bool accepting;
+    int next_rank;
+    string portfile;
+    char port[MPI_MAX_PORT_NAME];
+
+    virtual int wait_for_message(MPI_Status &status, MPI_Comm &comm, int &source, double timeout);
+    bool probe(MPI_Status &status, MPI_Comm &comm, int &source);
+    MPI_Comm comm_for(int rank, int &dest);
+    void add_joined();
+    void accept_loop();
+    static void *accept_thread(void *arg);
     
 public:
     bool sleep_on_recv;
     
-    MPICommunicator(int *argc, char ***argv);
+    MPICommunicator(int *argc, char ***argv, bool threads = false);
     virtual ~MPICommunicator();
     virtual void send_message(Message *message, int dest);
     virtual Message *recv_message(double timeout = 0);
@@ -25,7 +69,12 @@ public:
     virtual int size();
     virtual unsigned long sent();
     virtual unsigned long recvd();
+    virtual unsigned long messages_sent();
+    virtual unsigned long messages_recvd();
+    void accept_workers(const string &portfile);
+    bool join(const string &portfile);
+    virtual vector<int> stop_accepting();
+    virtual void disconnect(int rank);
 };
 
 #endif /* MPICOMM_H */
-
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+
+#include "trace.h"
+#include "version.h"
+
+using std::string;
+using std::vector;
+
+/* Convert the binary traces written by pegasus-mpi-cluster --trace into
+ * the Chrome trace event format */
+
+static const char *program;
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: %s [options] TRACEFILE...\n"
+        "\n"
+        "Convert pegasus-mpi-cluster traces to Chrome trace / Perfetto JSON\n"
+        "\n"
+        "Options:\n"
+        "   -h|--help            Print this message\n"
+        "   -V|--version         Print version information\n"
+        "   -o|--output PATH     Write JSON to PATH [default: stdout]\n",
+        program
+    );
+}
+
+int main(int argc, char *argv[]) {
+    program = argv[0];
+
+    string output;
+    vector<string> paths;
+    for (int i=1; i<argc; i++) {
+        string flag = argv[i];
+        if (flag == "-h" || flag == "--help") {
+            usage();
+            return 0;
+        } else if (flag == "-V" || flag == "--version") {
+            fprintf(stderr, "%s\n", PEGASUS_VERSION);
+            return 0;
+        } else if (flag == "-o" || flag == "--output") {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "-o/--output requires PATH\n");
+                return 1;
+            }
+            output = argv[++i];
+        } else if (flag[0] == '-' && flag != "-") {
+            fprintf(stderr, "Unrecognized argument: %s\n", flag.c_str());
+            return 1;
+        } else {
+            paths.push_back(flag);
+        }
+    }
+
+    if (paths.size() == 0) {
+        usage();
+        return 1;
+    }
+
+    vector<TraceFile> traces(paths.size());
+    for (unsigned i=0; i<paths.size(); i++) {
+        if (trace_read(paths[i], traces[i]) < 0) {
+            fprintf(stderr, "Unable to read trace %s: %s\n", paths[i].c_str(),
+                    strerror(errno));
+            return 1;
+        }
+    }
+
+    FILE *out = stdout;
+    if (output != "") {
+        out = fopen(output.c_str(), "w");
+        if (out == NULL) {
+            fprintf(stderr, "Unable to open %s: %s\n", output.c_str(), strerror(errno));
+            return 1;
+        }
+    }
+
+    trace_to_json(traces, out);
+
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Error writing JSON: %s\n", strerror(errno));
+        return 1;
+    }
+
+    return 0;
+}
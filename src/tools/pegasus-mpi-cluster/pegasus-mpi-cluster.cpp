@@ -17,6 +17,7 @@
 #include "protocol.h"
 #include "tools.h"
 #include "config.h"
+#include "trace.h"
 
 using std::string;
 using std::list;
@@ -73,15 +74,38 @@ void usage() {
             "   --host-memory N      Amount of memory per host in MB\n"
             "   --host-cpus N        Number of CPUs per host\n"
             "   --strict-limits      Enforce strict task resource limits\n"
+            "   --cgroup DIR         Run each task in a cgroup under cgroup v2 directory DIR\n"
+            "   --max-pids N         Limit each task to N processes (requires --cgroup)\n"
+            "   --adaptive-memory M  Reserve the observed peak memory of tasks plus M%%\n"
+            "   --speculate P        Run a duplicate of tasks slower than the Pth percentile\n"
+            "   --blacklist N        Stop using hosts for a while after N recent task failures\n"
             "   --max-wall-time T    Maximum wall time of the job in minutes\n"
             "   --per-task-stdio     Write each task's stdout/stderr to a different file\n"
+            "   --forward-stdio      Send task stdout/stderr to the master via I/O forwarding\n"
+            "   --local-stdio DIR    Write task stdout/stderr to DIR on each host\n"
             "   --jobstate-log       Generate jobstate.log\n"
             "   --monitord-hack      Generate a .dagman.out file to trick monitord\n"
             "   --no-resource-log    Do not generate a log of resource usage\n"
             "   --no-sleep-on-recv   Do not sleep on message receive\n"
             "   --maxfds             Maximum cached file descriptors\n"
+            "   --io-buffer-size N   Buffer up to N bytes of collective I/O per file\n"
+            "   --io-flush-interval T  Flush buffered collective I/O after T seconds\n"
+            "   --max-io-inflight N  Limit forwarded I/O in flight to the master to N bytes\n"
+            "   --io-credit N        Bytes of I/O each task can send without credit\n"
             "   --keep-affinity      Keep inherited CPU and memory affinity\n"
-            "   --set-affinity       Set CPU affinity for multicore tasks\n",
+            "   --set-affinity       Set CPU affinity for multicore tasks\n"
+            "   --vfork              Launch tasks with vfork() instead of fork()\n"
+            "   --elastic PORTFILE   Accept workers that join later using the port in PORTFILE\n"
+            "   --join PORTFILE      Join a running workflow as workers using the port in PORTFILE\n"
+            "   --trace PREFIX       Write a binary trace of each rank to PREFIX.RANK\n"
+            "   --metrics PATH       Periodically write master metrics to PATH\n"
+            "   --metrics-socket PATH  Serve master metrics on Unix socket PATH\n"
+            "   --metrics-interval T  Rewrite the metrics file every T seconds\n"
+            "   --profile            Log latency histograms of the master loop\n"
+            "   --async-log          Format and write log messages in a separate thread\n"
+            "   --checkpoint T       Checkpoint the state of the tasks every T seconds\n"
+            "   --group-weight G=W   Give task group G a share of the CPUs with weight W\n"
+            "   --priority-aging T   Raise the priority of ready tasks by 1 every T seconds\n",
             program
         );
     }
@@ -117,13 +141,37 @@ int mpidag(int argc, char *argv[], MPICommunicator &comm) {
     bool strict_limits = false;
     double max_wall_time = 0.0;
     bool per_task_stdio = false;
+    bool forward_stdio = false;
+    string local_stdio = "";
+    string cgroup = "";
+    unsigned max_pids = 0;
+    bool adaptive_memory = false;
+    unsigned memory_margin = 0;
+    unsigned speculation = 0;
+    unsigned host_failures = 0;
     bool jobstate_log = false;
     bool monitord_hack = false;
     bool log_resources = true;
     bool sleep_on_recv = true;
     int maxfds = 0;
+    unsigned io_buffer_size = 0;
+    double io_flush_interval = 1.0;
+    unsigned long max_io_inflight = 0;
+    unsigned io_credit = 65536;
     bool clear_affinity = true;
+    string elastic_port = "";
+    string join_port = "";
+    string trace_prefix = "";
+    string metrics_path = "";
+    string metrics_socket = "";
+    double metrics_interval = METRICS_INTERVAL;
+    bool profile = false;
+    bool async_log = false;
+    double checkpoint_interval = 0.0;
+    map<string, double> group_weights;
+    double priority_aging = 0.0;
     config.set_affinity = false;
+    config.use_vfork = false;
 
     // Environment variable defaults
     char *env_host_script = getenv("PMC_HOST_SCRIPT");
@@ -259,6 +307,60 @@ int mpidag(int argc, char *argv[], MPICommunicator &comm) {
             }
         } else if (flag == "--strict-limits") {
             strict_limits = true;
+        } else if (flag == "--cgroup") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--cgroup requires DIR");
+                return 1;
+            }
+            cgroup = flags.front();
+        } else if (flag == "--max-pids") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--max-pids requires N");
+                return 1;
+            }
+            string max_pids_string = flags.front();
+            if (sscanf(max_pids_string.c_str(), "%u", &max_pids) != 1 || max_pids == 0) {
+                argerror("Invalid value for --max-pids");
+                return 1;
+            }
+        } else if (flag == "--adaptive-memory") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--adaptive-memory requires M");
+                return 1;
+            }
+            string margin_string = flags.front();
+            if (sscanf(margin_string.c_str(), "%u", &memory_margin) != 1) {
+                argerror("Invalid value for --adaptive-memory");
+                return 1;
+            }
+            adaptive_memory = true;
+        } else if (flag == "--speculate") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--speculate requires P");
+                return 1;
+            }
+            string percentile_string = flags.front();
+            if (sscanf(percentile_string.c_str(), "%u", &speculation) != 1 ||
+                    speculation < 1 || speculation > 100) {
+                argerror("P for --speculate must be between 1 and 100");
+                return 1;
+            }
+        } else if (flag == "--blacklist") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--blacklist requires N");
+                return 1;
+            }
+            string failures_string = flags.front();
+            if (sscanf(failures_string.c_str(), "%u", &host_failures) != 1 ||
+                    host_failures == 0) {
+                argerror("N for --blacklist must be >= 1");
+                return 1;
+            }
         } else if (flag == "--max-wall-time") {
             flags.pop_front();
             if (flags.size() == 0) {
@@ -272,6 +374,15 @@ int mpidag(int argc, char *argv[], MPICommunicator &comm) {
             }
         } else if (flag == "--per-task-stdio") {
             per_task_stdio = true;
+        } else if (flag == "--forward-stdio") {
+            forward_stdio = true;
+        } else if (flag == "--local-stdio") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--local-stdio requires DIR");
+                return 1;
+            }
+            local_stdio = flags.front();
         } else if (flag == "--jobstate-log") {
             jobstate_log = true;
         } else if (flag == "--monitord-hack") {
@@ -296,10 +407,163 @@ int mpidag(int argc, char *argv[], MPICommunicator &comm) {
                 argerror("--maxfds must be at least 1");
                 return 1;
             }
+        } else if (flag == "--io-buffer-size") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--io-buffer-size requires N");
+                return 1;
+            }
+            string bufsize_string = flags.front();
+            if (sscanf(bufsize_string.c_str(), "%u", &io_buffer_size) != 1) {
+                argerror("Invalid value for --io-buffer-size");
+                return 1;
+            }
+        } else if (flag == "--io-flush-interval") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--io-flush-interval requires T");
+                return 1;
+            }
+            string interval_string = flags.front();
+            if (sscanf(interval_string.c_str(), "%lf", &io_flush_interval) != 1) {
+                argerror("Invalid value for --io-flush-interval");
+                return 1;
+            }
+            if (io_flush_interval <= 0.0) {
+                argerror("--io-flush-interval must be greater than 0");
+                return 1;
+            }
+        } else if (flag == "--max-io-inflight") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--max-io-inflight requires N");
+                return 1;
+            }
+            string inflight_string = flags.front();
+            if (sscanf(inflight_string.c_str(), "%lu", &max_io_inflight) != 1) {
+                argerror("Invalid value for --max-io-inflight");
+                return 1;
+            }
+        } else if (flag == "--io-credit") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--io-credit requires N");
+                return 1;
+            }
+            string credit_string = flags.front();
+            if (sscanf(credit_string.c_str(), "%u", &io_credit) != 1) {
+                argerror("Invalid value for --io-credit");
+                return 1;
+            }
         } else if (flag == "--keep-affinity") {
             clear_affinity = false;
         } else if (flag == "--set-affinity") {
             config.set_affinity = true;
+        } else if (flag == "--vfork") {
+            config.use_vfork = true;
+        } else if (flag == "--elastic") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--elastic requires PORTFILE");
+                return 1;
+            }
+            elastic_port = flags.front();
+        } else if (flag == "--join") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--join requires PORTFILE");
+                return 1;
+            }
+            join_port = flags.front();
+        } else if (flag == "--trace") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--trace requires PREFIX");
+                return 1;
+            }
+            trace_prefix = flags.front();
+        } else if (flag == "--profile") {
+            profile = true;
+        } else if (flag == "--async-log") {
+            async_log = true;
+        } else if (flag == "--metrics") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--metrics requires PATH");
+                return 1;
+            }
+            metrics_path = flags.front();
+        } else if (flag == "--metrics-socket") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--metrics-socket requires PATH");
+                return 1;
+            }
+            metrics_socket = flags.front();
+        } else if (flag == "--metrics-interval") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--metrics-interval requires T");
+                return 1;
+            }
+            string interval_string = flags.front();
+            if (sscanf(interval_string.c_str(), "%lf", &metrics_interval) != 1) {
+                argerror("Invalid value for --metrics-interval");
+                return 1;
+            }
+            if (metrics_interval <= 0.0) {
+                argerror("--metrics-interval must be greater than 0");
+                return 1;
+            }
+        } else if (flag == "--checkpoint") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--checkpoint requires T");
+                return 1;
+            }
+            string interval_string = flags.front();
+            if (sscanf(interval_string.c_str(), "%lf", &checkpoint_interval) != 1) {
+                argerror("Invalid value for --checkpoint");
+                return 1;
+            }
+            if (checkpoint_interval <= 0.0) {
+                argerror("--checkpoint must be greater than 0");
+                return 1;
+            }
+        } else if (flag == "--group-weight") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--group-weight requires G=W");
+                return 1;
+            }
+            string weight_string = flags.front();
+            size_t eq = weight_string.rfind('=');
+            double weight;
+            if (eq == string::npos || 
+                    sscanf(weight_string.c_str() + eq + 1, "%lf", &weight) != 1) {
+                argerror("Invalid value for --group-weight");
+                return 1;
+            }
+            if (weight <= 0.0) {
+                argerror("--group-weight must be greater than 0");
+                return 1;
+            }
+            group_weights[weight_string.substr(0, eq)] = weight;
+        } else if (flag == "--priority-aging") {
+            flags.pop_front();
+            if (flags.size() == 0) {
+                argerror("--priority-aging requires T");
+                return 1;
+            }
+            string aging_string = flags.front();
+            if (sscanf(aging_string.c_str(), "%lf", &priority_aging) != 1) {
+                argerror("Invalid value for --priority-aging");
+                return 1;
+            }
+            if (priority_aging <= 0.0) {
+                argerror("--priority-aging must be greater than 0");
+                return 1;
+            }
         } else if (flag[0] == '-') {
             string message = "Unrecognized argument: ";
             message += flag;
@@ -321,11 +585,43 @@ int mpidag(int argc, char *argv[], MPICommunicator &comm) {
         return 1;
     }
 
+    if (forward_stdio && per_task_stdio) {
+        argerror("--forward-stdio cannot be used with --per-task-stdio or --monitord-hack");
+        return 1;
+    }
+
+    if (max_pids > 0 && cgroup == "") {
+        argerror("--max-pids requires --cgroup");
+        return 1;
+    }
+
+    if (local_stdio != "" && (forward_stdio || per_task_stdio)) {
+        argerror("--local-stdio cannot be used with --forward-stdio, --per-task-stdio or --monitord-hack");
+        return 1;
+    }
+
+    if (elastic_port != "" && join_port != "") {
+        argerror("--elastic cannot be used with --join");
+        return 1;
+    }
+
+    // Workers that join later do not take part in the barriers that 
+    // these options need
+    if ((elastic_port != "" || join_port != "") && (host_script != "" || local_stdio != "")) {
+        argerror("--elastic and --join cannot be used with --host-script or --local-stdio");
+        return 1;
+    }
+
     string dagfile = args.front();
 
     log_set_level(loglevel);
 
-    if (numprocs < 2) {
+    if (async_log && log_start_async() < 0) {
+        myfailure("Unable to start asynchronous logging");
+    }
+
+    // With an elastic pool all of the workers can join later
+    if (numprocs < 2 && elastic_port == "" && join_port == "") {
         fprintf(stderr, "At least one worker process is required\n");
         return 1;
     }
@@ -346,14 +642,14 @@ int mpidag(int argc, char *argv[], MPICommunicator &comm) {
     // are not configured correctly and bind all the processes to one CPU,
     // and we can't expect users to know that this is happening.
     if (clear_affinity || config.set_affinity) {
-        log_debug("Rank %d: Clearing CPU and memory affinity", rank);
+        LOG(LOG_DEBUG, "Rank %d: Clearing CPU and memory affinity", rank);
         if (clear_cpu_affinity() < 0) {
             log_error("Rank %d: Error clearing CPU affinity: %s",
                       rank, strerror(errno));
             return 1;
         }
         if (clear_memory_affinity() < 0) {
-            log_debug("Rank %d: Error clearing memory affinity: %s",
+            LOG(LOG_DEBUG, "Rank %d: Error clearing memory affinity: %s",
                       rank, strerror(errno));
         }
     }
@@ -364,6 +660,27 @@ int mpidag(int argc, char *argv[], MPICommunicator &comm) {
     // etc.), so be careful how failures are handled after this point
     // and make sure MPI_Abort is called when something bad happens.
 
+    // All of the processes that join a running workflow are workers
+    if (join_port != "") {
+        if (!comm.join(join_port)) {
+            log_info("Rank %d: Workflow is no longer accepting workers", rank);
+            return 0;
+        }
+        LOG(LOG_DEBUG, "Rank %d: Joined the workflow as worker %d", rank, comm.rank());
+        rank = comm.rank();
+    }
+
+    // Each rank writes its own trace file
+    if (trace_prefix != "") {
+        char path[BUFSIZ];
+        snprintf(path, sizeof(path), "%s.%d", trace_prefix.c_str(), rank);
+        string host;
+        get_host_name(host);
+        if (trace_open(path, rank, host) < 0) {
+            myfailures("Unable to open trace file %s", path);
+        }
+    }
+
     if (rank == 0) {
 
         // If no rescue file specified, use default
@@ -379,8 +696,18 @@ int mpidag(int argc, char *argv[], MPICommunicator &comm) {
             oldrescue = "";
         }
 
-        log_debug("Using old rescue file: %s", oldrescue.c_str());
-        log_debug("Using new rescue file: %s", newrescue.c_str());
+        LOG(LOG_DEBUG, "Using old rescue file: %s", oldrescue.c_str());
+        LOG(LOG_DEBUG, "Using new rescue file: %s", newrescue.c_str());
+
+        // The checkpoint is only read if the old rescue file is
+        string checkpointfile;
+        string oldcheckpoint;
+        if (checkpoint_interval > 0.0) {
+            checkpointfile = rescuefile + ".checkpoint";
+            if (!skiprescue) {
+                oldcheckpoint = checkpointfile;
+            }
+        }
 
         string resource_log;
         if (log_resources) {
@@ -389,11 +716,27 @@ int mpidag(int argc, char *argv[], MPICommunicator &comm) {
 
         bool has_host_script = ("" != host_script);
 
-        DAG dag(dagfile, oldrescue, lock, tries);
+        DAG dag(dagfile, oldrescue, lock, tries, oldcheckpoint);
         Engine engine(dag, newrescue, max_failures);
         Master master(&comm, program, engine, dag, dagfile, outfile, errfile,
                 has_host_script, max_wall_time, resource_log, per_task_stdio,
                 maxfds);
+        master.set_io_buffer(io_buffer_size, io_flush_interval);
+        master.set_max_io_inflight(max_io_inflight);
+        master.set_local_stdio(local_stdio);
+        master.set_host_failures(host_failures);
+        if (forward_stdio) {
+            master.enable_stdio_forwarding();
+        }
+        if (adaptive_memory) {
+            master.enable_adaptive_memory(memory_margin);
+        }
+        if (speculation > 0) {
+            master.enable_speculation(speculation);
+        }
+        if (elastic_port != "") {
+            master.enable_elastic();
+        }
 
         string jobstate_path = dirname(dagfile) + "/jobstate.log";
         JobstateLog jslog(jobstate_path);
@@ -406,11 +749,39 @@ int mpidag(int argc, char *argv[], MPICommunicator &comm) {
             master.add_listener(&dagmanlog);
         }
 
+        MetricsExporter metrics(metrics_path, metrics_socket, metrics_interval);
+        if (metrics_path != "" || metrics_socket != "") {
+            master.set_metrics(&metrics);
+        }
+
+        if (profile) {
+            master.enable_profiling();
+        }
+
+        for (map<string, double>::iterator w = group_weights.begin(); 
+                w != group_weights.end(); w++) {
+            master.set_group_weight(w->first, w->second);
+        }
+        if (priority_aging > 0.0) {
+            master.set_priority_aging(priority_aging);
+        }
+
+        CheckpointWriter checkpoint(checkpointfile);
+        if (checkpoint_interval > 0.0) {
+            master.set_checkpoint(&checkpoint, checkpoint_interval);
+        }
+
+        if (elastic_port != "") {
+            comm.accept_workers(elastic_port);
+        }
+
         return master.run();
     } else {
 
         Worker worker(&comm, dagfile, host_script, host_memory, host_cpus, 
-                strict_limits, per_task_stdio);
+                strict_limits, per_task_stdio, forward_stdio, local_stdio,
+                max_io_inflight > 0, io_credit, cgroup, max_pids, 
+                join_port != "", speculation > 0);
 
         return worker.run();
     }
@@ -428,24 +799,33 @@ int main(int argc, char *argv[]) {
         usage();
         return 1;
     }
+    // The master needs threads to accept workers for an elastic pool
+    bool threads = false;
     for (int i=1; i<argc; i++) {
         string flag = argv[i];
         if (flag == "-h" || flag == "--help") {
             usage();
             return 0;
         }
+        if (flag == "--elastic") {
+            threads = true;
+        }
     }
 
-    MPICommunicator comm(&argc, &argv);
+    MPICommunicator comm(&argc, &argv, threads);
     try {
         std::set_new_handler(out_of_memory);
         int rc = mpidag(argc, argv, comm);
+        trace_close();
+        log_stop_async();
         return rc;
     } catch (exception &error) {
         // If we catch an execption here, then one of the
         // processes has hit an unsolvable problem and we
         // need to abort the entire workflow.
+        log_stop_async();
         fprintf(stderr, "ABORT: %s\n", error.what());
+        trace_close();
         // ensure that abort() is not eating our errors
         fflush(stdout);
         fflush(stderr);
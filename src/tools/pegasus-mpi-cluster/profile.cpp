@@ -0,0 +1,134 @@
+#include <cstring>
+
+#include "profile.h"
+#include "log.h"
+
+static const char *PHASE_NAMES[NUM_PHASES] = {
+    "other",
+    "queue",
+    "schedule",
+    "wait",
+    "result",
+    "iodata",
+    "control",
+    "flush",
+    "listeners"
+};
+
+const char *phase_name(MasterPhase phase) {
+    return PHASE_NAMES[phase];
+}
+
+Profile::Profile() {
+    running = false;
+    current = PHASE_OTHER;
+    last = 0;
+    memset(elapsed, 0, sizeof(elapsed));
+}
+
+/* Add the time since the last switch to the current phase */
+void Profile::charge(uint64_t now) {
+    elapsed[current] += now - last;
+    last = now;
+}
+
+void Profile::start() {
+    running = true;
+    last = monotonic_ns();
+}
+
+void Profile::stop() {
+    if (running) {
+        charge(monotonic_ns());
+        running = false;
+    }
+}
+
+/* Switch to phase, and return the phase that was running before */
+MasterPhase Profile::enter(MasterPhase phase) {
+    MasterPhase previous = current;
+    if (running && phase != current) {
+        charge(monotonic_ns());
+    }
+    current = phase;
+    return previous;
+}
+
+double Profile::seconds(MasterPhase phase) {
+    return elapsed[phase] / 1e9;
+}
+
+double Profile::total() {
+    uint64_t sum = 0;
+    for (int i=0; i<NUM_PHASES; i++) {
+        sum += elapsed[i];
+    }
+    return sum / 1e9;
+}
+
+Histogram::Histogram() {
+    memset(buckets, 0, sizeof(buckets));
+    total = 0;
+    sum = 0.0;
+    max = 0.0;
+}
+
+void Histogram::record(double seconds) {
+    double usec = seconds * 1e6;
+    int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS - 1 && usec >= 1.0) {
+        usec /= 2;
+        bucket++;
+    }
+    buckets[bucket]++;
+    total++;
+    sum += seconds;
+    if (seconds > max) {
+        max = seconds;
+    }
+}
+
+double Histogram::mean() {
+    if (total == 0) {
+        return 0.0;
+    }
+    return sum / total;
+}
+
+/* Return the upper bound of the bucket that holds the pth percentile,
+ * in seconds. This is never more than the largest value recorded. */
+double Histogram::percentile(double p) {
+    if (total == 0) {
+        return 0.0;
+    }
+    unsigned long rank = (unsigned long)(p / 100.0 * total);
+    if (rank == 0) {
+        rank = 1;
+    }
+    unsigned long seen = 0;
+    for (int i=0; i<HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank && i < HISTOGRAM_BUCKETS - 1) {
+            double bound = (1UL << i) / 1e6;
+            return bound < max ? bound : max;
+        }
+    }
+    return max;
+}
+
+/* Log a summary of the histogram, followed by its buckets */
+void Histogram::log(const char *name) {
+    log_info("%s: count=%lu mean=%lf p50=%lf p90=%lf p99=%lf max=%lf", name,
+            total, mean(), percentile(50), percentile(90), percentile(99), max);
+    for (int i=0; i<HISTOGRAM_BUCKETS; i++) {
+        if (buckets[i] == 0) {
+            continue;
+        }
+        unsigned long lo = i == 0 ? 0 : 1UL << (i-1);
+        if (i == HISTOGRAM_BUCKETS - 1) {
+            log_info("  >= %lu us: %lu", lo, buckets[i]);
+        } else {
+            log_info("  %lu-%lu us: %lu", lo, 1UL << i, buckets[i]);
+        }
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+#include "tools.h"
+
+/* The parts of the master loop that are timed. Time is charged to the
+ * innermost phase, so that the phases add up to the time spent in the
+ * loop. */
+typedef enum {
+    PHASE_OTHER,        // Not in any of the other phases
+    PHASE_QUEUE,        // Queueing tasks that are ready to run
+    PHASE_SCHEDULE,     // Matching tasks to slots and sending them
+    PHASE_WAIT,         // Waiting in recv_message
+    PHASE_RESULT,       // Processing task results
+    PHASE_IODATA,       // Writing forwarded I/O data
+    PHASE_CONTROL,      // Processing I/O credit, registration and depart messages
+    PHASE_FLUSH,        // Flushing buffered I/O
+    PHASE_LISTENERS,    // Calling workflow event listeners
+    NUM_PHASES
+} MasterPhase;
+
+const char *phase_name(MasterPhase phase);
+
+/* Accumulates the time the master spends in each phase. Only one clock
+ * read is needed each time the master switches phases. */
+class Profile {
+private:
+    bool running;
+    MasterPhase current;
+    uint64_t last;
+    uint64_t elapsed[NUM_PHASES];
+
+    void charge(uint64_t now);
+
+public:
+    Profile();
+    void start();
+    void stop();
+    MasterPhase enter(MasterPhase phase);
+    double seconds(MasterPhase phase);
+    double total();
+};
+
+/* Enters a phase for the life of the timer, and returns to the phase
+ * that was running before when it is destroyed */
+class PhaseTimer {
+private:
+    Profile &profile;
+    MasterPhase previous;
+
+public:
+    PhaseTimer(Profile &profile, MasterPhase phase) : profile(profile) {
+        previous = profile.enter(phase);
+    }
+    ~PhaseTimer() {
+        profile.enter(previous);
+    }
+};
+
+// The number of buckets in a latency histogram. Bucket 0 counts values
+// less than 1 microsecond, and bucket i counts values in [2^(i-1), 2^i)
+// microseconds. The last bucket also counts everything larger.
+#define HISTOGRAM_BUCKETS 32
+
+/* A histogram of latencies with power of two buckets */
+class Histogram {
+private:
+    unsigned long buckets[HISTOGRAM_BUCKETS];
+    unsigned long total;
+    double sum;
+    double max;
+
+public:
+    Histogram();
+    void record(double seconds);
+    unsigned long count() { return total; }
+    double mean();
+    double maximum() { return max; }
+    double percentile(double p);
+    void log(const char *name);
+};
+
+#endif /* PROFILE_H */
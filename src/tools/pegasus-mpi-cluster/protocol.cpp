@@ -28,6 +28,65 @@ ShutdownMessage::ShutdownMessage(char *msg, unsigned msgsize, int source) : Mess
 ShutdownMessage::ShutdownMessage() {
 }
 
+/* CPU bindings are encoded as the lowest CPU, the number of bytes in the 
+ * bitmap, and a bitmap where bit N is set if CPU lowest+N is bound. This 
+ * keeps the message small for tasks that use many CPUs because the
+ * bindings are usually contiguous. If buf is NULL, then this just 
+ * returns the size of the encoded bindings. */
+static unsigned encode_bindings(char *buf, const vector<cpu_t> &bindings) {
+    cpu_t lowest = 0;
+    cpu_t highest = 0;
+    for (unsigned i = 0; i<bindings.size(); i++) {
+        if (i == 0 || bindings[i] < lowest) {
+            lowest = bindings[i];
+        }
+        if (i == 0 || bindings[i] > highest) {
+            highest = bindings[i];
+        }
+    }
+
+    unsigned short nbytes = 0;
+    if (bindings.size() > 0) {
+        nbytes = (highest - lowest) / 8 + 1;
+    }
+
+    unsigned size = sizeof(lowest) + sizeof(nbytes) + nbytes;
+    if (buf == NULL) {
+        return size;
+    }
+
+    unsigned off = 0;
+    memcpy(buf + off, &lowest, sizeof(lowest));
+    off += sizeof(lowest);
+    memcpy(buf + off, &nbytes, sizeof(nbytes));
+    off += sizeof(nbytes);
+    memset(buf + off, 0, nbytes);
+    for (unsigned i = 0; i<bindings.size(); i++) {
+        unsigned bit = bindings[i] - lowest;
+        buf[off + bit / 8] |= (1 << (bit % 8));
+    }
+
+    return size;
+}
+
+/* Decode bindings encoded by encode_bindings. The bindings are returned
+ * in ascending order. Returns the number of bytes decoded. */
+static unsigned decode_bindings(const char *buf, vector<cpu_t> &bindings) {
+    cpu_t lowest;
+    unsigned short nbytes;
+    unsigned off = 0;
+    memcpy(&lowest, buf + off, sizeof(lowest));
+    off += sizeof(lowest);
+    memcpy(&nbytes, buf + off, sizeof(nbytes));
+    off += sizeof(nbytes);
+    for (unsigned bit = 0; bit < nbytes * 8u; bit++) {
+        if (buf[off + bit / 8] & (1 << (bit % 8))) {
+            bindings.push_back(lowest + bit);
+        }
+    }
+    return off + nbytes;
+}
+
 CommandMessage::CommandMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
     unsigned off = 0;
 
@@ -59,18 +118,8 @@ CommandMessage::CommandMessage(char *msg, unsigned msgsize, int source) : Messag
     memcpy(&cpus, msg + off, sizeof(cpus));
     off += sizeof(cpus);
 
-    // Get the number of bindings
-    cpu_t nbindings;
-    memcpy(&nbindings, msg + off, sizeof(nbindings));
-    off += sizeof(nbindings);
-
     // Get the bindings
-    for (cpu_t i = 0; i<nbindings; i++) {
-        cpu_t binding;
-        memcpy(&binding, msg + off, sizeof(binding));
-        bindings.push_back(binding);
-        off += sizeof(binding);
-    }
+    off += decode_bindings(msg + off, bindings);
 
     // Get the number of pipe forwards
     unsigned char npipes;
@@ -99,9 +148,21 @@ CommandMessage::CommandMessage(char *msg, unsigned msgsize, int source) : Messag
         off += destfile.length() + 1;
         file_forwards[srcfile] = destfile;
     }
+
+    // Get the number of hosts
+    unsigned nhosts;
+    memcpy(&nhosts, msg + off, sizeof(nhosts));
+    off += sizeof(nhosts);
+
+    // Get the hosts
+    for (unsigned i = 0; i<nhosts; i++) {
+        string host = msg + off;
+        off += host.length() + 1;
+        hosts.push_back(host);
+    }
 }
 
-CommandMessage::CommandMessage(const string &name, const list<string> &args, const string &id, unsigned memory, cpu_t cpus, const vector<cpu_t> &bindings, const map<string,string> *pipe_forwards, const map<string,string> *file_forwards) {
+CommandMessage::CommandMessage(const string &name, const list<string> &args, const string &id, unsigned memory, cpu_t cpus, const vector<cpu_t> &bindings, const map<string,string> *pipe_forwards, const map<string,string> *file_forwards, const vector<string> *hosts) {
     this->name = name;
     this->args = args;
     this->id = id;
@@ -110,12 +171,14 @@ CommandMessage::CommandMessage(const string &name, const list<string> &args, con
     this->bindings = bindings;
     if (pipe_forwards) this->pipe_forwards = *pipe_forwards;
     if (file_forwards) this->file_forwards = *file_forwards;
+    if (hosts) this->hosts = *hosts;
 
     // Compute the size of the variable length sections
     unsigned nargs = this->args.size();
-    cpu_t nbindings = this->bindings.size();
+    unsigned bindingsize = encode_bindings(NULL, this->bindings);
     unsigned char npipes = this->pipe_forwards.size();
     unsigned char nfiles = this->file_forwards.size();
+    unsigned nhosts = this->hosts.size();
 
     // The constant part of the message size
     msgsize = name.length() + 1 +
@@ -123,9 +186,10 @@ CommandMessage::CommandMessage(const string &name, const list<string> &args, con
               id.length() + 1 +
               sizeof(memory) +
               sizeof(cpus) +
-              sizeof(nbindings) + (nbindings * sizeof(cpu_t)) +
+              bindingsize +
               sizeof(npipes) +
-              sizeof(nfiles);
+              sizeof(nfiles) +
+              sizeof(nhosts);
 
     // Add the size of the arguments section
     list<string>::iterator l;
@@ -146,6 +210,12 @@ CommandMessage::CommandMessage(const string &name, const list<string> &args, con
         msgsize += m->second.length() + 1;
     }
 
+    // Add the size of the hosts section
+    vector<string>::iterator h;
+    for (h=this->hosts.begin(); h!=this->hosts.end(); h++) {
+        msgsize += h->length() + 1;
+    }
+
     // Now allocate an appropriate-sized buffer
     msg = new char[msgsize];
 
@@ -177,13 +247,7 @@ CommandMessage::CommandMessage(const string &name, const list<string> &args, con
     off += sizeof(cpus);
 
     // Add the bindings
-    memcpy(msg + off, &nbindings, sizeof(nbindings));
-    off += sizeof(nbindings);
-    for (vector<cpu_t>::iterator i=this->bindings.begin(); i!=this->bindings.end(); i++) {
-        cpu_t binding = *i;
-        memcpy(msg + off, &binding, sizeof(binding));
-        off += sizeof(binding);
-    }
+    off += encode_bindings(msg + off, this->bindings);
 
     // Add the pipe forwards
     memcpy(msg + off, &npipes, sizeof(npipes));
@@ -208,6 +272,14 @@ CommandMessage::CommandMessage(const string &name, const list<string> &args, con
         strcpy(msg + off, destfile->c_str());
         off += destfile->length() + 1;
     }
+
+    // Add the hosts
+    memcpy(msg + off, &nhosts, sizeof(nhosts));
+    off += sizeof(nhosts);
+    for (h=this->hosts.begin(); h!=this->hosts.end(); h++) {
+        strcpy(msg + off, h->c_str());
+        off += h->length() + 1;
+    }
 }
 
 ResultMessage::ResultMessage(char *msg, unsigned msgsize, int source, int _dummy_) : Message(msg, msgsize, source) {
@@ -217,15 +289,18 @@ ResultMessage::ResultMessage(char *msg, unsigned msgsize, int source, int _dummy
     memcpy(&exitcode, msg + off, sizeof(exitcode));
     off += sizeof(exitcode);
     memcpy(&runtime, msg + off, sizeof(runtime));
-    //off += sizeof(runtime);
+    off += sizeof(runtime);
+    memcpy(&usage, msg + off, sizeof(usage));
+    //off += sizeof(usage);
 }
 
-ResultMessage::ResultMessage(const string &name, int exitcode, double runtime) {
+ResultMessage::ResultMessage(const string &name, int exitcode, double runtime, const struct taskusage &usage) {
     this->name = name;
     this->exitcode = exitcode;
     this->runtime = runtime;
+    this->usage = usage;
 
-    this->msgsize = name.length() + 1 + sizeof(exitcode) + sizeof(runtime);
+    this->msgsize = name.length() + 1 + sizeof(exitcode) + sizeof(runtime) + sizeof(usage);
     this->msg = new char[this->msgsize];
     
     int off = 0;
@@ -234,12 +309,17 @@ ResultMessage::ResultMessage(const string &name, int exitcode, double runtime) {
     memcpy(msg + off, &exitcode, sizeof(exitcode));
     off += sizeof(exitcode);
     memcpy(msg + off, &runtime, sizeof(runtime));
-    //off += sizeof(runtime);
+    off += sizeof(runtime);
+    memcpy(msg + off, &usage, sizeof(usage));
+    //off += sizeof(usage);
 }
 
 RegistrationMessage::RegistrationMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
-    hostname = msg;
-    int off = hostname.length() + 1;
+    int off = 0;
+    memcpy(&version, msg + off, sizeof(version));
+    off += sizeof(version);
+    hostname = msg + off;
+    off += hostname.length() + 1;
     memcpy(&memory, msg + off, sizeof(memory));
     off += sizeof(memory);
     memcpy(&threads, msg + off, sizeof(threads));
@@ -247,22 +327,45 @@ RegistrationMessage::RegistrationMessage(char *msg, unsigned msgsize, int source
     memcpy(&cores, msg + off, sizeof(cores));
     off += sizeof(cores);
     memcpy(&sockets, msg + off, sizeof(sockets));
-    //off += sizeof(sockets);
+    off += sizeof(sockets);
+
+    // Get the topology
+    cpu_t ntopo;
+    memcpy(&ntopo, msg + off, sizeof(ntopo));
+    off += sizeof(ntopo);
+    cpu_nodes.resize(ntopo);
+    cpu_cores.resize(ntopo);
+    for (unsigned i = 0; i<ntopo; i++) {
+        memcpy(&cpu_nodes[i], msg + off, sizeof(cpu_t));
+        off += sizeof(cpu_t);
+        memcpy(&cpu_cores[i], msg + off, sizeof(cpu_t));
+        off += sizeof(cpu_t);
+    }
 }
 
-RegistrationMessage::RegistrationMessage(const string &hostname, unsigned memory, cpu_t threads, cpu_t cores, cpu_t sockets) {
+RegistrationMessage::RegistrationMessage(const string &hostname, unsigned memory, cpu_t threads, cpu_t cores, cpu_t sockets, const vector<cpu_t> &cpu_nodes, const vector<cpu_t> &cpu_cores) {
+    this->version = PROTOCOL_VERSION;
     this->hostname = hostname;
     this->memory = memory;
     this->threads = threads;
     this->cores = cores;
     this->sockets = sockets;
 
-    this->msgsize = hostname.length() + 1 + sizeof(memory) + sizeof(threads) + sizeof(cores) + sizeof(sockets);
+    // The topology is only sent if it is complete
+    if (cpu_nodes.size() == cpu_cores.size()) {
+        this->cpu_nodes = cpu_nodes;
+        this->cpu_cores = cpu_cores;
+    }
+    cpu_t ntopo = this->cpu_nodes.size();
+
+    this->msgsize = sizeof(version) + hostname.length() + 1 + sizeof(memory) + sizeof(threads) + sizeof(cores) + sizeof(sockets) + sizeof(ntopo) + (2 * ntopo * sizeof(cpu_t));
     this->msg = new char[this->msgsize];
 
     int off = 0;
+    memcpy(msg + off, &version, sizeof(version));
+    off += sizeof(version);
     strcpy(msg + off, hostname.c_str());
-    off += strlen(msg) + 1;
+    off += hostname.length() + 1;
     memcpy(msg + off, &memory, sizeof(memory));
     off += sizeof(memory);
     memcpy(msg + off, &threads, sizeof(threads));
@@ -270,20 +373,53 @@ RegistrationMessage::RegistrationMessage(const string &hostname, unsigned memory
     memcpy(msg + off, &cores, sizeof(cores));
     off += sizeof(cores);
     memcpy(msg + off, &sockets, sizeof(sockets));
-    //off += sizeof(sockets);
+    off += sizeof(sockets);
+    memcpy(msg + off, &ntopo, sizeof(ntopo));
+    off += sizeof(ntopo);
+    for (unsigned i = 0; i<ntopo; i++) {
+        memcpy(msg + off, &this->cpu_nodes[i], sizeof(cpu_t));
+        off += sizeof(cpu_t);
+        memcpy(msg + off, &this->cpu_cores[i], sizeof(cpu_t));
+        off += sizeof(cpu_t);
+    }
 }
 
 HostrankMessage::HostrankMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
-    memcpy(&hostrank, msg, sizeof(hostrank));
+    unsigned off = 0;
+    memcpy(&hostrank, msg + off, sizeof(hostrank));
+    off += sizeof(hostrank);
+
+    // Get the ranks of all the workers on the host
+    unsigned nranks;
+    memcpy(&nranks, msg + off, sizeof(nranks));
+    off += sizeof(nranks);
+    for (unsigned i = 0; i<nranks; i++) {
+        int rank;
+        memcpy(&rank, msg + off, sizeof(rank));
+        off += sizeof(rank);
+        ranks.push_back(rank);
+    }
 }
 
-HostrankMessage::HostrankMessage(int hostrank) {
+HostrankMessage::HostrankMessage(int hostrank, const vector<int> &ranks) {
     this->hostrank = hostrank;
+    this->ranks = ranks;
+
+    unsigned nranks = ranks.size();
     
-    this->msgsize = sizeof(hostrank);
+    this->msgsize = sizeof(hostrank) + sizeof(nranks) + (nranks * sizeof(int));
     this->msg = new char [this->msgsize];
     
-    memcpy(msg, &hostrank, sizeof(hostrank));
+    unsigned off = 0;
+    memcpy(msg + off, &hostrank, sizeof(hostrank));
+    off += sizeof(hostrank);
+    memcpy(msg + off, &nranks, sizeof(nranks));
+    off += sizeof(nranks);
+    for (unsigned i = 0; i<nranks; i++) {
+        int rank = ranks[i];
+        memcpy(msg + off, &rank, sizeof(rank));
+        off += sizeof(rank);
+    }
 }
 
 IODataMessage::IODataMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
@@ -294,16 +430,19 @@ IODataMessage::IODataMessage(char *msg, unsigned msgsize, int source) : Message(
     off += filename.length() + 1;
     memcpy(&size, msg + off, sizeof(size));
     off += sizeof(size);
+    memcpy(&exitcode, msg + off, sizeof(exitcode));
+    off += sizeof(exitcode);
     data = msg + off;
 }
 
-IODataMessage::IODataMessage(const string &task, const string &filename, const char *data, unsigned size) {
+IODataMessage::IODataMessage(const string &task, const string &filename, const char *data, unsigned size, int exitcode) {
     this->task = task;
     this->filename = filename;
     this->data = data;
     this->size = size;
+    this->exitcode = exitcode;
 
-    this->msgsize = task.length() + 1 + filename.length() + 1 + sizeof(size) + size;
+    this->msgsize = task.length() + 1 + filename.length() + 1 + sizeof(size) + sizeof(exitcode) + size;
     this->msg = new char [this->msgsize];
     
     int off = 0;
@@ -313,6 +452,40 @@ IODataMessage::IODataMessage(const string &task, const string &filename, const c
     off += filename.length() + 1;
     memcpy(msg + off, &size, sizeof(size));
     off += sizeof(size);
+    memcpy(msg + off, &exitcode, sizeof(exitcode));
+    off += sizeof(exitcode);
     memcpy(msg + off, data, size);
 }
 
+
+IOCreditMessage::IOCreditMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
+    memcpy(&bytes, msg, sizeof(bytes));
+}
+
+IOCreditMessage::IOCreditMessage(unsigned bytes) {
+    this->bytes = bytes;
+
+    this->msgsize = sizeof(bytes);
+    this->msg = new char [this->msgsize];
+
+    memcpy(msg, &bytes, sizeof(bytes));
+}
+
+DepartMessage::DepartMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
+}
+
+DepartMessage::DepartMessage() {
+}
+
+KillMessage::KillMessage(char *msg, unsigned msgsize, int source) : Message(msg, msgsize, source) {
+    name = msg;
+}
+
+KillMessage::KillMessage(const string &name) {
+    this->name = name;
+
+    this->msgsize = name.length() + 1;
+    this->msg = new char[this->msgsize];
+
+    strcpy(msg, name.c_str());
+}
@@ -13,13 +13,21 @@ using std::map;
 using std::list;
 using std::vector;
 
+// This should be incremented whenever the format of a message changes.
+// The workers send it to the master when they register so that the
+// master can detect workers that are running a different version.
+#define PROTOCOL_VERSION 8
+
 enum MessageType {
     COMMAND      = 1,
     RESULT       = 2,
     SHUTDOWN     = 3,
     REGISTRATION = 4,
     HOSTRANK     = 5,
-    IODATA       = 6
+    IODATA       = 6,
+    IOCREDIT     = 7,
+    DEPART       = 8,
+    KILL         = 9
 };
 
 class Message {
@@ -52,8 +60,11 @@ public:
     map<string, string> pipe_forwards;
     map<string, string> file_forwards;
 
+    // The hosts reserved for a task that requested more than one node
+    vector<string> hosts;
+
     CommandMessage(char *msg, unsigned msgsize, int source);
-    CommandMessage(const string &name, const list<string> &args, const string &id, unsigned memory, cpu_t cpus, const vector<cpu_t> &bindings, const map<string,string> *pipe_forwards, const map<string,string> *file_forwards);
+    CommandMessage(const string &name, const list<string> &args, const string &id, unsigned memory, cpu_t cpus, const vector<cpu_t> &bindings, const map<string,string> *pipe_forwards, const map<string,string> *file_forwards, const vector<string> *hosts = NULL);
     virtual int tag() const { return COMMAND; };
 };
 
@@ -62,45 +73,94 @@ public:
     string name;
     int exitcode;
     double runtime;
+    struct taskusage usage;
 
     ResultMessage(char *msg, unsigned msgsize, int source, int _dummy_);
-    ResultMessage(const string &name, int exitcode, double runtime);
+    ResultMessage(const string &name, int exitcode, double runtime, const struct taskusage &usage);
     virtual int tag() const { return RESULT; };
 };
 
 class RegistrationMessage: public Message {
 public:
+    unsigned version;
     string hostname;
     unsigned memory;
     cpu_t threads;
     cpu_t cores;
     cpu_t sockets;
 
+    // The NUMA node and physical core of each cpu, or empty if the 
+    // topology of the host is unknown
+    vector<cpu_t> cpu_nodes;
+    vector<cpu_t> cpu_cores;
+
     RegistrationMessage(char *msg, unsigned msgsize, int source);
-    RegistrationMessage(const string &hostname, unsigned memory, cpu_t threads, cpu_t cores, cpu_t sockets);
+    RegistrationMessage(const string &hostname, unsigned memory, cpu_t threads, cpu_t cores, cpu_t sockets, const vector<cpu_t> &cpu_nodes, const vector<cpu_t> &cpu_cores);
     virtual int tag() const { return REGISTRATION; };
 };
 
 class HostrankMessage: public Message {
 public:
     int hostrank;
+    vector<int> ranks;
 
     HostrankMessage(char *msg, unsigned msgsize, int source);
-    HostrankMessage(int hostrank);
+    HostrankMessage(int hostrank, const vector<int> &ranks);
     virtual int tag() const { return HOSTRANK; };
 };
 
+// Destinations of I/O data messages that carry task stdout and stderr
+// when the workers forward task stdio to the master
+#define IODATA_STDOUT "stdout"
+#define IODATA_STDERR "stderr"
+
+// I/O data is sent in messages of at most this many bytes. Forwards that
+// are larger are sent in several messages.
+#define IODATA_MAX_SIZE (64*1024*1024)
+
 class IODataMessage: public Message {
 public:
     string task;
     string filename;
     const char *data;
     unsigned size;
+    int exitcode;               // Status of the task, if it has exited
 
     IODataMessage(char *msg, unsigned msgsize, int source);
-    IODataMessage(const string &task, const string &filename, const char *data, unsigned size);
+    IODataMessage(const string &task, const string &filename, const char *data, unsigned size, int exitcode);
     virtual int tag() const { return IODATA; }
 };
 
+/* Sent by a worker to ask for permission to send I/O data to the master,
+ * and by the master to grant it */
+class IOCreditMessage: public Message {
+public:
+    unsigned bytes;
+
+    IOCreditMessage(char *msg, unsigned msgsize, int source);
+    IOCreditMessage(unsigned bytes);
+    virtual int tag() const { return IOCREDIT; }
+};
+
+/* Sent by a worker that joined the workflow after it started when it 
+ * wants to leave. The master replies with a ShutdownMessage. */
+class DepartMessage: public Message {
+public:
+    DepartMessage(char *msg, unsigned msgsize, int source);
+    DepartMessage();
+    virtual int tag() const { return DEPART; }
+};
+
+/* Sent to a worker to kill a task that is running. This is used to kill
+ * the copy of a task that lost when the task was run speculatively. */
+class KillMessage: public Message {
+public:
+    string name;
+
+    KillMessage(char *msg, unsigned msgsize, int source);
+    KillMessage(const string &name);
+    virtual int tag() const { return KILL; }
+};
+
 #endif /* PROTOCOL_H */
 
@@ -0,0 +1,88 @@
+#include <string>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cgroup.h"
+#include "failure.h"
+#include "log.h"
+#include "tools.h"
+
+using std::string;
+
+/* The cgroup interface files are just files, so we can test most of
+ * the CGroup class on a regular directory */
+static void create_file(const string &path, const char *contents) {
+    FILE *f = fopen(path.c_str(), "w");
+    if (f == NULL) {
+        myfailures("Unable to create %s", path.c_str());
+    }
+    fputs(contents, f);
+    fclose(f);
+}
+
+void test_cgroup() {
+    string path = "test/scratch/cgroup";
+    rmdir(path.c_str());
+
+    CGroup cg(path);
+    if (cg.create() < 0) {
+        myfailures("Unable to create cgroup");
+    }
+    if (CGroup::is_cgroup(path)) {
+        myfailure("Directory should not be a cgroup yet");
+    }
+    create_file(path + "/cgroup.controllers", "cpu memory pids\n");
+    if (!CGroup::is_cgroup(path)) {
+        myfailure("Directory should be a cgroup");
+    }
+    if (cg.procs() != path + "/cgroup.procs") {
+        myfailure("Wrong procs file");
+    }
+
+    // Files are not created by write
+    if (cg.write("memory.max", "1048576") == 0) {
+        myfailure("write should fail for a missing file");
+    }
+    create_file(path + "/memory.max", "");
+    if (cg.write("memory.max", "1048576") < 0) {
+        myfailures("Unable to write memory.max");
+    }
+    unsigned long value = 0;
+    if (cg.read_unsigned("memory.max", &value) < 0 || value != 1048576) {
+        myfailure("Wrong value for memory.max: %lu", value);
+    }
+
+    create_file(path + "/cpu.stat", "usage_usec 1500000\nuser_usec 1000000\nsystem_usec 500000\n");
+    if (cg.read_key("cpu.stat", "user_usec", &value) < 0 || value != 1000000) {
+        myfailure("Wrong value for user_usec: %lu", value);
+    }
+    if (cg.read_key("cpu.stat", "nr_periods", &value) == 0 || errno != ENOENT) {
+        myfailure("read_key should fail for a missing key");
+    }
+
+    // A cgroup can only be removed when it is empty, which is always
+    // the case for real cgroups
+    if (cg.destroy() == 0) {
+        myfailure("destroy should fail for a directory with files in it");
+    }
+    unlink((path + "/cgroup.controllers").c_str());
+    unlink((path + "/memory.max").c_str());
+    unlink((path + "/cpu.stat").c_str());
+    if (cg.destroy() < 0) {
+        myfailures("Unable to destroy cgroup");
+    }
+    if (access(path.c_str(), F_OK) == 0) {
+        myfailure("cgroup was not removed");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    log_set_level(LOG_ERROR);
+    if (mkdirs("test/scratch") < 0) {
+        myfailures("Unable to create test/scratch");
+    }
+    test_cgroup();
+    return 0;
+}
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "checkpoint.h"
+#include "dag.h"
+#include "failure.h"
+#include "log.h"
+#include "tools.h"
+
+void write_checkpoint(const string &path, DAG &dag, unsigned long id, unsigned long offset) {
+    string data;
+    build_checkpoint(dag, checkpoint_hash(dag), id, offset, data);
+    CheckpointWriter writer(path);
+    writer.start();
+    writer.submit(data);
+    writer.finish();
+}
+
+void write_file(const string &path, const char *contents) {
+    FILE *f = fopen(path.c_str(), "w");
+    if (f == NULL) {
+        myfailures("Unable to create %s", path.c_str());
+    }
+    fputs(contents, f);
+    fclose(f);
+}
+
+void test_roundtrip() {
+    string path = "test/scratch/tries.checkpoint";
+    unlink(path.c_str());
+
+    {
+        DAG dag("test/tries.dag", "", true, 3);
+        Task *a = dag.get_task("A");
+        a->success = true;
+        a->submit_seq = 1;
+        a->usage.maxrss = 2048;
+        Task *b = dag.get_task("B");
+        b->failures = 2;
+        b->submit_seq = 3;
+        b->last_exitcode = 256;
+        Task *c = dag.get_task("C");
+        c->failures = 3;
+        c->submit_seq = 4;
+        c->memory_exceeded = true;
+
+        // Submitting twice before the writer runs only writes the last one
+        string first;
+        build_checkpoint(dag, checkpoint_hash(dag), 0, 0, first);
+        string second;
+        build_checkpoint(dag, checkpoint_hash(dag), 7, 42, second);
+        CheckpointWriter writer(path);
+        writer.submit(first);
+        writer.submit(second);
+        writer.start();
+        writer.finish();
+    }
+
+    if (access((path + ".tmp").c_str(), F_OK) == 0) {
+        myfailure("Temporary checkpoint was not renamed");
+    }
+
+    DAG dag("test/tries.dag", "", true, 3);
+    unsigned long id = 0;
+    unsigned long offset = 0;
+    if (!load_checkpoint(path, dag, &id, &offset)) {
+        myfailure("Checkpoint was not loaded");
+    }
+    if (id != 7 || offset != 42) {
+        myfailure("Expected rescue file 7 at offset 42, got %lu at %lu", id, offset);
+    }
+
+    Task *a = dag.get_task("A");
+    if (!a->success || a->submit_seq != 1 || a->usage.maxrss != 2048) {
+        myfailure("Task A was not restored");
+    }
+    Task *b = dag.get_task("B");
+    if (b->success || b->failures != 2 || b->submit_seq != 3 || b->last_exitcode != 256) {
+        myfailure("Task B was not restored");
+    }
+
+    // C used up all its tries, so it gets them all again
+    Task *c = dag.get_task("C");
+    if (c->failures != 0 || c->submit_seq != 4 || !c->memory_exceeded) {
+        myfailure("Task C was not restored: %u failures", c->failures);
+    }
+
+    Task *d = dag.get_task("D");
+    if (d->success || d->failures != 0 || d->submit_seq != 0) {
+        myfailure("Task D should not have changed");
+    }
+}
+
+void test_mismatch() {
+    DAG tries("test/tries.dag");
+    unsigned long id = 1;
+    unsigned long offset = 1;
+    if (load_checkpoint("test/scratch/missing.checkpoint", tries, &id, &offset) || offset != 0) {
+        myfailure("Missing checkpoint should be ignored");
+    }
+
+    // A checkpoint of a different DAG is ignored, even if it has the
+    // same number of tasks
+    string path = "test/scratch/diamond.checkpoint";
+    DAG diamond("test/diamond.dag");
+    diamond.get_task("A")->success = true;
+    write_checkpoint(path, diamond, 0, 0);
+    DAG test("test/test.dag");
+    if (load_checkpoint(path, test, &id, &offset)) {
+        myfailure("Checkpoint of a different DAG was loaded");
+    }
+
+    // The same task names with different contents are fine
+    if (!load_checkpoint(path, tries, &id, &offset) || !tries.get_task("A")->success) {
+        myfailure("Checkpoint should have been loaded");
+    }
+
+    // A corrupt checkpoint is ignored
+    string data;
+    build_checkpoint(diamond, 12345, 0, 0, data);
+    CheckpointWriter writer(path);
+    writer.start();
+    writer.submit(data);
+    writer.finish();
+    DAG other("test/diamond.dag");
+    if (load_checkpoint(path, other, &id, &offset) || other.get_task("A")->success) {
+        myfailure("Checkpoint with the wrong hash was loaded");
+    }
+}
+
+void test_rescue_offset() {
+    string rescue = "test/scratch/diamond.rescue";
+    string path = "test/scratch/diamond.checkpoint";
+    write_file(rescue, "DONE A\nDONE B\n");
+    struct stat st;
+    if (stat(rescue.c_str(), &st) < 0) {
+        myfailures("Unable to stat %s", rescue.c_str());
+    }
+
+    // The checkpoint covers the first record, which says that A is done,
+    // but the checkpoint says that it isn't, so A is only done if the
+    // first record is read
+    {
+        DAG dag("test/diamond.dag");
+        write_checkpoint(path, dag, st.st_ino, 7);
+    }
+    {
+        DAG dag("test/diamond.dag", rescue, true, 1, path);
+        if (dag.get_task("A")->success) {
+            myfailure("Rescue records before the offset were read");
+        }
+        if (!dag.get_task("B")->success) {
+            myfailure("Rescue records after the offset were not read");
+        }
+    }
+
+    // If the rescue file is smaller than the offset, then all of it is read
+    {
+        DAG dag("test/diamond.dag");
+        write_checkpoint(path, dag, st.st_ino, 1000);
+    }
+    {
+        DAG dag("test/diamond.dag", rescue, true, 1, path);
+        if (!dag.get_task("A")->success || !dag.get_task("B")->success) {
+            myfailure("Rescue file should have been read from the start");
+        }
+    }
+
+    // If the rescue file was replaced, then all of it is read
+    {
+        DAG dag("test/diamond.dag");
+        write_checkpoint(path, dag, st.st_ino + 1, 7);
+    }
+    {
+        DAG dag("test/diamond.dag", rescue, true, 1, path);
+        if (!dag.get_task("A")->success || !dag.get_task("B")->success) {
+            myfailure("Replaced rescue file should have been read from the start");
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    log_set_level(LOG_ERROR);
+    if (mkdirs("test/scratch") < 0) {
+        myfailures("Unable to create test/scratch");
+    }
+    test_roundtrip();
+    test_mismatch();
+    test_rescue_offset();
+    return 0;
+}
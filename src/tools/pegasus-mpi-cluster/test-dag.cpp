@@ -69,22 +69,18 @@ void test_pegasus_dag() {
     if (a->pegasus_id.compare("1") != 0) {
         myfailure("A should have had pegasus_id");
     }
-    /*
     if (a->pegasus_transformation.compare("mDiffFit:3.3") != 0) {
         myfailure("A should have had pegasus_transformation");
     }
-    */
     
     Task *b = dag.get_task("B");
     
     if (b->pegasus_id.compare("2") != 0) {
         myfailure("B should have had pegasus_id");
     }
-    /*
     if (b->pegasus_transformation.compare("mDiff:3.3") != 0) {
         myfailure("B should have had pegasus_transformation");
     }
-    */
 }
 
 void test_memory_dag() {
@@ -140,6 +136,20 @@ void test_cpu_dag() {
     }
 }
 
+void test_nodes_dag() {
+    DAG dag("test/nodes.dag");
+
+    if (dag.get_task("A")->nodes != 2) {
+        myfailure("A should require 2 nodes");
+    }
+    if (dag.get_task("B")->nodes != 1) {
+        myfailure("B should require 1 node");
+    }
+    if (dag.get_task("C")->nodes != 2) {
+        myfailure("C should require 2 nodes");
+    }
+}
+
 void test_tries_dag() {
     DAG dag("test/tries.dag", "", true, 3);
     
@@ -168,6 +178,24 @@ void test_tries_dag() {
     }
 }
 
+void test_group_dag() {
+    DAG dag("test/groups.dag");
+
+    if (dag.get_task("A1")->group != "a" || dag.get_task("A4")->group != "a") {
+        myfailure("A1 and A4 should be in group a");
+    }
+
+    // The group comes from the prefix of the pegasus id
+    if (dag.get_task("B1")->group != "b" || dag.get_task("B3")->group != "b") {
+        myfailure("B1 and B3 should be in group b");
+    }
+
+    // The group flag is used if the pegasus id has no prefix
+    if (dag.get_task("B4")->group != "b" || dag.get_task("B4")->pegasus_id != "4") {
+        myfailure("B4 should be in group b");
+    }
+}
+
 void test_priority_dag() {
     DAG dag("test/priority.dag");
     
@@ -281,8 +309,10 @@ int main(int argc, char *argv[]) {
         test_pegasus_dag();
         test_memory_dag();
         test_cpu_dag();
+        test_nodes_dag();
         test_tries_dag();
         test_priority_dag();
+        test_group_dag();
         test_pipe_forward();
         test_file_forward();
         return 0;
@@ -1,6 +1,7 @@
 #include <string>
 #include <stdio.h>
 #include <unistd.h>
+#include <string.h>
 
 #include "stdlib.h"
 #include "dag.h"
@@ -219,6 +220,54 @@ void diamond_dag_oldrescue() {
     }
 }
 
+void diamond_dag_compact_rescue() {
+    char temp[1024];
+    sprintf(temp, "file_XXXXXX");
+    int fd = mkstemp(temp);
+    const char *old = "# Old rescue file\nDONE C\nDONE A\n\nDONE A\n  DONE C  \n";
+    if (write(fd, old, strlen(old)) < 0) {
+        myfailures("Unable to write %s", temp);
+    }
+    close(fd);
+
+    {
+        DAG dag("test/diamond.dag", temp);
+        Engine engine(dag, temp);
+
+        // The old records are replaced with one record for each task
+        // that is done, in DAG order
+        char buf[1024];
+        read_file(temp, buf);
+        if (strcmp(buf, "\nDONE A\nDONE C") != 0) {
+            myfailure("Rescue file was not compacted: %s: %s", temp, buf);
+        }
+        string tmpfile = string(temp) + ".tmp";
+        if (access(tmpfile.c_str(), F_OK) == 0) {
+            myfailure("Temporary rescue file was not renamed");
+        }
+
+        Task *b = engine.next_ready_task();
+        if (b->name.compare("B") != 0) {
+            myfailure("Ready task is not B");
+        }
+        engine.mark_task_finished(b, 0);
+
+        read_file(temp, buf);
+        if (strcmp(buf, "\nDONE A\nDONE C\nDONE B") != 0) {
+            myfailure("Rescue file not updated properly: %s: %s", temp, buf);
+        }
+    }
+
+    // Records that are not in DAG order are still found
+    DAG dag("test/diamond.dag", temp);
+    if (!dag.get_task("A")->success || !dag.get_task("B")->success || 
+            !dag.get_task("C")->success || dag.get_task("D")->success) {
+        myfailure("Compacted rescue file was not read properly");
+    }
+
+    unlink(temp);
+}
+
 void diamond_dag_max_failures() {
     DAG dag("test/diamond.dag");
     Engine engine(dag, "", 1);
@@ -324,5 +373,6 @@ int main(int argc, char *argv[]) {
     diamond_dag_oldrescue();
     diamond_dag_newrescue();
     diamond_dag_rescue();
+    diamond_dag_compact_rescue();
     return 0;
 }
@@ -0,0 +1,210 @@
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "eventlog.h"
+#include "dag.h"
+#include "failure.h"
+#include "log.h"
+#include "strlib.h"
+#include "tools.h"
+
+using std::string;
+using std::vector;
+
+static void read_lines(const string &path, vector<string> &lines) {
+    FILE *f = fopen(path.c_str(), "r");
+    if (f == NULL) {
+        myfailures("Unable to open %s", path.c_str());
+    }
+    string contents;
+    char buf[BUFSIZ];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        contents.append(buf, n);
+    }
+    fclose(f);
+    lines.clear();
+    split(lines, contents, "\n");
+}
+
+static Task *make_task(const string &name, unsigned seq) {
+    list<string> args;
+    args.push_back("/bin/true");
+    map<string, string> forwards;
+    Task *task = new Task(name, args, 0, 1, 1, 1, 0, forwards, forwards);
+    task->submit_seq = seq;
+    return task;
+}
+
+void test_jobstate_log() {
+    string path = "test/scratch/jobstate.log";
+    unlink(path.c_str());
+
+    Task *a = make_task("A", 1);
+    Task *b = make_task("B", 2);
+    {
+        JobstateLog log(path);
+        log.on_event(WORKFLOW_START, NULL);
+        log.on_event(TASK_QUEUED, a);
+        log.on_event(TASK_SUBMIT, a);
+        a->last_exitcode = 0;
+        a->usage.maxrss = 1024;
+        log.on_event(TASK_SUCCESS, a);
+        log.on_event(TASK_QUEUED, b);
+        log.on_event(TASK_SUBMIT, b);
+        b->last_exitcode = 1;
+        log.on_event(TASK_FAILURE, b);
+        log.on_event(WORKFLOW_FAILURE, NULL);
+
+        // flush() waits until the queued events have been written
+        log.flush();
+        vector<string> lines;
+        read_lines(path, lines);
+        if (lines.size() != 10) {
+            myfailure("Expected 10 lines after flush, got %u", lines.size());
+        }
+    }
+
+    // The log is closed when it is destroyed, and it is appended to
+    vector<string> lines;
+    read_lines(path, lines);
+    if (lines.size() != 10) {
+        myfailure("Expected 10 lines, got %u", lines.size());
+    }
+    if (lines[0].find("INTERNAL *** PMC_STARTED ***") == string::npos) {
+        myfailure("Wrong first line: %s", lines[0].c_str());
+    }
+    if (lines[1].find(" A SUBMIT 1.0 - - 1") == string::npos) {
+        myfailure("Wrong submit line: %s", lines[1].c_str());
+    }
+    if (lines[3].find(" A JOB_TERMINATED 1.0 - - 1 maxrss=1024 ") == string::npos) {
+        myfailure("Wrong terminated line: %s", lines[3].c_str());
+    }
+    if (lines[4].find(" A JOB_SUCCESS 0 - - 1") == string::npos) {
+        myfailure("Wrong success line: %s", lines[4].c_str());
+    }
+    if (lines[8].find(" B JOB_FAILURE 1 - - 2") == string::npos) {
+        myfailure("Wrong failure line: %s", lines[8].c_str());
+    }
+    if (lines[9].find("INTERNAL *** PMC_FINISHED 1 ***") == string::npos) {
+        myfailure("Wrong last line: %s", lines[9].c_str());
+    }
+
+    delete a;
+    delete b;
+}
+
+void test_dagman_log() {
+    string path = "test/scratch/test.dagman.out";
+    Task *a = make_task("A", 1);
+    {
+        DAGManLog log(path, "test/scratch/test.dag");
+        log.on_event(WORKFLOW_START, NULL);
+        log.on_event(TASK_QUEUED, a);
+        a->last_exitcode = 0;
+        log.on_event(TASK_SUCCESS, a);
+        log.on_event(WORKFLOW_SUCCESS, NULL);
+    }
+
+    vector<string> lines;
+    read_lines(path, lines);
+    if (lines.size() != 9) {
+        myfailure("Expected 9 lines, got %u", lines.size());
+    }
+    if (lines[3].find("Parsing test.dag ...") == string::npos) {
+        myfailure("Wrong parsing line: %s", lines[3].c_str());
+    }
+    if (lines[5].find("ULOG_SUBMIT for Condor Node A (1.0)") == string::npos) {
+        myfailure("Wrong submit line: %s", lines[5].c_str());
+    }
+    if (lines[7].find("Node A job proc (1.0) completed successfully.") == string::npos) {
+        myfailure("Wrong success line: %s", lines[7].c_str());
+    }
+    if (lines[8].find("EXITING WITH STATUS 0") == string::npos) {
+        myfailure("Wrong last line: %s", lines[8].c_str());
+    }
+
+    delete a;
+}
+
+void test_many_events() {
+    string path = "test/scratch/many.log";
+    unlink(path.c_str());
+
+    // Queue many times more events than fit in the buffer so that it
+    // wraps around and the producer has to wait for the writer
+    unsigned count = 4 * EVENT_BUFFER_SIZE / sizeof(EventRecord);
+    Task *task = make_task("a_task_with_a_longer_name", 1);
+    {
+        JobstateLog log(path);
+        for (unsigned i=0; i<count; i++) {
+            task->submit_seq = i;
+            log.on_event(TASK_QUEUED, task);
+        }
+    }
+
+    vector<string> lines;
+    read_lines(path, lines);
+    if (lines.size() != count) {
+        myfailure("Expected %u lines, got %u", count, lines.size());
+    }
+    for (unsigned i=0; i<count; i++) {
+        char expected[64];
+        sprintf(expected, " SUBMIT %u.0 - - %u", i, i);
+        if (lines[i].find(expected) == string::npos) {
+            myfailure("Wrong line %u: %s", i, lines[i].c_str());
+        }
+    }
+
+    delete task;
+}
+
+void test_fatal_signal() {
+    string path = "test/scratch/fatal.log";
+    unlink(path.c_str());
+
+    // The queued events are written when the process is killed, even 
+    // though the writer thread has not woken up yet
+    pid_t pid = fork();
+    if (pid < 0) {
+        myfailures("Unable to fork");
+    }
+    if (pid == 0) {
+        Task *task = make_task("A", 1);
+        JobstateLog *log = new JobstateLog(path);
+        log->on_event(WORKFLOW_START, NULL);
+        log->on_event(TASK_QUEUED, task);
+        raise(SIGQUIT);
+        _exit(0);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0) {
+        myfailures("Unable to wait for child");
+    }
+    if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGQUIT) {
+        myfailure("Child should have been killed by SIGQUIT");
+    }
+
+    vector<string> lines;
+    read_lines(path, lines);
+    if (lines.size() != 2 || lines[1].find(" A SUBMIT 1.0") == string::npos) {
+        myfailure("Queued events were not written on SIGQUIT");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    log_set_level(LOG_ERROR);
+    if (mkdirs("test/scratch") < 0) {
+        myfailures("Unable to create test/scratch");
+    }
+    test_jobstate_log();
+    test_dagman_log();
+    test_many_events();
+    test_fatal_signal();
+    return 0;
+}
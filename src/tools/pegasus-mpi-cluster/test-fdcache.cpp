@@ -1,8 +1,10 @@
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "fdcache.h"
 #include "failure.h"
 #include "log.h"
+#include "tools.h"
 
 using std::exception;
 
@@ -268,6 +270,115 @@ void test_write() {
     cache.close();
 }
 
+static long file_size(const char *path) {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        return -1;
+    }
+    return st.st_size;
+}
+
+void test_buffered_write() {
+    const char *path1 = "test/scratch/test_buffered_write1";
+    const char *path2 = "test/scratch/test_buffered_write2";
+    unlink(path1);
+    unlink(path2);
+
+    FDCache cache(1, 16, 60.0);
+    char message[] = "0123456789\n";
+    
+    // The first record should be buffered
+    cache.write(path1, message, strlen(message));
+    if (file_size(path1) != 0) {
+        myfailure("first record should be buffered");
+    }
+    if (cache.dirty != 1) {
+        myfailure("cache should have one dirty entry");
+    }
+
+    // The second record does not fit, so the first should be written
+    cache.write(path1, message, strlen(message));
+    if (file_size(path1) != 11) {
+        myfailure("first record should have been written");
+    }
+
+    // Nothing has expired yet
+    cache.flush_expired(current_time());
+    if (file_size(path1) != 11) {
+        myfailure("buffer should not have expired");
+    }
+    cache.flush_expired(current_time() + 61.0);
+    if (file_size(path1) != 22) {
+        myfailure("buffer should have expired");
+    }
+    if (cache.dirty != 0) {
+        myfailure("cache should not have dirty entries");
+    }
+
+    // Records larger than the buffer are written directly
+    char large[] = "0123456789abcdefghijklmnopqrstuvwxyz\n";
+    cache.write(path1, large, strlen(large));
+    if (file_size(path1) != 59) {
+        myfailure("large record should be written directly");
+    }
+
+    // Buffer should be written when the entry is evicted
+    cache.write(path1, message, strlen(message));
+    cache.write(path2, message, strlen(message));
+    if (file_size(path1) != 70) {
+        myfailure("buffer should be written on eviction");
+    }
+
+    // Buffer should be written when the cache is closed
+    cache.close();
+    if (file_size(path2) != 11) {
+        myfailure("buffer should be written on close");
+    }
+
+    if (cache.records != 5 || cache.flushes != 5 || cache.flush_errors != 0) {
+        myfailure("wrong number of records/flushes/errors");
+    }
+}
+
+void test_pinned_write() {
+    const char *path = "test/scratch/test_pinned_write";
+    const char *other = "test/scratch/test_pinned_other";
+    unlink(other);
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        myfailures("Unable to open %s", path);
+    }
+
+    // Records for a pinned file go to the file it was pinned with, even
+    // if the name is not a path, and it is not evicted by other files
+    FDCache cache(1, 16, 60.0);
+    cache.pin("stdout", file);
+    char message[] = "0123456789\n";
+    cache.write("stdout", message, strlen(message));
+    cache.write(other, message, strlen(message));
+    if (access("stdout", F_OK) == 0) {
+        myfailure("pinned file was opened by name");
+    }
+    if (cache.size() != 1) {
+        myfailure("pinned file should not be in the LRU list");
+    }
+    if (file_size(path) != 0) {
+        myfailure("record for pinned file should be buffered");
+    }
+
+    // Unpinning writes the buffer, but leaves the file open
+    if (cache.unpin("stdout") < 0 || file_size(path) != 11) {
+        myfailure("buffer should be written when the file is unpinned");
+    }
+    if (fputs(message, file) < 0 || fclose(file) != 0) {
+        myfailure("pinned file should not be closed");
+    }
+    if (file_size(path) != 22) {
+        myfailure("wrong size after unpin");
+    }
+    cache.close();
+}
+
 int main(int argc, char **argv) {
 #ifdef __MACH__
     /* On recent versions of OSX we have to do this because some library
@@ -297,6 +408,10 @@ int main(int argc, char **argv) {
         test_open();
         log_trace("test_write");
         test_write();
+        log_trace("test_buffered_write");
+        test_buffered_write();
+        log_trace("test_pinned_write");
+        test_pinned_write();
         return 0;
     } catch (exception &error) {
         log_error("ERROR: %s", error.what());
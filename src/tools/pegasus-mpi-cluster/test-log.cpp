@@ -1,10 +1,181 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <string>
+#include <vector>
 
 #include "log.h"
 #include "failure.h"
+#include "strlib.h"
+#include "tools.h"
 
-int main(int argc, char *argv[]) {
+using std::string;
+using std::vector;
+
+static int evaluated = 0;
+
+static int count_evaluation() {
+    return ++evaluated;
+}
+
+void test_macro() {
+    log_set_level(LOG_DEBUG);
+
+    // The arguments are not evaluated when the level is disabled
+    LOG(LOG_TRACE, "NOT OK %d", count_evaluation());
+    if (evaluated != 0) {
+        myfailure("Arguments of a disabled message were evaluated");
+    }
+
+    LOG(LOG_DEBUG, "OK %d", count_evaluation());
+    if (evaluated != 1) {
+        myfailure("Arguments of an enabled message were not evaluated");
+    }
+}
+
+#define THREADS 4
+#define MESSAGES 20000
+
+// A string that is freed before the writer formats the message
+static void log_temporary(int thread, int i) {
+    char *name = strdup("temporary");
+    log_info("thread %d message %d: %s %5.2f%% %*d %.*s %lu %lld %c %x %Lg %p",
+            thread, i, name, 12.345, 6, i, 3, "abcdef", 123456789UL,
+            -1234567890123LL, 'z', 255, (long double)1.5, (void *)0x1234);
+    free(name);
+}
+
+static void *log_thread(void *arg) {
+    int thread = (int)(long)arg;
+    for (int i=0; i<MESSAGES; i++) {
+        log_temporary(thread, i);
+    }
+    return NULL;
+}
+
+void test_async() {
+    string path = "test/scratch/async.log";
+    FILE *log = fopen(path.c_str(), "w");
+    if (log == NULL) {
+        myfailures("Unable to open %s", path.c_str());
+    }
+    log_set_file(log);
+    log_set_level(LOG_INFO);
+
+    if (log_start_async() < 0) {
+        myfailure("Unable to start async logging");
+    }
+
+    // Enough messages from several threads to wrap the buffer many times
+    pthread_t threads[THREADS];
+    for (int t=0; t<THREADS; t++) {
+        pthread_create(&threads[t], NULL, log_thread, (void *)(long)t);
+    }
+    for (int t=0; t<THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    // Messages that cannot be formatted later are formatted right away
+    wchar_t wide[] = { 'w', 'i', 'd', 'e', 0 };
+    log_info("wide %ls", wide);
+
+    log_stop_async();
+    log_set_file(NULL);
+    fclose(log);
+
+    vector<char> buf(64*1024*1024);
+    int size = read_file(path, &buf[0], buf.size());
+    if (size < 0) {
+        myfailures("Unable to read %s", path.c_str());
+    }
+    vector<string> lines;
+    split(lines, string(&buf[0], size), "\n");
+    if (lines.size() != THREADS * MESSAGES + 1) {
+        myfailure("Expected %d lines, got %u", THREADS * MESSAGES + 1, lines.size());
+    }
+
+    // Messages from each thread are in order, and are formatted the
+    // same way as messages that are logged synchronously
+    int next[THREADS] = { 0 };
+    for (unsigned l=0; l<lines.size() - 1; l++) {
+        size_t start = lines[l].find("[info] ");
+        if (start == string::npos) {
+            myfailure("Line has no label: %s", lines[l].c_str());
+        }
+        string message = lines[l].substr(start + 7);
+        int thread, i;
+        if (sscanf(message.c_str(), "thread %d message %d", &thread, &i) != 2 ||
+                thread < 0 || thread >= THREADS || i != next[thread]) {
+            myfailure("Unexpected message: %s", message.c_str());
+        }
+        next[thread]++;
+
+        char expected[1024];
+        snprintf(expected, sizeof(expected),
+                "thread %d message %d: %s %5.2f%% %*d %.*s %lu %lld %c %x %Lg %p",
+                thread, i, "temporary", 12.345, 6, i, 3, "abcdef", 123456789UL,
+                -1234567890123LL, 'z', 255, (long double)1.5, (void *)0x1234);
+        if (message != expected) {
+            myfailure("Expected '%s', got '%s'", expected, message.c_str());
+        }
+    }
+    if (lines.back().find("[info] wide wide") == string::npos) {
+        myfailure("Wrong wide message: %s", lines.back().c_str());
+    }
+}
+
+// Strings with a precision do not have to be terminated, so the logger
+// must not read past the precision. The strings here end right before a
+// page that cannot be read.
+void test_precision() {
+    string path = "test/scratch/precision.log";
+    FILE *log = fopen(path.c_str(), "w");
+    if (log == NULL) {
+        myfailures("Unable to open %s", path.c_str());
+    }
+    log_set_file(log);
+    log_set_level(LOG_INFO);
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    char *map = (char *)mmap(NULL, 2 * page, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        myfailures("Unable to map guard page");
+    }
+    if (mprotect(map + page, page, PROT_NONE) < 0) {
+        myfailures("Unable to protect guard page");
+    }
+    char *abc = map + page - 3;
+    memcpy(abc, "abc", 3);
+
+    if (log_start_async() < 0) {
+        myfailure("Unable to start async logging");
+    }
+    log_info("fixed %.3s", abc);
+    log_info("star %.*s", 3, abc);
+    log_info("width %*.*s|", 5, 2, abc);
+    log_stop_async();
+    log_set_file(NULL);
+    fclose(log);
+    munmap(map, 2 * page);
+
+    char buf[1024];
+    int size = read_file(path, buf, sizeof(buf));
+    if (size < 0) {
+        myfailures("Unable to read %s", path.c_str());
+    }
+    string contents(buf, size);
+    if (contents.find("[info] fixed abc\n") == string::npos ||
+            contents.find("[info] star abc\n") == string::npos ||
+            contents.find("[info] width    ab|\n") == string::npos) {
+        myfailure("Wrong precision messages: %s", contents.c_str());
+    }
+}
+
+void test_levels() {
     FILE *log = fopen("/dev/null", "w");
     log_set_file(log);
     log_set_level(LOG_WARN);
@@ -41,6 +212,15 @@ int main(int argc, char *argv[]) {
 
     fclose(logf);
     */
-    
+}
+
+int main(int argc, char *argv[]) {
+    if (mkdirs("test/scratch") < 0) {
+        myfailures("Unable to create test/scratch");
+    }
+    test_levels();
+    test_macro();
+    test_async();
+    test_precision();
     return 0;
 }
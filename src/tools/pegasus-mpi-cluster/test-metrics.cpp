@@ -0,0 +1,128 @@
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+#include "failure.h"
+#include "log.h"
+#include "tools.h"
+
+using std::string;
+using std::vector;
+
+static string read_metrics(const string &path) {
+    vector<char> buf(64*1024);
+    int size = read_file(path, &buf[0], buf.size());
+    if (size < 0) {
+        myfailures("Unable to read %s", path.c_str());
+    }
+    return string(&buf[0], size);
+}
+
+static void expect(const string &metrics, const char *line) {
+    if (metrics.find(line) == string::npos) {
+        myfailure("Metrics do not contain %s:\n%s", line, metrics.c_str());
+    }
+}
+
+void test_format() {
+    MasterMetrics m;
+    m.workers = 4;
+    m.ready_tasks = 12;
+    m.succeeded_tasks = 100;
+    m.bytes_sent = 5000000000UL;
+    m.fdcache_hits = 3;
+    m.fdcache_misses = 1;
+    m.phase_seconds[PHASE_WAIT] = 1.5;
+
+    string metrics = format_metrics(m, 2.5);
+    expect(metrics, "# HELP pmc_workers Number of workers in the workflow\n");
+    expect(metrics, "# TYPE pmc_workers gauge\npmc_workers 4\n");
+    expect(metrics, "\npmc_ready_tasks 12\n");
+    expect(metrics, "# TYPE pmc_succeeded_tasks_total counter\npmc_succeeded_tasks_total 100\n");
+    expect(metrics, "\npmc_bytes_sent_total 5000000000\n");
+    expect(metrics, "\npmc_fdcache_hit_rate 0.75\n");
+    expect(metrics, "\npmc_task_throughput 2.5\n");
+    expect(metrics, "\npmc_running_tasks 0\n");
+    expect(metrics, "# TYPE pmc_master_phase_seconds_total counter\n"
+            "pmc_master_phase_seconds_total{phase=\"other\"} 0\n");
+    expect(metrics, "\npmc_master_phase_seconds_total{phase=\"wait\"} 1.5\n");
+}
+
+void test_file() {
+    string path = "test/scratch/metrics.prom";
+    unlink(path.c_str());
+
+    MetricsExporter exporter(path, "", 0.05);
+    exporter.start();
+
+    MasterMetrics m;
+    m.succeeded_tasks = 10;
+    exporter.update(m);
+
+    // The file is rewritten every interval while the exporter runs
+    usleep(300000);
+    expect(read_metrics(path), "\npmc_succeeded_tasks_total 10\n");
+    if (access((path + ".tmp").c_str(), F_OK) == 0) {
+        myfailure("The temporary metrics file was not renamed");
+    }
+
+    // The last snapshot is written when the exporter stops
+    m.succeeded_tasks = 20;
+    exporter.update(m);
+    exporter.stop();
+    expect(read_metrics(path), "\npmc_succeeded_tasks_total 20\n");
+}
+
+void test_socket() {
+    string path = "test/scratch/metrics.sock";
+
+    // The exporter only needs a long interval to serve the socket
+    MetricsExporter exporter("", path, 60.0);
+    exporter.start();
+
+    MasterMetrics m;
+    m.ready_tasks = 7;
+    exporter.update(m);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        myfailures("Unable to create socket");
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        myfailures("Unable to connect to metrics socket");
+    }
+    string metrics;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        metrics.append(buf, n);
+    }
+    close(fd);
+    expect(metrics, "\npmc_ready_tasks 7\n");
+
+    exporter.stop();
+    if (access(path.c_str(), F_OK) == 0) {
+        myfailure("The metrics socket was not removed");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    log_set_level(LOG_ERROR);
+    if (mkdirs("test/scratch") < 0) {
+        myfailures("Unable to create test/scratch");
+    }
+    test_format();
+    test_file();
+    test_socket();
+    return 0;
+}
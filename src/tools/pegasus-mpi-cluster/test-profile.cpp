@@ -0,0 +1,103 @@
+#include <math.h>
+#include <unistd.h>
+
+#include "profile.h"
+#include "failure.h"
+#include "log.h"
+
+void test_profile() {
+    Profile profile;
+
+    // Time before the profile starts is not counted
+    profile.enter(PHASE_WAIT);
+    usleep(20000);
+    profile.enter(PHASE_OTHER);
+
+    profile.start();
+    {
+        PhaseTimer timer(profile, PHASE_RESULT);
+        usleep(20000);
+        {
+            // Time in a nested phase is only charged to that phase
+            PhaseTimer inner(profile, PHASE_LISTENERS);
+            usleep(40000);
+        }
+        usleep(20000);
+    }
+    usleep(10000);
+    profile.stop();
+
+    // Time after the profile stops is not counted
+    profile.enter(PHASE_WAIT);
+    usleep(20000);
+
+    if (profile.seconds(PHASE_WAIT) != 0.0) {
+        myfailure("Time outside the profile was counted: %lf",
+                profile.seconds(PHASE_WAIT));
+    }
+    double result = profile.seconds(PHASE_RESULT);
+    if (result < 0.040 || result >= 0.080) {
+        myfailure("Expected 0.04 seconds in result, got %lf", result);
+    }
+    double listeners = profile.seconds(PHASE_LISTENERS);
+    if (listeners < 0.040 || listeners >= 0.200) {
+        myfailure("Expected 0.04 seconds in listeners, got %lf", listeners);
+    }
+    double other = profile.seconds(PHASE_OTHER);
+    if (other < 0.010 || other >= 0.040) {
+        myfailure("Expected 0.01 seconds in other, got %lf", other);
+    }
+    double total = profile.total();
+    if (fabs(total - (result + listeners + other)) > 1e-9) {
+        myfailure("Total should be the sum of the phases");
+    }
+}
+
+void test_histogram() {
+    Histogram h;
+    if (h.count() != 0 || h.mean() != 0.0 || h.percentile(50) != 0.0) {
+        myfailure("Empty histogram should be zero");
+    }
+
+    // 90 values of 3us and 10 values of 1ms
+    for (int i=0; i<90; i++) {
+        h.record(0.000003);
+    }
+    for (int i=0; i<10; i++) {
+        h.record(0.001);
+    }
+    if (h.count() != 100) {
+        myfailure("Expected 100 values, got %lu", h.count());
+    }
+    if (h.maximum() != 0.001) {
+        myfailure("Wrong maximum: %lf", h.maximum());
+    }
+    double mean = (90 * 0.000003 + 10 * 0.001) / 100;
+    if (h.mean() < mean * 0.999 || h.mean() > mean * 1.001) {
+        myfailure("Wrong mean: %lf", h.mean());
+    }
+
+    // Percentiles are the upper bound of the bucket
+    if (h.percentile(50) != 0.000004) {
+        myfailure("Wrong p50: %lf", h.percentile(50));
+    }
+    if (h.percentile(90) != 0.000004) {
+        myfailure("Wrong p90: %lf", h.percentile(90));
+    }
+    if (h.percentile(99) != 0.001) {
+        myfailure("p99 should be capped at the maximum: %lf", h.percentile(99));
+    }
+
+    // Values that are too large go in the last bucket
+    h.record(100000.0);
+    if (h.percentile(100) != 100000.0) {
+        myfailure("Wrong p100: %lf", h.percentile(100));
+    }
+}
+
+int main(int argc, char *argv[]) {
+    log_set_level(LOG_ERROR);
+    test_profile();
+    test_histogram();
+    return 0;
+}
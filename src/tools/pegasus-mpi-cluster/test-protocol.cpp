@@ -1,6 +1,7 @@
 #include <string>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "protocol.h"
 #include "failure.h"
@@ -29,7 +30,10 @@ void test_command() {
     pipe_forwards["FOO"] = "BAR";
     map<string,string> file_forwards;
     file_forwards["BAZ"] = "BOO";
-    CommandMessage input(name, args, id, memory, cpus, bindings, &pipe_forwards, &file_forwards);
+    vector<string> hosts;
+    hosts.push_back("node1");
+    hosts.push_back("node2");
+    CommandMessage input(name, args, id, memory, cpus, bindings, &pipe_forwards, &file_forwards, &hosts);
     CommandMessage output(msgcopy(input.msg, input.msgsize), input.msgsize, 0);
     if (input.name != output.name) {
         myfailure("names don't match");
@@ -61,13 +65,68 @@ void test_command() {
     if (output.file_forwards["BAZ"] != input.file_forwards["BAZ"]) {
         myfailure("file forwards don't match");
     }
+    if (output.hosts != input.hosts) {
+        myfailure("hosts don't match");
+    }
+}
+
+void test_bindings(const vector<cpu_t> &bindings) {
+    list<string> args;
+    args.push_back("command");
+    CommandMessage input("name", args, "id", 0, bindings.size(), bindings, NULL, NULL);
+    CommandMessage output(msgcopy(input.msg, input.msgsize), input.msgsize, 0);
+    if (output.bindings != input.bindings) {
+        myfailure("bindings don't match");
+    }
+}
+
+void test_many_bindings() {
+    // Bindings above 255 need more than one byte
+    vector<cpu_t> bindings;
+    for (cpu_t i=256; i<448; i++) {
+        bindings.push_back(i);
+    }
+    test_bindings(bindings);
+
+    // Sparse bindings spread over a wide range
+    bindings.clear();
+    bindings.push_back(3);
+    bindings.push_back(255);
+    bindings.push_back(256);
+    bindings.push_back(1000);
+    bindings.push_back(CPU_T_MAX);
+    test_bindings(bindings);
+
+    // No bindings at all
+    bindings.clear();
+    test_bindings(bindings);
+
+    // Contiguous bindings should use roughly one bit per cpu
+    for (cpu_t i=0; i<1024; i++) {
+        bindings.push_back(i);
+    }
+    list<string> args;
+    args.push_back("command");
+    CommandMessage small("name", args, "id", 0, 1, vector<cpu_t>(), NULL, NULL);
+    CommandMessage large("name", args, "id", 0, 1024, bindings, NULL, NULL);
+    if (large.msgsize - small.msgsize > 1024/8 + 8) {
+        myfailure("bindings are not encoded compactly: %u bytes", large.msgsize - small.msgsize);
+    }
 }
 
 void test_result() {
     string name = "name";
     int exitcode = 127;
     double runtime = 123.456;
-    ResultMessage input(name, exitcode, runtime);
+    struct taskusage usage;
+    memset(&usage, 0, sizeof(usage));
+    usage.utime = 12.5;
+    usage.stime = 0.25;
+    usage.maxrss = 4096;
+    usage.majflt = 7;
+    usage.read_bytes = 1ULL << 40;
+    usage.write_bytes = 12345;
+    ResultMessage input(name, exitcode, runtime, usage);
     ResultMessage output(msgcopy(input.msg, input.msgsize), input.msgsize, 0, 0);
     if (output.name != input.name) {
         myfailure("name does not match");
@@ -78,6 +137,9 @@ void test_result() {
     if (output.runtime != input.runtime) {
         myfailure("runtime does not match");
     }
+    if (memcmp(&output.usage, &input.usage, sizeof(usage)) != 0) {
+        myfailure("usage does not match");
+    }
 }
 
 void test_shutdown() {
@@ -85,13 +147,32 @@ void test_shutdown() {
     ShutdownMessage output(msgcopy(input.msg, input.msgsize), input.msgsize, 0);
 }
 
+void test_depart() {
+    DepartMessage input;
+    DepartMessage output(msgcopy(input.msg, input.msgsize), input.msgsize, 0);
+}
+
+void test_kill() {
+    KillMessage input("name");
+    KillMessage output(msgcopy(input.msg, input.msgsize), input.msgsize, 0);
+    if (input.name != output.name) {
+        myfailure("name does not match");
+    }
+}
+
 void test_registration() {
     string hostname = "hostname";
     unsigned memory = 7;
     unsigned threads = 5;
     unsigned cores = 3;
     unsigned sockets = 2;
-    RegistrationMessage input(hostname, memory, threads, cores, sockets);
+    vector<cpu_t> cpu_nodes;
+    vector<cpu_t> cpu_cores;
+    for (cpu_t i=0; i<threads; i++) {
+        cpu_nodes.push_back(i % sockets);
+        cpu_cores.push_back(i % cores);
+    }
+    RegistrationMessage input(hostname, memory, threads, cores, sockets, cpu_nodes, cpu_cores);
     RegistrationMessage output(msgcopy(input.msg, input.msgsize), input.msgsize, 0);
     if (input.hostname != output.hostname) {
         myfailure("hostname does not match");
@@ -108,15 +189,31 @@ void test_registration() {
     if (input.sockets != output.sockets) {
         myfailure("sockets do not match");
     }
+    if (input.cpu_nodes != output.cpu_nodes) {
+        myfailure("cpu nodes do not match");
+    }
+    if (input.cpu_cores != output.cpu_cores) {
+        myfailure("cpu cores do not match");
+    }
+    if (output.version != PROTOCOL_VERSION) {
+        myfailure("version does not match");
+    }
 }
 
 void test_hostrank() {
     int hostrank = 17;
-    HostrankMessage input(hostrank);
+    vector<int> ranks;
+    ranks.push_back(3);
+    ranks.push_back(17);
+    ranks.push_back(42);
+    HostrankMessage input(hostrank, ranks);
     HostrankMessage output(msgcopy(input.msg, input.msgsize), input.msgsize, 0);
     if (input.hostrank != output.hostrank) {
         myfailure("hostrank does not match");
     }
+    if (input.ranks != output.ranks) {
+        myfailure("ranks do not match");
+    }
 }
 
 void test_iodata() {
@@ -124,7 +221,7 @@ void test_iodata() {
     string filename = "filename";
     string data = "this is data";
     unsigned size = data.size();
-    IODataMessage input(task, filename, data.c_str(), size);
+    IODataMessage input(task, filename, data.c_str(), size, 256);
     IODataMessage output(msgcopy(input.msg, input.msgsize), input.msgsize, 0);
 
     if (input.task != output.task) {
@@ -136,20 +233,35 @@ void test_iodata() {
     if (input.size != output.size) {
         myfailure("size does not match");
     }
+    if (input.exitcode != output.exitcode) {
+        myfailure("exitcode does not match");
+    }
     if (strncmp(input.data, output.data, size)) {
         myfailure("data does not match");
     }
 }
 
+void test_iocredit() {
+    IOCreditMessage input(123456);
+    IOCreditMessage output(msgcopy(input.msg, input.msgsize), input.msgsize, 0);
+    if (input.bytes != output.bytes) {
+        myfailure("bytes does not match");
+    }
+}
+
 int main(int argc, char *argv[]) {
     try {
         log_set_level(LOG_ERROR);
         test_command();
+        test_many_bindings();
         test_result();
         test_shutdown();
+        test_depart();
+        test_kill();
         test_registration();
         test_hostrank();
         test_iodata();
+        test_iocredit();
         return 0;
     } catch (exception &error) {
         log_error("ERROR: %s", error.what());
@@ -1,3 +1,7 @@
+#include <signal.h>
+#include <math.h>
+#include <unistd.h>
+
 #include "failure.h"
 #include "master.h"
 #include "dag.h"
@@ -133,11 +137,521 @@ void test_scheduler_2222_4() {
     }
 }
 
+void test_scheduler_many_cpus() {
+    // Two sockets with 96 cores each and 2 threads per core
+    unsigned memory = 8192;
+    cpu_t threads = 384;
+    cpu_t cores = 192;
+    cpu_t sockets = 2;
+    Host h("localhost", memory, threads, cores, sockets);
+
+    DAG dag("test/manycpus.dag");
+    Task *socket1 = dag.get_task("socket1");
+    Task *socket2 = dag.get_task("socket2");
+
+    vector<cpu_t> r1 = h.allocate_resources(socket1);
+    vector<cpu_t> r2 = h.allocate_resources(socket2);
+
+    if (r1.size() != 192 || r1.front() != 0 || r1.back() != 191) {
+        myfailure("task socket1 was bound to the wrong cores");
+    }
+    if (r2.size() != 192 || r2.front() != 192 || r2.back() != 383) {
+        myfailure("task socket2 was bound to the wrong cores");
+    }
+
+    h.release_resources(socket1);
+    h.release_resources(socket2);
+}
+
+void test_scheduler_numa() {
+    // Two NUMA nodes with 4 cores each and 2 threads per core, where the
+    // cpus are numbered like Linux does it: node 0 has cpus 0-3 and their
+    // siblings 8-11, node 1 has cpus 4-7 and their siblings 12-15
+    unsigned memory = 8192;
+    cpu_t threads = 16;
+    cpu_t cores = 8;
+    cpu_t sockets = 2;
+    Host h("localhost", memory, threads, cores, sockets);
+
+    vector<cpu_t> cpu_nodes;
+    vector<cpu_t> cpu_cores;
+    for (cpu_t i=0; i<threads; i++) {
+        cpu_nodes.push_back((i % 8) / 4);
+        cpu_cores.push_back(i % 8);
+    }
+    h.set_topology(cpu_nodes, cpu_cores);
+
+    DAG dag("test/PM953.dag");
+    Task *two = dag.get_task("two");
+    Task *four = dag.get_task("four");
+    Task *four2 = dag.get_task("four2");
+    Task *eight = dag.get_task("eight");
+
+    // Task two gets a whole core on node 0
+    vector<cpu_t> rtwo = h.allocate_resources(two);
+    if (rtwo.size() != 2 || rtwo[0] != 0 || rtwo[1] != 8) {
+        myfailure("task two was bound to the wrong cores");
+    }
+
+    // Task four fits in the rest of node 0
+    vector<cpu_t> rfour = h.allocate_resources(four);
+    if (rfour.size() != 4 || rfour[0] != 1 || rfour[1] != 2 || 
+            rfour[2] != 9 || rfour[3] != 10) {
+        myfailure("task four was bound to the wrong cores");
+    }
+
+    // Task four2 does not fit on node 0, so it goes to node 1
+    vector<cpu_t> rfour2 = h.allocate_resources(four2);
+    if (rfour2.size() != 4 || rfour2[0] != 4 || rfour2[1] != 5 || 
+            rfour2[2] != 12 || rfour2[3] != 13) {
+        myfailure("task four2 was bound to the wrong cores");
+    }
+
+    h.release_resources(two);
+    h.release_resources(four2);
+
+    // Task eight only fits on node 1
+    vector<cpu_t> reight = h.allocate_resources(eight);
+    if (reight.size() != 8) {
+        myfailure("task eight was bound to the wrong number of cores");
+    }
+    for (unsigned i=0; i<reight.size(); i++) {
+        if (cpu_nodes[reight[i]] != 1) {
+            myfailure("task eight was bound to the wrong node");
+        }
+    }
+}
+
+void test_scheduler_best_fit() {
+    unsigned memory = 8192;
+    cpu_t threads = 8;
+    cpu_t cores = 4;
+    cpu_t sockets = 2;
+    Host h("localhost", memory, threads, cores, sockets);
+
+    DAG dag("test/PM953.dag");
+    Task *one = dag.get_task("one");
+    Task *two = dag.get_task("two");
+    Task *two2 = dag.get_task("two2");
+    Task *four = dag.get_task("four");
+    Task *four2 = dag.get_task("four2");
+
+    vector<cpu_t> rfour = h.allocate_resources(four);
+    vector<cpu_t> rtwo = h.allocate_resources(two);
+    if (rtwo.size() != 2 || rtwo[0] != 4 || rtwo[1] != 5) {
+        myfailure("task two was bound to the wrong cores");
+    }
+    h.release_resources(four);
+
+    // Socket 0 is free, so task two2 should fill the hole in socket 1
+    vector<cpu_t> rtwo2 = h.allocate_resources(two2);
+    if (rtwo2.size() != 2 || rtwo2[0] != 6 || rtwo2[1] != 7) {
+        myfailure("task two2 was not packed into socket 1");
+    }
+    if (h.largest_free_block() != 4 || h.fragmented_cpus() != 0) {
+        myfailure("wrong fragmentation statistics");
+    }
+
+    // ...which leaves socket 0 for task four2
+    vector<cpu_t> rfour2 = h.allocate_resources(four2);
+    if (rfour2.size() != 4 || rfour2[0] != 0 || rfour2[3] != 3) {
+        myfailure("task four2 was bound to the wrong cores");
+    }
+
+    h.release_resources(two);
+    h.release_resources(two2);
+    h.release_resources(four2);
+
+    // Single threaded tasks should prefer a host with a small hole to 
+    // one with a whole free socket
+    Host h2("otherhost", memory, threads, cores, sockets);
+    h2.allocate_resources(four);
+    h2.allocate_resources(two);
+    if (h2.fit_cost(one) >= h.fit_cost(one)) {
+        myfailure("task one was not steered to the fragmented host");
+    }
+
+    // Multicore tasks should prefer a host where they can be bound
+    if (h.fit_cost(four2) >= h2.fit_cost(four2)) {
+        myfailure("task four2 was not steered to the free host");
+    }
+}
+
+void test_scheduler_gang() {
+    Host h("localhost", 8192, 8, 4, 2);
+    h.add_slot();
+
+    DAG dag("test/nodes.dag");
+    Task *a = dag.get_task("A");
+    Task *b = dag.get_task("B");
+    Task *c = dag.get_task("C");
+
+    // Multi-node tasks need the whole host
+    h.allocate_resources(b);
+    if (h.can_run(a) || h.is_free()) {
+        myfailure("multi-node task can run on a busy host");
+    }
+    h.release_resources(b);
+    if (!h.is_free() || !h.can_run(a)) {
+        myfailure("multi-node task cannot run on a free host");
+    }
+
+    // ...and nothing else can run while they have it
+    vector<cpu_t> ra = h.allocate_resources(a);
+    if (ra.size() != 0) {
+        myfailure("multi-node task was bound to cpus");
+    }
+    if (h.can_run(b) || h.can_run(c)) {
+        myfailure("task can run on a host reserved by a multi-node task");
+    }
+    h.release_resources(a);
+
+    // Other hosts of the task are reserved without using a slot
+    h.reserve_host(c);
+    if (h.can_run(b)) {
+        myfailure("task can run on a reserved host");
+    }
+    h.release_host(c);
+    if (!h.is_free() || !h.can_run(b)) {
+        myfailure("host was not released");
+    }
+}
+
+void test_scheduler_overlap() {
+    Host h("localhost", 1000, 8, 4, 2);
+    for (int i=0; i<5; i++) {
+        h.add_slot();
+    }
+    Task *t = new Task("T", list<string>(), 300, 2, 1, 2, 0,
+            map<string,string>(), map<string,string>());
+
+    // The copy of T that lost to the other copy is still running here 
+    // when T fails and is retried with more memory on the same host
+    vector<cpu_t> loser = h.allocate_resources(t);
+    t->reserved_memory = 600;
+    vector<cpu_t> retry = h.allocate_resources(t);
+    if (loser.size() != 2 || retry.size() != 2 || loser[0] == retry[0]) {
+        myfailure("copies of task T were not bound to different cpus");
+    }
+
+    // Releasing what the losing copy was allocated leaves the retry 
+    // with its cpus and memory
+    h.release_resources(t, 2, 300, loser);
+    Task *big = new Task("big", list<string>(), 500, 6, 1, 1, 0,
+            map<string,string>(), map<string,string>());
+    if (h.can_run(big)) {
+        myfailure("the release of the losing copy freed the memory of the retry");
+    }
+    big->reserved_memory = 400;
+    if (!h.can_run(big)) {
+        myfailure("the memory of the losing copy was not released");
+    }
+    big->cpus = 7;
+    if (h.can_run(big)) {
+        myfailure("the release of the losing copy freed the cpus of the retry");
+    }
+
+    // The cpus of the losing copy can be bound again, but not the cpus 
+    // of the retry
+    Task *two = new Task("two", list<string>(), 100, 2, 1, 1, 0,
+            map<string,string>(), map<string,string>());
+    vector<cpu_t> rtwo[3];
+    for (int n=0; n<3; n++) {
+        rtwo[n] = h.allocate_resources(two);
+        if (rtwo[n].size() != 2) {
+            myfailure("the cpus of the losing copy were not released");
+        }
+        for (unsigned i=0; i<rtwo[n].size(); i++) {
+            if (rtwo[n][i] == retry[0] || rtwo[n][i] == retry[1]) {
+                myfailure("the cpus of the retry were given to another task");
+            }
+        }
+    }
+
+    for (int n=0; n<3; n++) {
+        h.release_resources(two, 2, 100, rtwo[n]);
+    }
+    h.release_resources(t, 2, 600, retry);
+    if (!h.is_free()) {
+        myfailure("host was not released");
+    }
+    delete two;
+    delete big;
+    delete t;
+}
+
+void test_adaptive_memory() {
+    Host h("localhost", 1000, 2, 2, 1);
+    MemoryModel model(50);
+
+    DAG dag("test/adaptive.dag");
+    const char *names[] = { "A", "B", "C", "D", "E", "F" };
+    Task *tasks[6];
+    for (unsigned i=0; i<6; i++) {
+        tasks[i] = dag.get_task(names[i]);
+    }
+
+    // Tasks get the memory they requested until we have seen enough runs
+    for (unsigned i=0; i<ADAPTIVE_MEMORY_SAMPLES; i++) {
+        if (model.predict(tasks[i]) != 600) {
+            myfailure("task %s did not reserve the memory requested", names[i]);
+        }
+        tasks[i]->usage.maxrss = 10240 * (i + 1);
+        model.record(tasks[i], 0);
+    }
+
+    // The peak was 30 MB, plus 50%
+    Task *d = tasks[3];
+    Task *e = tasks[4];
+    d->reserved_memory = model.predict(d);
+    e->reserved_memory = model.predict(e);
+    if (d->reserved_memory != 45 || e->reserved_memory != 45) {
+        myfailure("wrong prediction: %u", d->reserved_memory);
+    }
+    h.allocate_resources(d);
+    if (!h.can_run(e)) {
+        myfailure("host cannot run two tasks with adaptive memory");
+    }
+    h.allocate_resources(e);
+
+    // D used more than reserved, so it reserves what it requested next time
+    d->usage.maxrss = 100 * 1024;
+    model.record(d, 0);
+    h.release_resources(d);
+    if (!d->memory_exceeded || model.predict(d) != 600) {
+        myfailure("task D should fall back to the memory requested");
+    }
+
+    // E was killed, probably by the OOM killer
+    e->usage.maxrss = 1024;
+    model.record(e, SIGKILL);
+    h.release_resources(e);
+    if (!e->memory_exceeded || model.predict(e) != 600) {
+        myfailure("task E should fall back to the memory requested");
+    }
+
+    // The other tasks see the new peak
+    if (model.predict(tasks[5]) != 150) {
+        myfailure("prediction for task F did not include the new peak");
+    }
+}
+
+void test_runtime_model() {
+    RuntimeModel model(75);
+
+    DAG dag("test/adaptive.dag");
+    Task *a = dag.get_task("A");
+    Task *b = dag.get_task("B");
+
+    // There is no threshold until we have seen enough runs
+    double threshold = 0;
+    model.record(a, 4.0);
+    model.record(a, 1.0);
+    if (model.threshold(a, &threshold)) {
+        myfailure("threshold should not be known after two runs");
+    }
+
+    // The 75th percentile of 1, 2, 3, 4 is 3. Tasks with the same 
+    // executable share the runtimes.
+    model.record(a, 3.0);
+    model.record(b, 2.0);
+    if (!model.threshold(b, &threshold) || threshold != 3.0) {
+        myfailure("wrong threshold: %f", threshold);
+    }
+}
+
+void test_host_health() {
+    Host h("localhost", 1024, 1, 1, 1);
+
+    // Recent failures count fully, and are halved every half life
+    h.record_result(true, 100.0);
+    if (h.record_result(true, 100.0) != 2.0) {
+        myfailure("wrong failure score after two failures");
+    }
+    double score = h.record_result(false, 100.0 + HOST_HEALTH_HALF_LIFE);
+    if (fabs(score - 1.0) > 1e-9) {
+        myfailure("failure score did not decay: %f", score);
+    }
+    if (fabs(h.failure_rate() - 2.0/3.0) > 1e-9) {
+        myfailure("wrong failure rate: %f", h.failure_rate());
+    }
+
+    // The blacklist time doubles every time, up to the maximum
+    if (h.blacklist(0.0) != HOST_BLACKLIST_TIME || !h.is_blacklisted()) {
+        myfailure("host should be blacklisted");
+    }
+    h.restore();
+    if (h.is_blacklisted() || h.record_result(false, 200.0) != 0.0) {
+        myfailure("restored host should have a clean record");
+    }
+    if (h.blacklist(0.0) != 2 * HOST_BLACKLIST_TIME) {
+        myfailure("blacklist time should double");
+    }
+    for (int i=0; i<10; i++) {
+        h.blacklist(0.0);
+    }
+    if (h.blacklist(0.0) != HOST_BLACKLIST_MAX || h.times_blacklisted() != 13) {
+        myfailure("blacklist time should be limited");
+    }
+}
+
+Task *queue_task(const string &name, const string &group, int priority, unsigned cpus) {
+    static unsigned seq = 0;
+    Task *t = new Task(name, list<string>(), 0, cpus, 1, 1, priority, 
+            map<string,string>(), map<string,string>());
+    t->group = group;
+    t->submit_seq = ++seq;
+    return t;
+}
+
+string pop_tasks(TaskQueue &queue) {
+    string order;
+    while (queue.size() > 0) {
+        Task *t = queue.pop();
+        order += t->name + " ";
+        delete t;
+    }
+    return order;
+}
+
+void test_task_queue_priority() {
+    TaskQueue queue;
+    queue.push(queue_task("A", "", 1, 1));
+    queue.push(queue_task("B", "", 5, 1));
+    queue.push(queue_task("C", "", 1, 1));
+
+    // Tasks with the same priority run in the order they were queued
+    string order = pop_tasks(queue);
+    if (order != "B A C ") {
+        myfailure("wrong priority order: %s", order.c_str());
+    }
+}
+
+void test_task_queue_fair_share() {
+    // Group a gets twice as many turns as group b, even though all its
+    // tasks have a higher priority
+    TaskQueue queue;
+    queue.set_weight("a", 2);
+    queue.push(queue_task("a1", "a", 10, 1));
+    queue.push(queue_task("a2", "a", 10, 1));
+    queue.push(queue_task("a3", "a", 10, 1));
+    queue.push(queue_task("a4", "a", 10, 1));
+    queue.push(queue_task("b1", "b", 0, 1));
+    queue.push(queue_task("b2", "b", 0, 1));
+    queue.push(queue_task("b3", "b", 0, 1));
+    queue.push(queue_task("b4", "b", 0, 1));
+    string order = pop_tasks(queue);
+    if (order != "a1 a2 b1 a3 a4 b2 b3 b4 ") {
+        myfailure("wrong weighted order: %s", order.c_str());
+    }
+
+    // Groups share CPUs, not turns, so a task that needs 4 CPUs waits
+    // for the other group to use 4 CPUs
+    queue.push(queue_task("C", "c", 0, 4));
+    for (int i=1; i<=5; i++) {
+        queue.push(queue_task("d" + string(1, '0' + i), "d", 0, 1));
+    }
+    order = pop_tasks(queue);
+    if (order != "d1 d2 d3 C d4 d5 ") {
+        myfailure("wrong CPU share order: %s", order.c_str());
+    }
+
+    // A task that could not be scheduled is put back without using up
+    // its group's turn
+    queue.push(queue_task("e1", "e", 0, 1));
+    queue.push(queue_task("f1", "f", 0, 1));
+    queue.push(queue_task("e2", "e", 0, 1));
+    Task *e1 = queue.pop();
+    queue.requeue(e1);
+    order = pop_tasks(queue);
+    if (order != "e1 f1 e2 ") {
+        myfailure("wrong order after requeue: %s", order.c_str());
+    }
+}
+
+void test_task_queue_requeue() {
+    // Group a is the only one waiting, so it dispatches a task that it
+    // can't afford. The task can't be scheduled, and while it is put back
+    // group b starts waiting. Group a only gets back the 1 CPU it paid,
+    // not the 4 the task needs, so it has to wait for b to use the CPUs
+    // that a earns while it saves up for the task.
+    TaskQueue queue;
+    queue.push(queue_task("A", "a", 0, 4));
+    Task *a = queue.pop();
+    queue.push(queue_task("b1", "b", 0, 1));
+    queue.push(queue_task("b2", "b", 0, 1));
+    queue.requeue(a);
+    string order = pop_tasks(queue);
+    if (order != "b1 b2 A ") {
+        myfailure("wrong order after requeue of oversized task: %s", order.c_str());
+    }
+}
+
+void test_task_queue_depart() {
+    // When the worker running a1 leaves, the task is put back and group a
+    // gets back the 2 CPUs it paid for it, so a1 runs again before b gets
+    // a turn
+    TaskQueue queue;
+    queue.set_weight("a", 2);
+    queue.push(queue_task("a1", "a", 0, 2));
+    queue.push(queue_task("b1", "b", 0, 1));
+    queue.push(queue_task("b2", "b", 0, 1));
+    Task *a1 = queue.pop();
+    if (a1->name != "a1") {
+        myfailure("wrong first task: %s", a1->name.c_str());
+    }
+    queue.requeue(a1);
+    if (queue.size() != 3) {
+        myfailure("wrong queue size after depart: %u", queue.size());
+    }
+    string order = pop_tasks(queue);
+    if (order != "a1 b1 b2 ") {
+        myfailure("wrong order after depart: %s", order.c_str());
+    }
+}
+
+void test_task_queue_aging() {
+    // Without aging, the higher priority task goes first
+    TaskQueue strict;
+    strict.push(queue_task("L", "", 0, 1));
+    usleep(50000);
+    strict.push(queue_task("H", "", 1, 1));
+    string order = pop_tasks(strict);
+    if (order != "H L ") {
+        myfailure("wrong order without aging: %s", order.c_str());
+    }
+
+    // With aging, the lower priority task gains more than one priority 
+    // level while the other one is not queued yet
+    TaskQueue aging;
+    aging.set_aging(0.01);
+    aging.push(queue_task("L", "", 0, 1));
+    usleep(50000);
+    aging.push(queue_task("H", "", 1, 1));
+    order = pop_tasks(aging);
+    if (order != "L H ") {
+        myfailure("wrong order with aging: %s", order.c_str());
+    }
+}
+
 int main(int argc, char **argv) {
     log_set_level(LOG_WARN);
     test_scheduler_124_8();
     test_scheduler_44_2();
     test_scheduler_2222_4();
+    test_scheduler_many_cpus();
+    test_scheduler_numa();
+    test_scheduler_best_fit();
+    test_scheduler_gang();
+    test_scheduler_overlap();
+    test_adaptive_memory();
+    test_runtime_model();
+    test_host_health();
+    test_task_queue_priority();
+    test_task_queue_fair_share();
+    test_task_queue_requeue();
+    test_task_queue_depart();
+    test_task_queue_aging();
     return 0;
 }
 
@@ -2,10 +2,14 @@
 #include <unistd.h>
 #include <sys/param.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
 
 #include "tools.h"
 
 using std::string;
+using std::vector;
 
 void test_is_executable() {
     assert(is_executable("./test-tools"));
@@ -41,6 +45,101 @@ void test_mkdirs() {
     chdir("../..");
 }
 
+void test_copy_file_data() {
+    assert(mkdirs("test/scratch") >= 0);
+
+    const char *data = "0123456789";
+    int src = open("test/scratch/copy_src", O_RDWR|O_CREAT|O_TRUNC, 0644);
+    assert(src >= 0);
+    assert(write(src, data, 10) == 10);
+
+    // Append at the current offset
+    int dest = open("test/scratch/copy_dest", O_RDWR|O_CREAT|O_TRUNC, 0644);
+    assert(dest >= 0);
+    assert(write(dest, "ab", 2) == 2);
+    assert(lseek(src, 0, SEEK_SET) == 0);
+    assert(copy_file_data(dest, NULL, src, 10) == 10);
+    assert(lseek(dest, 0, SEEK_CUR) == 12);
+
+    // Write at an offset without moving the current offset
+    off_t offset = 20;
+    assert(lseek(src, 5, SEEK_SET) == 5);
+    assert(copy_file_data(dest, &offset, src, 5) == 5);
+    assert(offset == 25);
+    assert(lseek(dest, 0, SEEK_CUR) == 12);
+
+    // Short copy at EOF
+    assert(lseek(src, 8, SEEK_SET) == 8);
+    assert(copy_file_data(dest, NULL, src, 10) == 2);
+
+    char buf[32];
+    memset(buf, 0, sizeof(buf));
+    assert(pread(dest, buf, sizeof(buf), 0) == 25);
+    assert(memcmp(buf, "ab012345678989", 14) == 0);
+    assert(memcmp(buf + 20, "56789", 5) == 0);
+
+    close(src);
+    close(dest);
+}
+
+void test_host_topology() {
+    struct cpuinfo c = get_host_cpuinfo();
+    struct cputopo topo;
+    if (get_host_topology(c.threads, topo) < 0) {
+        // Not all systems have a usable sysfs
+        assert(topo.nodes.size() == 0 && topo.cores.size() == 0);
+        return;
+    }
+    assert(topo.nodes.size() == c.threads);
+    assert(topo.cores.size() == c.threads);
+    for (unsigned i=0; i<c.threads; i++) {
+        assert(topo.nodes[i] < c.threads);
+        assert(topo.cores[i] < c.threads);
+    }
+}
+
+void test_cpuset() {
+    struct cpuinfo c = get_host_cpuinfo();
+
+    vector<cpu_t> bindings;
+    bindings.push_back(c.threads);
+    CPUSet invalid(c.threads, bindings);
+    assert(invalid.apply() < 0 && errno == ERANGE);
+
+    bindings.clear();
+    bindings.push_back(0);
+    CPUSet valid(c.threads, bindings);
+    assert(valid.apply() == 0);
+    assert(clear_cpu_affinity() == 0);
+}
+
+void test_read_io_counters() {
+    assert(mkdirs("test/scratch") >= 0);
+
+    const char *data = 
+        "rchar: 1024\n"
+        "wchar: 2048\n"
+        "syscr: 3\n"
+        "syscw: 4\n"
+        "read_bytes: 4096\n"
+        "write_bytes: 8192\n"
+        "cancelled_write_bytes: 0\n";
+    int fd = open("test/scratch/io", O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    assert(fd >= 0);
+    assert(write(fd, data, strlen(data)) == (ssize_t)strlen(data));
+    close(fd);
+
+    struct taskusage usage;
+    memset(&usage, 0, sizeof(usage));
+    assert(read_io_counters("test/scratch/io", usage) == 0);
+    assert(usage.rchar == 1024);
+    assert(usage.wchar == 2048);
+    assert(usage.read_bytes == 4096);
+    assert(usage.write_bytes == 8192);
+
+    assert(read_io_counters("test/scratch/notfound", usage) < 0);
+}
+
 int main(int argc, char *argv[]) {
     get_host_memory();
     get_host_cpuinfo();
@@ -49,4 +148,8 @@ int main(int argc, char *argv[]) {
     test_mkdirs();
     test_is_executable();
     test_pathfind();
+    test_copy_file_data();
+    test_host_topology();
+    test_cpuset();
+    test_read_io_counters();
 }
@@ -0,0 +1,143 @@
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "failure.h"
+#include "log.h"
+#include "tools.h"
+
+using std::string;
+using std::vector;
+
+static void *trace_thread(void *arg) {
+    trace_event(TRACE_BEGIN, -1, "merge");
+    trace_event(TRACE_END, -1, "merge");
+    return NULL;
+}
+
+void test_trace() {
+    string path = "test/scratch/trace.0";
+
+    if (trace_enabled()) {
+        myfailure("Trace should not be enabled");
+    }
+    if (trace_open(path, 0, "localhost") < 0) {
+        myfailures("Unable to open trace");
+    }
+    if (!trace_enabled()) {
+        myfailure("Trace should be enabled");
+    }
+    trace_event(TRACE_SLOT, 1, "localhost");
+    trace_event(TRACE_QUEUED, -1, "A");
+    trace_event(TRACE_DISPATCH, 1, "A", 2, 100);
+    trace_event(TRACE_RESULT, 1, "A", 0);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, trace_thread, NULL);
+    pthread_join(thread, NULL);
+
+    // Enough events to fill a buffer more than once
+    for (unsigned i=0; i<20000; i++) {
+        trace_event(TRACE_COUNTERS, -1, "", i, 1);
+    }
+    trace_close();
+
+    if (trace_enabled()) {
+        myfailure("Trace should not be enabled after it is closed");
+    }
+    trace_event(TRACE_QUEUED, -1, "B");
+
+    TraceFile trace;
+    if (trace_read(path, trace) < 0) {
+        myfailures("Unable to read trace");
+    }
+    if (trace.header.rank != 0 || trace.host != "localhost") {
+        myfailure("Wrong trace header");
+    }
+    if (trace.events.size() != 20006) {
+        myfailure("Expected 20006 events, got %u", trace.events.size());
+    }
+
+    // Events from the same thread are in order, and each thread has
+    // its own id
+    TraceEvent &dispatch = trace.events[2];
+    if (dispatch.record.type != TRACE_DISPATCH || dispatch.name != "A" ||
+            dispatch.record.slot != 1 || dispatch.record.value != 2 ||
+            dispatch.record.extra != 100) {
+        myfailure("Wrong dispatch event");
+    }
+    if (trace.events[3].record.time < dispatch.record.time) {
+        myfailure("Events are out of order");
+    }
+    unsigned merges = 0;
+    for (unsigned i=0; i<trace.events.size(); i++) {
+        if (trace.events[i].name == "merge") {
+            merges++;
+            if (trace.events[i].record.thread == dispatch.record.thread) {
+                myfailure("Threads should have different ids");
+            }
+        }
+    }
+    if (merges != 2) {
+        myfailure("Expected 2 events from the other thread, got %u", merges);
+    }
+}
+
+void test_trace_json() {
+    string master = "test/scratch/trace.0";
+    string worker = "test/scratch/trace.1";
+
+    if (trace_open(worker, 1, "otherhost") < 0) {
+        myfailures("Unable to open trace");
+    }
+    trace_event(TRACE_START, 1, "A", 1234);
+    trace_event(TRACE_TASK_IO, 1, "A", 10, 20);
+    trace_event(TRACE_EXIT, 1, "A", 0);
+    trace_close();
+
+    vector<TraceFile> traces(2);
+    if (trace_read(master, traces[0]) < 0 || trace_read(worker, traces[1]) < 0) {
+        myfailures("Unable to read traces");
+    }
+
+    string path = "test/scratch/trace.json";
+    FILE *out = fopen(path.c_str(), "w");
+    trace_to_json(traces, out);
+    fclose(out);
+
+    vector<char> buf(8*1024*1024);
+    int size = read_file(path, &buf[0], buf.size());
+    if (size < 0) {
+        myfailures("Unable to read JSON");
+    }
+    string json(&buf[0], size);
+    const char *expected[] = {
+        "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[",
+        "\"ph\":\"b\",\"name\":\"A\",\"pid\":0",
+        "\"ph\":\"X\",\"name\":\"A\",\"pid\":1,\"tid\":0",
+        "\"args\":{\"exitcode\":0,\"cpus\":2,\"memory\":100}",
+        "\"ph\":\"X\",\"name\":\"A\",\"pid\":1,\"tid\":1",
+        "\"args\":{\"pid\":1234,\"status\":0,\"rchar\":10,\"wchar\":20}",
+        "\"ph\":\"B\",\"name\":\"merge\"",
+        "\"args\":{\"name\":\"worker 1 on otherhost\"}",
+        "\"args\":{\"name\":\"master on localhost\"}",
+        "\n]}\n"
+    };
+    for (unsigned i=0; i<sizeof(expected)/sizeof(expected[0]); i++) {
+        if (json.find(expected[i]) == string::npos) {
+            myfailure("JSON does not contain %s", expected[i]);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    log_set_level(LOG_ERROR);
+    if (mkdirs("test/scratch") < 0) {
+        myfailures("Unable to create test/scratch");
+    }
+    test_trace();
+    test_trace_json();
+    return 0;
+}
@@ -0,0 +1,17 @@
+#!/bin/bash
+
+# This script fails the first time it runs, hangs the second time so
+# that the workflow can be aborted while it is running, and fails after
+# that. It is used to test checkpoints.
+
+if ! [ -f test/scratch/checkpoint.1 ]; then
+    touch test/scratch/checkpoint.1
+    exit 1
+fi
+
+if ! [ -f test/scratch/checkpoint.2 ]; then
+    touch test/scratch/checkpoint.2
+    exec sleep 300
+fi
+
+exit 1
@@ -339,6 +339,44 @@ function test_priority {
     fi
 }
 
+# Make sure that task groups share the slots instead of using priorities
+function test_groups {
+    OUTPUT=$(mpiexec -np 2 $PMC -v -v -s test/groups.dag -o /dev/null -e /dev/null --host-cpus 1 --group-weight a=2 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Groups test failed"
+        return 1
+    fi
+
+    # Group a gets two turns for each turn of group b
+    DESIRED="[trace] Scheduling task A4
+[trace] Scheduling task A1
+[trace] Scheduling task B1
+[trace] Scheduling task A2
+[trace] Scheduling task A3
+[trace] Scheduling task B2
+[trace] Scheduling task B3
+[trace] Scheduling task B4"
+
+    ACTUAL=$(echo "$OUTPUT" | grep "Scheduling task ")
+
+    if [ "$ACTUAL" != "$DESIRED" ]; then
+        echo "$OUTPUT"
+        echo "Actual: $ACTUAL"
+        echo "Desired: $DESIRED"
+        echo "ERROR: Groups test failed"
+        return 1
+    fi
+
+    if ! echo "$OUTPUT" | grep -q "Group a: weight 2, 4 tasks dispatched"; then
+        echo "$OUTPUT"
+        echo "ERROR: Groups test failed on group summary"
+        return 1
+    fi
+}
+
 # Make sure that PMC aborts if the workflow takes too long
 function test_max_wall_time {
     OUTPUT=$(mpiexec -np 3 $PMC -s test/walltime.dag --host-cpus 2 --max-wall-time 0.05 2>&1)
@@ -449,6 +487,558 @@ function test_forward {
     fi
 }
 
+# Make sure buffered I/O forwarding writes all the records
+function test_forward_buffered {
+    OUTPUT=$(mpiexec -np 2 $PMC -v --io-buffer-size 65536 --io-flush-interval 0.5 test/forward.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Buffered forward test failed"
+        return 1
+    fi
+
+    FOO=$(grep "Variable FOO" test/forward.dag.foo | wc -l)
+    if [ $? -ne 0 ] || [ $FOO -ne 2 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Buffered forward test failed (foo problem)"
+        return 1
+    fi
+
+    BAR=$(grep "Variable BAR" test/forward.dag.bar | wc -l)
+    if [ $? -ne 0 ] || [ $BAR -ne 2 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Buffered forward test failed (bar problem)"
+        return 1
+    fi
+}
+
+# Make sure I/O forwarding works when every task needs credit
+function test_forward_credit {
+    OUTPUT=$(mpiexec -np 3 $PMC -v --max-io-inflight 1 --io-credit 0 test/forward.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Forward credit test failed"
+        return 1
+    fi
+
+    FOO=$(grep "Variable FOO" test/forward.dag.foo | wc -l)
+    BAR=$(grep "Variable BAR" test/forward.dag.bar | wc -l)
+    if [ $FOO -ne 2 ] || [ $BAR -ne 2 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Forward credit test failed (missing data)"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ "Max I/O credit in flight" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: Forward credit test did not use credit"
+        return 1
+    fi
+}
+
+# Make sure tasks can be launched with vfork
+function test_vfork {
+    rm -f test/forward.dag.foo test/forward.dag.bar
+    OUTPUT=$(mpiexec -np 2 $PMC -v --vfork test/forward.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: vfork test failed"
+        return 1
+    fi
+
+    FOO=$(grep "Variable FOO" test/forward.dag.foo | wc -l)
+    BAR=$(grep "Variable BAR" test/forward.dag.bar | wc -l)
+    if [ $FOO -ne 2 ] || [ $BAR -ne 2 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: vfork test failed (missing data)"
+        return 1
+    fi
+
+    OUTPUT=$(mpiexec -np 2 $PMC -v --vfork test/fail.dag 2>&1)
+    RC=$?
+
+    if [ $RC -eq 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: vfork test should have failed"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ "Unable to exec command /tmp/foobarbaz for task FAIL2" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: vfork test did not report exec failure"
+        return 1
+    fi
+}
+
+# Make sure tasks can be run in cgroups. This only runs if there is a
+# cgroup v2 hierarchy where we can create a cgroup.
+function test_cgroup {
+    MOUNT=$(awk '$3 == "cgroup2" { print $2; exit }' /proc/mounts)
+    SELF=$(awk -F: '$1 == "0" { print $3 }' /proc/self/cgroup)
+    CGROUP="$MOUNT$SELF/pmc-test.$$"
+    if [ -z "$MOUNT" ] || ! mkdir "$CGROUP" 2>/dev/null; then
+        echo "No writable cgroup v2 hierarchy: skipping"
+        return 0
+    fi
+
+    OUTPUT=$(mpiexec -np 2 $PMC -v -v --cgroup $CGROUP --strict-limits test/diamond.dag 2>&1)
+    RC=$?
+
+    LEFTOVER=$(find $CGROUP -mindepth 1 -type d | wc -l)
+    rmdir $CGROUP
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: cgroup test failed"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ "seconds of CPU time" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: cgroup test did not report resource usage"
+        return 1
+    fi
+
+    if [ $LEFTOVER -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: cgroup test did not remove task cgroups"
+        return 1
+    fi
+}
+
+# Make sure adaptive memory lets tasks that request too much memory run
+# at the same time
+function test_adaptive_memory {
+    OUTPUT=$(mpiexec -np 3 $PMC -s --host-cpus 2 --host-memory 1000 --adaptive-memory 20 test/adaptive.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: adaptive memory test failed"
+        return 1
+    fi
+
+    # Only one task fits unless less memory is reserved for them, so
+    # there should be a time when both slots were in use
+    if ! cut -d, -f2 test/adaptive.dag.resource | grep -q '^0$'; then
+        cat test/adaptive.dag.resource
+        echo "ERROR: adaptive memory did not run tasks at the same time"
+        return 1
+    fi
+}
+
+# Make sure multi-node tasks get the hosts they requested. Each worker
+# needs to be on a different host, so this uses a UTS namespace to give
+# one of the workers a different host name if we are allowed to.
+function test_request_nodes {
+    OUTPUT=$(mpiexec -np 3 $PMC -s test/nodes.dag 2>&1)
+    RC=$?
+
+    if [ $RC -eq 0 ] || ! [[ "$OUTPUT" =~ "requires 2 hosts" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: multi-node task should not run on one host"
+        return 1
+    fi
+
+    if ! unshare -u true 2>/dev/null; then
+        echo "Unable to create UTS namespace: skipping"
+        return 0
+    fi
+
+    OUTPUT=$(mpiexec -np 2 $PMC -s test/nodes.dag : \
+        -np 1 unshare -u sh -c "hostname pmc-test-node; exec $PMC -s test/nodes.dag" 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: multi-node test failed"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ "hosts=$(hostname),pmc-test-node" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: multi-node task did not get PMC_HOSTS"
+        return 1
+    fi
+
+    if ! echo "$OUTPUT" | grep -qx "pmc-test-node" || [ -f test/A.hosts ]; then
+        echo "$OUTPUT"
+        echo "ERROR: multi-node task host file was not written or removed"
+        return 1
+    fi
+}
+
+function test_speculate {
+    if ! unshare -u true 2>/dev/null; then
+        echo "Unable to create UTS namespace: skipping"
+        return 0
+    fi
+
+    # The first copy of S hangs, and the duplicate on the other host
+    # finishes right away
+    mkdir -p test/scratch
+    START=$SECONDS
+    OUTPUT=$(mpiexec -np 2 $PMC -s --speculate 50 test/speculate.dag : \
+        -np 1 unshare -u sh -c "hostname pmc-test-node; exec $PMC -s --speculate 50 test/speculate.dag" 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: speculation test failed"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ "S done" ]] || ! [[ "$OUTPUT" =~ "starting a duplicate" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: duplicate of task S was not run"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ "Duplicate tasks: 1 started, 1 finished first" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: duplicate did not finish first"
+        return 1
+    fi
+
+    if [ $((SECONDS - START)) -ge 30 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: first copy of task S was not killed"
+        return 1
+    fi
+}
+
+function test_speculate_output {
+    if ! unshare -u true 2>/dev/null; then
+        echo "Unable to create UTS namespace: skipping"
+        return 0
+    fi
+
+    # The first copy of S writes its stdout to the worker all the time, 
+    # so the worker never stops waiting for output, but it still has to 
+    # kill the copy when the duplicate finishes
+    mkdir -p test/scratch
+    START=$SECONDS
+    OUTPUT=$(mpiexec -np 2 $PMC -s --speculate 50 --forward-stdio test/speculate-output.dag : \
+        -np 1 unshare -u sh -c "hostname pmc-test-node; exec $PMC -s --speculate 50 --forward-stdio test/speculate-output.dag" 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: speculation output test failed"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ "Duplicate tasks: 1 started, 1 finished first" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: duplicate did not finish first"
+        return 1
+    fi
+
+    if [ $((SECONDS - START)) -ge 30 ]; then
+        echo "$OUTPUT" | tail -20
+        echo "ERROR: first copy of task S was not killed while it was writing"
+        return 1
+    fi
+}
+
+function test_speculate_failure {
+    if ! unshare -u true 2>/dev/null; then
+        echo "Unable to create UTS namespace: skipping"
+        return 0
+    fi
+
+    # The duplicate of S fails right away, and the first copy succeeds
+    # later, so the failure of the duplicate is ignored
+    mkdir -p test/scratch
+    OUTPUT=$(mpiexec -np 2 $PMC -s --speculate 50 --forward-stdio test/speculate-fail.dag : \
+        -np 1 unshare -u sh -c "hostname pmc-test-node; exec $PMC -s --speculate 50 --forward-stdio test/speculate-fail.dag" 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: failed duplicate caused the workflow to fail"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ "S done" ]] || ! [[ "$OUTPUT" =~ "Copy of task S failed" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: first copy of task S was not used"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ "failed=0" ]] || ! [[ "$OUTPUT" =~ "Duplicate tasks: 1 started, 0 finished first" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: failed duplicate was counted"
+        return 1
+    fi
+}
+
+function test_blacklist {
+    if ! unshare -u true 2>/dev/null; then
+        echo "Unable to create UTS namespace: skipping"
+        return 0
+    fi
+
+    # Every task fails on pmc-test-node, and succeeds on the other host
+    OUTPUT=$(mpiexec -np 2 $PMC -s -t 3 --blacklist 2 test/blacklist.dag : \
+        -np 1 unshare -u sh -c "hostname pmc-test-node; exec $PMC -s -t 3 --blacklist 2 test/blacklist.dag" 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: blacklist test failed"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ "Blacklisting host pmc-test-node" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: unhealthy host was not blacklisted"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ "blacklisted=\"pmc-test-node\"]" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: blacklisted host missing from cluster-summary"
+        return 1
+    fi
+}
+
+function test_trace {
+    mkdir -p test/scratch
+    rm -f test/scratch/diamond.trace.*
+
+    OUTPUT=$(mpiexec -np 3 $PMC -s --trace test/scratch/diamond.trace test/diamond.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: trace test failed"
+        return 1
+    fi
+
+    if ! [ -f test/scratch/diamond.trace.0 ] || ! [ -f test/scratch/diamond.trace.1 ] || 
+            ! [ -f test/scratch/diamond.trace.2 ]; then
+        echo "ERROR: each rank should write a trace"
+        return 1
+    fi
+
+    OUTPUT=$(./pegasus-mpi-cluster-trace test/scratch/diamond.trace.* 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: trace conversion failed"
+        return 1
+    fi
+
+    # Every task was queued, dispatched by the master, and run by a worker
+    for task in A B C D; do
+        if [ $(echo "$OUTPUT" | grep -c "\"name\":\"$task\"") -ne 4 ]; then
+            echo "$OUTPUT"
+            echo "ERROR: events for task $task are missing"
+            return 1
+        fi
+    done
+}
+
+function test_metrics {
+    mkdir -p test/scratch
+    rm -f test/scratch/diamond.prom
+
+    OUTPUT=$(mpiexec -np 3 $PMC -s --metrics test/scratch/diamond.prom --metrics-interval 0.1 --metrics-socket test/scratch/diamond.sock test/diamond.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: metrics test failed"
+        return 1
+    fi
+
+    if ! [ -f test/scratch/diamond.prom ]; then
+        echo "$OUTPUT"
+        echo "ERROR: metrics file was not written"
+        return 1
+    fi
+
+    # The metrics file has the final state of the workflow
+    METRICS=$(cat test/scratch/diamond.prom)
+    for metric in "pmc_workers 2" "pmc_succeeded_tasks_total 4" "pmc_running_tasks 0" "pmc_ready_tasks 0"; do
+        if ! echo "$METRICS" | grep -q "^$metric\$"; then
+            echo "$METRICS"
+            echo "ERROR: metrics should contain $metric"
+            return 1
+        fi
+    done
+
+    if [ -e test/scratch/diamond.sock ]; then
+        echo "ERROR: metrics socket was not removed"
+        return 1
+    fi
+}
+
+function test_profile {
+    OUTPUT=$(mpiexec -np 3 $PMC -v --profile test/diamond.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: profile test failed"
+        return 1
+    fi
+
+    for line in "Time in schedule:" "Time in wait:" "Time in result:" \
+            "Result to next dispatch latency: count=2 " \
+            "Message processing latency: count=4 " \
+            "Master loop cycle latency: count="; do
+        if ! echo "$OUTPUT" | grep -q "$line"; then
+            echo "$OUTPUT"
+            echo "ERROR: profile output should contain $line"
+            return 1
+        fi
+    done
+}
+
+function test_async_log {
+    OUTPUT=$(mpiexec -np 3 $PMC -v -v --async-log -s test/diamond.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: async log test failed"
+        return 1
+    fi
+
+    # All of the messages are written before PMC exits
+    for line in "\[trace\] Rank 1: Sending" "\[debug\] Submitting task D" \
+            "\[info\] Workflow suceeded"; do
+        if ! echo "$OUTPUT" | grep -q "$line"; then
+            echo "$OUTPUT"
+            echo "ERROR: log should contain $line"
+            return 1
+        fi
+    done
+}
+
+# Make sure that the failures of tasks are restored from the checkpoint
+function test_checkpoint {
+    mkdir -p test/scratch
+    rm -f test/scratch/checkpoint.*
+
+    # Task B fails once, and the workflow is aborted while it is running
+    # for the second time
+    OUTPUT=$(mpiexec -np 2 $PMC --checkpoint 0.1 -r test/scratch/checkpoint.rescue -o /dev/null -e /dev/null --max-wall-time 0.05 test/checkpoint.dag 2>&1)
+    RC=$?
+
+    if [ $RC -eq 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: checkpoint test should have been aborted"
+        return 1
+    fi
+
+    if ! [ -f test/scratch/checkpoint.rescue.checkpoint ]; then
+        echo "$OUTPUT"
+        echo "ERROR: checkpoint was not written"
+        return 1
+    fi
+
+    # After the restart task B only has one try left, so it fails once
+    # more instead of twice
+    OUTPUT=$(mpiexec -np 2 $PMC --checkpoint 0.1 -r test/scratch/checkpoint.rescue -o /dev/null -e /dev/null --max-wall-time 0.5 test/checkpoint.dag 2>&1)
+    RC=$?
+
+    if [ $RC -eq 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: checkpoint test should have failed"
+        return 1
+    fi
+
+    if ! echo "$OUTPUT" | grep -q "Loaded checkpoint .*: 1 of 2 tasks done"; then
+        echo "$OUTPUT"
+        echo "ERROR: checkpoint was not loaded"
+        return 1
+    fi
+
+    if [ $(echo "$OUTPUT" | grep "Task B failed" | wc -l) -ne 1 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: failures of task B were not restored"
+        return 1
+    fi
+}
+
+function wait_for_file {
+    for i in $(seq 1 300); do
+        if [ -f $1 ]; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    echo "ERROR: $1 was not created"
+    return 1
+}
+
+function test_elastic {
+    # OpenMPI needs ompi-server to connect processes started by
+    # different mpiexec commands
+    if [ -z "$(which ompi-server 2>/dev/null)" ]; then
+        echo "ompi-server not found: skipping"
+        return 0
+    fi
+
+    mkdir -p test/scratch
+    ompi-server --no-daemonize -r test/scratch/uri &
+    SERVER=$!
+    wait_for_file test/scratch/uri || return 1
+    MPIEXEC="mpiexec --ompi-server file:test/scratch/uri -np 1"
+
+    # The master starts without any workers
+    $MPIEXEC $PMC -s --elastic test/scratch/port test/elastic.dag > test/scratch/master.log 2>&1 &
+    MASTER=$!
+    wait_for_file test/scratch/port || return 1
+
+    # The first worker is asked to leave while it is running A
+    $MPIEXEC $PMC --join test/scratch/port test/elastic.dag > test/scratch/worker1.log 2>&1 &
+    WORKER=$!
+    wait_for_file test/scratch/A.started || return 1
+    kill -TERM $(pgrep -P $WORKER)
+    if ! wait $WORKER; then
+        cat test/scratch/worker1.log
+        echo "ERROR: worker did not leave cleanly"
+        return 1
+    fi
+
+    # The second worker runs A again and finishes the workflow
+    $MPIEXEC $PMC --join test/scratch/port test/elastic.dag > test/scratch/worker2.log 2>&1 &
+    WORKER=$!
+    wait $MASTER
+    RC=$?
+    wait $WORKER
+    kill $SERVER
+
+    if [ $RC -ne 0 ]; then
+        cat test/scratch/master.log test/scratch/worker2.log
+        echo "ERROR: elastic workflow failed"
+        return 1
+    fi
+
+    OUTPUT=$(cat test/scratch/master.log)
+    if ! [[ "$OUTPUT" =~ "left while running task A: requeueing it" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: task A was not requeued"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ "A done" ]] || ! [[ "$OUTPUT" =~ "B done" ]] || [ -f test/scratch/port ]; then
+        echo "$OUTPUT"
+        echo "ERROR: elastic workflow did not finish"
+        return 1
+    fi
+}
+
 # Make sure I/O forwarding failures cause task to fail
 function test_forward_fail {
     OUTPUT=$(mpiexec -np 2 $PMC -v test/forward_fail.dag 2>&1)
@@ -533,6 +1123,126 @@ function test_per_task_stdio {
     fi
 }
 
+function test_forward_stdio {
+    mkdir -p test/scratch
+    cp test/diamond.dag test/fail.dag test/scratch/
+
+    OUTPUT=$(mpiexec -np 2 $PMC -v --forward-stdio test/scratch/diamond.dag 2>/dev/null)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Forward stdio test failed"
+        return 1
+    fi
+
+    NTASKS=$(echo "$OUTPUT" | grep "^\[cluster-task" | wc -l)
+    NLINES=$(echo "$OUTPUT" | grep "^[ABCD]$" | wc -l)
+    if [ $NTASKS -ne 4 ] || [ $NLINES -ne 4 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Forward stdio test failed (missing output)"
+        return 1
+    fi
+
+    if ls test/scratch/diamond.dag.out.* test/scratch/diamond.dag.err.* >/dev/null 2>&1; then
+        echo "$OUTPUT"
+        echo "ERROR: Forward stdio test created worker stdio files"
+        return 1
+    fi
+
+    # Failed tasks should still have their stdio forwarded
+    OUTPUT=$(mpiexec -np 2 $PMC -v --forward-stdio -o test/scratch/fail.out -e test/scratch/fail.err test/scratch/fail.dag 2>&1)
+    RC=$?
+
+    if [ $RC -eq 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Forward stdio failure test should have failed"
+        return 1
+    fi
+
+    if ! grep -q "name=FAIL2," test/scratch/fail.out || ! grep -q "foobarbaz" test/scratch/fail.err; then
+        echo "$OUTPUT"
+        echo "ERROR: Forward stdio test did not forward stdio of failed task"
+        return 1
+    fi
+}
+
+function test_stream_stdio {
+    mkdir -p test/scratch
+    cp test/stream.dag test/scratch/
+    rm -f test/scratch/stream.out
+
+    # Task stdio is sent in chunks while the tasks run, with credit for
+    # each chunk
+    mpiexec -np 3 $PMC -v --forward-stdio --max-io-inflight 100000 --io-credit 1000 \
+        -o test/scratch/stream.out test/scratch/stream.dag > test/scratch/stream.log 2>&1 &
+    PID=$!
+
+    STREAMED=no
+    for i in $(seq 200); do
+        if grep -q "^first$" test/scratch/stream.out 2>/dev/null; then
+            if ! grep -q "^second$" test/scratch/stream.out; then
+                STREAMED=yes
+            fi
+            break
+        fi
+        sleep 0.1
+    done
+
+    wait $PID
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        cat test/scratch/stream.log
+        echo "ERROR: Stream stdio test failed"
+        return 1
+    fi
+
+    if [ "$STREAMED" != "yes" ]; then
+        cat test/scratch/stream.out
+        echo "ERROR: Stream stdio test did not forward stdio while the task was running"
+        return 1
+    fi
+
+    # Lines are not split between chunks
+    NLINES=$(grep -c "^line-[0-9]*$" test/scratch/stream.out)
+    NTASKS=$(grep -c "^\[cluster-task" test/scratch/stream.out)
+    if [ $NLINES -ne 20000 ] || [ $NTASKS -ne 2 ] || ! grep -q "^second$" test/scratch/stream.out; then
+        echo "NLINES=$NLINES NTASKS=$NTASKS"
+        echo "ERROR: Stream stdio test lost output"
+        return 1
+    fi
+}
+
+function test_local_stdio {
+    mkdir -p test/scratch
+    cp test/diamond.dag test/scratch/
+
+    OUTPUT=$(mpiexec -np 3 $PMC -v --local-stdio test/scratch/local test/scratch/diamond.dag 2>/dev/null)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Local stdio test failed"
+        return 1
+    fi
+
+    NTASKS=$(echo "$OUTPUT" | grep "^\[cluster-task" | wc -l)
+    NLINES=$(echo "$OUTPUT" | grep "^[ABCD]$" | wc -l)
+    if [ $NTASKS -ne 4 ] || [ $NLINES -ne 4 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Local stdio test failed (missing output)"
+        return 1
+    fi
+
+    NFILES=$(find test/scratch -name "diamond.dag.*.[0-9]*" | wc -l)
+    if [ $NFILES -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: Local stdio test left stdio files"
+        return 1
+    fi
+}
+
 function test_jobstate_log {
     mkdir -p test/scratch
     cp test/diamond.dag test/scratch/
@@ -553,6 +1263,37 @@ function test_jobstate_log {
     fi
 }
 
+# Make sure the resources used by tasks are recorded
+function test_task_usage {
+    mkdir -p test/scratch
+    cp test/usage.dag test/scratch/
+
+    OUTPUT=$(mpiexec -np 2 $PMC -v --jobstate-log test/scratch/usage.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: task usage test failed"
+        return 1
+    fi
+
+    # The task reads 8 MB
+    RCHAR=$(sed -n 's/.* JOB_TERMINATED .* rchar=\([0-9]*\) .*/\1/p' test/scratch/jobstate.log)
+    if [ -z "$RCHAR" ] || [ $RCHAR -lt 8388608 ]; then
+        cat test/scratch/jobstate.log
+        echo "ERROR: jobstate.log does not have the I/O of the task"
+        return 1
+    fi
+
+    # Lines for tasks that finished have 17 fields
+    FIELDS=$(tail -n 1 test/scratch/usage.dag.resource | awk -F, '{ print NF }')
+    if [ "$FIELDS" != "17" ]; then
+        cat test/scratch/usage.dag.resource
+        echo "ERROR: resource log does not have the usage of the task"
+        return 1
+    fi
+}
+
 function test_monitord_hack {
     mkdir -p test/scratch
     cp test/diamond.dag test/scratch/
@@ -687,6 +1428,24 @@ function test_affinity_env {
     fi
 }
 
+# Make sure the workers measure the time it takes to launch tasks
+function test_launch_latency {
+    OUTPUT=$(mpiexec -n 2 $PMC -v -v test/diamond.dag 2>&1)
+    RC=$?
+
+    if [ $RC -ne 0 ]; then
+        echo "$OUTPUT"
+        echo "ERROR: launch latency test failed"
+        return 1
+    fi
+
+    if ! [[ "$OUTPUT" =~ "Launched 4 tasks, fork-to-exec latency" ]]; then
+        echo "$OUTPUT"
+        echo "ERROR: launch latency test did not report the latency"
+        return 1
+    fi
+}
+
 function test_PM954 {
     OUTPUT=$(mpiexec -n 2 $PMC test/PM954.dag 2>&1)
     RC=$?
@@ -737,6 +1496,12 @@ run_test ./test-engine
 run_test ./test-fdcache
 run_test ./test-protocol
 run_test ./test-scheduler
+run_test ./test-cgroup
+run_test ./test-eventlog
+run_test ./test-trace
+run_test ./test-metrics
+run_test ./test-profile
+run_test ./test-checkpoint
 run_test test_PM954
 run_test test_help
 run_test test_help_no_mpi
@@ -746,22 +1511,31 @@ run_test test_out_err
 run_test test_rescue_file
 run_test test_memory_limit
 run_test test_insufficient_memory
+run_test test_adaptive_memory
+run_test test_request_nodes
 run_test test_strict_limits
 run_test test_cpus_limit
 run_test test_insufficient_cpus
 run_test test_tries
 run_test test_priority
+run_test test_groups
 run_test test_host_script
 run_test test_fail_script
 run_test test_fork_script
 run_test test_resource_log
 run_test test_append_stdio
 run_test test_forward
+run_test test_forward_buffered
+run_test test_forward_credit
 run_test test_forward_fail
 run_test test_file_forward
 run_test test_file_forward_fail
 run_test test_per_task_stdio
+run_test test_forward_stdio
+run_test test_stream_stdio
+run_test test_local_stdio
 run_test test_jobstate_log
+run_test test_task_usage
 run_test test_monitord_hack
 run_test test_monitord_hack_failure
 run_test test_max_wall_time
@@ -770,6 +1544,19 @@ run_test test_maxfds
 run_test test_complex_args
 run_test test_PM848
 run_test test_affinity_env
+run_test test_launch_latency
+run_test test_vfork
+run_test test_cgroup
+run_test test_elastic
+run_test test_speculate
+run_test test_speculate_output
+run_test test_speculate_failure
+run_test test_blacklist
+run_test test_trace
+run_test test_metrics
+run_test test_profile
+run_test test_async_log
+run_test test_checkpoint
 
 # setrlimit is broken on Darwin, so the strict limits test won't work
 if [ $(uname -s) != "Darwin" ]; then
@@ -5,6 +5,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
 #ifdef DARWIN
 # include <sys/param.h>
 # include <sys/sysctl.h>
@@ -15,8 +18,13 @@
 #include <sstream>
 #include <stdlib.h>
 #include <libgen.h>
+#include <dirent.h>
+#include <map>
+#include <utility>
 #ifdef LINUX
 # include <sched.h>
+# include <sys/sendfile.h>
+# include <sys/syscall.h>
 # ifdef HAS_LIBNUMA
 #  include <numaif.h>
 # endif
@@ -28,6 +36,8 @@
 
 using std::string;
 using std::vector;
+using std::map;
+using std::pair;
 
 /* purpose: formats ISO 8601 timestamp into given buffer (simplified)
  * paramtr: seconds (IN): time stamp
@@ -93,6 +103,14 @@ double current_time() {
     return ts;
 }
 
+/* Get the time from the monotonic clock in nanoseconds, which is used to
+ * measure intervals */
+uint64_t monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
 
 /* Get the total amount of physical memory in bytes */
 unsigned long get_host_memory() {
@@ -119,7 +137,7 @@ unsigned long get_host_memory() {
     return memory;
 }
 
-struct cpuinfo get_host_cpuinfo() {
+static struct cpuinfo read_host_cpuinfo() {
     struct cpuinfo c;
     c.threads = 0;
     c.cores = 0;
@@ -153,6 +171,9 @@ struct cpuinfo get_host_cpuinfo() {
         if (rec.find("processor\t:", 0, 11) == 0) {
             // Each time we encounter a processor field, we increment the
             // number of cpus/threads
+            if (c.threads == CPU_T_MAX) {
+                myfailure("Too many CPUs in /proc/cpuinfo");
+            }
             c.threads += 1;
         } else if (rec.find("physical id\t:", 0, 13) == 0) {
             // Each time we encounter a new physical id, we increment the
@@ -207,6 +228,109 @@ struct cpuinfo get_host_cpuinfo() {
     return c;
 }
 
+/* Get the number of threads, cores and sockets on this host. The result
+ * is cached, because /proc/cpuinfo is large on hosts with many cpus and
+ * it doesn't change while we are running. */
+struct cpuinfo get_host_cpuinfo() {
+    static bool cached = false;
+    static struct cpuinfo c;
+    if (!cached) {
+        c = read_host_cpuinfo();
+        cached = true;
+    }
+    return c;
+}
+
+#ifdef LINUX
+/* Read an unsigned integer from a sysfs file */
+static int read_sysfs_unsigned(const string &path, unsigned *value) {
+    char buf[64];
+    int size = read_file(path, buf, sizeof(buf) - 1);
+    if (size <= 0) {
+        return -1;
+    }
+    buf[size] = '\0';
+    if (sscanf(buf, "%u", value) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Find the NUMA node of a cpu by looking for a nodeN link in its sysfs 
+ * directory. Kernels without NUMA support don't have the link, in which 
+ * case all the cpus are on node 0. */
+static int get_cpu_node(const string &cpudir, unsigned *node) {
+    DIR *dir = opendir(cpudir.c_str());
+    if (dir == NULL) {
+        return -1;
+    }
+    *node = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        unsigned n;
+        char extra;
+        if (sscanf(ent->d_name, "node%u%c", &n, &extra) == 1) {
+            *node = n;
+            break;
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+#endif
+
+/* Get the NUMA node and physical core of the first threads cpus on this
+ * host from sysfs. Returns -1 and leaves topo empty if the topology is
+ * not available or does not make sense, in which case the caller should 
+ * assume that cpus are numbered contiguously by socket and core. */
+int get_host_topology(cpu_t threads, struct cputopo &topo) {
+    topo.nodes.clear();
+    topo.cores.clear();
+#ifdef LINUX
+    // Maps (package, core) to the host-wide core number
+    map<pair<unsigned, unsigned>, cpu_t> coremap;
+
+    for (unsigned i=0; i<threads; i++) {
+        char cpudir[64];
+        snprintf(cpudir, sizeof(cpudir), "/sys/devices/system/cpu/cpu%u", i);
+        string dir = cpudir;
+
+        unsigned node, package, core;
+        if (get_cpu_node(dir, &node) < 0 ||
+                read_sysfs_unsigned(dir + "/topology/physical_package_id", &package) < 0 ||
+                read_sysfs_unsigned(dir + "/topology/core_id", &core) < 0) {
+            LOG(LOG_DEBUG, "Unable to read topology of cpu %u: %s", i, strerror(errno));
+            topo.nodes.clear();
+            topo.cores.clear();
+            return -1;
+        }
+
+        if (node >= threads) {
+            LOG(LOG_DEBUG, "Invalid NUMA node for cpu %u: %u", i, node);
+            topo.nodes.clear();
+            topo.cores.clear();
+            errno = ERANGE;
+            return -1;
+        }
+
+        pair<unsigned, unsigned> key(package, core);
+        if (coremap.find(key) == coremap.end()) {
+            cpu_t next = coremap.size();
+            coremap[key] = next;
+        }
+
+        topo.nodes.push_back(node);
+        topo.cores.push_back(coremap[key]);
+    }
+
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
 int mkdirs(const char *path) {
     if (path == NULL || strlen(path) == 0) {
         return 0;
@@ -386,6 +510,31 @@ string dirname(const string &path) {
     return result;
 }
 
+/* Read the I/O counters from a /proc/PID/io file */
+int read_io_counters(const string &path, struct taskusage &usage) {
+    FILE *f = fopen(path.c_str(), "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    char name[32];
+    unsigned long long value;
+    while (fscanf(f, "%31[^:]: %llu ", name, &value) == 2) {
+        if (strcmp(name, "rchar") == 0) {
+            usage.rchar = value;
+        } else if (strcmp(name, "wchar") == 0) {
+            usage.wchar = value;
+        } else if (strcmp(name, "read_bytes") == 0) {
+            usage.read_bytes = value;
+        } else if (strcmp(name, "write_bytes") == 0) {
+            usage.write_bytes = value;
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
 /* Return the last part of a path */
 string filename(const string &path) {
     char *temp = strdup(path.c_str());
@@ -394,30 +543,50 @@ string filename(const string &path) {
     return result;
 }
 
-/* Set the cpu affinity to values in bindings */
-int set_cpu_affinity(vector<cpu_t> &bindings) {
+/* Build a set of cpus for a host with the given number of threads. This
+ * is done in the parent so that the child only has to call apply() 
+ * between fork() and exec(). */
+CPUSet::CPUSet(cpu_t threads, const vector<cpu_t> &bindings) {
+    this->set = NULL;
+    this->setsize = 0;
+    this->error = 0;
 #ifdef LINUX
-    struct cpuinfo c = get_host_cpuinfo();
-    cpu_set_t *cpuset = CPU_ALLOC(c.threads);
+    cpu_set_t *cpuset = CPU_ALLOC(threads);
     if (cpuset == NULL) {
-        return -1;
+        this->error = errno;
+        return;
     }
-    size_t cpusetsize = CPU_ALLOC_SIZE(c.threads);
-    CPU_ZERO_S(cpusetsize, cpuset);
+    this->set = cpuset;
+    this->setsize = CPU_ALLOC_SIZE(threads);
+    CPU_ZERO_S(setsize, cpuset);
 
-    for (vector<cpu_t>::iterator i = bindings.begin(); i != bindings.end(); i++) {
+    for (vector<cpu_t>::const_iterator i = bindings.begin(); i != bindings.end(); i++) {
         cpu_t j = *i;
-        if (j >= c.threads) {
-            CPU_FREE(cpuset);
-            errno = ERANGE;
-            return -1;
+        if (j >= threads) {
+            this->error = ERANGE;
+            return;
         }
-        CPU_SET_S(j, cpusetsize, cpuset);
+        CPU_SET_S(j, setsize, cpuset);
     }
+#endif
+}
 
-    int rc = sched_setaffinity(0, cpusetsize, cpuset);
-    CPU_FREE(cpuset);
-    if (rc < 0) {
+CPUSet::~CPUSet() {
+#ifdef LINUX
+    if (set != NULL) {
+        CPU_FREE((cpu_set_t *)set);
+    }
+#endif
+}
+
+/* Set the cpu affinity of the calling process to this set */
+int CPUSet::apply() {
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+#ifdef LINUX
+    if (sched_setaffinity(0, setsize, (cpu_set_t *)set) < 0) {
         return -1;
     }
 #endif
@@ -456,3 +625,212 @@ int clear_memory_affinity() {
 #endif
     return 0;
 }
+
+/* A memory policy that allocates memory on the given NUMA nodes. If there
+ * is only one node, then it is preferred, otherwise memory is interleaved
+ * across the nodes. This is a preference, not a hard limit, so tasks can
+ * still allocate memory on other nodes if their nodes are full. Like
+ * CPUSet, this is created before fork() and applied after. */
+MemoryPolicy::MemoryPolicy(const vector<cpu_t> &nodes) {
+    this->maxnode = 0;
+    this->mode = 0;
+
+    unsigned long bits = 8 * sizeof(unsigned long);
+    for (unsigned i=0; i<nodes.size(); i++) {
+        if (nodes[i] + 1u > maxnode) {
+            maxnode = nodes[i] + 1;
+        }
+    }
+    nodemask.resize((maxnode + bits - 1) / bits, 0);
+    for (unsigned i=0; i<nodes.size(); i++) {
+        nodemask[nodes[i] / bits] |= 1UL << (nodes[i] % bits);
+    }
+#ifdef HAS_LIBNUMA
+    mode = nodes.size() == 1 ? MPOL_PREFERRED : MPOL_INTERLEAVE;
+#endif
+}
+
+/* Set the memory policy of the calling process */
+int MemoryPolicy::apply() {
+#ifdef HAS_LIBNUMA
+    if (nodemask.size() == 0) {
+        return 0;
+    }
+
+    // The kernel expects maxnode to be one more than the number of bits
+    if (set_mempolicy(mode, &nodemask[0], maxnode + 1) < 0) {
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+#ifdef LINUX
+/* copy_file_range() was added to glibc in 2.27, but the system call
+ * exists in older versions of glibc as long as the kernel headers know it */
+static ssize_t do_copy_file_range(int srcfd, int destfd, off_t *destoff, size_t size) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+    loff_t off = destoff == NULL ? 0 : *destoff;
+    ssize_t rc = copy_file_range(srcfd, NULL, destfd, destoff == NULL ? NULL : &off, size, 0);
+    if (rc > 0 && destoff != NULL) {
+        *destoff = off;
+    }
+    return rc;
+#elif defined(SYS_copy_file_range)
+    loff_t off = destoff == NULL ? 0 : *destoff;
+    ssize_t rc = syscall(SYS_copy_file_range, srcfd, NULL, destfd, destoff == NULL ? NULL : &off, size, 0);
+    if (rc > 0 && destoff != NULL) {
+        *destoff = off;
+    }
+    return rc;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+#endif
+
+/* Copy size bytes from the current offset of srcfd to destfd. If destoff
+ * is NULL, then the data is written at the current offset of destfd,
+ * otherwise it is written at *destoff, and *destoff is updated. Where
+ * possible the data is copied by the kernel using copy_file_range() or
+ * sendfile() so that it does not have to pass through user space. Returns
+ * the number of bytes copied, which is less than size only if the end
+ * of srcfd was reached, or -1 on error.
+ */
+ssize_t copy_file_data(int destfd, off_t *destoff, int srcfd, size_t size) {
+    enum { COPY_FILE_RANGE, SENDFILE, READ_WRITE } method = READ_WRITE;
+#ifdef LINUX
+    method = COPY_FILE_RANGE;
+#endif
+
+    char buf[65536];
+    size_t copied = 0;
+    while (copied < size) {
+        size_t count = size - copied;
+        ssize_t rc;
+#ifdef LINUX
+        if (method == COPY_FILE_RANGE) {
+            rc = do_copy_file_range(srcfd, destfd, destoff, count);
+            if (rc < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+                           errno == EOPNOTSUPP || errno == EBADF)) {
+                // Not supported for this kernel, file system, or pair of files.
+                // sendfile() cannot write at an offset, so skip it in that case.
+                method = destoff == NULL ? SENDFILE : READ_WRITE;
+                continue;
+            }
+        } else if (method == SENDFILE) {
+            rc = sendfile(destfd, srcfd, NULL, count);
+            if (rc < 0 && (errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                method = READ_WRITE;
+                continue;
+            }
+        } else
+#endif
+        {
+            if (count > sizeof(buf)) {
+                count = sizeof(buf);
+            }
+            rc = read(srcfd, buf, count);
+            if (rc > 0) {
+                size_t r = rc;
+                size_t w = 0;
+                while (w < r) {
+                    ssize_t wc;
+                    if (destoff == NULL) {
+                        wc = write(destfd, buf + w, r - w);
+                    } else {
+                        wc = pwrite(destfd, buf + w, r - w, *destoff);
+                    }
+                    if (wc < 0) {
+                        if (errno == EINTR) {
+                            continue;
+                        }
+                        return -1;
+                    }
+                    w += wc;
+                    if (destoff != NULL) {
+                        *destoff += wc;
+                    }
+                }
+            }
+        }
+
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        // End of file
+        if (rc == 0) {
+            break;
+        }
+
+        copied += rc;
+    }
+
+    return copied;
+}
+
+/* Block all signals in the calling thread. Background threads call this
+ * so that signals are handled by the main thread. */
+void block_signals() {
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+}
+
+/* Replace the contents of path with data. The data is written to a
+ * temporary file, which is renamed over path, so readers see either the
+ * old contents or the new contents. If sync is true, then the data is
+ * flushed to disk before the rename so that a crash cannot leave an
+ * empty file. Returns 0 on success, or -1 with errno set on failure. */
+int replace_file(const std::string &path, const char *data, size_t size, bool sync) {
+    std::string tmpfile = path + ".tmp";
+
+    int fd = open(tmpfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int rc = 0;
+    size_t written = 0;
+    while (written < size) {
+        ssize_t w = write(fd, data + written, size - written);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            rc = -1;
+            break;
+        }
+        written += w;
+    }
+
+    if (rc == 0 && sync) {
+#ifdef DARWIN
+        // OSX does not have fdatasync
+        rc = fsync(fd);
+#else
+        rc = fdatasync(fd);
+#endif
+    }
+
+    int saved = errno;
+    if (close(fd) < 0 && rc == 0) {
+        rc = -1;
+        saved = errno;
+    }
+    if (rc == 0 && rename(tmpfile.c_str(), path.c_str()) < 0) {
+        rc = -1;
+        saved = errno;
+    }
+    if (rc < 0) {
+        unlink(tmpfile.c_str());
+        errno = saved;
+    }
+
+    return rc;
+}
@@ -3,17 +3,20 @@
 
 #include <string>
 #include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/types.h>
 #include <vector>
 
 #ifndef HOST_NAME_MAX
 #define HOST_NAME_MAX 255
 #endif
 
-typedef unsigned char cpu_t;
-#define SCNcpu_t "hhu"
-#define PRIcpu_t "hhu"
+typedef unsigned short cpu_t;
+#define SCNcpu_t "hu"
+#define PRIcpu_t "hu"
+#define CPU_T_MAX 65535
 
 struct cpuinfo {
     cpu_t threads;
@@ -21,20 +24,80 @@ struct cpuinfo {
     cpu_t sockets;
 };
 
+/* The NUMA node and physical core of each CPU on a host. Cores are
+ * numbered consecutively across the whole host, so two CPUs with the
+ * same core are SMT siblings. */
+struct cputopo {
+    std::vector<cpu_t> nodes;
+    std::vector<cpu_t> cores;
+};
+
+/* The resources used by a task and its children. Memory is in KB, times
+ * are in seconds, and I/O is in bytes. rchar and wchar count all reads
+ * and writes, read_bytes and write_bytes only count the ones that went
+ * to storage. */
+struct taskusage {
+    double utime;
+    double stime;
+    unsigned long maxrss;
+    unsigned long minflt;
+    unsigned long majflt;
+    unsigned long nvcsw;
+    unsigned long nivcsw;
+    unsigned long long rchar;
+    unsigned long long wchar;
+    unsigned long long read_bytes;
+    unsigned long long write_bytes;
+};
+
 char * isodate(time_t seconds, char* buffer, size_t size);
 char * iso2date(double seconds_wf, char* buffer, size_t size);
 double current_time();
+uint64_t monotonic_ns();
 void get_host_name(std::string &hostname);
 unsigned long get_host_memory();
+/* A set of cpus that can be created before fork() and applied after */
+class CPUSet {
+private:
+    void *set;
+    size_t setsize;
+    int error;
+
+    // Not copyable
+    CPUSet(const CPUSet &);
+    CPUSet &operator=(const CPUSet &);
+
+public:
+    CPUSet(cpu_t threads, const std::vector<cpu_t> &bindings);
+    ~CPUSet();
+    int apply();
+};
+
+/* A NUMA memory policy that can be created before fork() and applied after */
+class MemoryPolicy {
+private:
+    std::vector<unsigned long> nodemask;
+    unsigned long maxnode;
+    int mode;
+
+public:
+    MemoryPolicy(const std::vector<cpu_t> &nodes);
+    int apply();
+};
+
 struct cpuinfo get_host_cpuinfo();
+int get_host_topology(cpu_t threads, struct cputopo &topo);
+int read_io_counters(const std::string &path, struct taskusage &usage);
 int mkdirs(const char *path);
 bool is_executable(const std::string &file);
 std::string pathfind(const std::string &file);
 int read_file(const std::string &file, char *buf, size_t size);
 std::string dirname(const std::string &path);
 std::string filename(const std::string &path);
-int set_cpu_affinity(std::vector<cpu_t> &bindings);
 int clear_cpu_affinity();
 int clear_memory_affinity();
+ssize_t copy_file_data(int destfd, off_t *destoff, int srcfd, size_t size);
+void block_signals();
+int replace_file(const std::string &path, const char *data, size_t size, bool sync);
 
 #endif /* _TOOLS_H */
@@ -0,0 +1,351 @@
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <map>
+#include <pthread.h>
+
+#include "trace.h"
+#include "tools.h"
+
+using std::map;
+using std::pair;
+
+/* Each thread that records events gets its own buffer so that threads
+ * only take the lock when a buffer is written to the file */
+struct TraceBuffer {
+    char data[TRACE_BUFFER_SIZE];
+    size_t len;
+    uint32_t thread;
+};
+
+static FILE *trace_file = NULL;
+static uint64_t trace_start = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static vector<TraceBuffer *> trace_buffers;
+
+// The buffers of a thread are only valid for the trace they were
+// created for
+static unsigned trace_generation = 0;
+static __thread TraceBuffer *thread_buffer = NULL;
+static __thread unsigned thread_generation = 0;
+
+/* Must be called with trace_lock held */
+static void write_buffer(TraceBuffer *buf) {
+    if (buf->len > 0 && trace_file != NULL) {
+        fwrite(buf->data, 1, buf->len, trace_file);
+    }
+    buf->len = 0;
+}
+
+static TraceBuffer *get_buffer() {
+    if (thread_buffer != NULL && thread_generation == trace_generation) {
+        return thread_buffer;
+    }
+
+    TraceBuffer *buf = new TraceBuffer();
+    buf->len = 0;
+    pthread_mutex_lock(&trace_lock);
+    buf->thread = trace_buffers.size();
+    trace_buffers.push_back(buf);
+    pthread_mutex_unlock(&trace_lock);
+
+    thread_buffer = buf;
+    thread_generation = trace_generation;
+    return buf;
+}
+
+/* Start writing a trace to path. Returns -1 and sets errno on error. */
+int trace_open(const string &path, int rank, const string &host) {
+    FILE *file = fopen(path.c_str(), "w");
+    if (file == NULL) {
+        return -1;
+    }
+
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.rank = rank;
+    header.start = current_time();
+    header.hostlen = host.size();
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+            fwrite(host.c_str(), 1, host.size(), file) != host.size()) {
+        int error = errno;
+        fclose(file);
+        errno = error;
+        return -1;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    trace_start = monotonic_ns();
+    trace_generation++;
+    trace_file = file;
+    pthread_mutex_unlock(&trace_lock);
+
+    return 0;
+}
+
+/* Write the buffers of all the threads and close the trace */
+void trace_close() {
+    pthread_mutex_lock(&trace_lock);
+    for (unsigned i=0; i<trace_buffers.size(); i++) {
+        write_buffer(trace_buffers[i]);
+        delete trace_buffers[i];
+    }
+    trace_buffers.clear();
+    if (trace_file != NULL) {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    trace_generation++;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+bool trace_enabled() {
+    return trace_file != NULL;
+}
+
+/* Record an event in the calling thread's buffer */
+void trace_event(TraceType type, int slot, const char *name, uint64_t value, uint64_t extra) {
+    if (trace_file == NULL) {
+        return;
+    }
+
+    TraceBuffer *buf = get_buffer();
+
+    TraceRecord record;
+    record.time = monotonic_ns() - trace_start;
+    record.type = type;
+    record.thread = buf->thread;
+    record.slot = slot;
+    record.namelen = strlen(name);
+    if (record.namelen > TRACE_BUFFER_SIZE - sizeof(record)) {
+        record.namelen = TRACE_BUFFER_SIZE - sizeof(record);
+    }
+    record.value = value;
+    record.extra = extra;
+
+    size_t size = sizeof(record) + record.namelen;
+    if (buf->len + size > TRACE_BUFFER_SIZE) {
+        pthread_mutex_lock(&trace_lock);
+        write_buffer(buf);
+        pthread_mutex_unlock(&trace_lock);
+    }
+    memcpy(buf->data + buf->len, &record, sizeof(record));
+    memcpy(buf->data + buf->len + sizeof(record), name, record.namelen);
+    buf->len += size;
+}
+
+/* Read a trace file. A record that was cut off at the end of the file is
+ * ignored. Returns -1 and sets errno on error. */
+int trace_read(const string &path, TraceFile &trace) {
+    FILE *file = fopen(path.c_str(), "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    if (fread(&trace.header, sizeof(trace.header), 1, file) != 1 ||
+            memcmp(trace.header.magic, TRACE_MAGIC, sizeof(trace.header.magic)) != 0 ||
+            trace.header.version != TRACE_VERSION) {
+        fclose(file);
+        errno = EINVAL;
+        return -1;
+    }
+
+    vector<char> host(trace.header.hostlen);
+    if (trace.header.hostlen > 0 &&
+            fread(&host[0], 1, host.size(), file) != host.size()) {
+        fclose(file);
+        errno = EINVAL;
+        return -1;
+    }
+    trace.host.assign(host.begin(), host.end());
+
+    trace.events.clear();
+    while (true) {
+        TraceEvent event;
+        if (fread(&event.record, sizeof(event.record), 1, file) != 1) {
+            break;
+        }
+        vector<char> name(event.record.namelen);
+        if (event.record.namelen > 0 &&
+                fread(&name[0], 1, name.size(), file) != name.size()) {
+            break;
+        }
+        event.name.assign(name.begin(), name.end());
+        trace.events.push_back(event);
+    }
+
+    fclose(file);
+    return 0;
+}
+
+static void json_string(FILE *out, const string &s) {
+    fputc('"', out);
+    for (unsigned i=0; i<s.size(); i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void json_event(FILE *out, bool &first, const char *ph, const string &name,
+        int pid, int tid, double ts) {
+    fprintf(out, "%s\n{\"ph\":\"%s\",\"name\":", first ? "" : ",", ph);
+    json_string(out, name);
+    fprintf(out, ",\"pid\":%d,\"tid\":%d,\"ts\":%.3f", pid, tid, ts);
+    first = false;
+}
+
+/* Convert traces to the Chrome trace event format, which can be loaded
+ * into Perfetto or chrome://tracing. Each rank is a process. The master
+ * has a track for each of its threads, and counters for the ready tasks
+ * and free slots. Each worker has a track for each of its threads with
+ * the tasks it ran, and a track (tid 0) with the tasks the master
+ * dispatched to it. The time tasks spend in the ready queue is shown as
+ * async events on the master. */
+void trace_to_json(const vector<TraceFile> &traces, FILE *out) {
+    double base = 0.0;
+    for (unsigned i=0; i<traces.size(); i++) {
+        if (i == 0 || traces[i].header.start < base) {
+            base = traces[i].header.start;
+        }
+    }
+
+    map<int, string> process_names;
+    map<pair<int, int>, string> thread_names;
+
+    bool first = true;
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (unsigned i=0; i<traces.size(); i++) {
+        const TraceFile &trace = traces[i];
+        int pid = trace.header.rank;
+        double offset = (trace.header.start - base) * 1.0e6;
+
+        char label[BUFSIZ];
+        if (pid == 0) {
+            snprintf(label, sizeof(label), "master on %s", trace.host.c_str());
+        } else {
+            snprintf(label, sizeof(label), "worker %d on %s", pid, trace.host.c_str());
+        }
+        process_names[pid] = label;
+
+        // Tasks that are running on each worker, as seen by the master,
+        // and the task that is running on each thread of this rank
+        map<int, const TraceEvent *> dispatched;
+        map<uint32_t, const TraceEvent *> started;
+        map<uint32_t, const TraceEvent *> io;
+
+        for (unsigned j=0; j<trace.events.size(); j++) {
+            const TraceEvent &event = trace.events[j];
+            const TraceRecord &r = event.record;
+            double ts = offset + r.time / 1000.0;
+            int tid = r.thread + 1;
+
+            if (thread_names.find(std::make_pair(pid, tid)) == thread_names.end()) {
+                snprintf(label, sizeof(label), "thread %u", r.thread);
+                thread_names[std::make_pair(pid, tid)] = label;
+            }
+
+            switch (r.type) {
+                case TRACE_SLOT:
+                    snprintf(label, sizeof(label), "worker %d on %s", r.slot, event.name.c_str());
+                    if (process_names.find(r.slot) == process_names.end()) {
+                        process_names[r.slot] = label;
+                    }
+                    thread_names[std::make_pair(r.slot, 0)] = "dispatched by master";
+                    break;
+                case TRACE_QUEUED:
+                    json_event(out, first, "b", event.name, pid, tid, ts);
+                    fprintf(out, ",\"cat\":\"queued\",\"id\":");
+                    json_string(out, event.name);
+                    fprintf(out, "}");
+                    break;
+                case TRACE_DISPATCH:
+                    json_event(out, first, "e", event.name, pid, tid, ts);
+                    fprintf(out, ",\"cat\":\"queued\",\"id\":");
+                    json_string(out, event.name);
+                    fprintf(out, "}");
+                    dispatched[r.slot] = &event;
+                    break;
+                case TRACE_RESULT:
+                    if (dispatched.count(r.slot) > 0) {
+                        const TraceEvent *d = dispatched[r.slot];
+                        double start = offset + d->record.time / 1000.0;
+                        json_event(out, first, "X", d->name, r.slot, 0, start);
+                        fprintf(out, ",\"dur\":%.3f,\"args\":{\"exitcode\":%d,"
+                                "\"cpus\":%llu,\"memory\":%llu}}", ts - start,
+                                (int)r.value, (unsigned long long)d->record.value,
+                                (unsigned long long)d->record.extra);
+                        dispatched.erase(r.slot);
+                    }
+                    break;
+                case TRACE_IODATA:
+                    json_event(out, first, "i", "I/O data", r.slot, 0, ts);
+                    fprintf(out, ",\"s\":\"t\",\"args\":{\"task\":");
+                    json_string(out, event.name);
+                    fprintf(out, ",\"bytes\":%llu}}", (unsigned long long)r.value);
+                    break;
+                case TRACE_BEGIN:
+                    json_event(out, first, "B", event.name, pid, tid, ts);
+                    fprintf(out, "}");
+                    break;
+                case TRACE_END:
+                    json_event(out, first, "E", event.name, pid, tid, ts);
+                    fprintf(out, "}");
+                    break;
+                case TRACE_COUNTERS:
+                    json_event(out, first, "C", "scheduler", pid, tid, ts);
+                    fprintf(out, ",\"args\":{\"ready tasks\":%llu,\"free slots\":%llu}}",
+                            (unsigned long long)r.value, (unsigned long long)r.extra);
+                    break;
+                case TRACE_START:
+                    started[r.thread] = &event;
+                    io.erase(r.thread);
+                    break;
+                case TRACE_TASK_IO:
+                    io[r.thread] = &event;
+                    break;
+                case TRACE_EXIT:
+                    if (started.count(r.thread) > 0) {
+                        const TraceEvent *s = started[r.thread];
+                        double start = offset + s->record.time / 1000.0;
+                        json_event(out, first, "X", s->name, pid, tid, start);
+                        fprintf(out, ",\"dur\":%.3f,\"args\":{\"pid\":%llu,\"status\":%d",
+                                ts - start, (unsigned long long)s->record.value, (int)r.value);
+                        if (io.count(r.thread) > 0) {
+                            fprintf(out, ",\"rchar\":%llu,\"wchar\":%llu",
+                                    (unsigned long long)io[r.thread]->record.value,
+                                    (unsigned long long)io[r.thread]->record.extra);
+                        }
+                        fprintf(out, "}}");
+                        started.erase(r.thread);
+                    }
+                    break;
+            }
+        }
+    }
+
+    for (map<int, string>::iterator p = process_names.begin(); p != process_names.end(); p++) {
+        json_event(out, first, "M", "process_name", p->first, 0, 0.0);
+        fprintf(out, ",\"args\":{\"name\":");
+        json_string(out, p->second);
+        fprintf(out, "}}");
+        json_event(out, first, "M", "process_sort_index", p->first, 0, 0.0);
+        fprintf(out, ",\"args\":{\"sort_index\":%d}}", p->first);
+    }
+    for (map<pair<int, int>, string>::iterator t = thread_names.begin(); t != thread_names.end(); t++) {
+        json_event(out, first, "M", "thread_name", t->first.first, t->first.second, 0.0);
+        fprintf(out, ",\"args\":{\"name\":");
+        json_string(out, t->second);
+        fprintf(out, "}}");
+    }
+
+    fprintf(out, "\n]}\n");
+}
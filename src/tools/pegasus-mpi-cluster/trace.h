@@ -0,0 +1,78 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+
+using std::string;
+using std::vector;
+
+#define TRACE_MAGIC "PMCTRACE"
+#define TRACE_VERSION 1
+
+// Size of each thread's trace buffer. A buffer is written to the trace
+// file when it is full, and when the trace is closed.
+#define TRACE_BUFFER_SIZE (256*1024)
+
+typedef enum {
+    TRACE_SLOT = 1,     // A worker registered (slot=rank, name=host)
+    TRACE_QUEUED,       // A task is ready to run
+    TRACE_DISPATCH,     // A task was sent to a worker (value=cpus, extra=memory)
+    TRACE_RESULT,       // The master got the result (value=exitcode)
+    TRACE_IODATA,       // The master got I/O data (value=bytes)
+    TRACE_BEGIN,        // The start of a phase of the master loop
+    TRACE_END,          // The end of a phase of the master loop
+    TRACE_COUNTERS,     // Ready tasks (value) and free slots (extra)
+    TRACE_START,        // A worker started a task (value=pid)
+    TRACE_EXIT,         // A task exited on a worker (value=exitcode)
+    TRACE_TASK_IO       // Bytes read (value) and written (extra) by a task
+} TraceType;
+
+/* The first thing in a trace file. Timestamps in the records are
+ * relative to start, which is the wall clock time when the trace was
+ * opened, so that the traces of different ranks can be lined up. */
+struct TraceHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t rank;
+    double start;
+    uint32_t hostlen;
+    uint32_t reserved;
+};
+
+/* Each record is followed by namelen bytes of the name. Records are
+ * written in the native byte order. */
+struct TraceRecord {
+    uint64_t time;      // Nanoseconds since the trace was opened
+    uint32_t type;
+    uint32_t thread;
+    int32_t slot;       // Rank of the worker the event is about, or -1
+    uint32_t namelen;
+    uint64_t value;
+    uint64_t extra;
+};
+
+/* A record read back from a trace file */
+struct TraceEvent {
+    TraceRecord record;
+    string name;
+};
+
+/* A trace file read back by the converter */
+struct TraceFile {
+    TraceHeader header;
+    string host;
+    vector<TraceEvent> events;
+};
+
+int trace_open(const string &path, int rank, const string &host);
+void trace_close();
+bool trace_enabled();
+void trace_event(TraceType type, int slot, const char *name, uint64_t value = 0, uint64_t extra = 0);
+
+int trace_read(const string &path, TraceFile &trace);
+void trace_to_json(const vector<TraceFile> &traces, FILE *out);
+
+#endif /* TRACE_H */
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <sys/stat.h>
@@ -12,6 +13,7 @@
 #include <map>
 #include <poll.h>
 #include <memory>
+#include <algorithm>
 
 #include "worker.h"
 #include "comm.h"
@@ -19,6 +21,7 @@
 #include "log.h"
 #include "failure.h"
 #include "tools.h"
+#include "trace.h"
 #include "config.h"
 
 using std::string;
@@ -32,6 +35,18 @@ static void log_signal(int signo) {
     log_error("Caught signal %d", signo);
 }
 
+// Set when a worker that joined the workflow is asked to leave it, and
+// the task that needs to be killed when that happens
+static volatile sig_atomic_t DEPARTING = 0;
+static volatile pid_t TASK_PID = 0;
+
+static void on_depart(int signo) {
+    DEPARTING = 1;
+    if (TASK_PID > 0) {
+        kill(TASK_PID, SIGKILL);
+    }
+}
+
 PipeForward::PipeForward(string varname, string filename, int readfd, int writefd) {
     this->varname = varname;
     this->filename = filename;
@@ -62,6 +77,11 @@ void PipeForward::append(char *buff, int size) {
     this->buffer.append(buff, size);
 }
 
+/* Remove data that has been sent from the start of the buffer */
+void PipeForward::consume(size_t size) {
+    this->buffer.erase(0, size);
+}
+
 int PipeForward::read() {
     char buff[BUFSIZ];
     int rc = ::read(readfd, buff, BUFSIZ);
@@ -120,7 +140,7 @@ string FileForward::destination() {
     return destfile;
 }
 
-TaskHandler::TaskHandler(Worker *worker, string &name, list<string> &args, string &id, unsigned memory, unsigned cpus, const vector<cpu_t> &bindings, const map<string,string> &pipe_forwards, const map<string,string> &file_forwards) {
+TaskHandler::TaskHandler(Worker *worker, string &name, list<string> &args, string &id, unsigned memory, unsigned cpus, const vector<cpu_t> &bindings, const map<string,string> &pipe_forwards, const map<string,string> &file_forwards, const vector<string> &hosts) {
     this->worker = worker;
     this->name = name;
     this->args = args;
@@ -130,15 +150,31 @@ TaskHandler::TaskHandler(Worker *worker, string &name, list<string> &args, strin
     this->bindings = bindings;
     this->pipe_forwards = pipe_forwards;
     this->file_forwards = file_forwards;
+    this->hosts = hosts;
     this->start = 0;
     this->finish = 0;
     this->task_stdout = -1;
     this->task_stderr = -1;
+    this->stdout_forward = NULL;
+    this->stderr_forward = NULL;
+    this->stream_stdio = worker->forward_stdio && !worker->speculation;
+    this->credit = worker->io_credit;
+    this->cpuset = NULL;
+    this->mempolicy = NULL;
+    this->cgroup = NULL;
+    this->rlimits = false;
+    this->killed = false;
+    this->status = 0;
+    memset(&this->usage, 0, sizeof(this->usage));
 }
 
 TaskHandler::~TaskHandler() {
     close_stdio();
 
+    delete cpuset;
+    delete mempolicy;
+    delete cgroup;
+
     // Delete all the forwards
     for (unsigned i=0; i<forwards.size(); i++) {
         delete forwards[i];
@@ -146,6 +182,23 @@ TaskHandler::~TaskHandler() {
 }
 
 int TaskHandler::open_stdio() {
+    // If stdio is forwarded, then the task writes stdout/stderr to pipes
+    // and the data is sent to the master along with the other forwards
+    if (worker->forward_stdio) {
+        stdout_forward = new PipeForward("", IODATA_STDOUT, -1, -1);
+        forwards.push_back(stdout_forward);
+        stderr_forward = new PipeForward("", IODATA_STDERR, -1, -1);
+        forwards.push_back(stderr_forward);
+
+        if (open_stdio_forward(stdout_forward) || open_stdio_forward(stderr_forward)) {
+            return -1;
+        }
+
+        task_stdout = stdout_forward->writefd;
+        task_stderr = stderr_forward->writefd;
+        return 0;
+    }
+
     // If per-task-stdio is not enabled, then use the global 
     // task stdout/stderr streams
     if (!worker->per_task_stdio) {
@@ -201,6 +254,31 @@ int TaskHandler::open_stdio() {
     return 0;
 }
 
+int TaskHandler::open_stdio_forward(PipeForward *fwd) {
+    int pipefd[2];
+    if (pipe(pipefd) < 0) {
+        log_error("Task %s: Unable to create pipe for task %s: %s",
+                name.c_str(), fwd->filename.c_str(), strerror(errno));
+        return -1;
+    }
+    fwd->readfd = pipefd[0];
+    fwd->writefd = pipefd[1];
+    pipes.push_back(fwd);
+    return 0;
+}
+
+/* Returns true if fwd is the task's stdout or stderr */
+bool TaskHandler::is_stdio_forward(Forward *fwd) {
+    return fwd == stdout_forward || fwd == stderr_forward;
+}
+
+/* We only send the data if the task succeeds because if the task failed,
+ * then it might not have generated good output data. The exception is
+ * stdout/stderr, which are always sent. */
+bool TaskHandler::should_send(Forward *fwd) {
+    return succeeded() || is_stdio_forward(fwd);
+}
+
 void TaskHandler::close_stdio() {
     if (worker->per_task_stdio) {
         if (task_stdout >= 0) {
@@ -226,97 +304,412 @@ double TaskHandler::elapsed() {
 }
 
 /**
- * Do all the operations required for the child process after
- * fork() up to and including execve()
+ * Compute the PMC_AFFINITY value, the cpu set and the memory policy for
+ * the task's bindings. This uses the topology that the worker read when
+ * it started, so nothing is read from /proc or /sys for each task.
  */
-void TaskHandler::child_process() {
-    // Redirect stdout/stderr. We do this first thing so that any
-    // of the error messages printed before the execve show up in
-    // the task stdout/stderr where they belong. Otherwise, we could
-    // end up shipping a lot of error messages to the master process.
-    if (dup2(task_stdout, STDOUT_FILENO) < 0) {
-        log_fatal("Error redirecting stdout of task %s: %s", 
-            name.c_str(), strerror(errno));
-        _exit(1);
+void TaskHandler::prepare_affinity() {
+    affinity = "";
+
+    if (bindings.size() == 0) {
+        return;
     }
-    if (dup2(task_stderr, STDERR_FILENO) < 0) {
-        log_fatal("Error redirecting stderr of task %s: %s", 
-            name.c_str(), strerror(errno));
-        _exit(1);
+
+    // This can be long on hosts with many CPUs, so it is not built 
+    // in a fixed-size buffer.
+    for (vector<cpu_t>::iterator i = bindings.begin(); i != bindings.end(); i++) {
+        char core[16];
+        snprintf(core, sizeof(core), "%" PRIcpu_t, *i);
+        if (affinity.size() > 0) {
+            affinity += ",";
+        }
+        affinity += core;
     }
 
-    // Close the read end of all the pipes. This should force a
-    // SIGPIPE in the case that the parent process closes the read
-    // end of the pipe while we are writing to it.
-    for (unsigned i=0; i<pipes.size(); i++) {
-        pipes[i]->closeread();
+    if (!config.set_affinity) {
+        return;
+    }
+
+    LOG(LOG_DEBUG, "Binding task %s to cores: %s", name.c_str(), affinity.c_str());
+
+    delete cpuset;
+    cpuset = new CPUSet(worker->host_threads, bindings);
+
+    // Memory should be allocated on the NUMA nodes of the cpus
+    vector<cpu_t> &cpu_nodes = worker->host_topology.nodes;
+    vector<cpu_t> nodes;
+    for (vector<cpu_t>::iterator i = bindings.begin(); i != bindings.end(); i++) {
+        if (*i < cpu_nodes.size() && 
+                find(nodes.begin(), nodes.end(), cpu_nodes[*i]) == nodes.end()) {
+            nodes.push_back(cpu_nodes[*i]);
+        }
+    }
+    delete mempolicy;
+    mempolicy = new MemoryPolicy(nodes);
+}
+
+/**
+ * Prepare everything the child process needs to exec the task: the path
+ * of the executable, the arguments, the environment, and the descriptors
+ * to close. This is done in the parent so that the child only has to make
+ * system calls, which is required when the child is created with vfork().
+ */
+void TaskHandler::prepare_exec() {
+    prepare_affinity();
+    prepare_cgroup();
+
+    // If the executable is not an absolute or relative path, then search PATH
+    executable = args.front();
+    if (executable.find("/") == string::npos) {
+        executable = pathfind(executable);
     }
 
     // Create argument structure
-    char **argp = new char*[args.size()+1];
-    int j = 0;
+    argv.clear();
     for (list<string>::iterator i = args.begin(); i != args.end(); i++) {
-        string arg = *i;
-        char *a = new char[arg.size()+1];
-        strncpy(a, arg.c_str(), arg.size()+1);
-        argp[j++] = a;
+        argv.push_back(const_cast<char *>(i->c_str()));
     }
-    argp[j] = NULL;
+    argv.push_back(NULL);
 
-    // Update environment. We need to add env variables for the pipes used to
-    // forward I/O from the task.
+    // These environment variables are added to the environment of the
+    // worker. We need to add env variables for the pipes used to forward 
+    // I/O from the task, and some other useful variables.
+    map<string, string> vars;
     for (unsigned i=0; i<pipes.size(); i++) {
         PipeForward *p = pipes[i];
+        if (is_stdio_forward(p)) {
+            continue;
+        }
         char buf[32];
-        if (snprintf(buf, 32, "%d", p->writefd) >= 32) {
-            log_fatal("Unable to create environment value for pipe forward: %s",
-                      strerror(errno));
-            _exit(1);
+        snprintf(buf, sizeof(buf), "%d", p->writefd);
+        vars[p->varname] = buf;
+    }
+    char buf[32];
+    vars["PMC_TASK"] = name;
+    snprintf(buf, sizeof(buf), "%u", memory);
+    vars["PMC_MEMORY"] = buf;
+    snprintf(buf, sizeof(buf), "%u", cpus);
+    vars["PMC_CPUS"] = buf;
+    snprintf(buf, sizeof(buf), "%d", worker->rank);
+    vars["PMC_RANK"] = buf;
+    snprintf(buf, sizeof(buf), "%d", worker->host_rank);
+    vars["PMC_HOST_RANK"] = buf;
+    if (bindings.size() > 0) {
+        vars["PMC_AFFINITY"] = affinity;
+    }
+    if (hosts.size() > 0) {
+        string hostlist = hosts[0];
+        for (unsigned i=1; i<hosts.size(); i++) {
+            hostlist += "," + hosts[i];
         }
-        if (setenv(p->varname.c_str(), buf, 1) < 0) {
-            log_fatal("Unable to set environment entry for pipe forward: %s",
-                      strerror(errno));
-            _exit(1);
+        vars["PMC_HOSTS"] = hostlist;
+        vars["PMC_HOSTFILE"] = hostfile;
+    }
+
+    envstrings.clear();
+    for (char **e = environ; *e != NULL; e++) {
+        string entry = *e;
+        string varname = entry.substr(0, entry.find('='));
+        if (vars.find(varname) == vars.end()) {
+            envstrings.push_back(entry);
         }
     }
+    for (map<string, string>::iterator v = vars.begin(); v != vars.end(); v++) {
+        envstrings.push_back(v->first + "=" + v->second);
+    }
+    envp.clear();
+    for (unsigned i=0; i<envstrings.size(); i++) {
+        envp.push_back(const_cast<char *>(envstrings[i].c_str()));
+    }
+    envp.push_back(NULL);
 
-    // Add other useful environment variables
-    int rc;
-    char envbuf[1024];
-    int envsz = sizeof(envbuf);
-    if (setenv("PMC_TASK", this->name.c_str(), 1) < 0) {
-        log_fatal("Unable to set environment entry for PMC_TASK: %s", strerror(errno));
-        _exit(1);
+    // Close the read end of all the pipes. This should force a
+    // SIGPIPE in the case that the parent process closes the read
+    // end of the pipe while we are writing to it. The stdio pipes are 
+    // duplicated onto stdout/stderr, so the original descriptors are 
+    // not needed by the task.
+    child_close_fds.clear();
+    for (unsigned i=0; i<pipes.size(); i++) {
+        child_close_fds.push_back(pipes[i]->readfd);
     }
-    rc = snprintf(envbuf, envsz, "%u", this->memory);
-    if (rc < 0 || rc >= envsz || setenv("PMC_MEMORY", envbuf, 1) < 0) {
-        log_fatal("Unable to set environment entry for PMC_MEMORY: %s", strerror(errno));
-        _exit(1);
+    if (stdout_forward != NULL && stdout_forward->writefd > STDERR_FILENO) {
+        child_close_fds.push_back(stdout_forward->writefd);
     }
-    rc = snprintf(envbuf, envsz, "%u", this->cpus);
-    if (rc < 0 || rc >= envsz || setenv("PMC_CPUS", envbuf, 1) < 0) {
-        log_fatal("Unable to set environment entry for PMC_CPUS: %s", strerror(errno));
-        _exit(1);
+    if (stderr_forward != NULL && stderr_forward->writefd > STDERR_FILENO) {
+        child_close_fds.push_back(stderr_forward->writefd);
+    }
+}
+
+/**
+ * Create a cgroup for the task, if the worker has one, and set its limits.
+ * The memory, cpu and pids limits are only set with --strict-limits, and
+ * the cpuset only with --set-affinity. If the cgroup cannot enforce the
+ * memory limit, then we fall back on rlimits.
+ */
+void TaskHandler::prepare_cgroup() {
+    delete cgroup;
+    cgroup = NULL;
+    cgroup_procs = "";
+    rlimits = worker->strict_limits && memory > 0;
+
+    if (worker->cgroup == "") {
+        return;
+    }
+
+    char cgname[64];
+    snprintf(cgname, sizeof(cgname), "/pmc-%d-%d-%u", worker->rank, 
+             (int)getpid(), worker->cgroup_seq++);
+    cgroup = new CGroup(worker->cgroup + cgname);
+    if (cgroup->create() < 0) {
+        log_error("Unable to create cgroup %s for task %s: %s",
+                cgroup->path.c_str(), name.c_str(), strerror(errno));
+        delete cgroup;
+        cgroup = NULL;
+        return;
+    }
+    cgroup_procs = cgroup->procs();
+
+    set<string> &controllers = worker->cgroup_controllers;
+    char value[64];
+
+    if (worker->strict_limits) {
+        if (memory > 0 && controllers.count("memory")) {
+            snprintf(value, sizeof(value), "%lu", memory * 1024ul * 1024ul);
+            if (cgroup->write("memory.max", value) < 0) {
+                log_error("Unable to set memory.max for task %s: %s",
+                        name.c_str(), strerror(errno));
+            } else {
+                rlimits = false;
+            }
+            // Don't let the task get around the limit by swapping. Not
+            // all systems have swap accounting, so ignore errors.
+            cgroup->write("memory.swap.max", "0");
+        }
+        if (controllers.count("cpu")) {
+            snprintf(value, sizeof(value), "%u 100000", cpus * 100000);
+            if (cgroup->write("cpu.max", value) < 0) {
+                log_error("Unable to set cpu.max for task %s: %s",
+                        name.c_str(), strerror(errno));
+            }
+        }
+    }
+
+    if (cpuset != NULL && controllers.count("cpuset")) {
+        if (cgroup->write("cpuset.cpus", affinity) < 0) {
+            log_error("Unable to set cpuset.cpus for task %s: %s",
+                    name.c_str(), strerror(errno));
+        }
+    }
+
+    if (worker->max_pids > 0 && controllers.count("pids")) {
+        snprintf(value, sizeof(value), "%u", worker->max_pids);
+        if (cgroup->write("pids.max", value) < 0) {
+            log_error("Unable to set pids.max for task %s: %s",
+                    name.c_str(), strerror(errno));
+        }
     }
-    rc = snprintf(envbuf, envsz, "%d", this->worker->rank);
-    if (rc < 0 || rc >= envsz || setenv("PMC_RANK", envbuf, 1) < 0) {
-        log_fatal("Unable to set environment entry for PMC_RANK: %s", strerror(errno));
+}
+
+/* Handle the messages the master sent while the task is running. The 
+ * master can tell the worker to kill the task, or to shut down after 
+ * the task finishes. */
+void TaskHandler::check_for_kill(pid_t pid) {
+    while (worker->comm->message_waiting()) {
+        Message *mesg = worker->comm->recv_message();
+        if (KillMessage *km = dynamic_cast<KillMessage *>(mesg)) {
+            if (km->name == name && !killed) {
+                LOG(LOG_DEBUG, "Task %s: Killing task at the request of the master",
+                        name.c_str());
+                kill(pid, SIGKILL);
+                killed = true;
+            }
+            delete km;
+        } else if (ShutdownMessage *sdm = dynamic_cast<ShutdownMessage *>(mesg)) {
+            LOG(LOG_DEBUG, "Task %s: Got shutdown message while task is running",
+                    name.c_str());
+            worker->shutdown = true;
+            delete sdm;
+        } else if (mesg != NULL) {
+            myfailure("Task %s: Unexpected message while task is running",
+                    name.c_str());
+        }
+    }
+}
+
+/* Wait for the task to exit without reaping it, checking for messages
+ * from the master while it runs */
+void TaskHandler::wait_for_exit(pid_t pid) {
+    while (true) {
+        siginfo_t info;
+        info.si_pid = 0;
+        if (waitid(P_PID, pid, &info, WEXITED|WNOWAIT|WNOHANG) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        if (info.si_pid != 0) {
+            return;
+        }
+        check_for_kill(pid);
+        usleep(TASK_POLL_INTERVAL * 1000);
+    }
+}
+
+/**
+ * Wait for the task process to exit and record its resource usage. The
+ * I/O counters are read while the process is a zombie, because /proc/PID
+ * goes away when it is reaped. They include the I/O of all the children
+ * that the task waited for.
+ */
+int TaskHandler::wait_for_process(pid_t pid, int *status) {
+#ifdef LINUX
+    siginfo_t info;
+    if (waitid(P_PID, pid, &info, WEXITED|WNOWAIT) < 0) {
+        return -1;
+    }
+
+    char iofile[64];
+    sprintf(iofile, "/proc/%d/io", pid);
+    if (read_io_counters(iofile, usage) < 0) {
+        LOG(LOG_TRACE, "Unable to read I/O counters of task %s: %s", 
+                name.c_str(), strerror(errno));
+    }
+#endif
+
+    struct rusage ru;
+    if (wait4(pid, status, 0, &ru) < 0) {
+        return -1;
+    }
+
+    usage.utime = ru.ru_utime.tv_sec + (ru.ru_utime.tv_usec / 1.0e6);
+    usage.stime = ru.ru_stime.tv_sec + (ru.ru_stime.tv_usec / 1.0e6);
+#ifdef DARWIN
+    // ru_maxrss is in bytes on Darwin
+    usage.maxrss = ru.ru_maxrss / 1024;
+#else
+    usage.maxrss = ru.ru_maxrss;
+#endif
+    usage.minflt = ru.ru_minflt;
+    usage.majflt = ru.ru_majflt;
+    usage.nvcsw = ru.ru_nvcsw;
+    usage.nivcsw = ru.ru_nivcsw;
+
+    return 0;
+}
+
+/**
+ * Read the resource usage of the task from its cgroup and remove it.
+ * The cgroup also counts processes that the task did not wait for, and 
+ * memory.peak is the peak of all of the processes together instead of the
+ * peak of the largest one. memory.peak requires Linux 5.19 or later.
+ */
+void TaskHandler::read_cgroup_usage() {
+    if (cgroup == NULL) {
+        return;
+    }
+
+    unsigned long value;
+    if (cgroup->read_unsigned("memory.peak", &value) == 0) {
+        usage.maxrss = std::max(usage.maxrss, value / 1024);
+    }
+    if (cgroup->read_key("memory.events", "oom_kill", &value) == 0 && value > 0) {
+        log_error("Task %s was killed because it used more than %u MB of memory",
+                name.c_str(), memory);
+    }
+    if (cgroup->read_key("cpu.stat", "user_usec", &value) == 0) {
+        usage.utime = value / 1.0e6;
+    }
+    if (cgroup->read_key("cpu.stat", "system_usec", &value) == 0) {
+        usage.stime = value / 1.0e6;
+    }
+
+    if (cgroup->destroy() < 0) {
+        log_warn("Unable to remove cgroup %s: %s", cgroup->path.c_str(), 
+                strerror(errno));
+    }
+}
+
+/* Steps in the child process that can fail */
+enum ChildStep {
+    CHILD_STDOUT,
+    CHILD_STDERR,
+    CHILD_CGROUP,
+    CHILD_RLIMIT_DATA,
+    CHILD_RLIMIT_STACK,
+    CHILD_RLIMIT_RSS,
+    CHILD_RLIMIT_AS,
+    CHILD_CPU_AFFINITY,
+    CHILD_MEMORY_AFFINITY,
+    CHILD_EXEC
+};
+
+static const char *child_step_message[] = {
+    "Error redirecting stdout",
+    "Error redirecting stderr",
+    "Unable to move process to cgroup",
+    "Unable to set memory limit (RLIMIT_DATA)",
+    "Unable to set memory limit (RLIMIT_STACK)",
+    "Unable to set memory limit (RLIMIT_RSS)",
+    "Unable to set memory limit (RLIMIT_AS)",
+    "Unable to set cpu affinity",
+    "Unable to set memory affinity",
+    "Unable to exec command"
+};
+
+/* Errors in the child are sent to the parent through the exec pipe */
+struct ChildError {
+    int step;
+    int error;
+};
+
+static void child_error(int execfd, int step) {
+    struct ChildError e;
+    e.step = step;
+    e.error = errno;
+    if (write(execfd, &e, sizeof(e)) < 0) {
+        // Nothing we can do about it
+    }
+}
+
+/**
+ * Do all the operations required for the child process after
+ * fork() up to and including execve(). This may run in a child created 
+ * by vfork(), so it must only make system calls: it cannot allocate 
+ * memory, modify any variables, or write log messages. Errors are
+ * written to execfd, which is closed automatically by execve().
+ */
+void TaskHandler::child_process(int execfd) {
+    // Redirect stdout/stderr. We do this first thing so that any
+    // error messages from the task show up in the task stdout/stderr 
+    // where they belong.
+    if (dup2(task_stdout, STDOUT_FILENO) < 0) {
+        child_error(execfd, CHILD_STDOUT);
         _exit(1);
     }
-    rc = snprintf(envbuf, envsz, "%d", this->worker->host_rank);
-    if (rc < 0 || rc >= envsz || setenv("PMC_HOST_RANK", envbuf, 1) < 0) {
-        log_fatal("Unable to set environment entry for PMC_HOST_RANK: %s", strerror(errno));
+    if (dup2(task_stderr, STDERR_FILENO) < 0) {
+        child_error(execfd, CHILD_STDERR);
         _exit(1);
     }
 
-    // If the executable is not an absolute or relative path, then search PATH
-    string executable = argp[0];
-    if (executable.find("/") == string::npos) {
-        executable = pathfind(executable);
+    for (unsigned i=0; i<child_close_fds.size(); i++) {
+        close(child_close_fds[i]);
     }
 
-    // Set strict resource limits
-    if (worker->strict_limits && memory > 0) {
+    // Move the process into the task's cgroup. Writing 0 moves the 
+    // process that does the write.
+    if (cgroup_procs.size() > 0) {
+        int fd = open(cgroup_procs.c_str(), O_WRONLY);
+        if (fd < 0 || write(fd, "0", 1) < 0) {
+            child_error(execfd, CHILD_CGROUP);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // Set strict resource limits, if the cgroup doesn't do it
+    if (rlimits) {
         rlim_t bytes = memory * 1024 * 1024;
         struct rlimit memlimit;
         memlimit.rlim_cur = bytes;
@@ -325,77 +718,235 @@ void TaskHandler::child_process() {
         // These limits don't always seem to work, so set all of them. In fact,
         // they don't seem to work at all on OS X.
         if (setrlimit(RLIMIT_DATA, &memlimit) < 0) {
-            log_error("Unable to set memory limit (RLIMIT_DATA) for task %s: %s",
-                name.c_str(), strerror(errno));
+            child_error(execfd, CHILD_RLIMIT_DATA);
         }
         if (setrlimit(RLIMIT_STACK, &memlimit) < 0) {
-            log_error("Unable to set memory limit (RLIMIT_STACK) for task %s: %s",
-                name.c_str(), strerror(errno));
+            child_error(execfd, CHILD_RLIMIT_STACK);
         }
         if (setrlimit(RLIMIT_RSS, &memlimit) < 0) {
-            log_error("Unable to set memory limit (RLIMIT_RSS) for task %s: %s",
-                name.c_str(), strerror(errno));
+            child_error(execfd, CHILD_RLIMIT_RSS);
         }
         if (setrlimit(RLIMIT_AS, &memlimit) < 0) {
-            log_error("Unable to set memory limit (RLIMIT_AS) for task %s: %s",
-                name.c_str(), strerror(errno));
+            child_error(execfd, CHILD_RLIMIT_AS);
         }
     }
 
     // For multicore jobs with CPU affinity
-    if (bindings.size() > 0) {
+    if (cpuset != NULL && cpuset->apply() < 0) {
+        child_error(execfd, CHILD_CPU_AFFINITY);
+    }
+    if (mempolicy != NULL && mempolicy->apply() < 0) {
+        child_error(execfd, CHILD_MEMORY_AFFINITY);
+    }
+
+    // Exec process
+    execve(executable.c_str(), &argv[0], &envp[0]);
+    child_error(execfd, CHILD_EXEC);
+    _exit(1);
+}
 
-        // Set environment variable
-        unsigned off = 0;
-        char env_bindings[1024];
-        for (vector<cpu_t>::iterator i = bindings.begin(); i != bindings.end(); i++) {
-            cpu_t core = *i;
-            off += snprintf(env_bindings + off, sizeof(env_bindings) - off, "%" PRIcpu_t ",", core);
-        }
-        env_bindings[off-1] = '\0';
-        setenv("PMC_AFFINITY", env_bindings, 1);
-
-        // Set the cpu affinity
-        if (config.set_affinity) {
-            log_debug("Binding task %s to cores: %s", this->name.c_str(), env_bindings);
-            if (set_cpu_affinity(bindings) < 0) {
-                log_error("Unable to set cpu affinity for task %s to %s: %s",
-                        name.c_str(), env_bindings, strerror(errno));
+/**
+ * Read the errors reported by the child from the exec pipe until it is 
+ * closed. Returns true if the child called exec successfully.
+ */
+bool TaskHandler::wait_for_exec(int execfd) {
+    bool success = true;
+    while (true) {
+        struct ChildError e;
+        ssize_t rc = read(execfd, &e, sizeof(e));
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc < (ssize_t)sizeof(e)) {
+            break;
+        }
+        if (e.step < CHILD_STDOUT || e.step > CHILD_EXEC) {
+            log_error("Unknown error in child process of task %s", name.c_str());
+            success = false;
+            continue;
+        }
+
+        const char *message = child_step_message[e.step];
+        if (e.step == CHILD_EXEC) {
+            // This goes to the task's stderr so that the user sees it
+            char buf[BUFSIZ];
+            int size = snprintf(buf, sizeof(buf), "%s %s for task %s: %s\n",
+                    message, executable.c_str(), name.c_str(), strerror(e.error));
+            if (size > 0 && write(task_stderr, buf, std::min((size_t)size, sizeof(buf) - 1)) < 0) {
+                log_error("Unable to write to stderr of task %s: %s", 
+                        name.c_str(), strerror(errno));
+            }
+            LOG(LOG_DEBUG, "%s %s for task %s: %s", message, executable.c_str(),
+                    name.c_str(), strerror(e.error));
+            success = false;
+        } else {
+            log_error("%s for task %s: %s", message, name.c_str(), strerror(e.error));
+            if (e.step == CHILD_STDOUT || e.step == CHILD_STDERR) {
+                success = false;
             }
         }
     }
+    return success;
+}
 
-    // Exec process
-    execve(executable.c_str(), argp, environ);
-    fprintf(stderr, "Unable to exec command %s for task %s: %s\n", 
-        executable.c_str(), name.c_str(), strerror(errno));
-    _exit(1);
+/* Ask the master for permission to send bytes of I/O data, and wait 
+ * for it. Returns false if the master tells the worker to shut down
+ * while it is waiting. This can happen while the task is running if its
+ * stdio is streamed, but that is not done with speculation, so the task
+ * is never killed while the worker waits. */
+bool TaskHandler::wait_for_io_credit(unsigned bytes) {
+    LOG(LOG_TRACE, "Task %s: Requesting credit for %u bytes of I/O", name.c_str(), bytes);
+
+    IOCreditMessage request(bytes);
+    worker->comm->send_message(&request, 0);
+
+    // The wait is interrupted if the worker is asked to leave. The task
+    // has already finished, so it is too late to kill it.
+    Message *mesg = NULL;
+    while (mesg == NULL) {
+        mesg = worker->comm->recv_message();
+        if (dynamic_cast<KillMessage *>(mesg) != NULL) {
+            delete mesg;
+            mesg = NULL;
+        }
+    }
+    if (IOCreditMessage *grant = dynamic_cast<IOCreditMessage *>(mesg)) {
+        if (grant->bytes != bytes) {
+            myfailure("Task %s: Expected credit for %u bytes, got %u", 
+                    name.c_str(), bytes, grant->bytes);
+        }
+        delete grant;
+        return true;
+    } else if (ShutdownMessage *sdm = dynamic_cast<ShutdownMessage *>(mesg)) {
+        log_warn("Task %s: Got shutdown message while waiting to send I/O", 
+                name.c_str());
+        delete sdm;
+        worker->shutdown = true;
+        return false;
+    }
+
+    myfailure("Task %s: Expected I/O credit message", name.c_str());
+    return false;
+}
+
+/* Send size bytes of data for destination to the master in messages of
+ * at most IODATA_MAX_SIZE bytes. If flow control is enabled, then each
+ * message that does not fit in the task's remaining credit waits for
+ * credit from the master. Returns false if the master tells the worker 
+ * to shut down while it is waiting. */
+bool TaskHandler::send_data(const string &destination, const char *data, size_t size) {
+    while (size > 0) {
+        size_t n = std::min(size, (size_t)IODATA_MAX_SIZE);
+        if (worker->io_flow_control) {
+            if (n <= credit) {
+                credit -= n;
+            } else if (!wait_for_io_credit(n)) {
+                return false;
+            }
+        }
+
+        IODataMessage iodata(this->name, destination, data, n, this->status);
+        worker->comm->send_message(&iodata, 0);
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+/* Send the stdout or stderr of the task that has been buffered in fwd to
+ * the master in chunks of at most STDIO_CHUNK_SIZE bytes. Chunks end at a
+ * line break, if there is one, so that lines from different tasks are 
+ * not mixed together in the output. Unless partial is set, a line that
+ * is not finished yet stays in the buffer until the rest of it arrives,
+ * or until the buffer is full. */
+void TaskHandler::send_stdio(PipeForward *fwd, bool partial) {
+    const char *data = fwd->data();
+    size_t size = fwd->size();
+    size_t sent = 0;
+
+    // If the master told the worker to shut down, then it is no longer
+    // waiting for the output
+    while (sent < size && !worker->shutdown) {
+        size_t n = std::min(size - sent, (size_t)STDIO_CHUNK_SIZE);
+        size_t end = n;
+        while (end > 0 && data[sent + end - 1] != '\n') {
+            end--;
+        }
+        if (end > 0) {
+            n = end;
+        } else if (!partial && size - sent < STDIO_CHUNK_SIZE) {
+            break;
+        }
+        if (!send_data(fwd->destination(), data + sent, n)) {
+            break;
+        }
+        sent += n;
+    }
+
+    if (worker->shutdown) {
+        sent = size;
+    }
+    fwd->consume(sent);
 }
 
 /* Send all I/O forwarded data to master */
 void TaskHandler::send_io_data() {
-    for (unsigned i = 0; i < this->forwards.size(); i++) {
+    for (unsigned i = 0; i < this->forwards.size() && !worker->shutdown; i++) {
         Forward *f = this->forwards[i];
-        log_trace("Task %s: Forward %s got %d bytes", name.c_str(), 
-                f->destination().c_str(), f->size());
 
-        // Don't bother to send the message if there is no data
-        if (f->size() == 0) {
+        if (!should_send(f)) {
             continue;
         }
 
-        IODataMessage iodata(this->name, f->destination(), f->data(), f->size());
-        worker->comm->send_message(&iodata, 0);
+        LOG(LOG_TRACE, "Task %s: Forward %s got %lu bytes", name.c_str(), 
+                f->destination().c_str(), (unsigned long)f->size());
+
+        if (is_stdio_forward(f)) {
+            send_stdio((PipeForward *)f, true);
+        } else if (!send_data(f->destination(), f->data(), f->size())) {
+            return;
+        }
     }
 }
 
+/* Write the hosts reserved for a multi-node task to a file with one host
+ * per line, which can be passed to mpiexec */
+int TaskHandler::write_hostfile() {
+    if (hosts.size() == 0) {
+        return 0;
+    }
+
+    hostfile = worker->workdir + "/" + name + ".hosts";
+    FILE *f = fopen(hostfile.c_str(), "w");
+    if (f == NULL) {
+        log_error("Task %s: Unable to create host file %s: %s", 
+                name.c_str(), hostfile.c_str(), strerror(errno));
+        return -1;
+    }
+    for (unsigned i=0; i<hosts.size(); i++) {
+        fprintf(f, "%s\n", hosts[i].c_str());
+    }
+    if (fclose(f)) {
+        log_error("Task %s: Unable to write host file %s: %s", 
+                name.c_str(), hostfile.c_str(), strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
 /* unlink() all I/O forwarded files */
 void TaskHandler::delete_files() {
+    if (hostfile != "" && unlink(hostfile.c_str())) {
+        LOG(LOG_DEBUG, "Task %s: Error unlinking host file %s: %s",
+                name.c_str(), hostfile.c_str(), strerror(errno));
+    }
+
     map<string,string>::iterator i;
     for (i = file_forwards.begin(); i != file_forwards.end(); i++) {
         string srcfile = i->first;
         if (unlink(srcfile.c_str())) {
-            log_debug("Task %s: Error unlinking forwarded file %s: %s", 
+            LOG(LOG_DEBUG, "Task %s: Error unlinking forwarded file %s: %s", 
                     name.c_str(), srcfile.c_str(), strerror(errno));
         }
     }
@@ -415,7 +966,7 @@ int TaskHandler::read_file_data() {
                 // If the file does not exist, then we just skip it. We assume that
                 // the user wants to have some tasks exit successfully without 
                 // producing any output data.
-                log_debug("Task %s: file %s does not exist", name.c_str(), 
+                LOG(LOG_DEBUG, "Task %s: file %s does not exist", name.c_str(), 
                         srcfile.c_str());
                 continue;
             }
@@ -456,7 +1007,7 @@ int TaskHandler::read_file_data() {
 
 /* Send info about the task back to the master */
 void TaskHandler::send_result() {
-    ResultMessage res(this->name, this->status, this->elapsed());
+    ResultMessage res(this->name, this->status, this->elapsed(), this->usage);
     worker->comm->send_message(&res, 0);
 }
 
@@ -476,23 +1027,58 @@ int TaskHandler::run_process() {
                     name.c_str(), strerror(errno));
             return -1;
         }
-        log_trace("Pipe: %s = %s", varname.c_str(), filename.c_str());
+        LOG(LOG_TRACE, "Pipe: %s = %s", varname.c_str(), filename.c_str());
         PipeForward *p = new PipeForward(varname, filename, pipefd[0], pipefd[1]);
         pipes.push_back(p);
         forwards.push_back(p);
     }
 
-    // Fork a child process to execute the task
-    pid_t pid = fork();
+    prepare_exec();
+
+    // This pipe is used to find out when the child calls exec(). Both ends 
+    // are closed on exec, so the read below returns 0 if it succeeds.
+    int execpipe[2];
+    if (pipe(execpipe) < 0) {
+        log_error("Unable to create pipe for task %s: %s",
+                name.c_str(), strerror(errno));
+        return -1;
+    }
+    fcntl(execpipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(execpipe[1], F_SETFD, FD_CLOEXEC);
+
+    // Fork a child process to execute the task. vfork() doesn't copy the
+    // address space of the worker, which can be large, but it suspends the
+    // worker until the child calls exec().
+    double fork_time = current_time();
+    pid_t pid = config.use_vfork ? vfork() : fork();
     if (pid < 0) {
         // Fork failed
         log_error("Unable to fork task %s: %s", name.c_str(), strerror(errno));
+        close(execpipe[0]);
+        close(execpipe[1]);
         return -1;
     }
 
     if (pid == 0) {
-        child_process();
+        close(execpipe[0]);
+        child_process(execpipe[1]);
+    }
+    trace_event(TRACE_START, worker->rank, name.c_str(), pid);
+
+    // The task is killed if the worker leaves the workflow
+    if (worker->joined) {
+        TASK_PID = pid;
+        if (DEPARTING) {
+            kill(pid, SIGKILL);
+        }
+    }
+
+    // Wait for the child to exec
+    close(execpipe[1]);
+    if (wait_for_exec(execpipe[0])) {
+        worker->record_launch(current_time() - fork_time);
     }
+    close(execpipe[0]);
 
     // Close the write end of all the pipes
     for (unsigned i=0; i<pipes.size(); i++) {
@@ -507,7 +1093,8 @@ int TaskHandler::run_process() {
     }
 
     bool poll_failure = false;
-    std::vector<struct pollfd> fds(pipe_forwards.size());
+    std::vector<struct pollfd> fds(pipes.size());
+    double last_check = current_time();
 
     // TODO Refactor the pipe/polling into another method
 
@@ -523,10 +1110,35 @@ int TaskHandler::run_process() {
             nfds++;
         }
 
-        log_trace("Polling %d pipes", nfds);
+        LOG(LOG_TRACE, "Polling %d pipes", nfds);
 
-        int timeout = -1;
+        // With speculation, the master can tell us to kill the task. If
+        // stdio is streamed, then buffered output is sent when the task
+        // stops writing for a while.
+        int timeout = worker->speculation ? TASK_POLL_INTERVAL : -1;
+        if (stream_stdio && (stdout_forward->size() > 0 || stderr_forward->size() > 0)) {
+            timeout = STDIO_FLUSH_INTERVAL;
+        }
         int rc = poll(&fds[0], nfds, timeout);
+
+        // A task that writes all the time would keep poll() from timing
+        // out, so the master's messages are checked whenever it is time
+        if (worker->speculation && 
+                current_time() - last_check >= TASK_POLL_INTERVAL / 1000.0) {
+            check_for_kill(pid);
+            last_check = current_time();
+        }
+
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc == 0 && timeout > 0) {
+            if (stream_stdio) {
+                send_stdio(stdout_forward, true);
+                send_stdio(stderr_forward, true);
+            }
+            continue;
+        }
         if (rc <= 0) {
             // If this happens then we are in trouble. The only thing we
             // can do is log it and break out of the loop. What should happen
@@ -549,7 +1161,8 @@ int TaskHandler::run_process() {
             }
 
             if (revents & POLLIN) {
-                rc = reading[fd]->read();
+                PipeForward *pipe = reading[fd];
+                rc = pipe->read();
                 if (rc < 0) {
                     // If this happens we have a serious problem and need the
                     // task to fail. Cause the failure by breaking out of the
@@ -560,15 +1173,19 @@ int TaskHandler::run_process() {
                     goto after_poll_loop;
                 } else if (rc == 0) {
                     // Pipe was closed, EOF. Stop polling it.
-                    log_trace("Pipe %d closed", fd);
+                    LOG(LOG_TRACE, "Pipe %d closed", fd);
                     reading.erase(fd);
                 } else {
-                    log_trace("Read %d bytes from pipe %d", rc, fd);
+                    LOG(LOG_TRACE, "Read %d bytes from pipe %d", rc, fd);
+                    if (stream_stdio && is_stdio_forward(pipe) && 
+                            pipe->size() >= STDIO_CHUNK_SIZE) {
+                        send_stdio(pipe, false);
+                    }
                 }
             }
 
             if (revents & POLLHUP) {
-                log_trace("Hangup on pipe %d", fd);
+                LOG(LOG_TRACE, "Hangup on pipe %d", fd);
                 // It is important that we don't stop reading the fd here
                 // because in the next poll we may get more data if our
                 // buffer wasn't big enough to get everything on this read.
@@ -601,8 +1218,13 @@ after_poll_loop:
     }
 
     // Wait for task to complete
+    if (worker->speculation) {
+        wait_for_exit(pid);
+    }
     int exitcode;
-    if (waitpid(pid, &exitcode, 0) < 0) {
+    int wait_rc = wait_for_process(pid, &exitcode);
+    TASK_PID = 0;
+    if (wait_rc < 0) {
         log_error("Failed waiting for task %s: %s", name.c_str(), 
                 strerror(errno));
         return -1;
@@ -611,13 +1233,18 @@ after_poll_loop:
     // Record the finish time of the task
     this->finish = current_time();
 
+    read_cgroup_usage();
+
+    trace_event(TRACE_TASK_IO, worker->rank, name.c_str(), usage.rchar, usage.wchar);
+    trace_event(TRACE_EXIT, worker->rank, name.c_str(), exitcode);
+
     double runtime = elapsed();
 
     if (WIFEXITED(exitcode)) {
-        log_debug("Task %s exited with status %d (%d) in %f seconds", 
+        LOG(LOG_DEBUG, "Task %s exited with status %d (%d) in %f seconds", 
             name.c_str(), WEXITSTATUS(exitcode), exitcode, runtime);
     } else {
-        log_debug("Task %s exited on signal %d (%d) in %f seconds", 
+        LOG(LOG_DEBUG, "Task %s exited on signal %d (%d) in %f seconds", 
             name.c_str(), WTERMSIG(exitcode), exitcode, runtime);
     }
 
@@ -650,7 +1277,11 @@ void TaskHandler::write_cluster_task() {
         id_string.c_str(), name.c_str(), date, elapsed(), status, app.c_str(), 
         worker->host_name.c_str(), worker->rank, cpus, memory);
 
-    write(task_stdout, summary, strlen(summary));
+    if (stdout_forward != NULL) {
+        stdout_forward->append(summary, strlen(summary));
+    } else {
+        write(task_stdout, summary, strlen(summary));
+    }
 }
 
 bool TaskHandler::succeeded() {
@@ -658,15 +1289,35 @@ bool TaskHandler::succeeded() {
 }
 
 void TaskHandler::execute() {
-    log_trace("Running task %s", this->name.c_str());
+    LOG(LOG_TRACE, "Running task %s", this->name.c_str());
 
-    if (open_stdio()) {
-        // If we were unable to open stdio, then the task failed
+    if (open_stdio() || write_hostfile()) {
+        // If we were unable to open stdio or write the host file, then
+        // the task failed
         this->status = 256;
     } else {
         this->status = run_process();
     }
 
+    // If another copy of the task finished first, then the master only 
+    // needs to know that this one is done
+    if (killed) {
+        LOG(LOG_DEBUG, "Task %s was killed because another copy finished first",
+                name.c_str());
+        delete_files();
+        send_result();
+        return;
+    }
+
+    // If the worker is leaving, then the master runs the task again
+    // on another worker
+    if (DEPARTING) {
+        log_info("Task %s was interrupted because the worker is leaving",
+                name.c_str());
+        delete_files();
+        return;
+    }
+
     // If the task succeeded, then read all of the files. We only
     // do this if the task succeeded because we only send the data
     // if the task succeeded.
@@ -685,27 +1336,33 @@ void TaskHandler::execute() {
     // Regardless of what happens, we need to delete the files
     delete_files();
 
-    // If the task succeeded, then send the I/O back to the master.
-    // We only do this if the task succeeds because if the task 
-    // failed, then it might not have generated good output data.
-    // It is important that we do this before sending back the 
-    // result message. If we send the result message first, or if
-    // it gets processed first, then we could have a situation
-    // where, when a failure occurs, a task has been marked as
-    // success in the transaction log, but the I/O from the task
-    // has not been saved. The MPI standard guarantees that 
+    // Send the I/O back to the master. It is important that we do 
+    // this before sending back the result message. If we send the 
+    // result message first, or if it gets processed first, then we
+    // could have a situation where, when a failure occurs, a task has
+    // been marked as success in the transaction log, but the I/O from
+    // the task has not been saved. The MPI standard guarantees that 
     // messages sent from one process to another are delivered 
-    // in the order sent.
-    if (this->succeeded()) {
+    // in the order sent. If the master told us to shut down while the
+    // task was running, then it is no longer waiting for the I/O.
+    if (!worker->shutdown) {
         send_io_data();
     }
 
+    // If the master told us to shut down while we were waiting to
+    // send I/O, then it is no longer waiting for the result
+    if (worker->shutdown) {
+        return;
+    }
+
     send_result();
 }
 
 Worker::Worker(Communicator *comm, const string &dagfile, const string &host_script,
         unsigned int host_memory, cpu_t host_cpus, bool strict_limits, 
-        bool per_task_stdio) {
+        bool per_task_stdio, bool forward_stdio, const string &local_stdio,
+        bool io_flow_control, unsigned io_credit, const string &cgroup,
+        unsigned max_pids, bool joined, bool speculation) {
     this->comm = comm;
     this->dagfile = dagfile;
     this->workdir = dirname(dagfile);
@@ -724,6 +1381,10 @@ Worker::Worker(Communicator *comm, const string &dagfile, const string &host_scr
         this->host_threads = c.threads;
         this->host_cores = c.cores;
         this->host_sockets = c.sockets;
+        if (get_host_topology(c.threads, this->host_topology) < 0) {
+            LOG(LOG_DEBUG, "Unable to determine CPU topology: assuming CPUs are "
+                      "numbered by socket and core");
+        }
     } else {
         this->host_threads = host_cpus;
         this->host_cores = host_cpus;
@@ -731,10 +1392,40 @@ Worker::Worker(Communicator *comm, const string &dagfile, const string &host_scr
     }
     this->strict_limits = strict_limits;
     this->per_task_stdio = per_task_stdio;
+    this->forward_stdio = forward_stdio;
+    this->local_stdio = local_stdio;
+    this->io_flow_control = io_flow_control;
+    this->io_credit = io_credit;
+    this->cgroup = cgroup;
+    this->max_pids = max_pids;
+    this->cgroup_seq = 0;
+    if (cgroup != "") {
+        if (!CGroup::is_cgroup(cgroup)) {
+            myfailure("%s is not a cgroup v2 directory", cgroup.c_str());
+        }
+        if (CGroup::enable_controllers(cgroup, cgroup_controllers) < 0) {
+            myfailures("Unable to enable controllers in cgroup %s", cgroup.c_str());
+        }
+        string enabled;
+        for (set<string>::iterator c = cgroup_controllers.begin(); c != cgroup_controllers.end(); c++) {
+            enabled += " " + *c;
+        }
+        LOG(LOG_DEBUG, "Cgroup %s has controllers:%s", cgroup.c_str(), enabled.c_str());
+        if (strict_limits && cgroup_controllers.count("memory") == 0) {
+            log_warn("The memory controller is not available in cgroup %s: "
+                     "using rlimits for --strict-limits", cgroup.c_str());
+        }
+    }
+    this->shutdown = false;
+    this->joined = joined;
+    this->speculation = speculation;
+    this->launches = 0;
+    this->launch_time = 0;
+    this->max_launch_time = 0;
     this->host_script_pgid = 0;
     rank = comm->rank();
     get_host_name(host_name);
-    if (per_task_stdio) {
+    if (per_task_stdio || forward_stdio) {
         this->out = -1;
         this->err = -1;
     } else {
@@ -744,8 +1435,19 @@ Worker::Worker(Communicator *comm, const string &dagfile, const string &host_scr
         string outfile = dagfile + ".out." + rankstr;
         string errfile = dagfile + ".err." + rankstr;
 
-        log_debug("Worker %d: Using task stdout file: %s", rank, outfile.c_str());
-        log_debug("Worker %d: Using task stderr file: %s", rank, errfile.c_str());
+        // With node-local stdio the files are copied to shared 
+        // storage when the worker shuts down
+        if (local_stdio != "") {
+            if (mkdirs(local_stdio.c_str()) < 0) {
+                myfailures("Worker %d: unable to create local stdio directory %s",
+                        rank, local_stdio.c_str());
+            }
+            outfile = local_stdio_file(rank, "out");
+            errfile = local_stdio_file(rank, "err");
+        }
+
+        LOG(LOG_DEBUG, "Worker %d: Using task stdout file: %s", rank, outfile.c_str());
+        LOG(LOG_DEBUG, "Worker %d: Using task stderr file: %s", rank, errfile.c_str());
 
         out = open(outfile.c_str(), O_WRONLY|O_APPEND|O_CREAT, 0000644);
         if (out < 0) {
@@ -768,6 +1470,95 @@ Worker::~Worker() {
     }
 }
 
+/* Path to the node-local stdio file for a worker */
+string Worker::local_stdio_file(int rank, const string &stream) {
+    char rankstr[10];
+    sprintf(rankstr, "%d", rank);
+    return local_stdio + "/" + filename(dagfile) + "." + stream + "." + rankstr;
+}
+
+/**
+ * Copy the node-local stdio files of all the workers on this host to
+ * shared storage. The worker with host rank 0 appends the files from 
+ * every worker on the host to its own DAGFILE.out.X and DAGFILE.err.X 
+ * so that the master only needs to merge one file per host.
+ */
+void Worker::copy_local_stdio() {
+    if (out >= 0) {
+        close(out);
+        out = -1;
+    }
+    if (err >= 0) {
+        close(err);
+        err = -1;
+    }
+
+    // Wait for all the workers to close their files
+    comm->barrier();
+
+    if (host_rank == 0) {
+        copy_local_stdio("out");
+        copy_local_stdio("err");
+    }
+
+    // Tell the master that the copies are done
+    comm->barrier();
+}
+
+void Worker::copy_local_stdio(const string &stream) {
+    char rankstr[10];
+    sprintf(rankstr, "%d", rank);
+    string destfile = dagfile + "." + stream + "." + rankstr;
+
+    int dest = open(destfile.c_str(), O_WRONLY|O_APPEND|O_CREAT, 0000644);
+    if (dest < 0) {
+        log_error("Worker %d: Unable to open %s: %s", rank, destfile.c_str(), 
+                strerror(errno));
+        return;
+    }
+
+    for (unsigned i=0; i<host_ranks.size(); i++) {
+        string srcfile = local_stdio_file(host_ranks[i], stream);
+
+        int src = open(srcfile.c_str(), O_RDONLY);
+        if (src < 0) {
+            log_error("Worker %d: Unable to open local stdio file %s: %s", 
+                    rank, srcfile.c_str(), strerror(errno));
+            continue;
+        }
+
+        struct stat st;
+        if (fstat(src, &st) < 0) {
+            log_error("Worker %d: Unable to stat local stdio file %s: %s", 
+                    rank, srcfile.c_str(), strerror(errno));
+            close(src);
+            continue;
+        }
+
+        LOG(LOG_TRACE, "Worker %d: Copying %lu bytes from %s to %s", rank, 
+                (unsigned long)st.st_size, srcfile.c_str(), destfile.c_str());
+
+        ssize_t copied = copy_file_data(dest, NULL, src, st.st_size);
+        close(src);
+        if (copied < 0) {
+            // Leave the local file in case someone wants to recover it
+            log_error("Worker %d: Error copying local stdio file %s to %s: %s", 
+                    rank, srcfile.c_str(), destfile.c_str(), strerror(errno));
+            continue;
+        }
+
+        if (unlink(srcfile.c_str()) < 0) {
+            log_warn("Worker %d: Unable to delete local stdio file %s: %s", 
+                    rank, srcfile.c_str(), strerror(errno));
+        }
+    }
+
+    if (close(dest) < 0) {
+        log_error("Worker %d: Error closing %s: %s", rank, destfile.c_str(),
+                strerror(errno));
+    }
+}
+
 /**
  * Launch the host script if a) this worker has host rank 0, and 
  * b) the host script is valid 
@@ -781,7 +1572,7 @@ void Worker::run_host_script() {
     if (host_rank > 0)
         return;
 
-    log_debug("Worker %d: Launching host script %s", rank, host_script.c_str());
+    LOG(LOG_DEBUG, "Worker %d: Launching host script %s", rank, host_script.c_str());
 
     pid_t pid = fork();
     if (pid < 0) {
@@ -866,10 +1657,10 @@ void Worker::run_host_script() {
             }
         } else {
             if (WIFEXITED(status)) {
-                log_debug("Worker %d: Host script exited with status %d (%d)", 
+                LOG(LOG_DEBUG, "Worker %d: Host script exited with status %d (%d)", 
                     rank, WEXITSTATUS(status), status);
             } else {
-                log_debug("Worker %d: Host script exited on signal %d (%d)", 
+                LOG(LOG_DEBUG, "Worker %d: Host script exited on signal %d (%d)", 
                     rank, WTERMSIG(status), status);
             }
 
@@ -893,7 +1684,7 @@ void Worker::kill_host_script_group() {
     if (host_script_pgid <= 0)
         return;
 
-    log_debug("Worker %d: Terminating host script process group with SIGTERM", rank);
+    LOG(LOG_DEBUG, "Worker %d: Terminating host script process group with SIGTERM", rank);
 
     if (killpg(host_script_pgid, SIGTERM) < 0) {
         if (errno != ESRCH) {
@@ -918,26 +1709,85 @@ void Worker::kill_host_script_group() {
     }
 }
 
+/* Record the time it took to launch a task, from fork() to exec() */
+void Worker::record_launch(double elapsed) {
+    launches += 1;
+    launch_time += elapsed;
+    if (elapsed > max_launch_time) {
+        max_launch_time = elapsed;
+    }
+    LOG(LOG_TRACE, "Worker %d: Launched task in %.6f seconds", rank, elapsed);
+}
+
+/* Tell the master that this worker is leaving the workflow, and wait 
+ * until it says the worker can go. Any tasks the master sends before it
+ * gets the message are run by other workers. */
+void Worker::depart() {
+    log_info("Worker %d: Leaving the workflow", rank);
+
+    DepartMessage dmsg;
+    comm->send_message(&dmsg, 0);
+
+    while (true) {
+        Message *mesg = comm->recv_message();
+        if (mesg == NULL) {
+            continue;
+        }
+        bool done = dynamic_cast<ShutdownMessage *>(mesg) != NULL;
+        if (!done) {
+            LOG(LOG_DEBUG, "Worker %d: Ignoring message of type %d while leaving",
+                    rank, mesg->tag());
+        }
+        delete mesg;
+        if (done) {
+            break;
+        }
+    }
+}
+
 int Worker::run() {
-    log_debug("Worker %d: Starting...", rank);
+    LOG(LOG_DEBUG, "Worker %d: Starting...", rank);
+
+    // A worker that joined can be asked to leave with SIGTERM or SIGINT
+    if (joined) {
+        struct sigaction act;
+        act.sa_handler = on_depart;
+        act.sa_flags = SA_RESTART;
+        sigemptyset(&act.sa_mask);
+        if (sigaction(SIGTERM, &act, NULL) < 0 || sigaction(SIGINT, &act, NULL) < 0) {
+            myfailures("Worker %d: Unable to set signal handler for SIGTERM", rank);
+        }
+    }
 
     // Send worker's registration message to the master
-    RegistrationMessage regmsg(host_name, host_memory, host_threads, host_cores, host_sockets);
+    RegistrationMessage regmsg(host_name, host_memory, host_threads, host_cores, host_sockets,
+            host_topology.nodes, host_topology.cores);
     comm->send_message(&regmsg, 0);
-    log_trace("Worker %d: Host name: %s", rank, host_name.c_str());
-    log_trace("Worker %d: Host memory: %u MB", rank, this->host_memory);
-    log_trace("Worker %d: Host threads/CPUs: %" PRIcpu_t, rank, this->host_threads);
-    log_trace("Worker %d: Host cores: %" PRIcpu_t, rank, this->host_cores);
-    log_trace("Worker %d: Host sockets: %" PRIcpu_t, rank, this->host_sockets);
-
-    // Get worker's host rank
-    HostrankMessage *hrmsg = dynamic_cast<HostrankMessage *>(comm->recv_message());
+    LOG(LOG_TRACE, "Worker %d: Host name: %s", rank, host_name.c_str());
+    LOG(LOG_TRACE, "Worker %d: Host memory: %u MB", rank, this->host_memory);
+    LOG(LOG_TRACE, "Worker %d: Host threads/CPUs: %" PRIcpu_t, rank, this->host_threads);
+    LOG(LOG_TRACE, "Worker %d: Host cores: %" PRIcpu_t, rank, this->host_cores);
+    LOG(LOG_TRACE, "Worker %d: Host sockets: %" PRIcpu_t, rank, this->host_sockets);
+
+    // Get worker's host rank. A worker that joined is told to shut down
+    // instead if the workflow finished before it was registered.
+    Message *mesg = NULL;
+    while (mesg == NULL) {
+        mesg = comm->recv_message();
+    }
+    if (joined && dynamic_cast<ShutdownMessage *>(mesg) != NULL) {
+        LOG(LOG_DEBUG, "Worker %d: Workflow finished before registration", rank);
+        delete mesg;
+        return 0;
+    }
+    HostrankMessage *hrmsg = dynamic_cast<HostrankMessage *>(mesg);
     if (hrmsg == NULL) {
         myfailure("Expected hostrank message");
     }
     host_rank = hrmsg->hostrank;
+    host_ranks = hrmsg->ranks;
     delete hrmsg;
-    log_trace("Worker %d: Host rank: %d", rank, host_rank);
+    LOG(LOG_TRACE, "Worker %d: Host rank: %d", rank, host_rank);
 
     // If there is a host script, then run it and wait here for all the host scripts to finish
     if ("" != host_script) {
@@ -946,23 +1796,40 @@ int Worker::run() {
     }
 
     while (true) {
-        log_trace("Worker %d: Waiting for request", rank);
+        LOG(LOG_TRACE, "Worker %d: Waiting for request", rank);
 
-        Message *mesg = comm->recv_message();
+        // A worker that joined wakes up every second to see if it
+        // needs to leave
+        if (DEPARTING) {
+            depart();
+            break;
+        }
+        Message *mesg = comm->recv_message(joined ? 1.0 : 0);
+        if (mesg == NULL && joined) {
+            continue;
+        }
         if (ShutdownMessage *sdm = dynamic_cast<ShutdownMessage *>(mesg)) {
-            log_trace("Worker %d: Got shutdown message", rank);
+            LOG(LOG_TRACE, "Worker %d: Got shutdown message", rank);
             delete sdm;
             break;
         } else if (CommandMessage *cmd = dynamic_cast<CommandMessage *>(mesg)) {
 
-            log_trace("Worker %d: Got task", rank);
+            LOG(LOG_TRACE, "Worker %d: Got task", rank);
 
             TaskHandler task(this, cmd->name, cmd->args,
                     cmd->id, cmd->memory, cmd->cpus, cmd->bindings, cmd->pipe_forwards,
-                    cmd->file_forwards);
+                    cmd->file_forwards, cmd->hosts);
 
             task.execute();
             delete cmd;
+
+            if (shutdown) {
+                break;
+            }
+        } else if (KillMessage *km = dynamic_cast<KillMessage *>(mesg)) {
+            // The task finished before the message got here
+            LOG(LOG_TRACE, "Worker %d: Task %s is not running", rank, km->name.c_str());
+            delete km;
         } else {
             myfailure("Unexpected message");
         }
@@ -970,7 +1837,17 @@ int Worker::run() {
 
     kill_host_script_group();
 
-    log_debug("Worker %d: Exiting...", rank);
+    if (local_stdio != "") {
+        copy_local_stdio();
+    }
+
+    if (launches > 0) {
+        LOG(LOG_DEBUG, "Worker %d: Launched %u tasks, fork-to-exec latency: "
+                  "mean %.3f ms, max %.3f ms", rank, launches,
+                  1000 * launch_time / launches, 1000 * max_launch_time);
+    }
+
+    LOG(LOG_DEBUG, "Worker %d: Exiting...", rank);
 
     return 0;
 }
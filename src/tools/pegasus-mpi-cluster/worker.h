@@ -5,14 +5,17 @@
 #include <map>
 #include <list>
 #include <vector>
+#include <set>
 
 #include "comm.h"
 #include "tools.h"
+#include "cgroup.h"
 
 using std::string;
 using std::map;
 using std::list;
 using std::vector;
+using std::set;
 
 // Give the host script 60 seconds to exit
 #define HOST_SCRIPT_TIMEOUT 60
@@ -21,6 +24,16 @@ using std::vector;
 // group 5 seconds after SIGTERM before sending SIGKILL
 #define HOST_SCRIPT_GRACE_PERIOD 5
 
+// How often a worker checks for messages from the master while a task
+// is running, if speculation is enabled, in milliseconds
+#define TASK_POLL_INTERVAL 100
+
+// When task stdio is forwarded, it is sent to the master while the task
+// runs whenever this many bytes are buffered, or when the task has not
+// written anything for STDIO_FLUSH_INTERVAL milliseconds
+#define STDIO_CHUNK_SIZE (64*1024)
+#define STDIO_FLUSH_INTERVAL 1000
+
 class Forward {
 public: 
     virtual ~Forward() {};
@@ -43,6 +56,7 @@ public:
     ~PipeForward();
     int read();
     void append(char *buff, int size);
+    void consume(size_t size);
     void close();
     void closeread();
     void closewrite();
@@ -77,6 +91,7 @@ public:
 
     int rank;
     int host_rank;
+    vector<int> host_ranks;
 
     string host_script;
     pid_t host_script_pgid;
@@ -86,16 +101,54 @@ public:
     cpu_t host_threads;
     cpu_t host_cores;
     cpu_t host_sockets;
+    struct cputopo host_topology;
 
     bool strict_limits;
 
     bool per_task_stdio;
+    bool forward_stdio;
+    string local_stdio;
+
+    // Flow control for I/O forwarding. Each task can send io_credit
+    // bytes without asking the master, if flow control is enabled.
+    bool io_flow_control;
+    unsigned io_credit;
+
+    // Each task is run in its own cgroup under this one, if it is set
+    string cgroup;
+    set<string> cgroup_controllers;
+    unsigned max_pids;
+    unsigned cgroup_seq;
+
+    bool shutdown;
+
+    // Workers that joined after the workflow started can also leave 
+    // before it finishes
+    bool joined;
+
+    // If the master runs duplicates of slow tasks, then it can tell the
+    // worker to kill a task while it is running
+    bool speculation;
+
+    // Time from fork() to a successful exec() of each task
+    unsigned launches;
+    double launch_time;
+    double max_launch_time;
 
     Worker(Communicator *comm, const string &dagfile, const string &host_script, 
             unsigned host_memory = 0, cpu_t host_cpus = 0, 
-            bool strict_limits = false, bool per_task_stdio=false);
+            bool strict_limits = false, bool per_task_stdio=false,
+            bool forward_stdio=false, const string &local_stdio="",
+            bool io_flow_control=false, unsigned io_credit=0,
+            const string &cgroup="", unsigned max_pids=0, bool joined=false,
+            bool speculation=false);
     ~Worker();
     int run();
+    void depart();
+    string local_stdio_file(int rank, const string &stream);
+    void copy_local_stdio();
+    void copy_local_stdio(const string &stream);
+    void record_launch(double elapsed);
     void run_host_script();
     void kill_host_script_group();
 };
@@ -110,6 +163,11 @@ public:
     cpu_t cpus;
     vector<cpu_t> bindings;
 
+    // The hosts reserved for the task if it runs on more than one node, 
+    // and the file they are written to for the task
+    vector<string> hosts;
+    string hostfile;
+
     vector<Forward *> forwards;
     vector<PipeForward *> pipes;
     map<string, string> pipe_forwards;
@@ -121,10 +179,39 @@ public:
 
     int status;
 
+    // Set if the master told the worker to kill the task
+    bool killed;
+
     int task_stdout;
     int task_stderr;
 
-    TaskHandler(Worker *worker, string &name, list<string> &args, string &id, unsigned memory, unsigned cpus, const vector<cpu_t> &bindings, const map<string,string> &pipe_forwards, const map<string,string> &file_forwards);
+    PipeForward *stdout_forward;
+    PipeForward *stderr_forward;
+
+    // Set if stdio is sent to the master while the task runs, and the
+    // number of bytes of I/O the task can still send without asking the
+    // master for credit
+    bool stream_stdio;
+    unsigned long credit;
+
+    // Everything the child needs is computed before fork() so that the
+    // child has as little to do as possible before exec()
+    string executable;
+    vector<char *> argv;
+    vector<string> envstrings;
+    vector<char *> envp;
+    vector<int> child_close_fds;
+    string affinity;
+    CPUSet *cpuset;
+    MemoryPolicy *mempolicy;
+    CGroup *cgroup;
+    string cgroup_procs;
+    bool rlimits;
+
+    // Resource usage of the task and its children
+    struct taskusage usage;
+
+    TaskHandler(Worker *worker, string &name, list<string> &args, string &id, unsigned memory, unsigned cpus, const vector<cpu_t> &bindings, const map<string,string> &pipe_forwards, const map<string,string> &file_forwards, const vector<string> &hosts);
     ~TaskHandler();
     double elapsed();
     void execute();
@@ -132,13 +219,28 @@ private:
     bool succeeded();
     void send_result();
     int run_process();
-    void child_process();
+    void prepare_affinity();
+    void prepare_exec();
+    void prepare_cgroup();
+    int wait_for_process(pid_t pid, int *status);
+    void wait_for_exit(pid_t pid);
+    void check_for_kill(pid_t pid);
+    void read_cgroup_usage();
+    void child_process(int execfd);
+    bool wait_for_exec(int execfd);
     void write_cluster_task();
+    bool wait_for_io_credit(unsigned bytes);
+    bool send_data(const string &destination, const char *data, size_t size);
+    void send_stdio(PipeForward *fwd, bool partial);
     void send_io_data();
     int read_file_data();
     void delete_files();
     int open_stdio();
+    int write_hostfile();
+    int open_stdio_forward(PipeForward *fwd);
     void close_stdio();
+    bool is_stdio_forward(Forward *fwd);
+    bool should_send(Forward *fwd);
 };
 
 #endif /* WORKER_H */